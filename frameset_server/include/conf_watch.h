@@ -0,0 +1,23 @@
+#ifndef CONF_WATCH_H
+#define CONF_WATCH_H
+
+#include <limits.h>
+#include <stdbool.h>
+
+/**
+ * Watches the camera config for changes with inotify
+ *
+ * The directory is watched rather than the file, since editors and
+ * config management usually replace the file with a rename, which
+ * would leave a watch on the file itself pointing at the old inode.
+ */
+struct conf_watch {
+  int fd;
+  char name[NAME_MAX + 1]; // the config's file name within the watched directory
+};
+
+int conf_watch_init(struct conf_watch* watch, const char* path);
+bool conf_watch_changed(struct conf_watch* watch);
+void conf_watch_cleanup(struct conf_watch* watch);
+
+#endif // CONF_WATCH_H
@@ -0,0 +1,67 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "frameset_asm.h"
+#include "stream_mgr.h"
+
+#define DEFAULT_POOL_FRAMES_PER_CAM 64
+
+struct cam_pool_state {
+  _Alignas(64) _Atomic uint32_t held; // buffers the camera owns anywhere in the pipeline
+  _Atomic uint64_t dropped; // frames decoded without a buffer to keep them in
+  uint32_t low; // buffers guaranteed to the camera
+  uint32_t high; // most buffers the camera can hold
+};
+
+/**
+ * A frame buffer pool shared by every camera
+ *
+ * Free buffers sit on a lock free stack, so a camera that is running
+ * behind can borrow buffers a healthy one is not using. Each camera is
+ * guaranteed up to its own low watermark, and can only borrow past it
+ * out of the buffers not set aside for other cameras' guarantees. No
+ * camera can hold more than its own high watermark.
+ *
+ * A buffer can have more than one holder, a decoder keeping it as a
+ * reference frame while the pipeline holds the same frame in a
+ * frameset, so it only goes back on the stack with its last reference.
+ */
+struct frame_pool {
+  _Alignas(64) _Atomic uint64_t head; // ABA tag in the high 32 bits, index + 1 in the low
+  _Alignas(64) _Atomic int64_t free_count;
+  _Atomic int64_t reserved; // free buffers owed to cameras under their low watermark
+  _Atomic uint32_t* next; // free stack links, index + 1, 0 ends the stack
+  _Atomic uint32_t* refs; // holders of each buffer taken off the stack
+  struct ts_frame_buf* bufs;
+  uint32_t count;
+  uint32_t cam_count;
+  struct cam_pool_state cams[MAX_CAMS];
+};
+
+int frame_pool_init(
+  struct frame_pool* pool,
+  struct ts_frame_buf* bufs,
+  uint32_t count,
+  uint32_t cam_count,
+  const uint32_t* lows,
+  const uint32_t* highs
+);
+int frame_pool_set_watermarks(
+  struct frame_pool* pool,
+  uint32_t cam,
+  uint32_t low,
+  uint32_t high
+);
+void frame_pool_cleanup(struct frame_pool* pool);
+struct ts_frame_buf* frame_pool_get(struct frame_pool* pool, uint32_t cam);
+void frame_pool_ref(struct frame_pool* pool, struct ts_frame_buf* buf);
+void frame_pool_put(
+  struct frame_pool* pool,
+  uint32_t cam,
+  struct ts_frame_buf* buf
+);
+
+#endif // FRAME_POOL_H
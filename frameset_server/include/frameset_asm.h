@@ -0,0 +1,83 @@
+#ifndef FRAMESET_ASM_H
+#define FRAMESET_ASM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stream_mgr.h"
+
+#define MAX_CAMS 64 // bounded by the width of the presence mask
+#define ASM_WINDOW 64 // frame indices in flight, must be a power of 2
+
+struct frame_pool;
+
+struct frameset {
+  uint64_t timestamp; // scheduled capture timestamp of the frame index
+  uint64_t cam_mask; // bit i is set when frame_idx[i] holds a frame
+  uint64_t active_mask; // bit i is set when camera i was streaming for the frame index
+  uint32_t frame_idx[MAX_CAMS]; // index into the shared ts_frame_buf array
+};
+
+struct asm_slot {
+  uint64_t frame_idx;
+  uint64_t first_arrival; // monotonic ns, 0 while nothing is waiting on the slot
+  uint64_t cam_mask;
+  struct ts_frame_buf* frames[MAX_CAMS];
+};
+
+struct cam_asm_stats {
+  uint64_t frames; // frames delivered in emitted framesets
+  uint64_t dropped; // frame indices emitted without this camera
+  uint64_t late; // frames which arrived after their index was emitted
+};
+
+struct frameset_asm {
+  uint64_t t0;
+  uint64_t interval;
+  uint64_t deadline;
+  uint64_t active_mask; // cameras streaming, whether or not they delivered yet
+  uint32_t cam_count; // frameset positions, including ones without a camera
+  bool started;
+  uint64_t next_idx; // oldest frame index not yet emitted
+  uint64_t stamped_idx; // newest frame index with a deadline running
+  uint64_t last_idx[MAX_CAMS]; // newest frame index seen per camera, +1 so 0 is unset
+  uint64_t join_idx[MAX_CAMS]; // first frame index an active camera is expected in, UINT64_MAX until its first frame
+  struct asm_slot slots[ASM_WINDOW];
+  struct ts_frame_buf* ts_frame_bufs; // base that emitted frame indices are relative to
+  struct frame_pool* pool; // where late and expired frames are recycled to
+  uint64_t complete_framesets;
+  uint64_t partial_framesets;
+  uint64_t expired_framesets; // pushed out of the window before they could be emitted
+  struct cam_asm_stats stats[MAX_CAMS];
+};
+
+void frameset_asm_init(
+  struct frameset_asm* fa,
+  uint32_t cam_count,
+  uint64_t active_mask,
+  uint64_t t0,
+  uint64_t interval,
+  uint64_t deadline,
+  struct ts_frame_buf* ts_frame_bufs,
+  struct frame_pool* pool
+);
+
+void frameset_asm_add_cam(struct frameset_asm* fa, uint32_t cam);
+void frameset_asm_remove_cam(struct frameset_asm* fa, uint32_t cam);
+
+void frameset_asm_insert(
+  struct frameset_asm* fa,
+  uint32_t cam,
+  struct ts_frame_buf* buf,
+  uint64_t now
+);
+
+bool frameset_asm_pop(
+  struct frameset_asm* fa,
+  uint64_t now,
+  struct frameset* out
+);
+
+uint64_t frameset_asm_next_deadline(struct frameset_asm* fa);
+
+#endif // FRAMESET_ASM_H
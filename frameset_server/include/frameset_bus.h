@@ -0,0 +1,117 @@
+#ifndef FRAMESET_BUS_H
+#define FRAMESET_BUS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_SUBSCRIBERS 31 // one reference bit each, bit 31 is the publisher's
+#define LATEST_HOLD (1U << 31) // pins the most recently published slot
+#define REAP_INTERVAL 1000000000ULL // 1 sec between stale subscriber sweeps
+
+struct notifier;
+
+enum sub_state {
+  SUB_FREE = 0,
+  SUB_CLAIMED, // being set up by a consumer
+  SUB_RELIABLE, // sees every frameset, pins what it has not released
+  SUB_LATEST // only ever takes the newest frameset, never pins the pipeline
+};
+
+struct bus_sub {
+  _Atomic uint32_t state;
+  _Atomic int32_t pid; // owner, so the server can reclaim it if the owner dies
+};
+
+/**
+ * Per frameset slot reference state
+ *
+ * refs holds one bit per subscriber still reading the slot, plus
+ * LATEST_HOLD while it is the newest publication. The server only
+ * reuses a slot once refs drops to 0, and nothing can take a new
+ * reference on a slot with refs at 0, so reclaiming cannot race.
+ * seq is the publish sequence number the slot currently holds, and
+ * lets a latest-only reader detect that it raced with a reuse.
+ */
+struct frameset_ref {
+  _Alignas(64) _Atomic uint32_t refs;
+  _Atomic uint64_t seq;
+};
+
+/**
+ * Broadcast ring of published frameset slot indices
+ *
+ * Entry i holds the slot published with sequence number i. Reliable
+ * subscribers walk every entry from where they joined. Every entry a
+ * reliable subscriber has not read yet pins its slot, so as long as the
+ * ring is at least as large as the slot pool an unread entry can never
+ * be overwritten.
+ */
+struct frameset_bus {
+  _Alignas(64) _Atomic uint64_t head; // sequence number of the next publish
+  _Atomic uint32_t reliable_mask; // bits of the subscribers in SUB_RELIABLE
+  uint32_t mask; // ring capacity - 1
+  struct bus_sub subs[MAX_SUBSCRIBERS];
+  _Alignas(64) _Atomic uint32_t entries[];
+};
+
+/**
+ * Server side publisher state, private to the server process
+ */
+struct frameset_pub {
+  struct frameset_bus* bus;
+  struct frameset_ref* refs;
+  uint32_t slot_count;
+  uint32_t* free_slots;
+  uint32_t free_count;
+  uint32_t* inflight_slots; // published and not yet reclaimed
+  uint32_t inflight_count;
+  uint32_t latest; // slot holding LATEST_HOLD, or UINT32_MAX
+  uint64_t last_reap;
+  uint64_t reaped_subscribers;
+};
+
+/**
+ * A reliable subscriber inside the server process, for server side
+ * outputs that have to see every frameset exactly as consumers do
+ *
+ * It claims a subscriber slot like any consumer, so it pins what it
+ * hasn't released and shows up in the held counts.
+ */
+struct frameset_sub {
+  struct frameset_bus* bus;
+  struct frameset_ref* refs;
+  struct notifier* server_notify;
+  uint32_t slot_count;
+  int32_t idx; // subscriber slot and reference bit, -1 when not joined
+  uint64_t cursor; // sequence number of the next publish to read
+};
+
+size_t frameset_bus_size(uint32_t ring_capacity);
+
+int frameset_pub_init(
+  struct frameset_pub* pub,
+  struct frameset_bus* bus,
+  struct frameset_ref* refs,
+  uint32_t slot_count,
+  uint32_t ring_capacity
+);
+void frameset_pub_cleanup(struct frameset_pub* pub);
+int frameset_pub_acquire(struct frameset_pub* pub, uint32_t* slot);
+void frameset_pub_publish(struct frameset_pub* pub, uint32_t slot);
+uint32_t frameset_pub_reclaim(struct frameset_pub* pub, uint32_t* slots);
+void frameset_pub_reap(struct frameset_pub* pub, uint64_t now);
+void frameset_pub_held(struct frameset_pub* pub, uint32_t* held);
+
+int frameset_sub_join(
+  struct frameset_sub* sub,
+  struct frameset_bus* bus,
+  struct frameset_ref* refs,
+  uint32_t slot_count,
+  struct notifier* server_notify
+);
+int frameset_sub_next(struct frameset_sub* sub, uint32_t* slot);
+void frameset_sub_release(struct frameset_sub* sub, uint32_t slot);
+void frameset_sub_leave(struct frameset_sub* sub);
+
+#endif // FRAMESET_BUS_H
@@ -0,0 +1,149 @@
+#ifndef FRAMESET_DUMP_H
+#define FRAMESET_DUMP_H
+
+#include <liburing.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "frameset_asm.h"
+#include "frameset_bus.h"
+#include "parse_conf.h"
+#include "shm_layout.h"
+
+#define DUMP_MAGIC 0x504d55445346434dULL // "MCFSDUMP" little endian
+#define DUMP_VERSION 1
+#define DUMP_ALIGN 4096 // of every region and frame, and of O_DIRECT buffers, offsets and lengths
+#define DUMP_ENTRIES_PER_PAGE (DUMP_ALIGN / sizeof(struct dump_entry))
+#define DEFAULT_DUMP_CHUNK_MB 1024
+#define DUMP_QUEUE_DEPTH 16 // framesets being written at once
+#define DUMP_WAIT_TIMEOUT 100000000ULL // 100 ms, bounds how long a stop goes unnoticed
+#define DUMP_PATH_LEN PATH_MAX
+#define DUMP_NAME_LEN 36 // "frameset_<timestamp>.dump", the longest timestamp included
+#define DUMP_STOP_SIGNAL CAM_STOP_SIGNAL // only interrupts, unlike SIGUSR2 in the other threads
+
+/**
+ * Start of a dump chunk, a file of framesets as consumers saw them,
+ * laid out to be mapped and read in place
+ *
+ *   0               this header, padded to DUMP_ALIGN
+ *   index_offset    index_capacity dump_entry, padded to DUMP_ALIGN
+ *   data_offset     frames, frame_stride bytes each
+ *
+ * A frameset's frames are back to back from its entry's offset, one
+ * for each bit set in its cam_mask in position order, each laid out
+ * like a frame buffer in shared memory. Readers go by frameset_count
+ * when it's set, and otherwise up to the first entry with a timestamp
+ * of 0, since a chunk left open by a crash never had it set.
+ */
+struct dump_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t cam_count; // frameset positions
+  uint32_t frame_width;
+  uint32_t frame_height;
+  uint32_t pixel_format; // enum frame_format
+  uint32_t fps;
+  uint32_t chunk_seq; // counts up from 0 over the chunks of one server run
+  uint64_t frame_size;
+  uint64_t frame_stride; // frame_size rounded up to DUMP_ALIGN
+  uint64_t index_offset;
+  uint64_t index_capacity;
+  uint64_t data_offset;
+  uint64_t frameset_count; // 0 until the chunk is closed
+  uint8_t cam_ids[MAX_CAMS]; // config id of the camera in each position, as of the chunk's first frameset
+};
+
+struct dump_entry {
+  uint64_t timestamp; // 0 past the last frameset written
+  uint64_t cam_mask;
+  uint64_t active_mask;
+  uint64_t offset; // of the frameset's first frame, from the start of the chunk
+};
+
+/**
+ * A frameset being written, and the snapshot of the index page its
+ * entry went into
+ */
+struct dump_write {
+  uint32_t slot; // frameset slot, UINT32_MAX while the write is unused
+  uint32_t pending; // completions still to come
+  bool data_done; // its frames are down, so other index pages can point to them
+  uint64_t entry; // in the open chunk's index
+  uint64_t data_len;
+  uint8_t* index_page;
+  struct iovec iovs[MAX_CAMS];
+};
+
+/**
+ * Writes every published frameset to a sequence of chunk files
+ *
+ * Chunks are preallocated at dump_chunk_mb and cut down to what they
+ * hold when closed. Frames go to disk straight from their shared memory
+ * buffers, in one io_uring writev per frameset linked to a write of the
+ * index page its entry is on, with O_DIRECT where the filesystem allows
+ * it, so the dump never copies a frame or fills the page cache. The
+ * frameset stays referenced until both writes complete.
+ *
+ * The link only orders a page after its own frameset's frames, so each
+ * page written leaves out the entries of other framesets whose frames
+ * are still in flight. An index page on disk then only ever points to
+ * frames that are down, whichever order the page writes land in.
+ */
+struct frameset_dump {
+  const char* dir;
+  uint8_t* shm_base;
+  struct shm_header* shm_hdr;
+  struct ts_frame_buf* ts_frame_bufs;
+  struct frameset* frameset_slots;
+  struct frameset_sub* sub; // where finished framesets are released
+  struct io_uring ring;
+  bool ring_initialized;
+  bool direct; // cleared when the filesystem refuses O_DIRECT
+  bool failed; // a write failed, the open chunk is left as its index pages are
+
+  uint64_t chunk_size;
+  int fd; // -1 between chunks
+  struct dump_header* hdr; // of the open chunk, DUMP_ALIGN bytes
+  struct dump_entry* index; // of the open chunk
+  uint64_t index_size; // bytes, a multiple of DUMP_ALIGN
+  uint64_t count; // framesets in the open chunk
+  uint64_t data_end; // where the next frameset's frames go
+
+  struct dump_write writes[DUMP_QUEUE_DEPTH];
+  uint8_t* pages; // index page snapshots, one per write
+  uint32_t inflight;
+
+  uint64_t framesets;
+  uint64_t bytes;
+  uint64_t chunks;
+};
+
+struct dump_ctx {
+  struct stream_conf* stream_conf;
+  const char* dir;
+  uint8_t* shm_base;
+  struct frameset_sub sub;
+  struct notifier* filled_notify;
+  uint32_t core;
+  volatile sig_atomic_t* main_running;
+  volatile sig_atomic_t stop; // set along with a DUMP_STOP_SIGNAL to interrupt it
+};
+
+int frameset_dump_init(
+  struct frameset_dump* dump,
+  const char* dir,
+  uint8_t* shm_base,
+  struct frameset_sub* sub,
+  uint32_t chunk_mb
+);
+int frameset_dump_write(struct frameset_dump* dump, uint32_t slot);
+int frameset_dump_reap(struct frameset_dump* dump, uint64_t timeout_ns);
+int frameset_dump_close_chunk(struct frameset_dump* dump);
+void frameset_dump_cleanup(struct frameset_dump* dump);
+void* frameset_dump_fn(void* ptr);
+
+#endif // FRAMESET_DUMP_H
@@ -0,0 +1,137 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <signal.h>
+#include <spsc_queue.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "notify.h"
+#include "parse_conf.h"
+#include "stream_mgr.h"
+#include "viddec.h"
+#include "wire.h"
+
+#define PKT_BUFS_PER_CAM 16 // must be a power of 2
+
+struct cam_stats;
+struct frame_pool;
+struct decode_worker;
+struct reactor;
+
+struct enc_pkt {
+  uint64_t timestamp;
+  uint32_t size; // 0 marks the end of the stream
+  uint32_t conn; // the camera connection it arrived on, a new one resets the decoder
+  uint32_t lost; // packets lost just before it, any has the decoder resync
+  uint8_t* spill; // holds the payload instead of data when it didn't fit
+  uint8_t data[ENCODED_FRAME_BUF_SIZE];
+};
+
+/**
+ * A camera's state, shared by the reactor that owns its socket
+ * and whichever decode worker currently holds its claim
+ *
+ * Encoded packets are handed from the reactor to the decode workers
+ * through filled_pkts and back through free_pkts, both single
+ * producer single consumer. Any worker may consume them, but only
+ * while holding the claim, so there is still a single consumer at a
+ * time and the camera's packets are decoded in order.
+ */
+struct cam_ingest {
+  struct cam_conf* conf;
+  uint32_t cam_idx;
+  uint32_t local_idx; // position in the reactor's cameras, which tags its epoll events
+  struct reactor* reactor;
+  struct decode_worker* worker; // home worker, which checks this camera first
+  struct notifier* decode_notify;
+  struct cam_stats* stats;
+
+  // owned by the reactor
+  int listenfd; // kept open while connected, so the camera can reconnect
+  int clientfd;
+  bool listening; // listenfd is in the reactor's epoll set
+  uint32_t conn; // connections dropped so far, stamped on each packet
+  uint64_t listen_start;
+  uint64_t last_recv;
+  uint64_t recv_start; // trace start of the receive the records being parsed came in with
+  struct wire_rx wire;
+  struct wire_seq seq;
+  struct enc_pkt* pkt; // free packet the next record is copied into
+  bool paused; // waiting on a free packet buffer with records unparsed
+  _Atomic bool stalled; // tells the decode worker to wake the reactor on release
+
+  struct producer_q filled_pkts_producer;
+  struct consumer_q filled_pkts_consumer;
+  struct producer_q free_pkts_producer;
+  struct consumer_q free_pkts_consumer;
+  void* q_bufs[PKT_BUFS_PER_CAM * 2];
+  struct enc_pkt* pkts;
+
+  // owned by the decode worker holding the claim
+  _Atomic uint32_t claimed;
+  decoder viddec;
+  bool decoder_initialized;
+  bool stream_ended;
+  uint32_t decoded_conn; // connection the decoder's stream came from
+  struct ts_frame_buf* current_buf;
+  struct producer_q* filled_bufs;
+};
+
+struct reactor {
+  int epfd;
+  int wakefd; // eventfd written by decode workers releasing a stalled camera's packets
+  struct cam_ingest** cams;
+  uint32_t cam_count;
+  uint32_t idx;
+  uint32_t core;
+  volatile sig_atomic_t* main_running;
+};
+
+struct decode_worker {
+  struct notifier* notify; // bumped on every packet handed to any worker
+  struct cam_ingest** cams; // home cameras
+  uint32_t cam_count;
+  struct cam_ingest* all_cams; // stolen from when the home cameras are idle
+  uint32_t all_cam_count;
+  uint32_t idx;
+  uint64_t stolen; // batches decoded from other workers' cameras
+  uint32_t core;
+  uint8_t* shm_base;
+  uint8_t* scratch_frame_buf;
+  struct stream_conf* stream_conf;
+  struct notifier* filled_notify;
+  struct frame_pool* pool;
+  volatile sig_atomic_t* main_running;
+};
+
+struct ingest {
+  struct notifier decode_notify;
+  struct cam_ingest* cams;
+  uint32_t cam_count;
+  struct reactor* reactors;
+  uint32_t reactor_count;
+  struct decode_worker* workers;
+  uint32_t worker_count;
+};
+
+int ingest_init(
+  struct ingest* ing,
+  struct cam_conf* confs,
+  uint32_t cam_count,
+  struct stream_conf* stream_conf,
+  uint32_t reactor_count,
+  uint32_t worker_count,
+  uint8_t* shm_base,
+  struct producer_q* filled_bufs,
+  struct notifier* filled_notify,
+  struct frame_pool* pool,
+  struct cam_stats* cam_stats,
+  volatile sig_atomic_t* main_running
+);
+void ingest_cleanup(struct ingest* ing);
+void* reactor_fn(void* ptr);
+void* decode_worker_fn(void* ptr);
+
+#endif // INGEST_H
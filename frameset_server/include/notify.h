@@ -0,0 +1,39 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <spsc_queue.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * A futex backed wakeup for queue consumers
+ *
+ * Producers bump seq after enqueueing and only make a syscall when a
+ * consumer is actually asleep. The futex is process shared, so a
+ * notifier placed in the shared memory segment works across processes.
+ */
+struct notifier {
+  _Alignas(64) _Atomic uint32_t seq;
+  _Atomic uint32_t waiters;
+};
+
+void notifier_init(struct notifier* n);
+void notify(struct notifier* n);
+int notify_wait(
+  struct notifier* n,
+  uint32_t seq,
+  uint64_t timeout_ns
+);
+
+int spsc_enqueue_notify(
+  struct producer_q* q,
+  struct notifier* n,
+  void* data
+);
+void* spsc_dequeue_wait(
+  struct consumer_q* q,
+  struct notifier* n,
+  uint64_t timeout_ns
+);
+
+#endif // NOTIFY_H
@@ -5,11 +5,32 @@
 #include <stdint.h>
 
 #define CAM_NAME_LEN 9
+#define CPU_LIST_LEN 64
 
 struct stream_conf {
   uint32_t frame_width;
   uint32_t frame_height;
   uint32_t fps;
+  uint32_t frameset_deadline_ms; // optional, 0 waits one frame interval
+  uint32_t hugepage_size_mb; // optional, 2 or 1024 backs the frame pool with hugepages
+  uint32_t lock_frame_pool; // optional, nonzero prefaults and mlocks the frame pool
+  uint32_t frame_pool_mb; // optional, memory budget for the frame pool
+  uint32_t frame_pool_frames; // optional, frames per camera when there is no memory budget
+  uint32_t frame_pool_low; // optional, frames guaranteed to each camera
+  uint32_t frame_pool_high; // optional, most frames one camera can hold
+  uint32_t ingest_threads; // optional, nonzero sets the reactor count instead of a thread per camera
+  uint32_t decode_threads; // optional, decode workers shared by the reactors' cameras
+  uint32_t uring_rx; // optional, nonzero receives through io_uring in thread per camera mode
+  uint32_t udp_jitter_ms; // optional, how long a UDP frame waits for its fragments, 0 waits one frame interval
+  uint32_t decoder_backend; // optional, 0 self-tests at startup, 1 cuvid, 2 software
+  uint32_t decoder_threads; // optional, software decoder threads per camera
+  uint32_t zero_copy_decode; // optional, nonzero decodes straight into shared memory as I420, software backend only
+  uint32_t record_segment_sec; // optional, length of each file in record mode
+  uint32_t record_container; // optional, 0 mkv, 1 mp4 in record mode
+  uint32_t dump_chunk_mb; // optional, size of each chunk file with -d
+  uint32_t trace_seconds; // optional, how much of the session a trace keeps, with -t
+  uint32_t max_cams; // optional, frameset positions to reserve so cameras can be added to the config live
+  char cpu_list[CPU_LIST_LEN]; // optional, cpus like 0-7,16-23 to place threads on instead of the largest L3 domain
 };
 
 struct cam_conf {
@@ -19,6 +40,8 @@ struct cam_conf {
   uint16_t udp_port;
   uint8_t id;
   char name[CAM_NAME_LEN]; // expected name format rpicamXX\0 where XX is a counter from 00-99
+  uint32_t frame_pool_low; // optional, overrides stream_params.frame_pool_low for this camera
+  uint32_t frame_pool_high; // optional, overrides stream_params.frame_pool_high for this camera
 };
 
 int count_cameras(const char* fpath);
@@ -0,0 +1,29 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdint.h>
+
+#define PLACEMENT_MAX_CPUS 1024 // CPU_SETSIZE
+
+/**
+ * The cores the server's threads are placed on, and the NUMA node
+ * their memory comes from
+ *
+ * By default that's the largest L3 domain the process may run on, so
+ * ingestion, decoding, assembly and the consumer share a last level
+ * cache, and the node those cores sit on. Cores are ordered with one
+ * hardware thread of every physical core ahead of any SMT siblings, so
+ * consecutive threads only share a core once every core has one.
+ */
+struct placement {
+  uint32_t cpus[PLACEMENT_MAX_CPUS];
+  uint32_t count;
+  int node; // -1 when the kernel has no NUMA nodes
+};
+
+int placement_init(struct placement* place, const char* cpu_list);
+uint32_t placement_cpu(struct placement* place, uint32_t idx);
+void placement_bind_memory(struct placement* place);
+int placement_allow_all(struct placement* place);
+
+#endif // PLACEMENT_H
@@ -0,0 +1,81 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parse_conf.h"
+
+#define DEFAULT_RECORD_SEGMENT_SEC 60
+#define RECORD_IO_BUF_SIZE (4 * 1024 * 1024) // bytes buffered per write syscall
+#define RECORD_PATH_LEN PATH_MAX
+#define RECORD_NAME_LEN (CAM_NAME_LEN + 24) // "<cam name>_<timestamp>.<ext>", the longest timestamp included
+
+struct AVFormatContext;
+struct AVIOContext;
+struct AVPacket;
+
+enum record_container {
+  RECORD_MKV,
+  RECORD_MP4,
+  RECORD_CONTAINER_COUNT
+};
+
+/**
+ * Writes one camera's encoded stream to disk as is
+ *
+ * Packets are remuxed into a sequence of container files, each
+ * starting on a keyframe once the current one has run for the segment
+ * duration, with the capture timestamp of every packet as its pts.
+ * Nothing is decoded. Writes go through a RECORD_IO_BUF_SIZE buffer,
+ * so a camera costs a write syscall every few megabytes.
+ */
+struct recorder {
+  const char* dir;
+  const char* cam_name;
+  enum record_container container;
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+  uint64_t segment_ns;
+
+  struct AVFormatContext* fmt; // NULL between segments
+  struct AVIOContext* io;
+  struct AVPacket* pkt;
+  int fd;
+  uint64_t segment_start;
+  uint64_t last_timestamp;
+
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t segments;
+  uint64_t skipped; // packets before the first keyframe, or out of order
+};
+
+struct record_ctx {
+  struct cam_conf* conf;
+  struct stream_conf* stream_conf;
+  const char* dir;
+  uint32_t core;
+  volatile sig_atomic_t* main_running;
+};
+
+int recorder_init(
+  struct recorder* rec,
+  const char* dir,
+  const char* cam_name,
+  struct stream_conf* stream_conf
+);
+int recorder_write(
+  struct recorder* rec,
+  uint64_t timestamp,
+  uint8_t* data,
+  uint32_t size
+);
+int recorder_close_segment(struct recorder* rec);
+void recorder_cleanup(struct recorder* rec);
+void* recorder_fn(void* ptr);
+
+#endif // RECORDER_H
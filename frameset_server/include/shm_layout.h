@@ -0,0 +1,71 @@
+#ifndef SHM_LAYOUT_H
+#define SHM_LAYOUT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frameset_asm.h"
+
+#define DEFAULT_SHM_NAME "/mocap-toolkit_shm"
+#define SHM_MAGIC 0x4d535041434f4dULL // "MOCAPSM" little endian
+#define SHM_VERSION 10
+#define SHM_PAGE_ALIGN 4096
+
+enum frame_format {
+  FRAME_FORMAT_NV12, // luma plane, then interleaved chroma
+  FRAME_FORMAT_I420 // luma plane, then the two chroma planes, from zero copy decoding
+};
+
+/**
+ * Describes the shared memory segment, and lives at offset 0 of it
+ *
+ * Every region is located by its offset from the start of the segment,
+ * and nothing in the segment stores an absolute pointer, so consumers
+ * can map it at any address and validate it without knowing how it was
+ * laid out. Bump SHM_VERSION on any change to a shared structure.
+ */
+struct shm_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  _Atomic uint32_t ready; // set once every region is initialized
+  uint32_t cam_count; // frameset positions, some may have no camera while the config allows more
+  uint32_t frame_width;
+  uint32_t frame_height;
+  uint32_t pixel_format; // enum frame_format, every frame buffer is frame_width * frame_height * 3 / 2 either way
+  uint32_t fps;
+  uint32_t frame_bufs_count;
+  uint32_t frameset_slots;
+  uint32_t frameset_ring_capacity;
+  uint32_t consumer_cpu; // for a consumer's main thread, on the server's L3 domain past its threads
+  uint64_t frame_buf_size;
+  uint64_t frame_buf_stride; // frame_buf_size rounded up to SHM_PAGE_ALIGN, so every frame starts page aligned
+  uint64_t page_size; // the segment is mapped in multiples of this
+  uint64_t shm_size;
+
+  uint64_t frame_bufs_offset;
+  uint64_t ts_frame_bufs_offset;
+  uint64_t frameset_slots_offset;
+  uint64_t frameset_refs_offset;
+  uint64_t frameset_bus_offset;
+  uint64_t filled_frameset_notify_offset;
+  uint64_t server_notify_offset;
+  uint64_t stats_offset;
+
+  _Atomic uint64_t active_mask; // positions with a camera, which change when the config is reloaded
+  uint8_t cam_ids[MAX_CAMS]; // config id of the camera in each frameset position, set before its bit
+};
+
+size_t shm_layout(
+  struct shm_header* hdr,
+  uint32_t cam_count,
+  uint32_t frame_width,
+  uint32_t frame_height,
+  uint32_t fps,
+  uint32_t frame_bufs_count,
+  uint32_t frameset_slots,
+  uint64_t page_size
+);
+
+#endif // SHM_LAYOUT_H
@@ -0,0 +1,37 @@
+#ifndef SHM_SEG_H
+#define SHM_SEG_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The shared memory segment backing the frame pool
+ *
+ * Either a POSIX shm object, or a file on a hugetlbfs mount named
+ * after it so consumers can find it by the same name. Consumers check
+ * the hugetlbfs mounts for the name before falling back to shm_open.
+ */
+struct shm_seg {
+  int fd;
+  uint8_t* buf;
+  size_t size;
+  size_t page_size;
+  const char* name;
+  char hugetlb_path[PATH_MAX]; // empty when backed by POSIX shm
+};
+
+int shm_seg_open(
+  struct shm_seg* seg,
+  const char* name,
+  uint32_t hugepage_size_mb
+);
+int shm_seg_map(
+  struct shm_seg* seg,
+  size_t size,
+  bool lock
+);
+void shm_seg_close(struct shm_seg* seg);
+
+#endif // SHM_SEG_H
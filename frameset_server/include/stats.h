@@ -0,0 +1,83 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "frameset_asm.h"
+#include "frameset_bus.h"
+
+#define STATS_INTERVAL 100000000ULL // 100 ms between refreshes of the main thread's gauges
+
+struct frame_pool;
+
+/**
+ * One camera's counters in the stats region
+ *
+ * Each group has a single writer, so counters are bumped with a
+ * relaxed load and store rather than a locked add, and readers in
+ * other processes may see the groups at slightly different instants.
+ * Every counter is cumulative since the server started, rates are
+ * left to the reader.
+ */
+struct cam_stats {
+  // written by the thread receiving the camera's stream
+  _Alignas(64) _Atomic uint64_t bytes; // encoded payload bytes
+  _Atomic uint64_t packets;
+  _Atomic uint64_t lost; // packets that never arrived, exact for v2 streams
+  _Atomic uint64_t corrupt; // corrupt records or spans of bytes skipped in v2 streams
+  _Atomic uint64_t recv_syscalls; // taken to receive them, io_uring enters included
+
+  // written by whichever thread is decoding the camera's packets
+  _Alignas(64) _Atomic uint64_t decoded_packets;
+  _Atomic uint64_t decode_ns; // spent decoding them, including taking the frames out
+
+  // refreshed by the main thread every STATS_INTERVAL
+  _Alignas(64) _Atomic uint64_t frames; // delivered in framesets
+  _Atomic uint64_t dropped; // framesets emitted without this camera
+  _Atomic uint64_t late; // frames recycled for arriving after their frameset
+  _Atomic uint64_t pool_denied; // frames decoded without a pool buffer to keep them in
+  _Atomic uint64_t last_capture; // capture timestamp of the newest frame assembled, 0 before any
+  _Atomic uint32_t held; // frame buffers the camera holds anywhere in the pipeline
+};
+
+/**
+ * The stats region of the shared memory segment
+ *
+ * Lets tools like mocap-stat watch a running session without touching
+ * the pipeline. Only the server writes to it.
+ */
+struct server_stats {
+  _Atomic uint64_t updated; // realtime ns of the main thread's last refresh, 0 before the first
+  _Atomic uint64_t published; // framesets published
+  _Atomic uint64_t complete_framesets;
+  _Atomic uint64_t partial_framesets;
+  _Atomic uint64_t expired_framesets; // pushed out of the assembly window before they could be emitted
+  _Atomic uint64_t reaped_subscribers;
+  _Atomic int64_t pool_free;
+  _Atomic uint32_t inflight_framesets; // published and not yet released by every subscriber
+  _Atomic uint32_t sub_held[MAX_SUBSCRIBERS]; // published framesets each subscriber has yet to release
+  struct cam_stats cams[MAX_CAMS];
+};
+
+static inline void stat_add(_Atomic uint64_t* stat, uint64_t n) {
+  atomic_store_explicit(
+    stat,
+    atomic_load_explicit(stat, memory_order_relaxed) + n,
+    memory_order_relaxed
+  );
+}
+
+static inline void stat_set(_Atomic uint64_t* stat, uint64_t value) {
+  atomic_store_explicit(stat, value, memory_order_relaxed);
+}
+
+void stats_init(struct server_stats* stats);
+void stats_refresh(
+  struct server_stats* stats,
+  struct frameset_asm* fa,
+  struct frame_pool* pool,
+  struct frameset_pub* pub
+);
+
+#endif // STATS_H
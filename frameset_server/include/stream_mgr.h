@@ -5,22 +5,34 @@
 #include <spsc_queue.h>
 #include <stdint.h>
 
+#include "notify.h"
 #include "parse_conf.h"
 
-#define ENCODED_FRAME_BUF_SIZE 96000
+#define ENCODED_FRAME_BUF_SIZE 96000 // larger payloads go to spill buffers
+#define CAM_STOP_SIGNAL SIGUSR1
+
+struct cam_stats;
+struct frame_pool;
+struct placement;
 
 struct thread_ctx {
   struct cam_conf* conf;
   struct stream_conf* stream_conf;
+  uint8_t* shm_base; // ts_frame_buf offsets are relative to this
   struct producer_q* filled_bufs;
-  struct consumer_q* empty_bufs;
+  struct notifier* filled_notify;
+  struct frame_pool* pool;
+  struct cam_stats* stats;
+  uint32_t cam_idx; // position in the frameset, and the pool's camera index
   uint32_t core;
+  struct placement* placement; // the decoder's own threads may run on any of its cpus
   volatile sig_atomic_t* main_running;
+  volatile sig_atomic_t stop; // stops just this camera, along with a CAM_STOP_SIGNAL to interrupt it
 };
 
 struct ts_frame_buf {
   uint64_t timestamp;
-  uint8_t* frame_buf;
+  uint64_t frame_offset; // from the start of the shared memory segment
 };
 
 void* stream_mgr_fn(void* ptr);
@@ -0,0 +1,112 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "parse_conf.h"
+
+#define TRACE_DEFAULT_SECONDS 10 // how far back a dump reaches without trace_seconds set
+#define TRACE_EVENTS_PER_FRAME 8 // sizes each thread's ring to hold the window
+#define TRACE_MAX_THREADS 64
+#define TRACE_NO_CAM UINT32_MAX
+
+enum trace_stage {
+  TRACE_RECV,
+  TRACE_DECODE_SUBMIT,
+  TRACE_DECODE_OUTPUT,
+  TRACE_ASSEMBLE,
+  TRACE_PUBLISH,
+  TRACE_STAGE_COUNT
+};
+
+struct trace_event {
+  uint64_t start; // monotonic ns
+  uint64_t end;
+  uint64_t frame_ts; // capture timestamp of the frame, 0 when the work isn't tied to one
+  uint32_t stage;
+  uint32_t cam; // frameset position, or TRACE_NO_CAM
+};
+
+enum trace_ring_state {
+  TRACE_RING_FREE,
+  TRACE_RING_OWNED, // claimed by a live thread
+  TRACE_RING_RELEASED // its thread exited, dumped until another thread claims it
+};
+
+/**
+ * One thread's most recent events, overwritten oldest first
+ *
+ * Only the owning thread writes, so recording is a plain store of the
+ * event and a release store of head. A dump can run while the owner
+ * keeps recording, and rereads head afterwards to discard any event
+ * that was overwritten under it.
+ *
+ * A ring outlives its thread, so a camera stopped by a config reload
+ * still shows up in the next dump, and is handed to a later thread
+ * with its events buffer kept, since a dump may be reading it. head
+ * keeps counting across owners, and base marks where the current one
+ * started.
+ */
+struct trace_ring {
+  _Atomic uint64_t head; // events ever recorded, the newest is at head - 1
+  _Atomic bool ready; // set once the fields below are, dumps skip the ring until then
+  _Atomic uint32_t state;
+  uint64_t base; // head when the current owner claimed the ring
+  uint64_t mask;
+  int32_t tid;
+  char name[16];
+  struct trace_event* events;
+};
+
+extern _Thread_local struct trace_ring* thread_trace; // NULL unless the thread is tracing
+
+int trace_init(
+  const char* path,
+  uint32_t seconds,
+  uint32_t fps,
+  struct cam_conf* confs,
+  uint32_t cam_count
+);
+int trace_thread(const char* name, uint32_t cams);
+void trace_error(const char* reason);
+void trace_stop();
+void trace_cleanup();
+
+static inline uint64_t trace_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t trace_begin() {
+  /**
+   * Starts timing a stage, costing nothing but a branch on threads
+   * that aren't tracing
+   */
+  return thread_trace ? trace_clock() : 0;
+}
+
+static inline void trace_end(
+  uint32_t stage,
+  uint32_t cam,
+  uint64_t frame_ts,
+  uint64_t start
+) {
+  struct trace_ring* ring = thread_trace;
+  if (!ring)
+    return;
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct trace_event* ev = &ring->events[head & ring->mask];
+  ev->start = start;
+  ev->end = trace_clock();
+  ev->frame_ts = frame_ts;
+  ev->stage = stage;
+  ev->cam = cam;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#endif // TRACE_H
@@ -0,0 +1,88 @@
+#ifndef UDP_RX_H
+#define UDP_RX_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "wire.h"
+
+#define UDP_RX_SLOTS 8 // frames in reassembly at once, must be a power of 2
+#define UDP_RX_BATCH 32 // datagrams per recvmmsg
+#define UDP_RX_DGRAM_SIZE 2048 // over any valid datagram, so a truncated one stands out
+#define UDP_RX_MAX_FRAGS ((WIRE_MAX_PAYLOAD + WIRE_FRAG_PAYLOAD - 1) / WIRE_FRAG_PAYLOAD)
+#define UDP_RX_RESTART_GAP 64 // a sequence number further off than this restarts reassembly from it
+#define UDP_RX_IDLE_TIMEOUT 1000000000ULL // 1 sec without a datagram
+#define UDP_KEYFRAME_REQ "IDR"
+#define UDP_KEYFRAME_REQ_INTERVAL 100000000ULL // 100 ms between requests to one camera
+
+/**
+ * A frame being put back together from its fragments
+ */
+struct udp_frame {
+  bool used;
+  struct wire_hdr hdr;
+  uint64_t deadline; // monotonic ns it's given up on at unless complete
+  uint32_t frag_count;
+  uint32_t frags_have;
+  uint64_t frag_bits[(UDP_RX_MAX_FRAGS + 63) / 64];
+  uint8_t* data;
+};
+
+/**
+ * Receives one camera's frames over UDP
+ *
+ * Datagrams come in batches through recvmmsg, and each fragment is
+ * copied to its place in a frame slot, so frames are handed out whole
+ * and in sequence order without ever being assembled again. A frame
+ * still missing fragments once its jitter window runs out is given up
+ * on, and so is the oldest one when a fragment arrives too far ahead
+ * of it, so a lost datagram costs a frame instead of stalling the
+ * stream. Only datagrams from the camera's own addresses are taken,
+ * since keyframe requests go back to where they came from.
+ */
+struct udp_rx {
+  int fd;
+  uint64_t jitter_ns;
+  struct in_addr cam_ips[2]; // the camera's eth and wifi addresses
+  uint8_t* frame_mem;
+  struct udp_frame frames[UDP_RX_SLOTS];
+
+  bool next_valid;
+  uint32_t next; // oldest sequence number not yet handed out or given up on
+  bool ended;
+  uint32_t eos_seq; // repeats of the end of stream carry this
+
+  // the batch of datagrams being parsed
+  struct mmsghdr msgs[UDP_RX_BATCH];
+  struct iovec iovs[UDP_RX_BATCH];
+  struct sockaddr_in addrs[UDP_RX_BATCH];
+  uint8_t* dgrams;
+  uint32_t batch_len;
+  uint32_t batch_pos;
+
+  struct sockaddr_in peer; // of the last valid fragment
+  bool have_peer;
+  uint64_t last_keyframe_req;
+
+  uint32_t corrupt;
+  uint64_t recvs;
+  uint64_t expired; // frames given up on incomplete
+  uint64_t stale; // fragments of frames already handed out or given up on
+  uint64_t foreign; // datagrams from addresses other than the camera's
+};
+
+int udp_rx_init(
+  struct udp_rx* rx,
+  int fd,
+  uint64_t jitter_ns,
+  struct in_addr eth_ip,
+  struct in_addr wifi_ip
+);
+void udp_rx_cleanup(struct udp_rx* rx);
+void udp_rx_reset(struct udp_rx* rx);
+int udp_rx_recv_packet(struct udp_rx* rx, struct rx_pkt* pkt);
+void udp_rx_request_keyframe(struct udp_rx* rx, uint16_t cam_port);
+
+#endif // UDP_RX_H
@@ -0,0 +1,60 @@
+#ifndef URING_RX_H
+#define URING_RX_H
+
+#include <liburing.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wire.h"
+
+#define URING_RX_BUFS 64 // must be a power of 2
+#define URING_RX_BUF_SIZE 32768
+#define URING_RX_BGID 0
+
+/**
+ * An io_uring receive path for one camera connection
+ *
+ * A single multishot recv stays armed on the socket and the kernel
+ * picks a buffer from a provided buffer ring for each completion, so
+ * steady state streaming needs no syscall to issue receives and only
+ * one to wait when nothing has arrived yet. Payloads that land whole
+ * in one buffer are handed out in place, and only payloads split
+ * across completions are assembled, into asm_buf or a spill buffer
+ * when they are larger than ENCODED_FRAME_BUF_SIZE.
+ */
+struct uring_rx {
+  struct io_uring ring;
+  struct io_uring_buf_ring* br;
+  uint8_t* bufs;
+  uint8_t* asm_buf;
+  int fd;
+  bool ring_initialized;
+  bool armed;
+
+  // the completion being parsed
+  int cur_bid;
+  uint8_t* cur;
+  uint32_t cur_len;
+  uint32_t cur_pos;
+  int lent_bid; // buffer the last packet's payload points into
+
+  // the packet being parsed
+  uint32_t field; // 0 header, 1 payload
+  uint32_t parsed;
+  uint8_t hdr_buf[WIRE_V2_HEADER_SIZE];
+  struct wire_hdr hdr;
+  uint8_t* payload_buf; // asm_buf or a spill buffer, NULL discards the payload
+  uint8_t version; // of the stream, 0 until its first bytes say
+  bool resyncing; // sliding over corrupt bytes to the next header
+
+  uint32_t dropped;
+  uint32_t corrupt;
+  uint64_t syscalls;
+  uint64_t discarded;
+};
+
+int uring_rx_init(struct uring_rx* rx, int clientfd);
+int uring_rx_next(struct uring_rx* rx, struct rx_pkt* pkt);
+void uring_rx_cleanup(struct uring_rx* rx);
+
+#endif // URING_RX_H
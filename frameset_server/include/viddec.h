@@ -1,19 +1,71 @@
 #ifndef VIDDEC_H
 #define VIDDEC_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#define DEFAULT_DECODER_THREADS 2
+#define DECODER_TS_SLOTS 64 // power of 2, frames that can be in flight in a decoder
+
 struct AVCodecContext;
 struct AVFrame;
 struct AVPacket;
 struct AVBufferRef;
+struct frame_pool;
+struct ts_frame_buf;
+
+enum decoder_backend {
+  DECODER_AUTO, // picked by decoder_self_test at startup
+  DECODER_CUVID,
+  DECODER_SOFTWARE,
+  DECODER_BACKEND_COUNT
+};
+
+/**
+ * Where a zero copy decoder takes its frame buffers from
+ *
+ * The software backend then decodes straight into frame pool buffers
+ * in the shared memory segment, leaving frames in I420 rather than
+ * NV12, and holds a pool reference on each for as long as it keeps
+ * the frame around to predict later frames from.
+ */
+struct decoder_sink {
+  struct frame_pool* pool;
+  uint8_t* shm_base;
+  uint64_t frame_buf_stride; // distance between frame buffers in the segment
+  uint32_t cam_idx;
+};
+
+/**
+ * The capture timestamp of a packet in flight in the decoder
+ *
+ * Each packet goes in with a sequence number as its pts, which the
+ * decoder carries over to the frame decoded from it, and the slot that
+ * sequence number maps to holds the capture timestamp. Frames come
+ * back labelled by their own packet no matter the decoder delay,
+ * reordering or dropped frames, and a slot that has since been reused
+ * shows up as a pts mismatch rather than a wrong timestamp.
+ */
+struct ts_slot {
+  int64_t pts;
+  uint64_t timestamp;
+};
 
 typedef struct decoder {
   struct AVCodecContext* ctx;
   struct AVFrame* frame;
-  struct AVFrame* hw_frame;
+  struct AVFrame* hw_frame; // what the backend decodes into
   struct AVPacket* pkt;
   struct AVBufferRef* hw_device_ctx;
+  enum decoder_backend backend;
+  struct decoder_sink sink;
+  bool zero_copy;
+  _Atomic bool sink_compatible; // cleared once the stream turns out unable to decode into the pool
+  struct ts_slot ts_slots[DECODER_TS_SLOTS];
+  int64_t next_pts;
+  bool resyncing; // set by reset_decoder or resync_decoder, packets are skipped until the next keyframe
+  uint64_t skipped; // packets skipped while resyncing
 
   uint32_t width;
   uint32_t height;
@@ -22,21 +74,41 @@ typedef struct decoder {
 int init_decoder(
   decoder* dec,
   uint32_t width,
-  uint32_t height
+  uint32_t height,
+  enum decoder_backend backend,
+  uint32_t threads,
+  struct decoder_sink* sink
 );
 
 int decode_packet(
   decoder* dec,
   uint8_t* data,
-  uint32_t size
+  uint32_t size,
+  uint64_t timestamp
 );
 
 int recv_frame(
   decoder* dec,
-  uint8_t* out_buf
+  uint8_t* out_buf,
+  uint64_t* timestamp
+);
+
+int recv_pool_frame(
+  decoder* dec,
+  struct ts_frame_buf** out,
+  uint64_t* timestamp
 );
 
 int flush_decoder(decoder* dec);
+void reset_decoder(decoder* dec);
+void resync_decoder(decoder* dec);
 void cleanup_decoder(decoder* dec);
 
+const char* decoder_backend_name(enum decoder_backend backend);
+enum decoder_backend decoder_self_test(
+  uint32_t width,
+  uint32_t height,
+  uint32_t threads
+);
+
 #endif // VIDDEC_H
@@ -0,0 +1,163 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WIRE_RING_SIZE (256 * 1024) // must be a power of 2 and a multiple of the page size
+#define WIRE_MAX_PAYLOAD (8 * 1024 * 1024) // anything larger is a corrupt stream
+#define WIRE_SPILL_BUFS 8 // shared by every camera, at most 32
+
+#define WIRE_PROBE_SIZE 8 // enough to tell a hello, a v1 end of stream and a header apart
+#define WIRE_V1_HEADER_SIZE 12
+#define WIRE_V2_HEADER_SIZE 28
+#define WIRE_HELLO "MOCAPWV2"
+#define WIRE_V1_EOS "EOSTREAM"
+#define WIRE_MAGIC 0x3257434dU // "MCW2"
+#define WIRE_FLAG_KEYFRAME 0x01
+#define WIRE_FLAG_EOS 0x02
+#define WIRE_CAM_UNSET 0xff // sent by cameras that weren't given their id
+#define WIRE_FRAG_HEADER_SIZE (WIRE_V2_HEADER_SIZE + 8)
+#define WIRE_FRAG_PAYLOAD 1400 // keeps each datagram under a 1500 byte MTU
+
+/*
+ * A v1 record is an 8 byte timestamp, a 4 byte payload size and the
+ * payload, and a v1 stream ends with an 8 byte "EOSTREAM".
+ *
+ * A v2 stream opens with the 8 byte WIRE_HELLO, which no v1 timestamp
+ * could equal before 2084, and the server picks the version per
+ * connection from it. Every v2 record then has a 28 byte little endian
+ * header ahead of its payload:
+ *
+ *   0  u32  WIRE_MAGIC
+ *   4  u8   version, 2
+ *   5  u8   WIRE_FLAG_* flags
+ *   6  u8   camera id
+ *   7  u8   reserved, 0
+ *   8  u64  capture timestamp
+ *   16 u32  sequence number
+ *   20 u32  payload size, 0 with WIRE_FLAG_EOS ending the stream
+ *   24 u32  CRC32C of the header's first 24 bytes, then the payload
+ *
+ * A camera numbers every packet it encodes, including ones it couldn't
+ * send, and keeps counting across reconnects, so gaps in the sequence
+ * are exactly the frames the server never got. The magic lets a parser
+ * find the next record after a corrupt one.
+ *
+ * Over UDP a v2 record is split into datagrams of WIRE_FRAG_PAYLOAD
+ * payload bytes each, the last one shorter, and every datagram carries
+ * the record's header followed by:
+ *
+ *   28 u16  fragment index
+ *   30 u16  fragment count, 1 for an end of stream
+ *   32 u32  CRC32C of the datagram's first 32 bytes
+ *
+ * The record's own CRC can only be checked once every fragment is in,
+ * so each datagram's CRC is what lets its sequence number be trusted.
+ * There's no hello, a UDP stream is always v2.
+ */
+
+/**
+ * A record's header, in whichever version it arrived
+ */
+struct wire_hdr {
+  uint64_t timestamp;
+  uint32_t size;
+  uint32_t seq;
+  uint32_t crc; // as sent, checked against the payload once it's in
+  uint32_t hdr_crc; // of the header bytes, the payload's CRC continues from it
+  uint8_t version;
+  uint8_t flags;
+  uint8_t cam_id;
+};
+
+struct rx_pkt {
+  uint64_t timestamp;
+  uint32_t size; // 0 marks the end of the stream
+  uint8_t* data;
+  bool spilled; // data is a spill buffer the caller returns with wire_spill_put
+  uint8_t version;
+  uint8_t flags; // v2 only
+  uint8_t cam_id; // v2 only
+  uint32_t seq; // v2 only
+  uint32_t dropped; // records the parser dropped since the last one it returned
+  uint32_t corrupt; // corrupt spans the parser skipped since the last one it returned
+};
+
+/**
+ * Tracks a camera's v2 sequence numbers across its connections, to
+ * count the records that never reached the decoder
+ */
+struct wire_seq {
+  bool valid;
+  bool id_warned;
+  uint32_t next;
+};
+
+/**
+ * A receive ring and resumable parser for one camera stream
+ *
+ * The ring is mapped twice back to back, so every record in it is
+ * contiguous in memory however it wraps. Each receive takes as many
+ * bytes as fit, and every complete record in them is handed out in
+ * place without waiting on further receives.
+ *
+ * Payloads over ENCODED_FRAME_BUF_SIZE, large keyframes mostly, are
+ * received straight into a spill buffer from a small shared pool
+ * instead, so the ring never needs to hold a whole one.
+ */
+struct wire_rx {
+  uint8_t* ring;
+  uint64_t head; // total bytes received
+  uint64_t tail; // total bytes parsed
+
+  uint8_t version; // of the connection's stream, 0 until its first bytes say
+  bool resyncing; // skipping corrupt bytes up to the next header
+
+  // the oversized record being received into a spill buffer
+  bool in_spill;
+  struct wire_hdr spill_hdr;
+  uint32_t spill_have;
+  uint8_t* spill; // NULL with in_spill set discards the payload
+
+  uint32_t dropped;
+  uint32_t corrupt;
+  uint64_t recvs;
+  uint64_t discarded;
+};
+
+int wire_spill_init();
+void wire_spill_cleanup();
+uint8_t* wire_spill_get();
+void wire_spill_put(uint8_t* buf);
+
+int wire_parse_header(
+  uint8_t* version,
+  const uint8_t* buf,
+  uint32_t avail,
+  struct wire_hdr* hdr
+);
+uint32_t wire_header_size(uint8_t version);
+bool wire_payload_ok(struct wire_hdr* hdr, const uint8_t* payload);
+void wire_hdr_pkt(struct wire_hdr* hdr, struct rx_pkt* pkt);
+uint32_t wire_seq_lost(
+  struct wire_seq* seq,
+  struct rx_pkt* pkt,
+  uint8_t cam_id,
+  const char* cam_name
+);
+
+int wire_rx_init(struct wire_rx* rx);
+void wire_rx_cleanup(struct wire_rx* rx);
+void wire_rx_reset(struct wire_rx* rx);
+ssize_t wire_rx_recv(struct wire_rx* rx, int fd);
+int wire_rx_next(struct wire_rx* rx, struct rx_pkt* pkt);
+int wire_rx_recv_packet(
+  struct wire_rx* wire,
+  int clientfd,
+  struct rx_pkt* pkt,
+  const char* cam_name
+);
+
+#endif // WIRE_H
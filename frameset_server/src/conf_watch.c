@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "conf_watch.h"
+#include "logging.h"
+
+int conf_watch_init(struct conf_watch* watch, const char* path) {
+  /**
+   * Starts watching the config's directory for the config being
+   * written or moved into place
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+  char dir_buf[PATH_MAX];
+  char name_buf[PATH_MAX];
+
+  watch->fd = -1;
+  snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+  snprintf(name_buf, sizeof(name_buf), "%s", path);
+  snprintf(watch->name, sizeof(watch->name), "%s", basename(name_buf));
+  const char* dir = dirname(dir_buf);
+
+  watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch->fd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating inotify instance: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  int wd = inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    int err = errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error watching %s: %s",
+      dir,
+      strerror(err)
+    );
+    log(ERROR, logstr);
+    conf_watch_cleanup(watch);
+    return -err;
+  }
+
+  return 0;
+}
+
+bool conf_watch_changed(struct conf_watch* watch) {
+  /**
+   * Drains pending events without blocking
+   *
+   * Returns:
+   * - bool: true if the config was rewritten since the last call
+   */
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool changed = false;
+
+  while (true) {
+    ssize_t len = read(watch->fd, buf, sizeof(buf));
+    if (len <= 0)
+      return changed;
+
+    for (char* ptr = buf; ptr < buf + len;) {
+      struct inotify_event* ev = (struct inotify_event*)ptr;
+      if (ev->len && strcmp(ev->name, watch->name) == 0)
+        changed = true;
+      ptr += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+void conf_watch_cleanup(struct conf_watch* watch) {
+  if (watch->fd >= 0)
+    close(watch->fd);
+  watch->fd = -1;
+}
@@ -0,0 +1,79 @@
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78U // Castagnoli, reflected
+
+#ifndef __SSE4_2__
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void init_table() {
+  /**
+   * Builds the slicing by 8 tables, where table[k][b] is the crc of
+   * byte b followed by k zero bytes
+   */
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int i = 0; i < 8; i++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    table[0][b] = crc;
+  }
+
+  for (uint32_t b = 0; b < 256; b++) {
+    for (int k = 1; k < 8; k++)
+      table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+  }
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+  /**
+   * Extends a CRC32C over len more bytes, starting from 0 for a new
+   * one, so a record can be checked in pieces
+   *
+   * Builds with SSE 4.2 enabled use the crc32 instruction, 8 bytes at
+   * a time, and the rest fall back to slicing by 8 tables
+   */
+  const uint8_t* p = buf;
+  crc = ~crc;
+
+#ifdef __SSE4_2__
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+
+  for (; len; len--, p++)
+    crc = _mm_crc32_u8(crc, *p);
+#else
+  pthread_once(&table_once, init_table);
+
+  for (; len >= 8; len -= 8, p += 8) {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    lo ^= crc;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+          table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+          table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+          table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+  }
+
+  for (; len; len--, p++)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+#endif
+
+  return ~crc;
+}
@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_pool.h"
+#include "stream_mgr.h"
+
+int frame_pool_init(
+  struct frame_pool* pool,
+  struct ts_frame_buf* bufs,
+  uint32_t count,
+  uint32_t cam_count,
+  const uint32_t* lows,
+  const uint32_t* highs
+) {
+  /**
+   * Puts every buffer on the free stack
+   *
+   * Parameters:
+   * - struct ts_frame_buf* bufs: the shared buffer array
+   * - uint32_t count: number of buffers, at least the sum of lows
+   * - const uint32_t* lows: buffers guaranteed to each camera
+   * - const uint32_t* highs: most buffers each camera can hold
+   *
+   * Returns:
+   * - int: 0 on success, -EINVAL, or -ENOMEM
+   */
+  memset(pool, 0, sizeof(*pool));
+
+  uint64_t reserved = 0;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    if (highs[i] < lows[i])
+      return -EINVAL;
+    reserved += lows[i];
+  }
+  if (reserved > count)
+    return -EINVAL;
+
+  pool->next = malloc(sizeof(*pool->next) * count);
+  pool->refs = malloc(sizeof(*pool->refs) * count);
+  if (!pool->next || !pool->refs) {
+    frame_pool_cleanup(pool);
+    return -ENOMEM;
+  }
+
+  pool->bufs = bufs;
+  pool->count = count;
+  pool->cam_count = cam_count;
+
+  for (uint32_t i = 0; i < count; i++) {
+    atomic_init(&pool->next[i], i + 1 < count ? i + 2 : 0);
+    atomic_init(&pool->refs[i], 0);
+  }
+
+  atomic_init(&pool->head, count ? 1 : 0);
+  atomic_init(&pool->free_count, count);
+  atomic_init(&pool->reserved, (int64_t)reserved);
+
+  for (uint32_t i = 0; i < MAX_CAMS; i++) {
+    atomic_init(&pool->cams[i].held, 0);
+    atomic_init(&pool->cams[i].dropped, 0);
+    pool->cams[i].low = i < cam_count ? lows[i] : 0;
+    pool->cams[i].high = i < cam_count ? highs[i] : 0;
+  }
+
+  return 0;
+}
+
+int frame_pool_set_watermarks(
+  struct frame_pool* pool,
+  uint32_t cam,
+  uint32_t low,
+  uint32_t high
+) {
+  /**
+   * Gives a camera joining the session the watermarks of its own
+   * config entry, high cut down to what the other cameras' guarantees
+   * leave
+   *
+   * Only safe while no thread takes buffers for the camera, and only
+   * the calling thread gives them back, as between stopping a camera
+   * and starting the next in its position.
+   *
+   * Returns:
+   * - int: 0 on success, or -EINVAL when high is under low or the
+   *   pool can't guarantee low on top of the other cameras
+   */
+  uint64_t others = 0;
+  for (uint32_t i = 0; i < pool->cam_count; i++) {
+    if (i != cam)
+      others += pool->cams[i].low;
+  }
+
+  if (high < low || others + low > pool->count)
+    return -EINVAL;
+  if (high > pool->count - others)
+    high = pool->count - others;
+
+  // the buffers set aside for the camera follow its guarantee
+  struct cam_pool_state* state = &pool->cams[cam];
+  uint32_t held = atomic_load(&state->held);
+  int64_t owed_before = state->low > held ? state->low - held : 0;
+  int64_t owed_after = low > held ? low - held : 0;
+  atomic_fetch_add(&pool->reserved, owed_after - owed_before);
+
+  state->low = low;
+  state->high = high;
+  return 0;
+}
+
+void frame_pool_cleanup(struct frame_pool* pool) {
+  free(pool->next);
+  free(pool->refs);
+  pool->next = NULL;
+  pool->refs = NULL;
+}
+
+static struct ts_frame_buf* pop(struct frame_pool* pool) {
+  uint64_t head = atomic_load(&pool->head);
+
+  while (true) {
+    uint32_t idx = (uint32_t)head;
+    if (idx == 0)
+      return NULL;
+
+    // the tag changes on every update so a stale head can never swap back in
+    uint64_t tag = (head >> 32) + 1;
+    uint32_t next = atomic_load_explicit(&pool->next[idx - 1], memory_order_relaxed);
+    if (atomic_compare_exchange_weak(&pool->head, &head, tag << 32 | next))
+      return &pool->bufs[idx - 1];
+  }
+}
+
+static void push(struct frame_pool* pool, struct ts_frame_buf* buf) {
+  uint32_t idx = buf - pool->bufs + 1;
+  uint64_t head = atomic_load(&pool->head);
+
+  while (true) {
+    uint64_t tag = (head >> 32) + 1;
+    atomic_store_explicit(&pool->next[idx - 1], (uint32_t)head, memory_order_relaxed);
+    if (atomic_compare_exchange_weak(&pool->head, &head, tag << 32 | idx))
+      return;
+  }
+}
+
+struct ts_frame_buf* frame_pool_get(struct frame_pool* pool, uint32_t cam) {
+  /**
+   * Takes a free buffer for a camera's next frame
+   *
+   * Never blocks. When the camera is at its high watermark, or past its
+   * low watermark with nothing left to borrow, the frame is counted as
+   * dropped and the worker decodes it into scratch memory instead, so
+   * a stalled consumer costs frames rather than stalling ingestion.
+   *
+   * Returns:
+   * - struct ts_frame_buf*: the buffer, or NULL when denied
+   */
+  struct cam_pool_state* state = &pool->cams[cam];
+  uint32_t held = atomic_load(&state->held);
+
+  bool guaranteed = held < state->low;
+  bool can_borrow = atomic_load(&pool->free_count) > atomic_load(&pool->reserved);
+  if (held >= state->high || (!guaranteed && !can_borrow)) {
+    atomic_fetch_add_explicit(&state->dropped, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  struct ts_frame_buf* buf = pop(pool);
+  if (!buf) {
+    atomic_fetch_add_explicit(&state->dropped, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  atomic_fetch_sub(&pool->free_count, 1);
+  atomic_fetch_add(&state->held, 1);
+  if (guaranteed)
+    atomic_fetch_sub(&pool->reserved, 1);
+
+  atomic_store(&pool->refs[buf - pool->bufs], 1);
+  return buf;
+}
+
+void frame_pool_ref(struct frame_pool* pool, struct ts_frame_buf* buf) {
+  /**
+   * Adds a holder to a buffer that already has one, each holder
+   * releases it with its own frame_pool_put
+   */
+  atomic_fetch_add(&pool->refs[buf - pool->bufs], 1);
+}
+
+void frame_pool_put(
+  struct frame_pool* pool,
+  uint32_t cam,
+  struct ts_frame_buf* buf
+) {
+  /**
+   * Drops a holder of a buffer, returning it to the shared stack
+   * once nobody holds it
+   */
+  if (atomic_fetch_sub(&pool->refs[buf - pool->bufs], 1) != 1)
+    return;
+
+  struct cam_pool_state* state = &pool->cams[cam];
+
+  uint32_t held = atomic_fetch_sub(&state->held, 1) - 1;
+  if (held < state->low)
+    atomic_fetch_add(&pool->reserved, 1);
+
+  push(pool, buf);
+  atomic_fetch_add(&pool->free_count, 1);
+}
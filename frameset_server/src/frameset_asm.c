@@ -0,0 +1,315 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frame_pool.h"
+#include "frameset_asm.h"
+#include "stream_mgr.h"
+
+#define WINDOW_MASK (ASM_WINDOW - 1)
+
+void frameset_asm_init(
+  struct frameset_asm* fa,
+  uint32_t cam_count,
+  uint64_t active_mask,
+  uint64_t t0,
+  uint64_t interval,
+  uint64_t deadline,
+  struct ts_frame_buf* ts_frame_bufs,
+  struct frame_pool* pool
+) {
+  /**
+   * Initializes a timestamp bucketed frameset assembler
+   *
+   * Frames are filed into slots keyed by their frame index, which
+   * is the number of frame intervals since the broadcast start
+   * timestamp. Every camera computes its capture schedule from that
+   * same timestamp, so frames captured for the same instant share
+   * an index even when they arrive at different times.
+   *
+   * Parameters:
+   * - uint32_t cam_count: number of frameset positions, at most MAX_CAMS
+   * - uint64_t active_mask: the positions streaming from the start,
+   *   the rest can be filled later with frameset_asm_add_cam
+   * - uint64_t t0: the start timestamp broadcast to the cameras
+   * - uint64_t interval: nanoseconds between scheduled captures
+   * - uint64_t deadline: nanoseconds a frame index waits for stragglers
+   *   after the first frame for it arrives
+   * - struct ts_frame_buf* ts_frame_bufs: the shared frame buffer array,
+   *   emitted framesets refer to frames by their index into it
+   * - struct frame_pool* pool: the pool late and expired frames are
+   *   recycled into
+   */
+  memset(fa, 0, sizeof(*fa));
+  fa->t0 = t0;
+  fa->interval = interval;
+  fa->deadline = deadline;
+  fa->cam_count = cam_count;
+  fa->ts_frame_bufs = ts_frame_bufs;
+  fa->active_mask = active_mask;
+  fa->pool = pool;
+}
+
+static void recycle(
+  struct frameset_asm* fa,
+  uint32_t cam,
+  struct ts_frame_buf* buf
+) {
+  frame_pool_put(fa->pool, cam, buf);
+}
+
+static void reset_slot(struct asm_slot* slot) {
+  slot->first_arrival = 0;
+  slot->cam_mask = 0;
+  memset(slot->frames, 0, sizeof(slot->frames));
+}
+
+static uint64_t expected_mask(struct frameset_asm* fa, uint64_t idx) {
+  /**
+   * The cameras a frame index waits on, which leaves out cameras that
+   * joined after it and ones whose first frame is still to come
+   */
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < fa->cam_count; i++) {
+    if ((fa->active_mask & (1ULL << i)) && fa->join_idx[i] <= idx)
+      mask |= 1ULL << i;
+  }
+  return mask;
+}
+
+void frameset_asm_add_cam(struct frameset_asm* fa, uint32_t cam) {
+  /**
+   * Starts assembling a camera into framesets without disturbing the
+   * others
+   *
+   * The camera joins at the frame index of its first frame, so the
+   * framesets before it aren't counted as missing it, and from there
+   * on every frameset waits for it like any other camera
+   */
+  fa->active_mask |= 1ULL << cam;
+  fa->join_idx[cam] = UINT64_MAX;
+  fa->last_idx[cam] = 0;
+  memset(&fa->stats[cam], 0, sizeof(fa->stats[cam]));
+}
+
+void frameset_asm_remove_cam(struct frameset_asm* fa, uint32_t cam) {
+  /**
+   * Stops assembling a camera, starting with the next frameset emitted
+   *
+   * Its frames still waiting in the window go back to the pool, and
+   * any that arrive afterwards are recycled as late
+   */
+  uint64_t bit = 1ULL << cam;
+  fa->active_mask &= ~bit;
+
+  for (uint32_t i = 0; i < ASM_WINDOW; i++) {
+    struct asm_slot* slot = &fa->slots[i];
+    if (!(slot->cam_mask & bit))
+      continue;
+
+    recycle(fa, cam, slot->frames[cam]);
+    slot->frames[cam] = NULL;
+    slot->cam_mask &= ~bit;
+  }
+}
+
+static void expire_oldest(struct frameset_asm* fa) {
+  struct asm_slot* slot = &fa->slots[fa->next_idx & WINDOW_MASK];
+
+  if (slot->cam_mask) {
+    uint64_t expected = expected_mask(fa, fa->next_idx);
+    for (uint32_t i = 0; i < fa->cam_count; i++) {
+      if (expected & (1ULL << i))
+        fa->stats[i].dropped++;
+      if (slot->cam_mask & (1ULL << i))
+        recycle(fa, i, slot->frames[i]);
+    }
+    fa->expired_framesets++;
+  }
+
+  reset_slot(slot);
+  fa->next_idx++;
+}
+
+void frameset_asm_insert(
+  struct frameset_asm* fa,
+  uint32_t cam,
+  struct ts_frame_buf* buf,
+  uint64_t now
+) {
+  /**
+   * Files a decoded frame into the slot for its frame index
+   *
+   * The index is rounded to the nearest interval so small capture
+   * skew between cameras lands in the same slot. Frames for indices
+   * that were already emitted are counted as late and recycled.
+   *
+   * The first frame to arrive for an index starts its deadline, and
+   * also starts the deadline of any older index nobody has delivered
+   * yet, since those are now known to be overdue.
+   */
+  uint64_t bit = 1ULL << cam;
+
+  // stragglers from a camera that was just removed
+  if (!(fa->active_mask & bit)) {
+    fa->stats[cam].late++;
+    recycle(fa, cam, buf);
+    return;
+  }
+
+  if (buf->timestamp + fa->interval / 2 < fa->t0) {
+    fa->stats[cam].late++;
+    recycle(fa, cam, buf);
+    return;
+  }
+
+  uint64_t idx = (buf->timestamp - fa->t0 + fa->interval / 2) / fa->interval;
+
+  if (!fa->started) {
+    fa->started = true;
+    fa->next_idx = idx;
+    fa->stamped_idx = idx;
+  }
+
+  if (idx < fa->next_idx) {
+    fa->stats[cam].late++;
+    recycle(fa, cam, buf);
+    return;
+  }
+
+  // a jump past the window means everything in it is far past its deadline
+  if (idx - fa->next_idx >= 2 * ASM_WINDOW) {
+    for (uint32_t i = 0; i < ASM_WINDOW; i++)
+      expire_oldest(fa);
+    fa->next_idx = idx - ASM_WINDOW + 1;
+  }
+
+  while (idx >= fa->next_idx + ASM_WINDOW)
+    expire_oldest(fa);
+
+  if (fa->join_idx[cam] == UINT64_MAX)
+    fa->join_idx[cam] = idx;
+
+  if (fa->stamped_idx < fa->next_idx)
+    fa->stamped_idx = fa->next_idx;
+
+  struct asm_slot* slot = &fa->slots[idx & WINDOW_MASK];
+  if (slot->cam_mask & bit) {
+    // a second frame for an index this camera already filled
+    fa->stats[cam].late++;
+    recycle(fa, cam, buf);
+    return;
+  }
+
+  slot->frame_idx = idx;
+  slot->cam_mask |= bit;
+  slot->frames[cam] = buf;
+
+  for (uint64_t i = fa->stamped_idx; i <= idx; i++) {
+    struct asm_slot* pending = &fa->slots[i & WINDOW_MASK];
+    if (pending->first_arrival == 0) {
+      pending->frame_idx = i;
+      pending->first_arrival = now;
+    }
+  }
+  if (idx > fa->stamped_idx)
+    fa->stamped_idx = idx;
+
+  if (idx + 1 > fa->last_idx[cam])
+    fa->last_idx[cam] = idx + 1;
+}
+
+static bool all_cams_passed(
+  struct frameset_asm* fa,
+  uint64_t expected,
+  uint64_t idx
+) {
+  for (uint32_t i = 0; i < fa->cam_count; i++) {
+    if ((expected & (1ULL << i)) && fa->last_idx[i] <= idx + 1)
+      return false;
+  }
+  return true;
+}
+
+bool frameset_asm_pop(
+  struct frameset_asm* fa,
+  uint64_t now,
+  struct frameset* out
+) {
+  /**
+   * Emits the oldest frame index once it is resolved
+   *
+   * An index is resolved when every camera has delivered a frame for
+   * it, when every camera has already delivered a newer frame (cameras
+   * deliver in order, so nothing more can arrive), or when its deadline
+   * has expired. Indices no camera delivered are skipped.
+   *
+   * Partial framesets are emitted with the missing cameras cleared in
+   * cam_mask, and count as a drop for each missing camera. active_mask
+   * tells consumers which cameras the frameset waited on, which only
+   * changes between framesets as cameras join and leave. Frames are
+   * emitted as indices into the shared ts_frame_buf array so the
+   * frameset means the same thing in every process mapping it.
+   *
+   * Returns:
+   * - bool: true if out was filled with a frameset
+   */
+  while (fa->started) {
+    struct asm_slot* slot = &fa->slots[fa->next_idx & WINDOW_MASK];
+    if (slot->first_arrival == 0)
+      return false;
+
+    uint64_t expected = expected_mask(fa, fa->next_idx);
+    bool complete = slot->cam_mask == expected;
+    bool expired = now - slot->first_arrival >= fa->deadline;
+    if (!complete && !expired && !all_cams_passed(fa, expected, fa->next_idx))
+      return false;
+
+    if (slot->cam_mask == 0) {
+      reset_slot(slot);
+      fa->next_idx++;
+      continue;
+    }
+
+    out->timestamp = fa->t0 + fa->next_idx * fa->interval;
+    out->cam_mask = slot->cam_mask;
+    out->active_mask = expected;
+    memset(out->frame_idx, 0, sizeof(out->frame_idx));
+
+    for (uint32_t i = 0; i < fa->cam_count; i++) {
+      if (slot->cam_mask & (1ULL << i)) {
+        out->frame_idx[i] = slot->frames[i] - fa->ts_frame_bufs;
+        fa->stats[i].frames++;
+      } else if (expected & (1ULL << i)) {
+        fa->stats[i].dropped++;
+      }
+    }
+
+    if (complete)
+      fa->complete_framesets++;
+    else
+      fa->partial_framesets++;
+
+    reset_slot(slot);
+    fa->next_idx++;
+    return true;
+  }
+
+  return false;
+}
+
+uint64_t frameset_asm_next_deadline(struct frameset_asm* fa) {
+  /**
+   * Returns the monotonic time at which the oldest pending frame
+   * index expires, or UINT64_MAX when nothing is pending, so the
+   * caller knows how long it can sleep without missing a deadline
+   */
+  if (!fa->started)
+    return UINT64_MAX;
+
+  struct asm_slot* slot = &fa->slots[fa->next_idx & WINDOW_MASK];
+  if (slot->first_arrival == 0)
+    return UINT64_MAX;
+
+  return slot->first_arrival + fa->deadline;
+}
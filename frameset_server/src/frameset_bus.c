@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frameset_bus.h"
+#include "logging.h"
+#include "notify.h"
+
+size_t frameset_bus_size(uint32_t ring_capacity) {
+  /**
+   * Returns the bytes needed for a bus whose ring holds
+   * ring_capacity entries, which must be a power of 2
+   */
+  return sizeof(struct frameset_bus) + sizeof(uint32_t) * ring_capacity;
+}
+
+int frameset_pub_init(
+  struct frameset_pub* pub,
+  struct frameset_bus* bus,
+  struct frameset_ref* refs,
+  uint32_t slot_count,
+  uint32_t ring_capacity
+) {
+  /**
+   * Initializes the shared bus and the server's view of the slot pool
+   *
+   * Parameters:
+   * - struct frameset_bus* bus: the bus in the shared segment
+   * - struct frameset_ref* refs: slot_count reference states in the
+   *   shared segment, one per frameset slot
+   * - uint32_t ring_capacity: power of 2, at least slot_count
+   *
+   * Returns:
+   * - int: 0 on success, -ENOMEM
+   */
+  memset(pub, 0, sizeof(*pub));
+  pub->free_slots = malloc(sizeof(uint32_t) * slot_count);
+  pub->inflight_slots = malloc(sizeof(uint32_t) * slot_count);
+  if (!pub->free_slots || !pub->inflight_slots) {
+    frameset_pub_cleanup(pub);
+    return -ENOMEM;
+  }
+
+  atomic_init(&bus->head, 0);
+  atomic_init(&bus->reliable_mask, 0);
+  bus->mask = ring_capacity - 1;
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    atomic_init(&bus->subs[i].state, SUB_FREE);
+    atomic_init(&bus->subs[i].pid, 0);
+  }
+
+  for (uint32_t i = 0; i < slot_count; i++) {
+    atomic_init(&refs[i].refs, 0);
+    atomic_init(&refs[i].seq, UINT64_MAX);
+    pub->free_slots[i] = slot_count - 1 - i;
+  }
+
+  pub->bus = bus;
+  pub->refs = refs;
+  pub->slot_count = slot_count;
+  pub->free_count = slot_count;
+  pub->latest = UINT32_MAX;
+  return 0;
+}
+
+void frameset_pub_cleanup(struct frameset_pub* pub) {
+  free(pub->free_slots);
+  free(pub->inflight_slots);
+  pub->free_slots = NULL;
+  pub->inflight_slots = NULL;
+}
+
+int frameset_pub_acquire(struct frameset_pub* pub, uint32_t* slot) {
+  /**
+   * Takes a slot nobody references to fill with a frameset
+   *
+   * Returns:
+   * - int: 0 with slot set, or -EAGAIN when subscribers still hold
+   *   every slot, in which case the caller drops rather than waits
+   */
+  if (pub->free_count == 0)
+    return -EAGAIN;
+
+  *slot = pub->free_slots[--pub->free_count];
+  return 0;
+}
+
+void frameset_pub_publish(struct frameset_pub* pub, uint32_t slot) {
+  /**
+   * Publishes a filled slot to every subscriber
+   *
+   * The slot starts out referenced by every reliable subscriber and by
+   * LATEST_HOLD, which keeps it alive for latest-only readers until a
+   * newer frameset replaces it. The caller notifies the subscribers.
+   */
+  struct frameset_bus* bus = pub->bus;
+  struct frameset_ref* ref = &pub->refs[slot];
+  uint64_t seq = atomic_load_explicit(&bus->head, memory_order_relaxed);
+
+  uint32_t mask = atomic_load(&bus->reliable_mask);
+  atomic_store_explicit(&ref->seq, seq, memory_order_relaxed);
+  atomic_store(&ref->refs, mask | LATEST_HOLD);
+
+  /*
+   * A subscriber leaving clears its bit from the mask, then from every
+   * slot. If it left after the load above, it may have already swept
+   * past this slot, but then the reload below sees its bit gone
+   */
+  uint32_t left = mask & ~atomic_load(&bus->reliable_mask);
+  if (left)
+    atomic_fetch_and(&ref->refs, ~left);
+
+  atomic_store_explicit(&bus->entries[seq & bus->mask], slot, memory_order_relaxed);
+  atomic_store_explicit(&bus->head, seq + 1, memory_order_release);
+
+  pub->inflight_slots[pub->inflight_count++] = slot;
+
+  if (pub->latest != UINT32_MAX)
+    atomic_fetch_and(&pub->refs[pub->latest].refs, ~LATEST_HOLD);
+  pub->latest = slot;
+}
+
+uint32_t frameset_pub_reclaim(struct frameset_pub* pub, uint32_t* slots) {
+  /**
+   * Returns published slots every subscriber has released to the pool
+   *
+   * Parameters:
+   * - uint32_t* slots: receives the reclaimed slot indices, must have
+   *   room for slot_count entries, so the caller can recycle the
+   *   frames they hold
+   *
+   * Returns:
+   * - uint32_t: the number of slots reclaimed
+   */
+  uint32_t reclaimed = 0;
+  uint32_t i = 0;
+  while (i < pub->inflight_count) {
+    uint32_t slot = pub->inflight_slots[i];
+    if (atomic_load_explicit(&pub->refs[slot].refs, memory_order_acquire) != 0) {
+      i++;
+      continue;
+    }
+
+    pub->inflight_slots[i] = pub->inflight_slots[--pub->inflight_count];
+    pub->free_slots[pub->free_count++] = slot;
+    slots[reclaimed++] = slot;
+  }
+
+  return reclaimed;
+}
+
+void frameset_pub_reap(struct frameset_pub* pub, uint64_t now) {
+  /**
+   * Frees the subscriptions of consumers that exited without
+   * unsubscribing, dropping every reference they still held
+   *
+   * Runs at most once per REAP_INTERVAL since it costs a syscall
+   * per subscriber
+   */
+  if (now - pub->last_reap < REAP_INTERVAL)
+    return;
+  pub->last_reap = now;
+
+  char logstr[128];
+  struct frameset_bus* bus = pub->bus;
+
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    struct bus_sub* sub = &bus->subs[i];
+    if (atomic_load(&sub->state) == SUB_FREE)
+      continue;
+
+    int32_t pid = atomic_load(&sub->pid);
+    if (pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH)
+      continue;
+
+    uint32_t bit = 1U << i;
+    atomic_fetch_and(&bus->reliable_mask, ~bit);
+    for (uint32_t j = 0; j < pub->slot_count; j++)
+      atomic_fetch_and(&pub->refs[j].refs, ~bit);
+
+    atomic_store(&sub->pid, 0);
+    atomic_store(&sub->state, SUB_FREE);
+    pub->reaped_subscribers++;
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Reclaimed subscription %u of exited consumer pid %d",
+      i,
+      pid
+    );
+    log(WARNING, logstr);
+  }
+}
+
+void frameset_pub_held(struct frameset_pub* pub, uint32_t* held) {
+  /**
+   * Counts the published framesets each subscriber has yet to release,
+   * how far a reliable subscriber is behind the server
+   *
+   * Parameters:
+   * - uint32_t* held: receives a count per subscriber, MAX_SUBSCRIBERS
+   *   entries
+   */
+  memset(held, 0, sizeof(uint32_t) * MAX_SUBSCRIBERS);
+
+  for (uint32_t i = 0; i < pub->inflight_count; i++) {
+    uint32_t refs = atomic_load_explicit(
+      &pub->refs[pub->inflight_slots[i]].refs,
+      memory_order_relaxed
+    ) & ~LATEST_HOLD;
+
+    while (refs) {
+      held[__builtin_ctz(refs)]++;
+      refs &= refs - 1;
+    }
+  }
+}
+
+int frameset_sub_join(
+  struct frameset_sub* sub,
+  struct frameset_bus* bus,
+  struct frameset_ref* refs,
+  uint32_t slot_count,
+  struct notifier* server_notify
+) {
+  /**
+   * Claims a free subscriber slot as a reliable subscriber, which sees
+   * every frameset published from here on
+   *
+   * Parameters:
+   * - struct notifier* server_notify: woken when a release drops the
+   *   last reference to a slot
+   *
+   * Returns:
+   * - int: 0 on success, or -EBUSY when every slot is taken
+   */
+  memset(sub, 0, sizeof(*sub));
+  sub->bus = bus;
+  sub->refs = refs;
+  sub->slot_count = slot_count;
+  sub->server_notify = server_notify;
+  sub->idx = -1;
+
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    uint32_t expected = SUB_FREE;
+    if (!atomic_compare_exchange_strong(&bus->subs[i].state, &expected, SUB_CLAIMED))
+      continue;
+
+    atomic_store(&bus->subs[i].pid, getpid());
+    sub->idx = i;
+    sub->cursor = atomic_load_explicit(&bus->head, memory_order_acquire);
+    atomic_fetch_or(&bus->reliable_mask, 1U << i);
+    atomic_store(&bus->subs[i].state, SUB_RELIABLE);
+    return 0;
+  }
+
+  return -EBUSY;
+}
+
+int frameset_sub_next(struct frameset_sub* sub, uint32_t* slot) {
+  /**
+   * Takes the next publish in order, which the publisher already
+   * referenced on our behalf
+   *
+   * Returns:
+   * - int: 0 with slot set, or -EAGAIN when there is nothing new
+   */
+  struct frameset_bus* bus = sub->bus;
+  uint32_t bit = 1U << sub->idx;
+  uint64_t head = atomic_load_explicit(&bus->head, memory_order_acquire);
+
+  while (sub->cursor < head) {
+    uint64_t seq = sub->cursor++;
+    uint32_t entry = atomic_load_explicit(&bus->entries[seq & bus->mask], memory_order_relaxed);
+    if (entry >= sub->slot_count)
+      continue;
+
+    struct frameset_ref* ref = &sub->refs[entry];
+    if ((atomic_load(&ref->refs) & bit) && atomic_load(&ref->seq) == seq) {
+      *slot = entry;
+      return 0;
+    }
+  }
+
+  return -EAGAIN;
+}
+
+void frameset_sub_release(struct frameset_sub* sub, uint32_t slot) {
+  /**
+   * Drops our reference to a slot, waking the server when it was the
+   * last one so the slot's frames go back to the workers
+   */
+  uint32_t bit = 1U << sub->idx;
+  uint32_t prev = atomic_fetch_and(&sub->refs[slot].refs, ~bit);
+  if ((prev & ~bit) == 0)
+    notify(sub->server_notify);
+}
+
+void frameset_sub_leave(struct frameset_sub* sub) {
+  /**
+   * Drops every reference still held and frees the subscriber slot
+   *
+   * The bit leaves the reliable mask before the sweep, so the publisher
+   * either stops handing it out or we clear it from the slot afterward
+   */
+  if (sub->idx < 0)
+    return;
+
+  uint32_t bit = 1U << sub->idx;
+  struct frameset_bus* bus = sub->bus;
+
+  atomic_fetch_and(&bus->reliable_mask, ~bit);
+  for (uint32_t i = 0; i < sub->slot_count; i++)
+    atomic_fetch_and(&sub->refs[i].refs, ~bit);
+
+  atomic_store(&bus->subs[sub->idx].pid, 0);
+  atomic_store(&bus->subs[sub->idx].state, SUB_FREE);
+  sub->idx = -1;
+
+  notify(sub->server_notify);
+}
@@ -0,0 +1,598 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frameset_dump.h"
+#include "logging.h"
+#include "notify.h"
+
+#define align_up(offset, align) (((offset) + (align-1)) & ~(align-1))
+
+#define WRITE_DATA 0 // low bit of a completion's user_data
+#define WRITE_INDEX 1
+
+static void interrupt_handler(int signum) {
+  (void)signum;
+}
+
+static int open_chunk(struct frameset_dump* dump, uint64_t timestamp) {
+  /**
+   * Creates the next chunk, named after the timestamp of its first
+   * frameset, preallocates it and writes its header
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  int ret = 0;
+  char logstr[128];
+  char name[DUMP_NAME_LEN];
+  char path[DUMP_PATH_LEN];
+
+  // frameset_dump_init made sure the directory leaves room for the name
+  snprintf(name, sizeof(name), "frameset_%lu.dump", timestamp);
+  snprintf(path, sizeof(path), "%s/%s", dump->dir, name);
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  dump->fd = open(path, flags | (dump->direct ? O_DIRECT : 0), 0644);
+  if (dump->fd == -1 && errno == EINVAL && dump->direct) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "%s doesn't support O_DIRECT, dumping through the page cache",
+      dump->dir
+    );
+    log(WARNING, logstr);
+    dump->direct = false;
+    dump->fd = open(path, flags, 0644);
+  }
+  if (dump->fd == -1) {
+    ret = -errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating dump chunk %s: %s",
+      name,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return ret;
+  }
+
+  // extents allocated up front keep a long dump from fragmenting
+  if (fallocate(dump->fd, 0, 0, dump->chunk_size) == -1 && errno != EOPNOTSUPP) {
+    ret = -errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error preallocating dump chunk %s: %s",
+      name,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    goto err;
+  }
+
+  memcpy(dump->hdr->cam_ids, dump->shm_hdr->cam_ids, MAX_CAMS);
+  dump->hdr->chunk_seq = dump->chunks;
+  dump->hdr->frameset_count = 0;
+  memset(dump->index, 0, dump->index_size);
+  dump->count = 0;
+  dump->data_end = dump->hdr->data_offset;
+
+  errno = 0;
+  if (pwrite(dump->fd, dump->hdr, DUMP_ALIGN, 0) != DUMP_ALIGN) {
+    ret = errno ? -errno : -EIO;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing dump chunk header %s: %s",
+      name,
+      strerror(-ret)
+    );
+    log(ERROR, logstr);
+    goto err;
+  }
+
+  return 0;
+
+err:
+  close(dump->fd);
+  dump->fd = -1;
+  return ret;
+}
+
+int frameset_dump_init(
+  struct frameset_dump* dump,
+  const char* dir,
+  uint8_t* shm_base,
+  struct frameset_sub* sub,
+  uint32_t chunk_mb
+) {
+  /**
+   * Sizes the chunks and sets up the ring, the first chunk is only
+   * created once there is a frameset to put in it
+   *
+   * Parameters:
+   * - uint8_t* shm_base: the initialized shared memory segment, which
+   *   frames are written from
+   * - struct frameset_sub* sub: the subscription framesets come from
+   * - uint32_t chunk_mb: size of each chunk, 0 for the default
+   *
+   * Returns:
+   * - int: 0 on success, -EINVAL when a chunk can't hold a whole
+   *   frameset, -ENAMETOOLONG when dir leaves no room for a chunk's
+   *   name, or a negative errno
+   */
+  char logstr[128];
+  struct shm_header* shm_hdr = (struct shm_header*)shm_base;
+
+  memset(dump, 0, sizeof(*dump));
+  dump->fd = -1;
+
+  // a chunk's path has to fit the directory and its name
+  if (strlen(dir) + 1 + DUMP_NAME_LEN > DUMP_PATH_LEN) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Dump directory is too long, it can have at most %d characters",
+      DUMP_PATH_LEN - 1 - DUMP_NAME_LEN
+    );
+    log(ERROR, logstr);
+    return -ENAMETOOLONG;
+  }
+  dump->dir = dir;
+  dump->shm_base = shm_base;
+  dump->shm_hdr = shm_hdr;
+  dump->ts_frame_bufs = (struct ts_frame_buf*)(shm_base + shm_hdr->ts_frame_bufs_offset);
+  dump->frameset_slots = (struct frameset*)(shm_base + shm_hdr->frameset_slots_offset);
+  dump->sub = sub;
+  dump->direct = true;
+  for (uint32_t i = 0; i < DUMP_QUEUE_DEPTH; i++)
+    dump->writes[i].slot = UINT32_MAX;
+
+  dump->chunk_size = (uint64_t)(chunk_mb ? chunk_mb : DEFAULT_DUMP_CHUNK_MB) << 20;
+
+  // frames are written from their buffers as they are, page padding and all
+  uint64_t frame_stride = shm_hdr->frame_buf_stride;
+  uint64_t index_capacity = dump->chunk_size / frame_stride;
+  dump->index_size = align_up(index_capacity * sizeof(struct dump_entry), DUMP_ALIGN);
+  uint64_t data_offset = DUMP_ALIGN + dump->index_size;
+
+  if (data_offset + shm_hdr->cam_count * frame_stride > dump->chunk_size) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "dump_chunk_mb of %lu can't hold a frameset of %u cameras",
+      dump->chunk_size >> 20,
+      shm_hdr->cam_count
+    );
+    log(ERROR, logstr);
+    return -EINVAL;
+  }
+
+  dump->hdr = aligned_alloc(DUMP_ALIGN, DUMP_ALIGN);
+  dump->index = aligned_alloc(DUMP_ALIGN, dump->index_size);
+  dump->pages = aligned_alloc(DUMP_ALIGN, DUMP_ALIGN * DUMP_QUEUE_DEPTH);
+  if (!dump->hdr || !dump->index || !dump->pages) {
+    log(ERROR, "Failed to allocate frameset dump buffers");
+    frameset_dump_cleanup(dump);
+    return -ENOMEM;
+  }
+  for (uint32_t i = 0; i < DUMP_QUEUE_DEPTH; i++)
+    dump->writes[i].index_page = dump->pages + i * DUMP_ALIGN;
+
+  memset(dump->hdr, 0, DUMP_ALIGN);
+  dump->hdr->magic = DUMP_MAGIC;
+  dump->hdr->version = DUMP_VERSION;
+  dump->hdr->header_size = sizeof(struct dump_header);
+  dump->hdr->cam_count = shm_hdr->cam_count;
+  dump->hdr->frame_width = shm_hdr->frame_width;
+  dump->hdr->frame_height = shm_hdr->frame_height;
+  dump->hdr->pixel_format = shm_hdr->pixel_format;
+  dump->hdr->fps = shm_hdr->fps;
+  dump->hdr->frame_size = shm_hdr->frame_buf_size;
+  dump->hdr->frame_stride = frame_stride;
+  dump->hdr->index_offset = DUMP_ALIGN;
+  dump->hdr->index_capacity = index_capacity;
+  dump->hdr->data_offset = data_offset;
+
+  // a data and an index write per frameset
+  int ret = io_uring_queue_init(DUMP_QUEUE_DEPTH * 2, &dump->ring, 0);
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error setting up the dump io_uring: %s",
+      strerror(-ret)
+    );
+    log(ERROR, logstr);
+    frameset_dump_cleanup(dump);
+    return ret;
+  }
+  dump->ring_initialized = true;
+
+  return 0;
+}
+
+int frameset_dump_write(struct frameset_dump* dump, uint32_t slot) {
+  /**
+   * Queues the writes of a frameset, which stays referenced until they
+   * complete, starting a new chunk first when the open one is full or
+   * a camera joined since it was started
+   *
+   * The caller makes sure fewer than DUMP_QUEUE_DEPTH framesets are
+   * being written.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno, in which case the caller
+   *   still holds the frameset
+   */
+  int ret = 0;
+  struct frameset* frameset = &dump->frameset_slots[slot];
+  uint32_t frames = __builtin_popcountll(frameset->cam_mask);
+  uint64_t data_len = frames * dump->hdr->frame_stride;
+
+  if (dump->fd >= 0 && (
+        dump->count == dump->hdr->index_capacity ||
+        dump->data_end + data_len > dump->chunk_size ||
+        memcmp(dump->hdr->cam_ids, dump->shm_hdr->cam_ids, MAX_CAMS) != 0)) {
+    ret = frameset_dump_close_chunk(dump);
+    if (ret)
+      return ret;
+  }
+
+  if (dump->fd < 0) {
+    ret = open_chunk(dump, frameset->timestamp);
+    if (ret)
+      return ret;
+  }
+
+  uint32_t w = 0;
+  while (dump->writes[w].slot != UINT32_MAX)
+    w++;
+  struct dump_write* write = &dump->writes[w];
+
+  uint64_t cam_mask = frameset->cam_mask;
+  for (uint32_t i = 0; cam_mask; i++, cam_mask &= cam_mask - 1) {
+    uint32_t cam = __builtin_ctzll(cam_mask);
+    struct ts_frame_buf* buf = &dump->ts_frame_bufs[frameset->frame_idx[cam]];
+    write->iovs[i].iov_base = dump->shm_base + buf->frame_offset;
+    write->iovs[i].iov_len = dump->hdr->frame_stride;
+  }
+
+  // a reader takes an entry as written once its timestamp is set
+  struct dump_entry* entry = &dump->index[dump->count];
+  entry->cam_mask = frameset->cam_mask;
+  entry->active_mask = frameset->active_mask;
+  entry->offset = dump->data_end;
+  entry->timestamp = frameset->timestamp;
+
+  uint64_t page = dump->count / DUMP_ENTRIES_PER_PAGE;
+  memcpy(write->index_page, (uint8_t*)dump->index + page * DUMP_ALIGN, DUMP_ALIGN);
+
+  // the link below only waits on this frameset's frames, not on these
+  struct dump_entry* snapshot = (struct dump_entry*)write->index_page;
+  for (uint32_t i = 0; i < DUMP_QUEUE_DEPTH; i++) {
+    struct dump_write* other = &dump->writes[i];
+    if (other->slot != UINT32_MAX && !other->data_done &&
+        other->entry / DUMP_ENTRIES_PER_PAGE == page)
+      snapshot[other->entry % DUMP_ENTRIES_PER_PAGE].timestamp = 0;
+  }
+
+  write->slot = slot;
+  write->pending = 0;
+  write->data_done = frames == 0;
+  write->entry = dump->count;
+  write->data_len = data_len;
+
+  // the index page only goes out once this frameset's frames are down
+  struct io_uring_sqe* sqe;
+  if (frames) {
+    sqe = io_uring_get_sqe(&dump->ring);
+    io_uring_prep_writev(sqe, dump->fd, write->iovs, frames, dump->data_end);
+    io_uring_sqe_set_data64(sqe, (uint64_t)w << 1 | WRITE_DATA);
+    sqe->flags |= IOSQE_IO_LINK;
+    write->pending++;
+  }
+
+  sqe = io_uring_get_sqe(&dump->ring);
+  io_uring_prep_write(
+    sqe,
+    dump->fd,
+    write->index_page,
+    DUMP_ALIGN,
+    dump->hdr->index_offset + page * DUMP_ALIGN
+  );
+  io_uring_sqe_set_data64(sqe, (uint64_t)w << 1 | WRITE_INDEX);
+  write->pending++;
+
+  ret = io_uring_submit(&dump->ring);
+  if (ret < 0) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error submitting frameset dump writes: %s",
+      strerror(-ret)
+    );
+    log(ERROR, logstr);
+    write->slot = UINT32_MAX;
+    entry->timestamp = 0;
+    return ret;
+  }
+
+  dump->inflight++;
+  dump->count++;
+  dump->data_end += data_len;
+  dump->framesets++;
+  dump->bytes += data_len;
+
+  return 0;
+}
+
+int frameset_dump_reap(struct frameset_dump* dump, uint64_t timeout_ns) {
+  /**
+   * Handles finished writes, releasing each frameset once both of its
+   * writes are done
+   *
+   * Parameters:
+   * - uint64_t timeout_ns: how long to wait for a first completion, 0
+   *   only takes what already completed
+   *
+   * Returns:
+   * - int: 0 on success, including a timeout or a signal, or a
+   *   negative errno when a write failed
+   */
+  int ret = 0;
+  char logstr[128];
+  struct io_uring_cqe* cqe;
+
+  if (timeout_ns) {
+    struct __kernel_timespec timeout = {
+      .tv_sec = timeout_ns / 1000000000ULL,
+      .tv_nsec = timeout_ns % 1000000000ULL
+    };
+    ret = io_uring_wait_cqe_timeout(&dump->ring, &cqe, &timeout);
+    if (ret == -ETIME || ret == -EINTR)
+      return 0;
+    if (ret < 0)
+      return ret;
+  }
+
+  ret = 0;
+  while (io_uring_peek_cqe(&dump->ring, &cqe) == 0) {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    struct dump_write* write = &dump->writes[data >> 1];
+    uint64_t expected = (data & 1) == WRITE_DATA ? write->data_len : DUMP_ALIGN;
+
+    if (cqe->res < 0 || (uint64_t)cqe->res != expected) {
+      int err = cqe->res < 0 ? cqe->res : -EIO;
+      dump->failed = true;
+      if (!ret) {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Error writing frameset dump: %s",
+          strerror(-err)
+        );
+        log(ERROR, logstr);
+        ret = err;
+      }
+    } else if ((data & 1) == WRITE_DATA) {
+      write->data_done = true;
+    }
+    io_uring_cqe_seen(&dump->ring, cqe);
+
+    if (--write->pending > 0)
+      continue;
+
+    frameset_sub_release(dump->sub, write->slot);
+    write->slot = UINT32_MAX;
+    dump->inflight--;
+  }
+
+  return ret;
+}
+
+int frameset_dump_close_chunk(struct frameset_dump* dump) {
+  /**
+   * Waits out the open chunk's writes, then finishes it with its whole
+   * index and frameset count, and cuts it down to what it holds
+   *
+   * Index pages written per frameset can land out of order, so the
+   * index is written whole once more at the end. After a failed write
+   * the chunk is left as it is, like one the server never closed, since
+   * the index would point to frames that never made it.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  int ret = 0;
+  char logstr[128];
+
+  while (dump->inflight > 0 && ret == 0)
+    ret = frameset_dump_reap(dump, DUMP_WAIT_TIMEOUT);
+
+  if (dump->fd < 0)
+    return ret;
+
+  if (dump->failed) {
+    close(dump->fd);
+    dump->fd = -1;
+    dump->chunks++;
+    return ret ? ret : -EIO;
+  }
+
+  dump->hdr->frameset_count = dump->count;
+  errno = 0;
+  if (pwrite(dump->fd, dump->index, dump->index_size, dump->hdr->index_offset) != (ssize_t)dump->index_size ||
+      pwrite(dump->fd, dump->hdr, DUMP_ALIGN, 0) != DUMP_ALIGN ||
+      ftruncate(dump->fd, dump->data_end) == -1) {
+    int err = errno ? -errno : -EIO;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error finishing dump chunk %u: %s",
+      dump->hdr->chunk_seq,
+      strerror(-err)
+    );
+    log(ERROR, logstr);
+    if (!ret)
+      ret = err;
+  }
+
+  close(dump->fd);
+  dump->fd = -1;
+  dump->chunks++;
+  return ret;
+}
+
+void frameset_dump_cleanup(struct frameset_dump* dump) {
+  /**
+   * Closes the open chunk and releases any frameset whose writes never
+   * completed
+   */
+  if (dump->ring_initialized) {
+    frameset_dump_close_chunk(dump);
+    io_uring_queue_exit(&dump->ring);
+    dump->ring_initialized = false;
+  }
+
+  for (uint32_t i = 0; dump->inflight > 0 && i < DUMP_QUEUE_DEPTH; i++) {
+    if (dump->writes[i].slot == UINT32_MAX)
+      continue;
+    frameset_sub_release(dump->sub, dump->writes[i].slot);
+    dump->writes[i].slot = UINT32_MAX;
+    dump->inflight--;
+  }
+
+  free(dump->hdr);
+  free(dump->index);
+  free(dump->pages);
+  dump->hdr = NULL;
+  dump->index = NULL;
+  dump->pages = NULL;
+}
+
+void* frameset_dump_fn(void* ptr) {
+  /**
+   * Dumps every frameset published until we're stopped
+   *
+   * When stopped, the framesets the main thread published last are
+   * still dumped before the open chunk is closed. A failed write only
+   * ends the dump, the cameras keep streaming to the other consumers.
+   */
+  int ret = 0;
+  char logstr[128];
+
+  struct dump_ctx* ctx = (struct dump_ctx*)ptr;
+  struct frameset_dump dump = { .fd = -1 };
+
+  // without SA_RESTART, so it breaks the thread out of whatever it's waiting on
+  struct sigaction stop_sa = {
+    .sa_handler = interrupt_handler,
+    .sa_flags = 0
+  };
+  sigemptyset(&stop_sa.sa_mask);
+  sigaction(DUMP_STOP_SIGNAL, &stop_sa, NULL);
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(ctx->core, &cpuset);
+  ret = sched_setaffinity(
+    gettid(),
+    sizeof(cpu_set_t),
+    &cpuset
+  );
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error pinning thread %d to core %d, err: %s",
+      gettid(),
+      ctx->core,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    goto err_cleanup;
+  }
+
+  ret = frameset_dump_init(
+    &dump,
+    ctx->dir,
+    ctx->shm_base,
+    &ctx->sub,
+    ctx->stream_conf->dump_chunk_mb
+  );
+  if (ret)
+    goto err_cleanup;
+
+  uint32_t slot;
+  while (!ctx->stop && *ctx->main_running) {
+    // sampled before looking for work so a publish in between is never missed
+    uint32_t seq = atomic_load(&ctx->filled_notify->seq);
+
+    ret = frameset_dump_reap(&dump, 0);
+    if (ret)
+      goto err_cleanup;
+
+    if (dump.inflight < DUMP_QUEUE_DEPTH && frameset_sub_next(&ctx->sub, &slot) == 0) {
+      ret = frameset_dump_write(&dump, slot);
+      if (ret) {
+        frameset_sub_release(&ctx->sub, slot);
+        goto err_cleanup;
+      }
+      continue;
+    }
+
+    // writes finish within milliseconds, and framesets wait on the bus meanwhile
+    if (dump.inflight > 0)
+      ret = frameset_dump_reap(&dump, DUMP_WAIT_TIMEOUT);
+    else
+      notify_wait(ctx->filled_notify, seq, DUMP_WAIT_TIMEOUT);
+    if (ret)
+      goto err_cleanup;
+  }
+
+  while (frameset_sub_next(&ctx->sub, &slot) == 0) {
+    while (dump.inflight == DUMP_QUEUE_DEPTH && ret == 0)
+      ret = frameset_dump_reap(&dump, DUMP_WAIT_TIMEOUT);
+    if (ret == 0)
+      ret = frameset_dump_write(&dump, slot);
+    if (ret) {
+      frameset_sub_release(&ctx->sub, slot);
+      goto err_cleanup;
+    }
+  }
+  goto shutdown_cleanup;
+
+err_cleanup:
+  log(WARNING, "Frameset dump stopped, the server keeps running without it");
+
+shutdown_cleanup:
+  frameset_dump_cleanup(&dump);
+  frameset_sub_leave(&ctx->sub);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Dumped %lu framesets, %lu MB in %lu chunks%s",
+    dump.framesets,
+    dump.bytes >> 20,
+    dump.chunks,
+    dump.direct ? " with O_DIRECT" : ""
+  );
+  log(INFO, logstr);
+
+  return NULL;
+}
@@ -0,0 +1,831 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <spsc_queue.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame_pool.h"
+#include "ingest.h"
+#include "logging.h"
+#include "network.h"
+#include "notify.h"
+#include "shm_layout.h"
+#include "stats.h"
+#include "trace.h"
+#include "viddec.h"
+#include "wire.h"
+
+#define MAX_EVENTS 64
+#define REACTOR_TIMEOUT_MS 100 // bounds how long a stop or a timeout goes unnoticed
+#define DECODE_WAIT_TIMEOUT 100000000ULL // 100 ms
+#define ACCEPT_TIMEOUT 10000000000ULL // 10 sec
+#define RECV_TIMEOUT 1000000000ULL // 1 sec
+#define DECODE_BATCH 4 // packets decoded per claim, so other cameras get a turn
+
+// epoll event tags, the low bits of the event data below the camera index
+#define EV_WAKE 0
+#define EV_LISTEN 1
+#define EV_CLIENT 2
+#define EV_KIND_BITS 2
+#define EV_KIND_MASK ((1 << EV_KIND_BITS) - 1)
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static void install_shutdown_handler() {
+  struct sigaction sa = {
+    .sa_handler = shutdown_handler,
+    .sa_flags = 0
+  };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int pin_thread(uint32_t core) {
+  char logstr[128];
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(core, &cpuset);
+  int ret = sched_setaffinity(
+    gettid(),
+    sizeof(cpu_set_t),
+    &cpuset
+  );
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error pinning thread %d to core %d, err: %s",
+      gettid(),
+      core,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  return 0;
+}
+
+static int epoll_add(int epfd, int fd, uint32_t events, uint64_t tag) {
+  struct epoll_event ev = {
+    .events = events,
+    .data.u64 = tag
+  };
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1 ? -errno : 0;
+}
+
+static int init_cam(
+  struct cam_ingest* c,
+  struct cam_conf* conf,
+  uint32_t cam_idx,
+  struct stream_conf* stream_conf,
+  struct producer_q* filled_bufs,
+  struct decoder_sink* sink
+) {
+  c->conf = conf;
+  c->cam_idx = cam_idx;
+  c->listenfd = -1;
+  c->clientfd = -1;
+  c->filled_bufs = filled_bufs;
+  atomic_init(&c->stalled, false);
+
+  c->pkts = malloc(sizeof(struct enc_pkt) * PKT_BUFS_PER_CAM);
+  if (!c->pkts) {
+    log(ERROR, "Failed to allocate camera packet buffers");
+    return -ENOMEM;
+  }
+
+  int ret = wire_rx_init(&c->wire);
+  if (ret)
+    return ret;
+
+  spsc_queue_init(
+    &c->filled_pkts_producer,
+    &c->filled_pkts_consumer,
+    &c->q_bufs[0],
+    PKT_BUFS_PER_CAM
+  );
+  spsc_queue_init(
+    &c->free_pkts_producer,
+    &c->free_pkts_consumer,
+    &c->q_bufs[PKT_BUFS_PER_CAM],
+    PKT_BUFS_PER_CAM
+  );
+  for (uint32_t i = 0; i < PKT_BUFS_PER_CAM; i++) {
+    c->pkts[i].spill = NULL;
+    spsc_enqueue(&c->free_pkts_producer, &c->pkts[i]);
+  }
+
+  ret = init_decoder(
+    &c->viddec,
+    stream_conf->frame_width,
+    stream_conf->frame_height,
+    stream_conf->decoder_backend,
+    stream_conf->decoder_threads,
+    stream_conf->zero_copy_decode ? sink : NULL
+  );
+  if (ret)
+    return ret;
+  c->decoder_initialized = true;
+
+  c->listenfd = setup_stream(conf);
+  if (c->listenfd < 0) {
+    ret = c->listenfd;
+    c->listenfd = -1;
+    return ret;
+  }
+
+  return set_nonblocking(c->listenfd);
+}
+
+int ingest_init(
+  struct ingest* ing,
+  struct cam_conf* confs,
+  uint32_t cam_count,
+  struct stream_conf* stream_conf,
+  uint32_t reactor_count,
+  uint32_t worker_count,
+  uint8_t* shm_base,
+  struct producer_q* filled_bufs,
+  struct notifier* filled_notify,
+  struct frame_pool* pool,
+  struct cam_stats* cam_stats,
+  volatile sig_atomic_t* main_running
+) {
+  /**
+   * Sets up reactor mode ingestion
+   *
+   * Camera i is owned by reactor i % reactor_count, which accepts its
+   * connection and parses its stream. Its home decode worker is
+   * i % worker_count, but any idle worker steals its packets when the
+   * home worker is busy with another camera. Thread count is set by
+   * the config rather than the camera count.
+   *
+   * Parameters:
+   * - uint32_t reactor_count: threads owning the camera sockets
+   * - uint32_t worker_count: threads owning the decoders
+   * - struct producer_q* filled_bufs: per camera queues decoded frames
+   *   are handed to the main thread through
+   * - struct cam_stats* cam_stats: per camera counters in the stats region
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  int ret = 0;
+  char logstr[128];
+
+  memset(ing, 0, sizeof(*ing));
+  if (reactor_count > cam_count)
+    reactor_count = cam_count;
+  if (worker_count > cam_count)
+    worker_count = cam_count;
+
+  ing->cams = calloc(cam_count, sizeof(struct cam_ingest));
+  ing->reactors = calloc(reactor_count, sizeof(struct reactor));
+  ing->workers = calloc(worker_count, sizeof(struct decode_worker));
+  if (!ing->cams || !ing->reactors || !ing->workers) {
+    log(ERROR, "Failed to allocate ingestion state");
+    ingest_cleanup(ing);
+    return -ENOMEM;
+  }
+  ing->cam_count = cam_count;
+  ing->reactor_count = reactor_count;
+  ing->worker_count = worker_count;
+  notifier_init(&ing->decode_notify);
+
+  for (uint32_t i = 0; i < reactor_count; i++) {
+    struct reactor* r = &ing->reactors[i];
+    r->epfd = -1;
+    r->wakefd = -1;
+    r->idx = i;
+    r->core = i;
+    r->main_running = main_running;
+    r->cams = calloc(cam_count, sizeof(struct cam_ingest*));
+    if (!r->cams) {
+      ingest_cleanup(ing);
+      return -ENOMEM;
+    }
+
+    r->epfd = epoll_create1(0);
+    r->wakefd = eventfd(0, EFD_NONBLOCK);
+    if (r->epfd == -1 || r->wakefd == -1) {
+      ret = -errno;
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error creating reactor: %s",
+        strerror(errno)
+      );
+      log(ERROR, logstr);
+      ingest_cleanup(ing);
+      return ret;
+    }
+
+    ret = epoll_add(r->epfd, r->wakefd, EPOLLIN, EV_WAKE);
+    if (ret) {
+      ingest_cleanup(ing);
+      return ret;
+    }
+  }
+
+  for (uint32_t i = 0; i < worker_count; i++) {
+    struct decode_worker* w = &ing->workers[i];
+    w->notify = &ing->decode_notify;
+    w->all_cams = ing->cams;
+    w->all_cam_count = cam_count;
+    w->idx = i;
+    w->core = reactor_count + i;
+    w->shm_base = shm_base;
+    w->stream_conf = stream_conf;
+    w->filled_notify = filled_notify;
+    w->pool = pool;
+    w->main_running = main_running;
+    w->cams = calloc(cam_count, sizeof(struct cam_ingest*));
+    w->scratch_frame_buf = malloc(stream_conf->frame_width * stream_conf->frame_height * 3 / 2);
+    if (!w->cams || !w->scratch_frame_buf) {
+      ingest_cleanup(ing);
+      return -ENOMEM;
+    }
+  }
+
+  for (uint32_t i = 0; i < cam_count; i++) {
+    struct cam_ingest* c = &ing->cams[i];
+    struct decoder_sink sink = {
+      .pool = pool,
+      .shm_base = shm_base,
+      .frame_buf_stride = ((struct shm_header*)shm_base)->frame_buf_stride,
+      .cam_idx = i
+    };
+    ret = init_cam(c, &confs[i], i, stream_conf, &filled_bufs[i], &sink);
+    if (ret) {
+      ingest_cleanup(ing);
+      return ret;
+    }
+
+    struct reactor* r = &ing->reactors[i % reactor_count];
+    struct decode_worker* w = &ing->workers[i % worker_count];
+    c->reactor = r;
+    c->worker = w;
+    c->decode_notify = &ing->decode_notify;
+    c->stats = &cam_stats[i];
+
+    // a zero copy decoder takes its own buffers from the pool
+    if (!c->viddec.zero_copy)
+      c->current_buf = frame_pool_get(pool, i);
+
+    c->local_idx = r->cam_count;
+    uint64_t tag = (uint64_t)c->local_idx << EV_KIND_BITS;
+    r->cams[r->cam_count++] = c;
+    w->cams[w->cam_count++] = c;
+
+    ret = epoll_add(r->epfd, c->listenfd, EPOLLIN, tag | EV_LISTEN);
+    if (ret) {
+      ingest_cleanup(ing);
+      return ret;
+    }
+    c->listening = true;
+  }
+
+  return 0;
+}
+
+void ingest_cleanup(struct ingest* ing) {
+  for (uint32_t i = 0; ing->cams && i < ing->cam_count; i++) {
+    struct cam_ingest* c = &ing->cams[i];
+    if (c->listenfd >= 0)
+      close(c->listenfd);
+    if (c->clientfd >= 0)
+      close(c->clientfd);
+    if (c->decoder_initialized)
+      cleanup_decoder(&c->viddec);
+    wire_rx_cleanup(&c->wire);
+    for (uint32_t j = 0; c->pkts && j < PKT_BUFS_PER_CAM; j++) {
+      if (c->pkts[j].spill)
+        wire_spill_put(c->pkts[j].spill);
+    }
+    free(c->pkts);
+  }
+
+  for (uint32_t i = 0; ing->reactors && i < ing->reactor_count; i++) {
+    struct reactor* r = &ing->reactors[i];
+    if (r->epfd >= 0)
+      close(r->epfd);
+    if (r->wakefd >= 0)
+      close(r->wakefd);
+    free(r->cams);
+  }
+
+  for (uint32_t i = 0; ing->workers && i < ing->worker_count; i++) {
+    free(ing->workers[i].cams);
+    free(ing->workers[i].scratch_frame_buf);
+  }
+
+  free(ing->cams);
+  free(ing->reactors);
+  free(ing->workers);
+  memset(ing, 0, sizeof(*ing));
+}
+
+static bool take_pkt(struct cam_ingest* c) {
+  /**
+   * Takes a free packet buffer, or flags the camera as stalled so the
+   * decode worker wakes us when it releases one
+   *
+   * The second attempt after raising the flag catches a release that
+   * raced with it, since the worker checks the flag after releasing
+   */
+  c->pkt = spsc_dequeue(&c->free_pkts_consumer);
+  if (c->pkt)
+    return true;
+
+  atomic_store(&c->stalled, true);
+  c->pkt = spsc_dequeue(&c->free_pkts_consumer);
+  return c->pkt != NULL;
+}
+
+static void submit_pkt(struct cam_ingest* c) {
+  spsc_enqueue_notify(
+    &c->filled_pkts_producer,
+    c->decode_notify,
+    c->pkt
+  );
+  c->pkt = NULL;
+}
+
+static int parse(struct cam_ingest* c) {
+  /**
+   * Hands every complete record received so far to the decode worker
+   *
+   * Records are copied out of the ring, which the next receive reuses,
+   * while spilled payloads move to the decode worker with the packet.
+   *
+   * Returns:
+   * - int: 0 once everything is parsed, -EAGAIN when out of packet
+   *   buffers with records left over, or -EPROTO on a malformed stream
+   */
+  char logstr[128];
+
+  while (true) {
+    if (!c->pkt && !take_pkt(c))
+      return -EAGAIN;
+
+    struct rx_pkt rec;
+    int ret = wire_rx_next(&c->wire, &rec);
+    if (ret == -EAGAIN)
+      return 0;
+    if (ret)
+      return ret;
+
+    // a record's timestamp is only known once its header is parsed
+    trace_end(TRACE_RECV, c->cam_idx, rec.timestamp, c->recv_start);
+
+    if (rec.size) {
+      stat_add(&c->stats->bytes, rec.size);
+      stat_add(&c->stats->packets, 1);
+    }
+
+    uint32_t lost = wire_seq_lost(&c->seq, &rec, c->conf->id, c->conf->name);
+    stat_add(&c->stats->lost, lost);
+    if (rec.corrupt) {
+      stat_add(&c->stats->corrupt, rec.corrupt);
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %s stream was corrupt, skipped to its next valid record",
+        c->conf->name
+      );
+      log(WARNING, logstr);
+    }
+
+    c->pkt->timestamp = rec.timestamp;
+    c->pkt->size = rec.size;
+    c->pkt->conn = c->conn;
+    c->pkt->lost = lost;
+    if (rec.spilled)
+      c->pkt->spill = rec.data;
+    else if (rec.size)
+      memcpy(c->pkt->data, rec.data, rec.size);
+
+    submit_pkt(c);
+  }
+}
+
+static void listen_cam(struct cam_ingest* c, uint64_t now) {
+  uint64_t tag = ((uint64_t)c->local_idx << EV_KIND_BITS) | EV_LISTEN;
+  if (epoll_add(c->reactor->epfd, c->listenfd, EPOLLIN, tag)) {
+    log(ERROR, "Error listening for a camera to reconnect");
+    return;
+  }
+
+  c->listening = true;
+  c->listen_start = now;
+}
+
+static void close_client(struct cam_ingest* c, uint64_t now) {
+  /**
+   * Drops a camera's connection and listens for it to reconnect
+   *
+   * Bytes of a partly received record are dropped with it, and the
+   * packets of the next connection carry a new connection number, which
+   * has the decode worker reset the decoder and resume at a keyframe
+   */
+  epoll_ctl(c->reactor->epfd, EPOLL_CTL_DEL, c->clientfd, NULL);
+  close(c->clientfd);
+  c->clientfd = -1;
+  c->paused = false;
+  c->conn++;
+  wire_rx_reset(&c->wire);
+
+  listen_cam(c, now);
+}
+
+static void service_cam(struct cam_ingest* c, uint64_t now) {
+  /**
+   * Drains a camera's socket, which is edge triggered, so this reads
+   * until the kernel has nothing left. Running out of packet buffers
+   * pauses the camera with its unparsed bytes kept, and the reactor
+   * resumes it from here once the decode worker releases one
+   */
+  while (c->clientfd >= 0) {
+    int ret = parse(c);
+    if (ret == -EAGAIN) {
+      c->paused = true;
+      return;
+    }
+    c->paused = false;
+    if (ret) {
+      close_client(c, now);
+      return;
+    }
+
+    c->recv_start = trace_begin();
+    ssize_t bytes = wire_rx_recv(&c->wire, c->clientfd);
+    stat_add(&c->stats->recv_syscalls, 1);
+    if (bytes == -EAGAIN)
+      return;
+    if (bytes == -EINTR)
+      continue;
+    if (bytes <= 0) {
+      close_client(c, now);
+      return;
+    }
+
+    c->last_recv = now;
+  }
+}
+
+static void accept_cam(struct cam_ingest* c, uint32_t local_idx, uint64_t now) {
+  char logstr[128];
+
+  int clientfd = accept_conn_nonblock(c->listenfd);
+  if (clientfd < 0)
+    return;
+
+  // one client per camera, so stop listening until it disconnects
+  epoll_ctl(c->reactor->epfd, EPOLL_CTL_DEL, c->listenfd, NULL);
+  c->listening = false;
+
+  uint64_t tag = ((uint64_t)local_idx << EV_KIND_BITS) | EV_CLIENT;
+  int ret = epoll_add(c->reactor->epfd, clientfd, EPOLLIN | EPOLLRDHUP | EPOLLET, tag);
+  if (ret) {
+    log(ERROR, "Error adding camera connection to the reactor");
+    close(clientfd);
+    listen_cam(c, now);
+    return;
+  }
+
+  c->clientfd = clientfd;
+  c->last_recv = now;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s connected",
+    c->conf->name
+  );
+  log(INFO, logstr);
+
+  service_cam(c, now);
+}
+
+static void check_timeouts(struct reactor* r, uint64_t now) {
+  char logstr[128];
+
+  for (uint32_t i = 0; i < r->cam_count; i++) {
+    struct cam_ingest* c = r->cams[i];
+
+    // keep listening, a camera that isn't there yet may still come
+    if (c->listening && now - c->listen_start > ACCEPT_TIMEOUT) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Accept connection timed out, camera %s isn't connected",
+        c->conf->name
+      );
+      log(DEBUG, logstr);
+      c->listen_start = now;
+    }
+
+    // a paused camera is only quiet because we stopped reading it
+    if (c->clientfd >= 0 && !c->paused && now - c->last_recv > RECV_TIMEOUT) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Timed out waiting for packet from camera %s",
+        c->conf->name
+      );
+      log(WARNING, logstr);
+      close_client(c, now);
+    }
+  }
+}
+
+void* reactor_fn(void* ptr) {
+  /**
+   * Owns the sockets of a group of cameras, accepting their
+   * connections and splitting their streams into encoded packets
+   */
+  struct reactor* r = (struct reactor*)ptr;
+  char logstr[128];
+
+  install_shutdown_handler();
+  if (pin_thread(r->core))
+    return NULL;
+
+  char trace_name[16];
+  snprintf(trace_name, sizeof(trace_name), "reactor-%u", r->idx);
+  trace_thread(trace_name, r->cam_count);
+
+  uint64_t start = now_ns();
+  for (uint32_t i = 0; i < r->cam_count; i++)
+    r->cams[i]->listen_start = start;
+
+  struct epoll_event events[MAX_EVENTS];
+  while (running && *r->main_running) {
+    int n = epoll_wait(r->epfd, events, MAX_EVENTS, REACTOR_TIMEOUT_MS);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error waiting on reactor events: %s",
+        strerror(errno)
+      );
+      log(ERROR, logstr);
+      trace_error(logstr);
+      break;
+    }
+
+    uint64_t now = now_ns();
+    for (int i = 0; i < n; i++) {
+      uint64_t tag = events[i].data.u64;
+      uint32_t local_idx = tag >> EV_KIND_BITS;
+
+      switch (tag & EV_KIND_MASK) {
+        case EV_WAKE: {
+          uint64_t count;
+          if (read(r->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            log(WARNING, "Error reading reactor wakeup");
+
+          for (uint32_t j = 0; j < r->cam_count; j++) {
+            if (r->cams[j]->paused)
+              service_cam(r->cams[j], now);
+          }
+          break;
+        }
+        case EV_LISTEN:
+          accept_cam(r->cams[local_idx], local_idx, now);
+          break;
+        case EV_CLIENT:
+          service_cam(r->cams[local_idx], now);
+          break;
+      }
+    }
+
+    check_timeouts(r, now);
+  }
+
+  return NULL;
+}
+
+static void release_pkt(struct cam_ingest* c, struct enc_pkt* pkt) {
+  if (pkt->spill) {
+    wire_spill_put(pkt->spill);
+    pkt->spill = NULL;
+  }
+
+  spsc_enqueue(&c->free_pkts_producer, pkt);
+
+  if (atomic_exchange(&c->stalled, false)) {
+    uint64_t one = 1;
+    if (write(c->reactor->wakefd, &one, sizeof(one)) < 0)
+      log(WARNING, "Error waking reactor");
+  }
+}
+
+static int drain_frames(struct decode_worker* w, struct cam_ingest* c) {
+  /**
+   * Moves every frame the decoder has ready into the frame pool,
+   * or into scratch memory when the pool denies the camera a buffer
+   */
+  while (true) {
+    struct ts_frame_buf* frame = NULL;
+    uint64_t timestamp;
+    int ret = 0;
+    uint64_t trace_start = trace_begin();
+    if (c->viddec.zero_copy) {
+      ret = recv_pool_frame(&c->viddec, &frame, &timestamp);
+    } else {
+      ret = recv_frame(
+        &c->viddec,
+        c->current_buf ?
+          w->shm_base + c->current_buf->frame_offset :
+          w->scratch_frame_buf,
+        &timestamp
+      );
+      if (ret == 0) {
+        frame = c->current_buf;
+        c->current_buf = frame_pool_get(w->pool, c->cam_idx);
+      }
+    }
+    if (ret == EAGAIN || ret == ENODATA)
+      return 0;
+    if (ret == ENOENT)
+      continue;
+    if (ret)
+      return ret;
+    trace_end(TRACE_DECODE_OUTPUT, c->cam_idx, timestamp, trace_start);
+
+    if (frame) {
+      frame->timestamp = timestamp;
+      spsc_enqueue_notify(c->filled_bufs, w->filled_notify, (void*)frame);
+    }
+  }
+}
+
+static int decode_pkt(
+  struct decode_worker* w,
+  struct cam_ingest* c,
+  struct enc_pkt* pkt
+) {
+  int ret = 0;
+
+  if (pkt->size == 0) {
+    ret = flush_decoder(&c->viddec);
+    c->stream_ended = true;
+  } else {
+    uint64_t trace_start = trace_begin();
+    ret = decode_packet(
+      &c->viddec,
+      pkt->spill ? pkt->spill : pkt->data,
+      pkt->size,
+      pkt->timestamp
+    );
+    trace_end(TRACE_DECODE_SUBMIT, c->cam_idx, pkt->timestamp, trace_start);
+  }
+  if (ret)
+    return ret;
+
+  return drain_frames(w, c);
+}
+
+static bool decode_claimed(struct decode_worker* w, struct cam_ingest* c) {
+  /**
+   * Decodes up to DECODE_BATCH of a camera's waiting packets, unless
+   * another worker already holds its claim
+   *
+   * Returns:
+   * - bool: true if any packets were decoded
+   */
+  char logstr[128];
+
+  uint32_t expected = 0;
+  if (!atomic_compare_exchange_strong_explicit(
+    &c->claimed,
+    &expected,
+    1,
+    memory_order_acquire,
+    memory_order_relaxed
+  ))
+    return false;
+
+  uint32_t decoded = 0;
+  struct enc_pkt* pkt;
+  while (decoded < DECODE_BATCH &&
+         (pkt = spsc_dequeue(&c->filled_pkts_consumer)) != NULL) {
+    decoded++;
+
+    // the camera reconnected, so its stream starts over
+    if (pkt->conn != c->decoded_conn) {
+      reset_decoder(&c->viddec);
+      c->decoded_conn = pkt->conn;
+      c->stream_ended = false;
+    }
+    if (pkt->lost)
+      resync_decoder(&c->viddec);
+
+    uint64_t start = now_ns();
+    int ret = c->stream_ended ? 0 : decode_pkt(w, c, pkt);
+    if (pkt->size) {
+      stat_add(&c->stats->decode_ns, now_ns() - start);
+      stat_add(&c->stats->decoded_packets, 1);
+    }
+    release_pkt(c, pkt);
+    if (!ret)
+      continue;
+
+    // one camera's bad stream shouldn't take down the others
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Decoding failed for camera %s, resyncing at its next keyframe",
+      c->conf->name
+    );
+    log(ERROR, logstr);
+    trace_error(logstr);
+    reset_decoder(&c->viddec);
+  }
+
+  atomic_store_explicit(&c->claimed, 0, memory_order_release);
+  return decoded > 0;
+}
+
+void* decode_worker_fn(void* ptr) {
+  /**
+   * Decodes the packets of its home cameras, and steals from the rest
+   * when those have nothing waiting, sleeping on the shared notifier
+   * while no camera has packets waiting
+   *
+   * A camera is only ever decoded by the worker holding its claim, so
+   * stealing never reorders a camera's packets.
+   */
+  struct decode_worker* w = (struct decode_worker*)ptr;
+  char logstr[128];
+
+  install_shutdown_handler();
+  if (pin_thread(w->core))
+    return NULL;
+
+  char trace_name[16];
+  snprintf(trace_name, sizeof(trace_name), "decode-%u", w->idx);
+  trace_thread(trace_name, w->cam_count);
+
+  while (running && *w->main_running) {
+    // sampled before looking for work so a notify in between is never missed
+    uint32_t seq = atomic_load(&w->notify->seq);
+
+    bool idle = true;
+    for (uint32_t i = 0; i < w->cam_count; i++) {
+      if (decode_claimed(w, w->cams[i]))
+        idle = false;
+    }
+
+    // start where the other workers don't, so they spread over the cameras
+    for (uint32_t i = 0; idle && i < w->all_cam_count; i++) {
+      struct cam_ingest* c = &w->all_cams[(w->idx + i) % w->all_cam_count];
+      if (c->worker == w)
+        continue;
+      if (decode_claimed(w, c)) {
+        idle = false;
+        w->stolen++;
+      }
+    }
+
+    if (idle)
+      notify_wait(w->notify, seq, DECODE_WAIT_TIMEOUT);
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Decode worker %u stole %lu batches from other workers' cameras",
+    w->idx,
+    w->stolen
+  );
+  log(INFO, logstr);
+  return NULL;
+}
@@ -1,56 +1,166 @@
 #define _GNU_SOURCE
 #include <errno.h>
-#include <fcntl.h>
 #include <pthread.h>
 #include <sched.h>
 #include <signal.h>
 #include <spsc_queue.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "conf_watch.h"
+#include "frame_pool.h"
+#include "frameset_asm.h"
+#include "frameset_bus.h"
+#include "frameset_dump.h"
+#include "ingest.h"
 #include "logging.h"
+#include "notify.h"
 #include "parse_conf.h"
+#include "placement.h"
+#include "recorder.h"
+#include "shm_layout.h"
+#include "shm_seg.h"
+#include "stats.h"
 #include "stream_mgr.h"
+#include "trace.h"
 #include "network.h"
+#include "viddec.h"
+#include "wire.h"
 
 #define LOG_PATH "/var/log/mocap-toolkit/server.log"
 #define CAM_CONF_PATH "/etc/mocap-toolkit/cams.yaml"
 
-#define SHM_NAME "/mocap-toolkit_shm"
-#define SHM_ADDR ((void*)0x7f0000000000)
-
-#define CORES_PER_CCD 8
 #define TIMESTAMP_DELAY 1 // seconds
-#define EMPTY_QS_WAIT 10000 // 0.01 ms
-#define FRAME_BUFS_PER_THREAD 512
+#define MAIN_WAIT_TIMEOUT 100000000 // 100 ms, bounds how long a stop goes unnoticed
 #define FRAMESET_SLOTS_PER_THREAD 8
+#define MIN_POOL_FRAMES_PER_CAM 4
+#define CAMS_PER_DECODE_THREAD 4
+#define CAM_STOP_POLL 1000000 // 1 ms between interrupts while a camera thread winds down
 
 static void shutdown_handler(int signum);
 static void perform_cleanup();
+static int size_frame_pool(
+  struct stream_conf* stream_conf,
+  struct cam_conf* confs,
+  uint32_t cam_count,
+  uint32_t* count,
+  uint32_t* lows,
+  uint32_t* highs
+);
+static void pool_watermarks(
+  struct stream_conf* stream_conf,
+  struct cam_conf* conf,
+  uint64_t total,
+  uint32_t cam_count,
+  uint64_t* low,
+  uint64_t* high
+);
+static int resolve_decoder_backend(struct stream_conf* stream_conf);
+static void name_thread(pthread_t thread, const char* fmt, ...);
+static int run_record_mode(
+  struct cam_conf* confs,
+  int cam_count,
+  struct stream_conf* stream_conf,
+  const char* record_dir
+);
+static int start_dump(
+  const char* dump_dir,
+  struct stream_conf* stream_conf,
+  uint8_t* shm_base,
+  uint32_t core
+);
+static int spawn_stream_threads(
+  struct cam_conf* confs,
+  int cam_count,
+  uint32_t slot_count,
+  struct stream_conf* stream_conf,
+  uint8_t* shm_base,
+  struct producer_q* filled_bufs,
+  struct consumer_q* filled_frames,
+  struct notifier* filled_notify,
+  struct server_stats* stats,
+  pthread_t* threads
+);
+static int start_cam(uint32_t slot);
+static void stop_cam(uint32_t slot);
+static void reload_cams(const char* conf_path, uint64_t t0);
+static int spawn_ingest_threads(
+  struct cam_conf* confs,
+  int cam_count,
+  struct stream_conf* stream_conf,
+  uint32_t reactor_count,
+  uint32_t decode_count,
+  uint8_t* shm_base,
+  struct producer_q* filled_bufs,
+  struct notifier* filled_notify,
+  struct server_stats* stats,
+  pthread_t* threads
+);
+static void recycle_frameset(
+  struct frameset* frameset,
+  struct ts_frame_buf* ts_frame_bufs,
+  struct frame_pool* pool,
+  int cam_count
+);
+static void log_asm_stats(
+  struct frameset_asm* fa,
+  struct frame_pool* pool,
+  struct cam_conf* confs,
+  int cam_count
+);
 
 struct cleanup_ctx {
-  void* mmap_buf;
-  size_t shm_size;
-  int shm_fd;
+  struct shm_seg shm;
+  struct conf_watch watch;
   pthread_t* threads;
+  bool* idle_threads; // threads[i] isn't running when set, NULL if they all are
   int thread_count;
+  pthread_t dump_thread;
+  bool dump_running;
   bool logging_initialized;
 };
 
+/**
+ * The frameset positions of thread per camera mode, which cameras
+ * start in and stop from while the rest keep streaming
+ */
+struct cam_slots {
+  struct cam_conf* confs;
+  struct stream_conf* stream_conf;
+  uint32_t count;
+  uint8_t* shm_base;
+  struct producer_q* filled_bufs;
+  struct consumer_q* filled_frames;
+  struct notifier* filled_notify;
+  struct server_stats* stats;
+  pthread_t* threads;
+  uint32_t queue_size; // of each filled frame queue, which caps every camera's high watermark
+  bool idle[MAX_CAMS];
+  struct thread_ctx ctxs[MAX_CAMS];
+};
+
 static struct cleanup_ctx cleanup = {
-  0,
-  .shm_fd = -1
+  .shm = { .fd = -1 },
+  .watch = { .fd = -1 }
 };
 
 static volatile sig_atomic_t running = 1;
 
+static struct frameset_asm assembler;
+static struct frameset_pub publisher;
+static struct frame_pool frame_pool;
+static struct ingest ingest;
+static struct cam_slots slots;
+static struct placement placement;
+static struct dump_ctx dumper;
+
 int main(int argc, char* argv[]) {
   int ret = 0;
   char logstr[128];
@@ -88,7 +198,37 @@ int main(int argc, char* argv[]) {
     log(ERROR, logstr);
   }
 
-  int cam_count = count_cameras(CAM_CONF_PATH);
+  const char* shm_name = DEFAULT_SHM_NAME;
+  const char* record_dir = NULL;
+  const char* dump_dir = NULL;
+  const char* conf_path = CAM_CONF_PATH;
+  const char* trace_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:r:d:c:t:")) != -1) {
+    switch (opt) {
+      case 's':
+        shm_name = optarg;
+        break;
+      case 'c':
+        conf_path = optarg;
+        break;
+      case 'r':
+        record_dir = optarg;
+        break;
+      case 'd':
+        dump_dir = optarg;
+        break;
+      case 't':
+        trace_path = optarg;
+        break;
+      default:
+        log(ERROR, "Usage: mocap-toolkit-server [-s shm_name] [-c cams.yaml] [-r record_dir] [-d dump_dir] [-t trace.json] [cam_id]");
+        cleanup_logging();
+        return -EINVAL;
+    }
+  }
+
+  int cam_count = count_cameras(conf_path);
   if (cam_count <= 0) {
     snprintf(
       logstr,
@@ -101,8 +241,22 @@ int main(int argc, char* argv[]) {
     return cam_count;
   }
 
+  if (cam_count > MAX_CAMS) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera count %d exceeds the maximum of %d",
+      cam_count,
+      MAX_CAMS
+    );
+    log(ERROR, logstr);
+    perform_cleanup();
+    return -EINVAL;
+  }
+
+  // positions past cam_count take cameras added to the config while streaming
   struct stream_conf stream_conf;
-  struct cam_conf confs[cam_count];
+  static struct cam_conf confs[MAX_CAMS];
   ret = parse_conf(&stream_conf, confs, cam_count);
   if (ret) {
     snprintf(
@@ -118,8 +272,8 @@ int main(int argc, char* argv[]) {
 
   // filter out target cam, otherwise stream with all cams in config
   int target_cam_id;
-  if (argc > 1) {
-    target_cam_id = atoi(argv[1]);
+  if (optind < argc) {
+    target_cam_id = atoi(argv[optind]);
 
     bool found = false;
     for (int i = 0; i < cam_count; i++) {
@@ -145,11 +299,305 @@ int main(int argc, char* argv[]) {
     }
   }
 
-  // pin to cam_count % 8 to stay on ccd0 for 3dv cache with threads
-  // but not be on the same core as any threads until there are 8+
+  ret = placement_init(&placement, stream_conf.cpu_list);
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+  placement_bind_memory(&placement);
+
+  // decoders set up from here, the self-test's included, spread their
+  // threads over the placement, main only pins itself once they're up
+  ret = placement_allow_all(&placement);
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  if (record_dir) {
+    if (dump_dir)
+      log(WARNING, "Record mode decodes nothing, ignoring -d");
+    return run_record_mode(confs, cam_count, &stream_conf, record_dir);
+  }
+
+  ret = resolve_decoder_backend(&stream_conf);
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  /*
+   * In thread per camera mode the config is watched while streaming,
+   * and cameras added to it take frameset positions reserved up front
+   * with max_cams. Reactors are handed their cameras at startup, so
+   * ingest_threads mode keeps the config it started with
+   */
+  bool live_reload = !stream_conf.ingest_threads && optind >= argc;
+  uint32_t slot_count = cam_count;
+  if (stream_conf.max_cams && !live_reload) {
+    log(WARNING, "max_cams only applies to thread per camera mode with every camera, ignoring it");
+  } else if (stream_conf.max_cams) {
+    if (stream_conf.max_cams < (uint32_t)cam_count || stream_conf.max_cams > MAX_CAMS) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "max_cams of %u has to be between the camera count %d and %d",
+        stream_conf.max_cams,
+        cam_count,
+        MAX_CAMS
+      );
+      log(ERROR, logstr);
+      perform_cleanup();
+      return -EINVAL;
+    }
+    slot_count = stream_conf.max_cams;
+  }
+
+  if (trace_path) {
+    ret = trace_init(
+      trace_path,
+      stream_conf.trace_seconds,
+      stream_conf.fps,
+      confs,
+      slot_count
+    );
+    if (ret) {
+      perform_cleanup();
+      return ret;
+    }
+    trace_thread("main", cam_count);
+  }
+
+  /*
+   * By default each camera gets a thread that owns its socket and its
+   * decoder. With ingest_threads set, that many reactor threads own all
+   * the sockets and a separate set of decode threads sized to the
+   * decode load owns the decoders
+   */
+  uint32_t reactor_count = stream_conf.ingest_threads;
+  uint32_t decode_count = 0;
+  if (reactor_count) {
+    if (reactor_count > (uint32_t)cam_count)
+      reactor_count = cam_count;
+
+    decode_count = stream_conf.decode_threads ?
+                   stream_conf.decode_threads :
+                   (uint32_t)(cam_count + CAMS_PER_DECODE_THREAD - 1) / CAMS_PER_DECODE_THREAD;
+    if (decode_count > (uint32_t)cam_count)
+      decode_count = cam_count;
+  }
+  int thread_count = reactor_count ? (int)(reactor_count + decode_count) : (int)slot_count;
+
+  ret = shm_seg_open(
+    &cleanup.shm,
+    shm_name,
+    stream_conf.hugepage_size_mb
+  );
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  uint32_t frame_bufs_count;
+  uint32_t pool_lows[slot_count];
+  uint32_t pool_highs[slot_count];
+  ret = size_frame_pool(
+    &stream_conf,
+    confs,
+    slot_count,
+    &frame_bufs_count,
+    pool_lows,
+    pool_highs
+  );
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  uint32_t pool_low = pool_lows[0];
+  uint32_t pool_high = pool_highs[0];
+  for (uint32_t i = 1; i < slot_count; i++) {
+    if (pool_lows[i] < pool_low)
+      pool_low = pool_lows[i];
+    if (pool_highs[i] > pool_high)
+      pool_high = pool_highs[i];
+  }
+
+  /*
+   * Frames pinned in framesets are unavailable to the workers, so keep
+   * the pipeline's share of slots well under the smallest guarantee of
+   * any camera. Each latest-only subscriber can pin one more, as can
+   * the newest publish
+   */
+  uint32_t num_frameset_slots = slot_count * FRAMESET_SLOTS_PER_THREAD;
+  if (num_frameset_slots > pool_low / 2)
+    num_frameset_slots = pool_low / 2;
+  num_frameset_slots += MAX_SUBSCRIBERS + 1;
+
+  struct shm_header layout;
+
+  size_t shm_size = shm_layout(
+    &layout,
+    slot_count,
+    stream_conf.frame_width,
+    stream_conf.frame_height,
+    stream_conf.fps,
+    frame_bufs_count,
+    num_frameset_slots,
+    cleanup.shm.page_size
+  );
+  uint64_t active_mask = 0;
+  for (int i = 0; i < cam_count; i++) {
+    layout.cam_ids[i] = confs[i].id;
+    active_mask |= 1ULL << i;
+  }
+  atomic_init(&layout.active_mask, active_mask);
+  layout.consumer_cpu = placement_cpu(&placement, thread_count + 1);
+  layout.pixel_format = stream_conf.zero_copy_decode ?
+                        FRAME_FORMAT_I420 :
+                        FRAME_FORMAT_NV12;
+
+  ret = shm_seg_map(
+    &cleanup.shm,
+    shm_size,
+    stream_conf.lock_frame_pool
+  );
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+  uint8_t* mmap_buf = cleanup.shm.buf;
+
+  // the ready flag stays clear until every region below is initialized
+  struct shm_header* shm_hdr = (struct shm_header*)mmap_buf;
+  memcpy(shm_hdr, &layout, sizeof(layout));
+
+  // assign frame buffers to ts_frame_bufs (this is a permanent assignment)
+  struct ts_frame_buf* ts_frame_bufs = (struct ts_frame_buf*)(mmap_buf + layout.ts_frame_bufs_offset);
+  for (uint32_t i = 0; i < frame_bufs_count; i++) {
+    ts_frame_bufs[i].timestamp = 0;
+    ts_frame_bufs[i].frame_offset = layout.frame_bufs_offset + i * layout.frame_buf_stride;
+  }
+
+  struct frameset* frameset_slots = (struct frameset*)(mmap_buf + layout.frameset_slots_offset);
+  memset(frameset_slots, 0, sizeof(struct frameset) * num_frameset_slots);
+
+  ret = frameset_pub_init(
+    &publisher,
+    (struct frameset_bus*)(mmap_buf + layout.frameset_bus_offset),
+    (struct frameset_ref*)(mmap_buf + layout.frameset_refs_offset),
+    num_frameset_slots,
+    layout.frameset_ring_capacity
+  );
+  if (ret) {
+    log(ERROR, "Failed to allocate frameset publisher state");
+    perform_cleanup();
+    return ret;
+  }
+  uint32_t reclaimed_slots[num_frameset_slots];
+
+  struct notifier* filled_frameset_notify = (struct notifier*)(mmap_buf + layout.filled_frameset_notify_offset);
+  struct notifier* server_notify = (struct notifier*)(mmap_buf + layout.server_notify_offset);
+  notifier_init(filled_frameset_notify);
+  notifier_init(server_notify);
+
+  struct server_stats* stats = (struct server_stats*)(mmap_buf + layout.stats_offset);
+  stats_init(stats);
+
+  atomic_store_explicit(&shm_hdr->ready, 1, memory_order_release);
+
+  struct producer_q filled_frame_producer_qs[slot_count];
+  struct consumer_q filled_frame_consumer_qs[slot_count];
+
+  ret = frame_pool_init(
+    &frame_pool,
+    ts_frame_bufs,
+    frame_bufs_count,
+    slot_count,
+    pool_lows,
+    pool_highs
+  );
+  if (ret) {
+    log(ERROR, "Failed to initialize the frame pool");
+    perform_cleanup();
+    return ret;
+  }
+
+  // a camera never holds more than its high watermark, so neither can its queue
+  uint32_t filled_q_size = 1;
+  while (filled_q_size < pool_high)
+    filled_q_size <<= 1;
+  slots.queue_size = filled_q_size;
+
+  void* q_bufs[slot_count * filled_q_size];
+  for (uint32_t i = 0; i < slot_count; i++) {
+    spsc_queue_init(
+      &filled_frame_producer_qs[i],
+      &filled_frame_consumer_qs[i],
+      &q_bufs[i * filled_q_size],
+      filled_q_size
+    );
+  }
+
+  ret = wire_spill_init();
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  // subscribed before the cameras start, so the dump begins at the first frameset
+  if (dump_dir) {
+    ret = start_dump(
+      dump_dir,
+      &stream_conf,
+      mmap_buf,
+      placement_cpu(&placement, thread_count + 2)
+    );
+    if (ret) {
+      perform_cleanup();
+      return ret;
+    }
+  }
+
+  pthread_t threads[thread_count];
+  cleanup.threads = threads;
+  if (reactor_count) {
+    ret = spawn_ingest_threads(
+      confs,
+      cam_count,
+      &stream_conf,
+      reactor_count,
+      decode_count,
+      mmap_buf,
+      filled_frame_producer_qs,
+      server_notify,
+      stats,
+      threads
+    );
+  } else {
+    ret = spawn_stream_threads(
+      confs,
+      cam_count,
+      slot_count,
+      &stream_conf,
+      mmap_buf,
+      filled_frame_producer_qs,
+      filled_frame_consumer_qs,
+      server_notify,
+      stats,
+      threads
+    );
+  }
+  if (ret) {
+    perform_cleanup();
+    return ret;
+  }
+
+  // the cpu after the threads' shares their L3, and only shares a core
+  // with one of them once there are more threads than cpus
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
-  CPU_SET(cam_count % CORES_PER_CCD, &cpuset);
+  CPU_SET(placement_cpu(&placement, thread_count), &cpuset);
   pid_t pid = getpid();
   ret = sched_setaffinity(
     pid,
@@ -168,290 +616,943 @@ int main(int argc, char* argv[]) {
     return -errno;
   }
 
-  int shm_fd = shm_open(
-    SHM_NAME,
-    O_CREAT | O_RDWR,
-    0666
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t timestamp = (ts.tv_sec + TIMESTAMP_DELAY) * 1000000000ULL + ts.tv_nsec;
+  broadcast_msg(confs, cam_count, (char*)&timestamp, sizeof(timestamp));
+
+  uint64_t interval = 1000000000ULL / stream_conf.fps;
+  uint64_t deadline = stream_conf.frameset_deadline_ms ?
+                      stream_conf.frameset_deadline_ms * 1000000ULL :
+                      interval;
+  frameset_asm_init(
+    &assembler,
+    slot_count,
+    active_mask,
+    timestamp,
+    interval,
+    deadline,
+    ts_frame_bufs,
+    &frame_pool
   );
-  if (shm_fd == -1) {
+
+  if (live_reload && conf_watch_init(&cleanup.watch, conf_path))
+    log(WARNING, "Not watching the camera config, cameras won't be reloaded");
+
+  struct frameset* frameset = NULL;
+  uint32_t frameset_idx = 0;
+  uint64_t last_stats = 0;
+
+  while (running) {
+    // sampled before looking for work so a notify in between is never missed
+    uint32_t seq = atomic_load(&server_notify->seq);
+
+    struct timespec now_ts;
+    clock_gettime(CLOCK_MONOTONIC, &now_ts);
+    uint64_t now = now_ts.tv_sec * 1000000000ULL + now_ts.tv_nsec;
+
+    // file every decoded frame into the slot for its frame index
+    bool idle = true;
+    for (uint32_t i = 0; i < slot_count; i++) {
+      struct ts_frame_buf* frame;
+      while ((frame = spsc_dequeue(&filled_frame_consumer_qs[i])) != NULL) {
+        uint64_t trace_start = trace_begin();
+        frameset_asm_insert(&assembler, i, frame, now);
+        trace_end(TRACE_ASSEMBLE, i, frame->timestamp, trace_start);
+        idle = false;
+      }
+    }
+
+    // drop the references of consumers that died holding framesets
+    frameset_pub_reap(&publisher, now);
+
+    if (now - last_stats >= STATS_INTERVAL) {
+      stats_refresh(stats, &assembler, &frame_pool, &publisher);
+      last_stats = now;
+
+      // an edit to the config can wait for the next refresh
+      if (conf_watch_changed(&cleanup.watch))
+        reload_cams(conf_path, timestamp);
+    }
+
+    // frames go back to the workers once every subscriber released them
+    uint32_t reclaimed = frameset_pub_reclaim(&publisher, reclaimed_slots);
+    for (uint32_t i = 0; i < reclaimed; i++) {
+      recycle_frameset(
+        &frameset_slots[reclaimed_slots[i]],
+        ts_frame_bufs,
+        &frame_pool,
+        slot_count
+      );
+    }
+
+    /*
+     * Emit every resolved frame index. While subscribers hold every
+     * slot the frames wait in the assembler, and if they fall far enough
+     * behind the oldest indices expire and their frames go back to the
+     * workers, so a slow consumer never stalls ingestion
+     */
+    while (true) {
+      if (!frameset) {
+        if (frameset_pub_acquire(&publisher, &frameset_idx))
+          break;
+
+        frameset = &frameset_slots[frameset_idx];
+      }
+
+      uint64_t trace_start = trace_begin();
+      if (!frameset_asm_pop(&assembler, now, frameset))
+        break;
+
+      frameset_pub_publish(&publisher, frameset_idx);
+      notify(filled_frameset_notify);
+      trace_end(TRACE_PUBLISH, TRACE_NO_CAM, frameset->timestamp, trace_start);
+      frameset = NULL;
+      idle = false;
+    }
+
+    if (!idle)
+      continue;
+
+    /*
+     * Sleep until a worker decodes a frame or a subscriber releases a
+     * frameset. While holding an empty frameset, the assembler is only
+     * waiting on stragglers, so also wake for the oldest deadline
+     */
+    uint64_t timeout = MAIN_WAIT_TIMEOUT;
+    if (frameset) {
+      uint64_t deadline = frameset_asm_next_deadline(&assembler);
+      if (deadline <= now)
+        continue;
+      if (deadline - now < timeout)
+        timeout = deadline - now;
+    }
+
+    notify_wait(server_notify, seq, timeout);
+  }
+
+  log_asm_stats(&assembler, &frame_pool, confs, slot_count);
+
+  // stop the camera devices still in the session
+  const char* stop_msg = "STOP";
+  for (uint32_t i = 0; i < slot_count; i++) {
+    if (assembler.active_mask & (1ULL << i))
+      broadcast_msg(&confs[i], 1, stop_msg, strlen(stop_msg));
+  }
+
+  perform_cleanup();
+  return ret;
+}
+
+static int size_frame_pool(
+  struct stream_conf* stream_conf,
+  struct cam_conf* confs,
+  uint32_t cam_count,
+  uint32_t* count,
+  uint32_t* lows,
+  uint32_t* highs
+) {
+  /**
+   * Sizes the frame pool from the config, and picks the watermarks of
+   * the camera in each of the cam_count positions
+   *
+   * frame_pool_mb sets a memory budget for the whole pool, otherwise
+   * frame_pool_frames sets a latency budget in frames per camera.
+   *
+   * Returns:
+   * - int: 0 on success, or -EINVAL when the budget is too small or
+   *   can't cover every camera's guarantee
+   */
+  char logstr[128];
+
+  // every buffer takes up a whole number of pages in the segment
+  uint64_t frame_buf_size = (uint64_t)stream_conf->frame_width * stream_conf->frame_height * 3 / 2;
+  uint64_t frame_buf_stride = (frame_buf_size + SHM_PAGE_ALIGN - 1) & ~(uint64_t)(SHM_PAGE_ALIGN - 1);
+  uint64_t frames = stream_conf->frame_pool_frames ?
+                    stream_conf->frame_pool_frames :
+                    DEFAULT_POOL_FRAMES_PER_CAM;
+  uint64_t total = stream_conf->frame_pool_mb ?
+                   ((uint64_t)stream_conf->frame_pool_mb << 20) / frame_buf_stride :
+                   frames * cam_count;
+  if (total > UINT32_MAX)
+    total = UINT32_MAX;
+
+  if (total < (uint64_t)MIN_POOL_FRAMES_PER_CAM * cam_count) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error creating shared memory: %s",
-      strerror(errno)
+      "Frame pool of %lu frames is under the minimum of %d per camera",
+      total,
+      MIN_POOL_FRAMES_PER_CAM
     );
     log(ERROR, logstr);
-    perform_cleanup();
+    return -EINVAL;
   }
-  cleanup.shm_fd = shm_fd;
-
-  #define align_up(offset, align) (((offset) + (align-1)) & ~(align-1))
-
-  // frame buffers
-  const uint64_t frame_bufs_count = cam_count * FRAME_BUFS_PER_THREAD;
-  const uint64_t frame_buf_size = stream_conf.frame_width * stream_conf.frame_height * 3 / 2;
-  size_t shm_size = frame_buf_size * frame_bufs_count;
-
-  // timestamped structs with frame buffer ptrs
-  shm_size = align_up(shm_size, _Alignof(struct ts_frame_buf));
-  size_t ts_frame_bufs_offset = shm_size;
-  shm_size += sizeof(struct ts_frame_buf) * frame_bufs_count;
-
-  // filled frameset producer queue
-  shm_size = align_up(shm_size, _Alignof(struct producer_q));
-  size_t filled_frameset_producer_q_offset = shm_size;
-  shm_size += sizeof(struct producer_q);
-
-  // filled frameset consumer queue
-  shm_size = align_up(shm_size, _Alignof(struct consumer_q));
-  size_t filled_frameset_consumer_q_offset = shm_size;
-  shm_size += sizeof(struct consumer_q);
-
-  // empty frameset producer queue
-  shm_size = align_up(shm_size, _Alignof(struct producer_q));
-  size_t empty_frameset_producer_q_offset = shm_size;
-  shm_size += sizeof(struct producer_q);
-
-  // empty frameset consumer queue
-  shm_size = align_up(shm_size, _Alignof(struct consumer_q));
-  size_t empty_frameset_consumer_q_offset = shm_size;
-  shm_size += sizeof(struct consumer_q);
-
-  // filled frameset queue buffer
-  shm_size = align_up(shm_size, _Alignof(void**));
-  size_t filled_q_bufs_offset = shm_size;
-  shm_size += (sizeof(void*) * FRAME_BUFS_PER_THREAD);
-
-  // empty frameset queue buffer
-  shm_size = align_up(shm_size, _Alignof(void**));
-  size_t empty_q_bufs_offset = shm_size;
-  shm_size += (sizeof(void*) * FRAME_BUFS_PER_THREAD);
-
-  // framesets slots
-  size_t num_frameset_slots = FRAMESET_SLOTS_PER_THREAD * cam_count;
-  shm_size = align_up(shm_size, _Alignof(struct ts_frame_buf*));
-  size_t frameset_slots_offset = shm_size;
-  shm_size += sizeof(struct ts_frame_buf*) * num_frameset_slots;
-
-  ret = ftruncate(
-    shm_fd,
-    shm_size
-  );
-  if (ret == -1) {
+
+  uint64_t reserved = 0;
+  for (uint32_t i = 0; i < cam_count; i++) {
+    uint64_t low, high;
+    pool_watermarks(stream_conf, &confs[i], total, cam_count, &low, &high);
+    if (low == 0 || high < low) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Invalid frame pool watermarks in position %u low: %lu, high: %lu",
+        i,
+        low,
+        high
+      );
+      log(ERROR, logstr);
+      return -EINVAL;
+    }
+
+    lows[i] = low;
+    highs[i] = high;
+    reserved += low;
+  }
+
+  if (reserved > total) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error creating shared memory: %s",
-      strerror(errno)
+      "Frame pool of %lu frames can't guarantee the cameras %lu between them",
+      total,
+      reserved
     );
     log(ERROR, logstr);
-    perform_cleanup();
+    return -EINVAL;
   }
-  cleanup.shm_size = shm_size;
 
-  uint8_t* mmap_buf = mmap(
-    SHM_ADDR,
-    shm_size,
-    PROT_READ | PROT_WRITE,
-    MAP_SHARED,
-    shm_fd,
-    0
+  // past this the other cameras would be cut into their guarantees anyway
+  for (uint32_t i = 0; i < cam_count; i++) {
+    uint64_t borrowable = total - (reserved - lows[i]);
+    if (highs[i] > borrowable)
+      highs[i] = borrowable;
+  }
+
+  *count = total;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Frame pool of %lu frames, %lu MB, %lu guaranteed to the cameras",
+    total,
+    total * frame_buf_stride >> 20,
+    reserved
   );
-  if (mmap_buf == MAP_FAILED) {
+  log(INFO, logstr);
+
+  for (uint32_t i = 0; i < cam_count; i++) {
+    if (confs[i].name[0] == '\0')
+      continue;
+
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error mapping shared memory: %s",
-      strerror(errno)
+      "Camera %s frame pool watermarks low: %u, high: %u",
+      confs[i].name,
+      lows[i],
+      highs[i]
     );
-    log(ERROR, logstr);
-    perform_cleanup();
+    log(INFO, logstr);
   }
-  cleanup.mmap_buf = mmap_buf;
 
-  // assign frame buffers to ts_frame_bufs (this is a permanent assignment)
-  uint8_t* frame_bufs = mmap_buf;
-  struct ts_frame_buf* ts_frame_bufs = (struct ts_frame_buf*)(mmap_buf + ts_frame_bufs_offset);
-  for (uint i = 0; i < frame_bufs_count; i++) {
-    size_t offset = i * frame_buf_size;
-    ts_frame_bufs[i].frame_buf = frame_bufs + offset;
-  }
-
-  struct producer_q* filled_frameset_producer_q = (struct producer_q*)(mmap_buf + filled_frameset_producer_q_offset);
-  struct consumer_q* filled_frameset_consumer_q = (struct consumer_q*)(mmap_buf + filled_frameset_consumer_q_offset);
-  void* filled_frameset_q_bufs = (void**)(mmap_buf + filled_q_bufs_offset);
-  spsc_queue_init(
-    filled_frameset_producer_q,
-    filled_frameset_consumer_q,
-    filled_frameset_q_bufs,
-    num_frameset_slots
-  );
+  return 0;
+}
 
-  struct producer_q* empty_frameset_producer_q = (struct producer_q*)(mmap_buf + empty_frameset_producer_q_offset);
-  struct consumer_q* empty_frameset_consumer_q = (struct consumer_q*)(mmap_buf + empty_frameset_consumer_q_offset);
-  void* empty_frameset_q_bufs = (void**)(mmap_buf + empty_q_bufs_offset);
-  spsc_queue_init(
-    empty_frameset_producer_q,
-    empty_frameset_consumer_q,
-    empty_frameset_q_bufs,
-    num_frameset_slots
-  );
+static void pool_watermarks(
+  struct stream_conf* stream_conf,
+  struct cam_conf* conf,
+  uint64_t total,
+  uint32_t cam_count,
+  uint64_t* low,
+  uint64_t* high
+) {
+  /**
+   * Picks a camera's watermarks from its own config entry, falling
+   * back to stream_params, and then to half and twice its even share
+   * of the pool, so a camera can borrow up to a share from the others
+   * while always being able to get back to half of its own
+   */
+  uint64_t share = total / cam_count;
+
+  *low = conf->frame_pool_low ?
+         conf->frame_pool_low :
+         stream_conf->frame_pool_low ? stream_conf->frame_pool_low : share / 2;
+  *high = conf->frame_pool_high ?
+          conf->frame_pool_high :
+          stream_conf->frame_pool_high ? stream_conf->frame_pool_high : share * 2;
+
+  // a camera raising its own guarantee raises the cap it falls back to along with it
+  if (conf->frame_pool_low && !conf->frame_pool_high && *high < *low)
+    *high = *low;
+}
+
+static int resolve_decoder_backend(struct stream_conf* stream_conf) {
+  /**
+   * Settles the decoder backend every camera will use, running the
+   * decoder self-test when the config leaves it up to us
+   *
+   * Returns:
+   * - int: 0 on success, or -ENODEV when no backend works here
+   */
+  char logstr[128];
 
-  struct ts_frame_buf** frameset_slots = (struct ts_frame_buf**)(mmap_buf + frameset_slots_offset);
-  memset(frameset_slots, 0, sizeof(struct ts_frame_buf*) * num_frameset_slots);
-  for (size_t i = 0; i < num_frameset_slots; i++) {
-    struct ts_frame_buf** slot_addr = frameset_slots + (i * cam_count);
-    spsc_enqueue(
-      empty_frameset_producer_q,
-      slot_addr
+  if (stream_conf->decoder_backend >= DECODER_BACKEND_COUNT) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Unknown decoder backend %u",
+      stream_conf->decoder_backend
     );
+    log(ERROR, logstr);
+    return -EINVAL;
   }
 
-  struct producer_q filled_frame_producer_qs[cam_count];
-  struct consumer_q filled_frame_consumer_qs[cam_count];
+  if (stream_conf->zero_copy_decode && stream_conf->decoder_backend == DECODER_AUTO)
+    stream_conf->decoder_backend = DECODER_SOFTWARE;
 
-  struct producer_q empty_frame_producer_qs[cam_count];
-  struct consumer_q empty_frame_consumer_qs[cam_count];
+  if (stream_conf->decoder_backend == DECODER_AUTO) {
+    stream_conf->decoder_backend = decoder_self_test(
+      stream_conf->frame_width,
+      stream_conf->frame_height,
+      stream_conf->decoder_threads
+    );
+    if (stream_conf->decoder_backend == DECODER_AUTO) {
+      log(ERROR, "No decoder backend works on this machine");
+      return -ENODEV;
+    }
+  }
 
-  void* q_bufs[frame_bufs_count * 2];
-  for (int i = 0; i < cam_count; i++) {
-    spsc_queue_init(
-      &filled_frame_producer_qs[i],
-      &filled_frame_consumer_qs[i],
-      &q_bufs[i * 2 * FRAME_BUFS_PER_THREAD],
-      FRAME_BUFS_PER_THREAD
+  // cuvid frames have to come back from the gpu, there is no copy to save
+  if (stream_conf->zero_copy_decode && stream_conf->decoder_backend != DECODER_SOFTWARE) {
+    log(WARNING, "Zero copy decoding needs the software decoder backend, disabling it");
+    stream_conf->zero_copy_decode = 0;
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Using the %s decoder backend%s",
+    decoder_backend_name(stream_conf->decoder_backend),
+    stream_conf->zero_copy_decode ? " with zero copy" : ""
+  );
+  log(INFO, logstr);
+
+  return 0;
+}
+
+static int run_record_mode(
+  struct cam_conf* confs,
+  int cam_count,
+  struct stream_conf* stream_conf,
+  const char* record_dir
+) {
+  /**
+   * Records every camera's encoded stream to disk until stopped
+   *
+   * Each camera gets a thread that remuxes its packets into files in
+   * record_dir. Nothing is decoded, so there is no shared memory
+   * segment, frame pool or decoder to set up, and a host can record
+   * far more cameras than it can decode.
+   *
+   * Returns:
+   * - int: 0 on a clean stop, or a negative errno
+   */
+  static struct record_ctx ctxs[MAX_CAMS];
+  char logstr[128];
+  int ret = 0;
+
+  if (stream_conf->record_container >= RECORD_CONTAINER_COUNT) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Unknown recording container %u",
+      stream_conf->record_container
     );
+    log(ERROR, logstr);
+    perform_cleanup();
+    return -EINVAL;
+  }
 
-    spsc_queue_init(
-      &empty_frame_producer_qs[i],
-      &empty_frame_consumer_qs[i],
-      &q_bufs[(i * 2 + 1) * FRAME_BUFS_PER_THREAD],
-      FRAME_BUFS_PER_THREAD
+  // a recording's path has to fit the directory and its name
+  if (strlen(record_dir) + 1 + RECORD_NAME_LEN > RECORD_PATH_LEN) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Record directory is too long, it can have at most %d characters",
+      RECORD_PATH_LEN - 1 - RECORD_NAME_LEN
     );
+    log(ERROR, logstr);
+    perform_cleanup();
+    return -ENAMETOOLONG;
+  }
 
-    for (int j = 0; j < FRAME_BUFS_PER_THREAD; j++) {
-      spsc_enqueue(
-        &empty_frame_producer_qs[i],
-        &ts_frame_bufs[i * FRAME_BUFS_PER_THREAD + j]
-      );
-    }
+  ret = wire_spill_init();
+  if (ret) {
+    perform_cleanup();
+    return ret;
   }
 
-  struct thread_ctx ctxs[cam_count];
   pthread_t threads[cam_count];
   cleanup.threads = threads;
   for (int i = 0; i < cam_count; i++) {
     ctxs[i].conf = &confs[i];
-    ctxs[i].stream_conf = &stream_conf;
-    ctxs[i].filled_bufs = &filled_frame_producer_qs[i];
-    ctxs[i].empty_bufs = &empty_frame_consumer_qs[i];
-    ctxs[i].core = i % CORES_PER_CCD;
+    ctxs[i].stream_conf = stream_conf;
+    ctxs[i].dir = record_dir;
+    ctxs[i].core = placement_cpu(&placement, i);
     ctxs[i].main_running = &running;
 
     ret = pthread_create(
       &threads[i],
       NULL,
-      stream_mgr_fn,
+      recorder_fn,
       (void*)&ctxs[i]
     );
-
     if (ret) {
-      log(ERROR, "Error spawning thread");
+      log(ERROR, "Error spawning recorder thread");
       perform_cleanup();
-      return ret;
+      return -ret;
     }
+    name_thread(threads[i], "rec-%s", confs[i].name);
 
     cleanup.thread_count++;
   }
 
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Recording %d cameras to %s",
+    cam_count,
+    record_dir
+  );
+  log(INFO, logstr);
+
   struct timespec ts;
   clock_gettime(CLOCK_REALTIME, &ts);
   uint64_t timestamp = (ts.tv_sec + TIMESTAMP_DELAY) * 1000000000ULL + ts.tv_nsec;
   broadcast_msg(confs, cam_count, (char*)&timestamp, sizeof(timestamp));
 
-  struct ts_frame_buf* current_frames[cam_count];
-  memset(current_frames, 0, sizeof(struct ts_frame_buf*) * cam_count);
+  struct timespec wait = {
+    .tv_sec = 0,
+    .tv_nsec = MAIN_WAIT_TIMEOUT
+  };
+  while (running)
+    nanosleep(&wait, NULL);
 
-  // reuse ts for our sleep timer to prevent busy waiting
-  ts.tv_sec = 0;
-  ts.tv_nsec = EMPTY_QS_WAIT;
+  const char* stop_msg = "STOP";
+  broadcast_msg(confs, cam_count, stop_msg, strlen(stop_msg));
 
-  uint32_t dequeue_retry_counter = 0;
+  perform_cleanup();
+  return 0;
+}
 
-  uint32_t dequeued_framesets = 0;
+static int start_dump(
+  const char* dump_dir,
+  struct stream_conf* stream_conf,
+  uint8_t* shm_base,
+  uint32_t core
+) {
+  /**
+   * Spawns the thread that writes every frameset to dump_dir, as a
+   * reliable subscriber of its own, so the dump sees exactly what
+   * consumers do and a slow disk holds up framesets like a slow
+   * consumer would
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+  struct shm_header* hdr = (struct shm_header*)shm_base;
+
+  int ret = frameset_sub_join(
+    &dumper.sub,
+    (struct frameset_bus*)(shm_base + hdr->frameset_bus_offset),
+    (struct frameset_ref*)(shm_base + hdr->frameset_refs_offset),
+    hdr->frameset_slots,
+    (struct notifier*)(shm_base + hdr->server_notify_offset)
+  );
+  if (ret) {
+    log(ERROR, "No frameset subscription left for the dump");
+    return ret;
+  }
 
-  while (running) {
-    // dequeue a full set of timestamped frame buffers from each worker thread
-    bool full_set = true;
-    for(int i = 0; i < cam_count; i++) {
-      if (current_frames[i] != NULL)
-        continue; // already set
+  dumper.stream_conf = stream_conf;
+  dumper.dir = dump_dir;
+  dumper.shm_base = shm_base;
+  dumper.filled_notify = (struct notifier*)(shm_base + hdr->filled_frameset_notify_offset);
+  dumper.core = core;
+  dumper.main_running = &running;
+  dumper.stop = 0;
+
+  ret = pthread_create(
+    &cleanup.dump_thread,
+    NULL,
+    frameset_dump_fn,
+    (void*)&dumper
+  );
+  if (ret) {
+    log(ERROR, "Error spawning dump thread");
+    frameset_sub_leave(&dumper.sub);
+    return -ret;
+  }
+  name_thread(cleanup.dump_thread, "dump");
+  cleanup.dump_running = true;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Dumping framesets to %s",
+    dump_dir
+  );
+  log(INFO, logstr);
 
-      current_frames[i] = spsc_dequeue(&filled_frame_consumer_qs[i]);
+  return 0;
+}
 
-      if (current_frames[i] == NULL) {
-        full_set = false; // queue empty
-        continue;
-      }
-    }
+static int spawn_stream_threads(
+  struct cam_conf* confs,
+  int cam_count,
+  uint32_t slot_count,
+  struct stream_conf* stream_conf,
+  uint8_t* shm_base,
+  struct producer_q* filled_bufs,
+  struct consumer_q* filled_frames,
+  struct notifier* filled_notify,
+  struct server_stats* stats,
+  pthread_t* threads
+) {
+  /**
+   * Spawns a thread per camera that owns both its socket and its decoder
+   *
+   * Every one of the slot_count frameset positions gets a thread slot,
+   * and the positions past cam_count stay idle until a reload fills them
+   */
+  slots.confs = confs;
+  slots.stream_conf = stream_conf;
+  slots.count = slot_count;
+  slots.shm_base = shm_base;
+  slots.filled_bufs = filled_bufs;
+  slots.filled_frames = filled_frames;
+  slots.filled_notify = filled_notify;
+  slots.stats = stats;
+  slots.threads = threads;
+
+  for (uint32_t i = 0; i < slot_count; i++)
+    slots.idle[i] = true;
+  cleanup.idle_threads = slots.idle;
+  cleanup.thread_count = slot_count;
 
-    if (!full_set) { // need a full set to proceed
-      nanosleep(&ts, NULL);
-      continue;
-    }
+  for (int i = 0; i < cam_count; i++) {
+    int ret = start_cam(i);
+    if (ret)
+      return ret;
+  }
 
-    // find the max timestamp
-    uint64_t max_timestamp = 0;
-    for (int i = 0; i < cam_count; i++) {
-      if (current_frames[i]->timestamp > max_timestamp)
-        max_timestamp = current_frames[i]->timestamp;
-    }
+  return 0;
+}
 
-    // check if all have matching timestamps
-    bool all_equal = true;
-    for (int i = 0; i < cam_count; i++) {
-      if (current_frames[i]->timestamp != max_timestamp) {
-        all_equal = false;
-        spsc_enqueue(&empty_frame_producer_qs[i], current_frames[i]);
-        current_frames[i] = NULL; // get a new timestamped buffer
-      }
-    }
+static int start_cam(uint32_t slot) {
+  /**
+   * Spawns the thread for the camera in a frameset position
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  struct thread_ctx* ctx = &slots.ctxs[slot];
+  ctx->conf = &slots.confs[slot];
+  ctx->stream_conf = slots.stream_conf;
+  ctx->shm_base = slots.shm_base;
+  ctx->filled_bufs = &slots.filled_bufs[slot];
+  ctx->filled_notify = slots.filled_notify;
+  ctx->pool = &frame_pool;
+  ctx->stats = &slots.stats->cams[slot];
+  ctx->cam_idx = slot;
+  ctx->core = placement_cpu(&placement, slot);
+  ctx->placement = &placement;
+  ctx->main_running = &running;
+  ctx->stop = 0;
+
+  int ret = pthread_create(
+    &slots.threads[slot],
+    NULL,
+    stream_mgr_fn,
+    (void*)ctx
+  );
+
+  if (ret) {
+    log(ERROR, "Error spawning thread");
+    return -ret;
+  }
+  name_thread(slots.threads[slot], "cam-%s", ctx->conf->name);
+  slots.idle[slot] = false;
+
+  return 0;
+}
+
+static void stop_cam(uint32_t slot) {
+  /**
+   * Stops the thread for the camera in a frameset position while the
+   * other cameras keep streaming
+   *
+   * The signal only interrupts a blocking call, so it is repeated in
+   * case it lands between the thread checking its stop flag and
+   * blocking again
+   */
+  struct thread_ctx* ctx = &slots.ctxs[slot];
+  struct timespec poll = {
+    .tv_sec = 0,
+    .tv_nsec = CAM_STOP_POLL
+  };
+
+  ctx->stop = 1;
+  do {
+    pthread_kill(slots.threads[slot], CAM_STOP_SIGNAL);
+    nanosleep(&poll, NULL);
+  } while (pthread_tryjoin_np(slots.threads[slot], NULL) == EBUSY);
+
+  slots.idle[slot] = true;
+}
+
+static bool cam_conf_equal(struct cam_conf* a, struct cam_conf* b) {
+  return a->eth_ip.s_addr == b->eth_ip.s_addr &&
+         a->wifi_ip.s_addr == b->wifi_ip.s_addr &&
+         a->tcp_port == b->tcp_port &&
+         a->udp_port == b->udp_port &&
+         a->id == b->id &&
+         a->frame_pool_low == b->frame_pool_low &&
+         a->frame_pool_high == b->frame_pool_high &&
+         strcmp(a->name, b->name) == 0;
+}
+
+static void remove_cam(uint32_t slot) {
+  /**
+   * Takes a camera out of the session, from the next frameset emitted
+   */
+  char logstr[128];
+  struct shm_header* hdr = (struct shm_header*)slots.shm_base;
+  uint64_t bit = 1ULL << slot;
+
+  stop_cam(slot);
+  atomic_fetch_and(&hdr->active_mask, ~bit);
+  frameset_asm_remove_cam(&assembler, slot);
+
+  // a camera joining in this position must not inherit these frames
+  struct ts_frame_buf* frame;
+  while ((frame = spsc_dequeue(&slots.filled_frames[slot])) != NULL)
+    frame_pool_put(&frame_pool, slot, frame);
+
+  const char* stop_msg = "STOP";
+  broadcast_msg(&slots.confs[slot], 1, stop_msg, strlen(stop_msg));
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s left the session",
+    slots.confs[slot].name
+  );
+  log(INFO, logstr);
+}
+
+static int add_cam(struct cam_conf* conf, uint64_t t0) {
+  /**
+   * Brings a camera into the session in a free frameset position
+   *
+   * It is sent a start timestamp on the session's capture schedule,
+   * rather than the original one which is long past, so its frames land
+   * on the same frame indices as everyone else's
+   *
+   * Returns:
+   * - int: 0 on success, -ENOSPC without a free position, or a
+   *   negative errno from spawning its thread
+   */
+  char logstr[128];
+  struct shm_header* hdr = (struct shm_header*)slots.shm_base;
+
+  uint32_t slot = 0;
+  while (slot < slots.count && !slots.idle[slot])
+    slot++;
+
+  if (slot == slots.count) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "No free frameset position for camera %s, raise max_cams past %u",
+      conf->name,
+      slots.count
+    );
+    log(ERROR, logstr);
+    return -ENOSPC;
+  }
+
+  uint64_t low, high;
+  pool_watermarks(slots.stream_conf, conf, frame_pool.count, slots.count, &low, &high);
+  if (high > slots.queue_size)
+    high = slots.queue_size;
+  int ret = frame_pool_set_watermarks(&frame_pool, slot, low, high);
+  if (ret) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Frame pool can't guarantee camera %s %lu frames on top of the others",
+      conf->name,
+      low
+    );
+    log(ERROR, logstr);
+    return ret;
+  }
+
+  slots.confs[slot] = *conf;
+  memset(&slots.stats->cams[slot], 0, sizeof(slots.stats->cams[slot]));
+  atomic_store(&frame_pool.cams[slot].dropped, 0);
+  frameset_asm_add_cam(&assembler, slot);
+
+  ret = start_cam(slot);
+  if (ret) {
+    frameset_asm_remove_cam(&assembler, slot);
+    return ret;
+  }
 
-    if (!all_equal)
+  // consumers only look up the id once the position's bit is set
+  hdr->cam_ids[slot] = conf->id;
+  atomic_fetch_or(&hdr->active_mask, 1ULL << slot);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t start = (ts.tv_sec + TIMESTAMP_DELAY) * 1000000000ULL + ts.tv_nsec;
+  start = t0 + (start - t0 + assembler.interval - 1) / assembler.interval * assembler.interval;
+  broadcast_msg(&slots.confs[slot], 1, (char*)&start, sizeof(start));
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s joined the session in position %u",
+    conf->name,
+    slot
+  );
+  log(INFO, logstr);
+
+  return 0;
+}
+
+static void reload_cams(const char* conf_path, uint64_t t0) {
+  /**
+   * Applies a changed camera config without restarting the session
+   *
+   * Cameras are matched up by id. Ones that left the config or whose
+   * entry changed are stopped, and new or changed ones are started in
+   * a free frameset position, so the cameras that didn't change never
+   * miss a frame. Framesets change width at frameset boundaries, the
+   * active mask of each one says which positions were streaming for
+   * it. Stream parameters size the shared memory segment and the
+   * decoders, so changes to them wait for a restart.
+   */
+  char logstr[128];
+
+  int count = count_cameras(conf_path);
+  if (count <= 0) {
+    log(ERROR, "Keeping the running cameras, the changed config has none");
+    return;
+  }
+
+  struct stream_conf stream_conf;
+  struct cam_conf confs[count];
+  int ret = parse_conf(&stream_conf, confs, count);
+  if (ret) {
+    log(ERROR, "Keeping the running cameras, the changed config failed to parse");
+    return;
+  }
+
+  if (stream_conf.frame_width != slots.stream_conf->frame_width ||
+      stream_conf.frame_height != slots.stream_conf->frame_height ||
+      stream_conf.fps != slots.stream_conf->fps)
+    log(WARNING, "Stream parameter changes only take effect on restart");
+
+  bool kept[count];
+  memset(kept, 0, sizeof(kept));
+
+  for (uint32_t i = 0; i < slots.count; i++) {
+    if (!(assembler.active_mask & (1ULL << i)))
       continue;
 
-    struct ts_frame_buf** frameset = spsc_dequeue(empty_frameset_consumer_q);
-    while (!frameset) {
-      if (++dequeue_retry_counter >= stream_conf.fps) {
-        log(ERROR, "Main thread ran out of empty frameset dequeue retries");
-        running = 0;
-        break;
-      }
-      nanosleep(&ts, NULL);
-      frameset = spsc_dequeue(empty_frameset_consumer_q);
+    bool unchanged = false;
+    for (int j = 0; j < count; j++) {
+      if (confs[j].id != slots.confs[i].id)
+        continue;
+
+      unchanged = cam_conf_equal(&confs[j], &slots.confs[i]);
+      kept[j] = unchanged;
+      break;
     }
 
-    dequeue_retry_counter = 0;
+    if (!unchanged)
+      remove_cam(i);
+  }
 
-    if (dequeued_framesets >= FRAMESET_SLOTS_PER_THREAD) {
-      for (int i = 0; i < cam_count; i++) {
-        spsc_enqueue(&empty_frame_producer_qs[i], frameset[i]);
-      }
-    } else {
-      dequeued_framesets++;
+  for (int j = 0; j < count; j++) {
+    if (!kept[j])
+      add_cam(&confs[j], t0);
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Reloaded the camera config, streaming %d cameras",
+    __builtin_popcountll(assembler.active_mask)
+  );
+  log(INFO, logstr);
+}
+
+static int spawn_ingest_threads(
+  struct cam_conf* confs,
+  int cam_count,
+  struct stream_conf* stream_conf,
+  uint32_t reactor_count,
+  uint32_t decode_count,
+  uint8_t* shm_base,
+  struct producer_q* filled_bufs,
+  struct notifier* filled_notify,
+  struct server_stats* stats,
+  pthread_t* threads
+) {
+  /**
+   * Spawns the reactor threads that own the camera sockets, followed
+   * by the decode threads that own the decoders, pinned in that order
+   */
+  char logstr[128];
+
+  int ret = ingest_init(
+    &ingest,
+    confs,
+    cam_count,
+    stream_conf,
+    reactor_count,
+    decode_count,
+    shm_base,
+    filled_bufs,
+    filled_notify,
+    &frame_pool,
+    stats->cams,
+    &running
+  );
+  if (ret)
+    return ret;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Ingesting %d cameras with %u reactor and %u decode threads",
+    cam_count,
+    ingest.reactor_count,
+    ingest.worker_count
+  );
+  log(INFO, logstr);
+
+  uint32_t core = 0;
+  for (uint32_t i = 0; i < ingest.reactor_count; i++, core++) {
+    ingest.reactors[i].core = placement_cpu(&placement, core);
+    ret = pthread_create(
+      &threads[cleanup.thread_count],
+      NULL,
+      reactor_fn,
+      (void*)&ingest.reactors[i]
+    );
+    if (ret) {
+      log(ERROR, "Error spawning reactor thread");
+      return -ret;
     }
+    name_thread(threads[cleanup.thread_count], "reactor-%u", i);
+    cleanup.thread_count++;
+  }
 
-    memcpy(frameset, current_frames, sizeof(struct ts_frame_buf*) * cam_count);
-    spsc_enqueue(filled_frameset_producer_q, frameset);
-    memset(current_frames, 0, sizeof(struct ts_frame_buf*) * cam_count);
+  for (uint32_t i = 0; i < ingest.worker_count; i++, core++) {
+    ingest.workers[i].core = placement_cpu(&placement, core);
+    ret = pthread_create(
+      &threads[cleanup.thread_count],
+      NULL,
+      decode_worker_fn,
+      (void*)&ingest.workers[i]
+    );
+    if (ret) {
+      log(ERROR, "Error spawning decode thread");
+      return -ret;
+    }
+    name_thread(threads[cleanup.thread_count], "decode-%u", i);
+    cleanup.thread_count++;
   }
 
-  // stop the camera devices
-  const char* stop_msg = "STOP";
-  broadcast_msg(confs, cam_count, stop_msg, strlen(stop_msg));
+  return 0;
+}
 
-  perform_cleanup();
-  return ret;
+static void name_thread(pthread_t thread, const char* fmt, ...) {
+  /**
+   * Names a thread after its role, so per thread tools like top -H or
+   * /proc/<pid>/task/<tid>/comm can tell the pipeline stages apart.
+   * Names are cut to the 15 characters the kernel keeps, and failing
+   * to set one is harmless
+   */
+  char name[16];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(name, sizeof(name), fmt, args);
+  va_end(args);
+
+  pthread_setname_np(thread, name);
+}
+
+static void recycle_frameset(
+  struct frameset* frameset,
+  struct ts_frame_buf* ts_frame_bufs,
+  struct frame_pool* pool,
+  int cam_count
+) {
+  /**
+   * Returns the frames of a frameset every subscriber is done with
+   * back to the worker threads they were decoded by
+   */
+  for (int i = 0; i < cam_count; i++) {
+    if (frameset->cam_mask & (1ULL << i))
+      frame_pool_put(pool, i, &ts_frame_bufs[frameset->frame_idx[i]]);
+  }
+
+  frameset->cam_mask = 0;
+}
+
+static void log_asm_stats(
+  struct frameset_asm* fa,
+  struct frame_pool* pool,
+  struct cam_conf* confs,
+  int cam_count
+) {
+  char logstr[128];
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Framesets complete: %lu, partial: %lu, expired: %lu",
+    fa->complete_framesets,
+    fa->partial_framesets,
+    fa->expired_framesets
+  );
+  log(INFO, logstr);
+
+  for (int i = 0; i < cam_count; i++) {
+    if (!(fa->active_mask & (1ULL << i)))
+      continue;
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s frames: %lu, dropped: %lu, late: %lu, no buffer: %lu",
+      confs[i].name,
+      fa->stats[i].frames,
+      fa->stats[i].dropped,
+      fa->stats[i].late,
+      atomic_load(&pool->cams[i].dropped)
+    );
+    log(INFO, logstr);
+  }
 }
 
 static void shutdown_handler(int signum) {
@@ -462,22 +1563,38 @@ static void shutdown_handler(int signum) {
 static void perform_cleanup() {
   if (cleanup.threads) {
     for (int i = 0; i < cleanup.thread_count; i++) {
+      if (cleanup.idle_threads && cleanup.idle_threads[i])
+        continue;
       pthread_kill(cleanup.threads[i], SIGUSR2);
     }
 
     for (int i = 0; i < cleanup.thread_count; i++) {
+      if (cleanup.idle_threads && cleanup.idle_threads[i])
+        continue;
       pthread_join(cleanup.threads[i], NULL);
     }
   }
 
+  // once nothing is published anymore, so it can finish the last framesets
+  if (cleanup.dump_running) {
+    dumper.stop = 1;
+    pthread_kill(cleanup.dump_thread, DUMP_STOP_SIGNAL);
+    pthread_join(cleanup.dump_thread, NULL);
+    cleanup.dump_running = false;
+  }
+
+  conf_watch_cleanup(&cleanup.watch);
+
+  trace_stop();
+  trace_cleanup();
+
+  ingest_cleanup(&ingest);
+  wire_spill_cleanup();
+  frameset_pub_cleanup(&publisher);
+  frame_pool_cleanup(&frame_pool);
+
   if (cleanup.logging_initialized)
     cleanup_logging();
 
-  if (cleanup.mmap_buf)
-    munmap(cleanup.mmap_buf, cleanup.shm_size);
-
-  if (cleanup.shm_fd >= 0) {
-    close(cleanup.shm_fd);
-    shm_unlink(SHM_NAME);
-  }
+  shm_seg_close(&cleanup.shm);
 }
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <net/if.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -15,6 +18,7 @@
 
 #define ACCEPT_TIMEOUT 10 // 10 sec
 #define RECV_TIMEOUT 1 // 1 sec
+#define UDP_RCVBUF (4 * 1024 * 1024) // a few frames of datagrams, capped by net.core.rmem_max
 
 static bool is_eth_conn(int sockfd) {
   struct ifreq ifr;
@@ -181,6 +185,139 @@ int setup_stream(struct cam_conf* conf) {
   return ret;
 }
 
+int setup_udp_stream(struct cam_conf* conf) {
+  /**
+   * Binds a UDP socket on the camera's stream port, for cameras that
+   * stream over UDP instead of connecting
+   *
+   * Returns:
+   * - int: the socket, or a negative errno
+   */
+  int ret = 0;
+  char logstr[128];
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating udp socket: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  int enable = 1;
+  ret = setsockopt(
+    sockfd,
+    SOL_SOCKET,
+    SO_REUSEADDR,
+    &enable,
+    sizeof(int)
+  );
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error setting SO_REUSEADDR: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    ret = -errno;
+    goto err_cleanup;
+  }
+
+  // a burst of keyframe datagrams outruns the default buffer
+  int rcvbuf = UDP_RCVBUF;
+  ret = setsockopt(
+    sockfd,
+    SOL_SOCKET,
+    SO_RCVBUF,
+    &rcvbuf,
+    sizeof(rcvbuf)
+  );
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error setting udp receive buffer size: %s",
+      strerror(errno)
+    );
+    log(WARNING, logstr);
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(conf->tcp_port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+
+  ret = bind(sockfd, (struct sockaddr*)&addr, sizeof(addr));
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error binding udp socket: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    ret = -errno;
+    goto err_cleanup;
+  }
+
+  return sockfd;
+
+  err_cleanup:
+  close(sockfd);
+  return ret;
+}
+
+int accept_stream(int sockfd, int udpfd, bool* udp) {
+  /**
+   * Waits for a camera to either connect over TCP, or start sending
+   * datagrams when udpfd isn't -1
+   *
+   * Returns:
+   * - int: the connected client fd, udpfd with udp set once datagrams
+   *   are arriving, or a negative errno as from accept_conn
+   */
+  char logstr[128];
+
+  *udp = false;
+  struct pollfd fds[2] = {
+    { .fd = sockfd, .events = POLLIN },
+    { .fd = udpfd, .events = POLLIN }
+  };
+
+  int ret = poll(fds, udpfd >= 0 ? 2 : 1, ACCEPT_TIMEOUT * 1000);
+  if (ret < 0) {
+    if (errno == EINTR)
+      return -EINTR;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error waiting for a camera: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  // a camera that's off or rebooting times out every wait, so keep it out of the log
+  if (ret == 0) {
+    log(DEBUG, "Accept connection timed out, no camera connected");
+    return -ETIMEDOUT;
+  }
+
+  if (!(fds[0].revents & POLLIN) && udpfd >= 0) {
+    *udp = true;
+    return udpfd;
+  }
+
+  return accept_conn(sockfd);
+}
+
 int accept_conn(int sockfd) {
   char logstr[128];
 
@@ -190,9 +327,11 @@ int accept_conn(int sockfd) {
   int clientfd = accept(sockfd, (struct sockaddr*)&rcvr_addr, &addr_len);
   if (clientfd < 0) {
     if (errno == EWOULDBLOCK) {
-      log(ERROR, "Accept connection timed out, no camera connected");
+      log(DEBUG, "Accept connection timed out, no camera connected");
       return -ETIMEDOUT;
     }
+    if (errno == EINTR)
+      return -EINTR;
     snprintf(
       logstr,
       sizeof(logstr),
@@ -229,20 +368,71 @@ int accept_conn(int sockfd) {
   return clientfd;
 }
 
-ssize_t recv_from_stream(int clientfd, char* buf, size_t size) {
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -errno;
+
+  return 0;
+}
+
+int accept_conn_nonblock(int sockfd) {
+  /**
+   * Accepts a pending connection on a non-blocking listening socket
+   *
+   * Returns:
+   * - int: the non-blocking client fd, -EAGAIN when nothing is
+   *   pending, or a negative errno
+   */
   char logstr[128];
 
-  ssize_t bytes = recv(clientfd, buf, size, MSG_WAITALL);
+  struct sockaddr_in rcvr_addr;
+  socklen_t addr_len = sizeof(rcvr_addr);
+
+  int clientfd = accept4(
+    sockfd,
+    (struct sockaddr*)&rcvr_addr,
+    &addr_len,
+    SOCK_NONBLOCK
+  );
+  if (clientfd < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -EAGAIN;
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error accepting connection: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  return clientfd;
+}
+
+ssize_t recv_nonblock(int clientfd, char* buf, size_t size) {
+  /**
+   * Receives whatever is available in one call, without waiting for
+   * the buffer to fill
+   *
+   * Returns:
+   * - ssize_t: bytes received, 0 when the client disconnected,
+   *   -EAGAIN when nothing is available on a non-blocking socket or
+   *   the receive timeout expired, or a negative errno
+   */
+  char logstr[128];
+
+  ssize_t bytes = recv(clientfd, buf, size, 0);
   if (bytes == 0) {
     log(WARNING, "Client has disconnected");
     return 0;
   } else if (bytes < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -EAGAIN;
     if (errno == EINTR)
       return -EINTR;
-    if (errno == EWOULDBLOCK) {
-      log(WARNING, "Timed out waiting for packet from client");
-      return -ETIMEDOUT;
-    }
 
     snprintf(
       logstr,
@@ -0,0 +1,129 @@
+#include <errno.h>
+#include <linux/futex.h>
+#include <spsc_queue.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "notify.h"
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void notifier_init(struct notifier* n) {
+  atomic_init(&n->seq, 0);
+  atomic_init(&n->waiters, 0);
+}
+
+void notify(struct notifier* n) {
+  /**
+   * Wakes every consumer sleeping on the notifier
+   *
+   * The seq bump is ordered before the waiters check, and a consumer
+   * registers as a waiter before the kernel rechecks seq, so either we
+   * see the waiter or the waiter sees the new seq and never sleeps
+   */
+  atomic_fetch_add(&n->seq, 1);
+  if (atomic_load(&n->waiters) == 0)
+    return;
+
+  syscall(
+    SYS_futex,
+    (uint32_t*)&n->seq,
+    FUTEX_WAKE,
+    INT32_MAX,
+    NULL,
+    NULL,
+    0
+  );
+}
+
+int notify_wait(
+  struct notifier* n,
+  uint32_t seq,
+  uint64_t timeout_ns
+) {
+  /**
+   * Sleeps until the notifier moves past seq or the timeout passes
+   *
+   * Parameters:
+   * - struct notifier* n: the notifier to sleep on
+   * - uint32_t seq: the value of n->seq sampled before checking
+   *   for work, so a notify in between is never missed
+   * - uint64_t timeout_ns: relative timeout
+   *
+   * Returns:
+   * - int: 0 when woken or seq already moved, -ETIMEDOUT, or -EINTR
+   */
+  struct timespec timeout = {
+    .tv_sec = timeout_ns / 1000000000ULL,
+    .tv_nsec = timeout_ns % 1000000000ULL
+  };
+
+  atomic_fetch_add(&n->waiters, 1);
+  long ret = syscall(
+    SYS_futex,
+    (uint32_t*)&n->seq,
+    FUTEX_WAIT,
+    seq,
+    &timeout,
+    NULL,
+    0
+  );
+  int err = errno;
+  atomic_fetch_sub(&n->waiters, 1);
+
+  if (ret == 0 || err == EAGAIN)
+    return 0;
+
+  return -err;
+}
+
+int spsc_enqueue_notify(
+  struct producer_q* q,
+  struct notifier* n,
+  void* data
+) {
+  int ret = spsc_enqueue(q, data);
+  if (ret == 0)
+    notify(n);
+
+  return ret;
+}
+
+void* spsc_dequeue_wait(
+  struct consumer_q* q,
+  struct notifier* n,
+  uint64_t timeout_ns
+) {
+  /**
+   * Dequeues, sleeping on the notifier while the queue is empty
+   *
+   * Returns:
+   * - void*: the dequeued item, or NULL on timeout or interruption
+   *   by a signal so the caller can check its running flag
+   */
+  uint64_t deadline = now_ns() + timeout_ns;
+
+  while (true) {
+    uint32_t seq = atomic_load(&n->seq);
+
+    void* data = spsc_dequeue(q);
+    if (data)
+      return data;
+
+    uint64_t now = now_ns();
+    if (now >= deadline)
+      return NULL;
+
+    int ret = notify_wait(n, seq, deadline - now);
+    if (ret == -EINTR)
+      return NULL;
+  }
+}
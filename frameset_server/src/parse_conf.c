@@ -113,6 +113,14 @@ static int parse_str(const char* str, void* field) {
   return 0;
 }
 
+static int parse_cpu_list(const char* str, void* field) {
+  if (strlen(str) >= CPU_LIST_LEN)
+    return -EINVAL;
+
+  strcpy((char*)field, str);
+  return 0;
+}
+
 static int parse_uint8(const char* str, void* field) {
   *(uint8_t*)field = atoi(str);
   return 0;
@@ -144,6 +152,30 @@ static const struct field_map stream_fields[] = {
   {"fps", offsetof(struct stream_conf, fps), parse_uint32}
 };
 
+// stream params which fall back to a default when left out of the file
+static const struct field_map optional_stream_fields[] = {
+  {"frameset_deadline_ms", offsetof(struct stream_conf, frameset_deadline_ms), parse_uint32},
+  {"hugepage_size_mb", offsetof(struct stream_conf, hugepage_size_mb), parse_uint32},
+  {"lock_frame_pool", offsetof(struct stream_conf, lock_frame_pool), parse_uint32},
+  {"frame_pool_mb", offsetof(struct stream_conf, frame_pool_mb), parse_uint32},
+  {"frame_pool_frames", offsetof(struct stream_conf, frame_pool_frames), parse_uint32},
+  {"frame_pool_low", offsetof(struct stream_conf, frame_pool_low), parse_uint32},
+  {"frame_pool_high", offsetof(struct stream_conf, frame_pool_high), parse_uint32},
+  {"ingest_threads", offsetof(struct stream_conf, ingest_threads), parse_uint32},
+  {"decode_threads", offsetof(struct stream_conf, decode_threads), parse_uint32},
+  {"uring_rx", offsetof(struct stream_conf, uring_rx), parse_uint32},
+  {"udp_jitter_ms", offsetof(struct stream_conf, udp_jitter_ms), parse_uint32},
+  {"decoder_backend", offsetof(struct stream_conf, decoder_backend), parse_uint32},
+  {"decoder_threads", offsetof(struct stream_conf, decoder_threads), parse_uint32},
+  {"zero_copy_decode", offsetof(struct stream_conf, zero_copy_decode), parse_uint32},
+  {"record_segment_sec", offsetof(struct stream_conf, record_segment_sec), parse_uint32},
+  {"record_container", offsetof(struct stream_conf, record_container), parse_uint32},
+  {"dump_chunk_mb", offsetof(struct stream_conf, dump_chunk_mb), parse_uint32},
+  {"trace_seconds", offsetof(struct stream_conf, trace_seconds), parse_uint32},
+  {"max_cams", offsetof(struct stream_conf, max_cams), parse_uint32},
+  {"cpu_list", offsetof(struct stream_conf, cpu_list), parse_cpu_list}
+};
+
 static const struct field_map fields[] = {
   {"name", offsetof(struct cam_conf, name), parse_str},
   {"id", offsetof(struct cam_conf, id), parse_uint8},
@@ -153,6 +185,12 @@ static const struct field_map fields[] = {
   {"udp_port", offsetof(struct cam_conf, udp_port), parse_uint16}
 };
 
+// camera fields which fall back to the stream params when left out
+static const struct field_map optional_fields[] = {
+  {"frame_pool_low", offsetof(struct cam_conf, frame_pool_low), parse_uint32},
+  {"frame_pool_high", offsetof(struct cam_conf, frame_pool_high), parse_uint32}
+};
+
 static int parse_stream_params(struct stream_conf* stream_conf) {
   int ret = 0;
   char logstr[128];
@@ -174,8 +212,12 @@ static int parse_stream_params(struct stream_conf* stream_conf) {
   }
   yaml_parser_set_input_file(&parser, infile);
 
+  // optional fields left at zero fall back to their defaults
+  memset(stream_conf, 0, sizeof(*stream_conf));
+
   int fields_parsed = 0;
   const int fields_total = sizeof(stream_fields)/sizeof(stream_fields[0]);
+  const int optional_total = sizeof(optional_stream_fields)/sizeof(optional_stream_fields[0]);
   bool in_stream_params = false;
 
   while (true) {
@@ -187,8 +229,14 @@ static int parse_stream_params(struct stream_conf* stream_conf) {
     }
 
     if (event.type == YAML_STREAM_END_EVENT) {
-      log(ERROR, "Reached end of file before finding all stream parameters");
-      ret = -EINVAL;
+      // stream_params may come after cameras, in which case it ends the file
+      if (fields_parsed < fields_total) {
+        log(ERROR, "Reached end of file before finding all stream parameters");
+        ret = -EINVAL;
+        goto cleanup;
+      }
+
+      ret = 0;
       goto cleanup;
     }
 
@@ -216,6 +264,7 @@ static int parse_stream_params(struct stream_conf* stream_conf) {
       goto cleanup;
     }
 
+    bool matched = false;
     for (int i = 0; i < fields_total; i++) {
       if (strcmp((char*)event.data.scalar.value, stream_fields[i].name) != 0)
         continue;
@@ -242,15 +291,45 @@ static int parse_stream_params(struct stream_conf* stream_conf) {
       }
 
       fields_parsed++;
+      matched = true;
       break;
     }
 
-    yaml_event_delete(&event);
+    // event now holds the value just parsed, which is no key to match
+    if (matched) {
+      yaml_event_delete(&event);
+      continue;
+    }
 
-    if (fields_parsed == fields_total) {
-      ret = 0;
-      goto cleanup;
+    for (int i = 0; i < optional_total; i++) {
+      if (strcmp((char*)event.data.scalar.value, optional_stream_fields[i].name) != 0)
+        continue;
+
+      ret = yaml_parser_parse(&parser, &event);
+      if (ret == 0) {
+        log(ERROR, "Error parsing yaml file");
+        ret = -EINVAL;
+        goto cleanup;
+      }
+
+      void* field = (char*)stream_conf + optional_stream_fields[i].offset;
+      ret = optional_stream_fields[i].parser((char*)event.data.scalar.value, field);
+      if (ret < 0) {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Failed to parse %s",
+          optional_stream_fields[i].name
+        );
+        log(ERROR, logstr);
+        ret = -EINVAL;
+        goto cleanup;
+      }
+
+      break;
     }
+
+    yaml_event_delete(&event);
   }
 
   cleanup:
@@ -309,7 +388,10 @@ int parse_conf(
   int confs_parsed = 0;
   int fields_parsed = 0;
   const int fields_total = sizeof(fields)/sizeof(fields[0]);
+  const int optional_total = sizeof(optional_fields)/sizeof(optional_fields[0]);
+  bool in_cameras = false;
 
+  // each camera is a mapping in the cameras list, so its optional fields can come in any order
   while (confs_parsed < count) {
     ret = yaml_parser_parse(&parser, &event);
     if (ret == 0) {
@@ -331,11 +413,40 @@ int parse_conf(
       goto cleanup;
     }
 
+    if (in_cameras && event.type == YAML_MAPPING_START_EVENT) {
+      memset(&confs[confs_parsed], 0, sizeof(confs[confs_parsed]));
+      fields_parsed = 0;
+    }
+
+    if (in_cameras && event.type == YAML_MAPPING_END_EVENT) {
+      if (fields_parsed < fields_total) {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Camera %d is missing required fields",
+          confs_parsed
+        );
+        log(ERROR, logstr);
+        ret = -EINVAL;
+        goto cleanup;
+      }
+      confs_parsed++;
+    }
+
     if (event.type != YAML_SCALAR_EVENT) {
       yaml_event_delete(&event);
       continue;
     }
 
+    if (!in_cameras) {
+      if (strcmp((char*)event.data.scalar.value, "cameras") == 0)
+        in_cameras = true;
+
+      yaml_event_delete(&event);
+      continue;
+    }
+
+    bool matched = false;
     for (int i = 0; i < fields_total; i++) {
       // check if we have a key
       ret = strcmp((char*)event.data.scalar.value, fields[i].name);
@@ -364,14 +475,42 @@ int parse_conf(
         goto cleanup;
       }
 
-      if (++fields_parsed == fields_total) {
-        fields_parsed = 0;
-        confs_parsed++;
+      fields_parsed++;
+      matched = true;
+      break;
+    }
+
+    for (int i = 0; !matched && i < optional_total; i++) {
+      if (strcmp((char*)event.data.scalar.value, optional_fields[i].name) != 0)
+        continue;
+
+      ret = yaml_parser_parse(&parser, &event);
+      if (ret == 0) {
+        log(ERROR, "Error parsing yaml file");
+        ret = -EINVAL;
+        goto cleanup;
+      }
+
+      void* field = (char*)&confs[confs_parsed] + optional_fields[i].offset;
+      ret = optional_fields[i].parser((char*)event.data.scalar.value, field);
+      if (ret < 0) {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Failed to parse %s",
+          optional_fields[i].name
+        );
+        log(ERROR, logstr);
+        ret = -EINVAL;
+        goto cleanup;
       }
+
+      break;
     }
 
     yaml_event_delete(&event);
   }
+  ret = 0;
 
   cleanup:
   if (infile)
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "placement.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODES_ONLINE "/sys/devices/system/node/online"
+#define CACHE_INDEX_MAX 16
+#define SYSFS_LIST_LEN 1024
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+static int read_sysfs(const char* path, char* buf, size_t size) {
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return -errno;
+
+  bool read = fgets(buf, size, f) != NULL;
+  fclose(f);
+  return read ? 0 : -EIO;
+}
+
+static int parse_cpu_list(const char* str, cpu_set_t* set) {
+  /**
+   * Parses a list in the kernel's cpu list format, like "0-7,16-23"
+   *
+   * Returns:
+   * - int: 0 on success, or -EINVAL
+   */
+  CPU_ZERO(set);
+
+  const char* pos = str;
+  while (*pos && *pos != '\n') {
+    char* end;
+    unsigned long first = strtoul(pos, &end, 10);
+    if (end == pos)
+      return -EINVAL;
+
+    unsigned long last = first;
+    pos = end;
+    if (*pos == '-') {
+      pos++;
+      last = strtoul(pos, &end, 10);
+      if (end == pos || last < first)
+        return -EINVAL;
+      pos = end;
+    }
+
+    if (last >= PLACEMENT_MAX_CPUS)
+      return -EINVAL;
+    for (unsigned long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+
+    if (*pos == ',')
+      pos++;
+    else if (*pos && *pos != '\n')
+      return -EINVAL;
+  }
+
+  return 0;
+}
+
+static int l3_domain(uint32_t cpu, cpu_set_t* domain) {
+  /**
+   * Finds the cpus sharing a cpu's L3 cache
+   *
+   * Returns:
+   * - int: 0 on success, or -ENOENT when sysfs lists no L3 for it
+   */
+  char path[128];
+  char buf[SYSFS_LIST_LEN];
+
+  for (int i = 0; i < CACHE_INDEX_MAX; i++) {
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u/cache/index%d/level", cpu, i);
+    if (read_sysfs(path, buf, sizeof(buf)))
+      break;
+    if (atoi(buf) != 3)
+      continue;
+
+    snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u/cache/index%d/shared_cpu_list", cpu, i);
+    if (read_sysfs(path, buf, sizeof(buf)) == 0 && parse_cpu_list(buf, domain) == 0)
+      return 0;
+  }
+
+  return -ENOENT;
+}
+
+static bool first_sibling(uint32_t cpu, cpu_set_t* cpus) {
+  /**
+   * Checks whether a cpu is the lowest numbered hardware thread of its
+   * core among cpus, which are the ones placed first
+   */
+  char path[128];
+  char buf[SYSFS_LIST_LEN];
+  cpu_set_t siblings;
+
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u/topology/thread_siblings_list", cpu);
+  if (read_sysfs(path, buf, sizeof(buf)) || parse_cpu_list(buf, &siblings))
+    return true;
+
+  for (uint32_t other = 0; other < cpu; other++) {
+    if (CPU_ISSET(other, &siblings) && CPU_ISSET(other, cpus))
+      return false;
+  }
+
+  return true;
+}
+
+static int cpu_node(uint32_t cpu) {
+  /**
+   * Returns the NUMA node a cpu sits on, from the nodeN link in its
+   * sysfs directory, or -1 without one
+   */
+  char path[128];
+  snprintf(path, sizeof(path), SYSFS_CPU "/cpu%u", cpu);
+
+  DIR* dir = opendir(path);
+  if (!dir)
+    return -1;
+
+  int node = -1;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0 &&
+        ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+      node = atoi(ent->d_name + 4);
+      break;
+    }
+  }
+
+  closedir(dir);
+  return node;
+}
+
+int placement_init(struct placement* place, const char* cpu_list) {
+  /**
+   * Picks the cpus to place threads on, cpu_list when the config sets
+   * one, and otherwise the largest L3 domain among the cpus the process
+   * may run on, the lowest numbered of equally large ones
+   *
+   * Every allowed cpu is used when sysfs has no cache topology, as in
+   * some VMs.
+   *
+   * Returns:
+   * - int: 0 on success, -EINVAL when cpu_list is malformed or has
+   *   none of the allowed cpus, or a negative errno
+   */
+  char logstr[128];
+  cpu_set_t allowed;
+  cpu_set_t chosen;
+
+  memset(place, 0, sizeof(*place));
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error getting the cpus the server may run on: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  if (cpu_list && cpu_list[0]) {
+    cpu_set_t wanted;
+    if (parse_cpu_list(cpu_list, &wanted)) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Invalid cpu_list %s, expected a list like 0-7,16-23",
+        cpu_list
+      );
+      log(ERROR, logstr);
+      return -EINVAL;
+    }
+
+    CPU_AND(&chosen, &wanted, &allowed);
+    if (CPU_COUNT(&chosen) == 0) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "cpu_list %s has none of the cpus the server may run on",
+        cpu_list
+      );
+      log(ERROR, logstr);
+      return -EINVAL;
+    }
+  } else {
+    chosen = allowed;
+
+    int best = 0;
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (uint32_t cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &seen))
+        continue;
+
+      cpu_set_t domain;
+      if (l3_domain(cpu, &domain))
+        continue;
+      CPU_AND(&domain, &domain, &allowed);
+      CPU_OR(&seen, &seen, &domain);
+      CPU_SET(cpu, &seen);
+
+      int count = CPU_COUNT(&domain);
+      if (count > best) {
+        best = count;
+        chosen = domain;
+      }
+    }
+  }
+
+  // a thread on every core before any core gets a second one
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t cpu = 0; cpu < PLACEMENT_MAX_CPUS; cpu++) {
+      if (CPU_ISSET(cpu, &chosen) && first_sibling(cpu, &chosen) == (pass == 0))
+        place->cpus[place->count++] = cpu;
+    }
+  }
+  place->node = cpu_node(place->cpus[0]);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Placing threads on %u cpus starting at cpu %u, NUMA node %d",
+    place->count,
+    place->cpus[0],
+    place->node
+  );
+  log(INFO, logstr);
+
+  return 0;
+}
+
+uint32_t placement_cpu(struct placement* place, uint32_t idx) {
+  /**
+   * Returns the cpu for the idx'th thread placed, which wraps around
+   * once every cpu has a thread
+   */
+  return place->cpus[idx % place->count];
+}
+
+void placement_bind_memory(struct placement* place) {
+  /**
+   * Has memory the calling thread and the threads it spawns from here
+   * on fault in come from the placement's node, and from other nodes
+   * only once it's full
+   *
+   * The policy is per thread and inherited, so this runs before the
+   * shared memory segment is mapped and any thread is spawned. Does
+   * nothing with a single node online.
+   */
+  char logstr[128];
+  char buf[SYSFS_LIST_LEN];
+  cpu_set_t nodes; // node lists share the cpu list format
+
+  if (place->node < 0 || place->node >= PLACEMENT_MAX_CPUS ||
+      read_sysfs(SYSFS_NODES_ONLINE, buf, sizeof(buf)) ||
+      parse_cpu_list(buf, &nodes) ||
+      CPU_COUNT(&nodes) < 2)
+    return;
+
+  unsigned long nodemask[PLACEMENT_MAX_CPUS / LONG_BITS] = {0};
+  nodemask[place->node / LONG_BITS] = 1UL << (place->node % LONG_BITS);
+
+  long ret = syscall(
+    SYS_set_mempolicy,
+    MPOL_PREFERRED,
+    nodemask,
+    sizeof(nodemask) * 8 + 1
+  );
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error preferring NUMA node %d for memory: %s",
+      place->node,
+      strerror(errno)
+    );
+    log(WARNING, logstr);
+  }
+}
+
+int placement_allow_all(struct placement* place) {
+  /**
+   * Lets the calling thread, and the threads it spawns from here on,
+   * run on any of the placement's cpus
+   *
+   * Software decoders spawn their frame threads when they're set up,
+   * and those inherit the mask of the thread setting them up, so it
+   * widens to this before init_decoder and only pins itself after.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+  cpu_set_t cpuset;
+
+  CPU_ZERO(&cpuset);
+  for (uint32_t i = 0; i < place->count; i++)
+    CPU_SET(place->cpus[i], &cpuset);
+
+  if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error allowing a thread on the placement's cpus: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  return 0;
+}
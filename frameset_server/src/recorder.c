@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mem.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "network.h"
+#include "recorder.h"
+#include "wire.h"
+
+#define NAL_TYPE_MASK 0x1f
+#define NAL_IDR 5
+#define NAL_SPS 7
+#define NAL_PPS 8
+
+static const char* container_formats[RECORD_CONTAINER_COUNT] = {
+  "matroska",
+  "mp4"
+};
+static const char* container_exts[RECORD_CONTAINER_COUNT] = {
+  "mkv",
+  "mp4"
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint8_t* next_nal(uint8_t* p, uint8_t* end) {
+  // returns the first byte after the next 00 00 01 start code, or end
+  for (; p + 3 <= end; p++) {
+    if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+      return p + 3;
+  }
+  return end;
+}
+
+static bool is_keyframe(uint8_t* data, uint32_t size) {
+  uint8_t* end = data + size;
+  for (uint8_t* nal = next_nal(data, end); nal < end; nal = next_nal(nal, end)) {
+    if ((nal[0] & NAL_TYPE_MASK) == NAL_IDR)
+      return true;
+  }
+  return false;
+}
+
+static int set_extradata(AVCodecParameters* par, uint8_t* data, uint32_t size) {
+  /**
+   * Copies the SPS and PPS out of a keyframe as Annex B extradata,
+   * which the muxers convert to the avcC their headers need
+   *
+   * Returns:
+   * - int: 0 on success, -EINVAL when the keyframe carries no parameter
+   *   sets, or -ENOMEM
+   */
+  uint8_t* buf = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+  if (!buf)
+    return -ENOMEM;
+
+  uint32_t len = 0;
+  uint8_t* end = data + size;
+  uint8_t* nal = next_nal(data, end);
+  while (nal < end) {
+    uint8_t* next = next_nal(nal, end);
+    uint8_t* nal_end = next == end ? end : next - 3;
+    while (nal_end > nal && nal_end[-1] == 0)
+      nal_end--; // the leading zero of a 4 byte start code
+
+    uint8_t type = nal[0] & NAL_TYPE_MASK;
+    if (type == NAL_SPS || type == NAL_PPS) {
+      static const uint8_t start_code[3] = {0, 0, 1};
+      memcpy(buf + len, start_code, sizeof(start_code));
+      len += sizeof(start_code);
+      memcpy(buf + len, nal, nal_end - nal);
+      len += nal_end - nal;
+    }
+    nal = next;
+  }
+
+  if (len == 0) {
+    av_free(buf);
+    return -EINVAL;
+  }
+
+  par->extradata = buf;
+  par->extradata_size = len;
+  return 0;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int write_io(void* opaque, const uint8_t* buf, int size) {
+#else
+static int write_io(void* opaque, uint8_t* buf, int size) {
+#endif
+  struct recorder* rec = (struct recorder*)opaque;
+
+  int written = 0;
+  while (written < size) {
+    ssize_t n = write(rec->fd, buf + written, size - written);
+    if (n == -1 && errno == EINTR)
+      continue; // finish the buffer even when stopping
+    if (n == -1)
+      return AVERROR(errno);
+    written += n;
+  }
+
+  return size;
+}
+
+static int64_t seek_io(void* opaque, int64_t offset, int whence) {
+  struct recorder* rec = (struct recorder*)opaque;
+
+  if (whence == AVSEEK_SIZE) {
+    struct stat st;
+    return fstat(rec->fd, &st) == -1 ? AVERROR(errno) : st.st_size;
+  }
+
+  off_t pos = lseek(rec->fd, offset, whence & ~AVSEEK_FORCE);
+  return pos == -1 ? AVERROR(errno) : pos;
+}
+
+static void free_segment(struct recorder* rec) {
+  if (rec->fmt)
+    avformat_free_context(rec->fmt);
+  if (rec->io) {
+    av_freep(&rec->io->buffer);
+    avio_context_free(&rec->io);
+  }
+  if (rec->fd >= 0)
+    close(rec->fd);
+  rec->fmt = NULL;
+  rec->io = NULL;
+  rec->fd = -1;
+}
+
+static int open_segment(
+  struct recorder* rec,
+  uint64_t timestamp,
+  uint8_t* keyframe,
+  uint32_t size
+) {
+  /**
+   * Starts a new container file named after the camera and the
+   * capture timestamp of the keyframe it starts with
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  int ret = 0;
+  char logstr[128];
+  char name[RECORD_NAME_LEN];
+  char path[RECORD_PATH_LEN];
+
+  // run_record_mode made sure the directory leaves room for the name
+  snprintf(
+    name,
+    sizeof(name),
+    "%s_%lu.%s",
+    rec->cam_name,
+    timestamp,
+    container_exts[rec->container]
+  );
+  snprintf(path, sizeof(path), "%s/%s", rec->dir, name);
+
+  rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (rec->fd == -1) {
+    ret = -errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating recording %s: %s",
+      name,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return ret;
+  }
+
+  uint8_t* io_buf = av_malloc(RECORD_IO_BUF_SIZE);
+  if (io_buf)
+    rec->io = avio_alloc_context(io_buf, RECORD_IO_BUF_SIZE, 1, rec, NULL, write_io, seek_io);
+  if (!rec->io) {
+    av_free(io_buf);
+    log(ERROR, "Failed to allocate recording write buffer");
+    ret = -ENOMEM;
+    goto err;
+  }
+
+  ret = avformat_alloc_output_context2(
+    &rec->fmt,
+    NULL,
+    container_formats[rec->container],
+    path
+  );
+  if (ret < 0) {
+    log(ERROR, "Failed to allocate recording muxer");
+    goto err;
+  }
+  rec->fmt->pb = rec->io;
+
+  AVStream* st = avformat_new_stream(rec->fmt, NULL);
+  if (!st) {
+    ret = -ENOMEM;
+    goto err;
+  }
+  st->time_base = (AVRational){1, 1000000000};
+  st->avg_frame_rate = (AVRational){rec->fps, 1};
+  st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+  st->codecpar->codec_id = AV_CODEC_ID_H264;
+  st->codecpar->width = rec->width;
+  st->codecpar->height = rec->height;
+
+  ret = set_extradata(st->codecpar, keyframe, size);
+  if (ret) {
+    log(ERROR, "Keyframe carries no SPS/PPS to start a recording with");
+    goto err;
+  }
+
+  // fragments keep a segment readable up to its last keyframe if we die
+  AVDictionary* opts = NULL;
+  if (rec->container == RECORD_MP4)
+    av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov", 0);
+  ret = avformat_write_header(rec->fmt, &opts);
+  av_dict_free(&opts);
+  if (ret < 0) {
+    char err[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, err, AV_ERROR_MAX_STRING_SIZE);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing recording header: %s",
+      err
+    );
+    log(ERROR, logstr);
+    goto err;
+  }
+
+  rec->segment_start = timestamp;
+  rec->segments++;
+  return 0;
+
+err:
+  free_segment(rec);
+  unlink(path);
+  return ret;
+}
+
+int recorder_init(
+  struct recorder* rec,
+  const char* dir,
+  const char* cam_name,
+  struct stream_conf* stream_conf
+) {
+  /**
+   * Sets up a recorder, the first segment opens on the first keyframe
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  memset(rec, 0, sizeof(*rec));
+  rec->fd = -1;
+  rec->dir = dir;
+  rec->cam_name = cam_name;
+  rec->container = stream_conf->record_container;
+  rec->width = stream_conf->frame_width;
+  rec->height = stream_conf->frame_height;
+  rec->fps = stream_conf->fps;
+  rec->segment_ns = (uint64_t)(stream_conf->record_segment_sec ?
+                               stream_conf->record_segment_sec :
+                               DEFAULT_RECORD_SEGMENT_SEC) * 1000000000ULL;
+
+  if (rec->container >= RECORD_CONTAINER_COUNT) {
+    log(ERROR, "Unknown recording container");
+    return -EINVAL;
+  }
+
+  rec->pkt = av_packet_alloc();
+  if (!rec->pkt) {
+    log(ERROR, "Failed to allocate recording packet");
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+int recorder_write(
+  struct recorder* rec,
+  uint64_t timestamp,
+  uint8_t* data,
+  uint32_t size
+) {
+  /**
+   * Appends an encoded frame to the current segment, rolling over to a
+   * new one at the first keyframe past the segment duration
+   *
+   * Parameters:
+   * - uint64_t timestamp: capture timestamp, written as the pts
+   *
+   * Returns:
+   * - int: 0 on success, including frames skipped because no segment
+   *   can start on them, or a negative error code
+   */
+  int ret = 0;
+  char logstr[128];
+
+  bool keyframe = is_keyframe(data, size);
+  if (rec->fmt && keyframe && timestamp - rec->segment_start >= rec->segment_ns) {
+    ret = recorder_close_segment(rec);
+    if (ret)
+      return ret;
+  }
+
+  if (!rec->fmt) {
+    if (!keyframe) {
+      rec->skipped++;
+      return 0;
+    }
+
+    ret = open_segment(rec, timestamp, data, size);
+    if (ret)
+      return ret;
+  }
+
+  // the muxers reject timestamps that go backwards
+  if (rec->packets && timestamp <= rec->last_timestamp) {
+    rec->skipped++;
+    return 0;
+  }
+
+  AVStream* st = rec->fmt->streams[0];
+  AVPacket* pkt = rec->pkt;
+  pkt->data = data;
+  pkt->size = size;
+  pkt->stream_index = st->index;
+  pkt->flags = keyframe ? AV_PKT_FLAG_KEY : 0;
+  pkt->pts = av_rescale_q(timestamp, (AVRational){1, 1000000000}, st->time_base);
+  pkt->dts = pkt->pts; // the cameras encode without b-frames
+
+  ret = av_write_frame(rec->fmt, pkt);
+  if (ret < 0) {
+    char err[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, err, AV_ERROR_MAX_STRING_SIZE);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing frame to recording: %s",
+      err
+    );
+    log(ERROR, logstr);
+    return ret;
+  }
+
+  rec->last_timestamp = timestamp;
+  rec->packets++;
+  rec->bytes += size;
+  return 0;
+}
+
+int recorder_close_segment(struct recorder* rec) {
+  /**
+   * Finishes the current segment, if any, and flushes it to disk
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  if (!rec->fmt)
+    return 0;
+
+  int ret = av_write_trailer(rec->fmt);
+  if (ret < 0)
+    log(ERROR, "Error finishing recording segment");
+  else
+    avio_flush(rec->io);
+
+  free_segment(rec);
+  return ret < 0 ? ret : 0;
+}
+
+void recorder_cleanup(struct recorder* rec) {
+  recorder_close_segment(rec);
+  if (rec->pkt)
+    av_packet_free(&rec->pkt);
+}
+
+void* recorder_fn(void* ptr) {
+  /**
+   * Records one camera's stream to disk until it ends or we're stopped
+   */
+  int ret = 0;
+  char logstr[128];
+
+  struct record_ctx* ctx = (struct record_ctx*)ptr;
+
+  struct sigaction sa = {
+    .sa_handler = shutdown_handler,
+    .sa_flags = 0
+  };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+
+  int sockfd = -1;
+  int clientfd = -1;
+  struct wire_rx wire = {0};
+  struct recorder rec = { .fd = -1 };
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(ctx->core, &cpuset);
+  ret = sched_setaffinity(
+    gettid(),
+    sizeof(cpu_set_t),
+    &cpuset
+  );
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error pinning thread %d to core %d, err: %s",
+      gettid(),
+      ctx->core,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    goto err_cleanup;
+  }
+
+  ret = recorder_init(&rec, ctx->dir, ctx->conf->name, ctx->stream_conf);
+  if (ret)
+    goto err_cleanup;
+
+  ret = wire_rx_init(&wire);
+  if (ret)
+    goto err_cleanup;
+
+  sockfd = setup_stream(ctx->conf);
+  if (sockfd < 0)
+    goto err_cleanup;
+
+  /*
+   * A camera whose stream drops, stalls or ends has its segment closed
+   * and goes back to waiting for a connection, while the other cameras
+   * keep recording. Its next segment starts at its first keyframe
+   */
+  while (running && *ctx->main_running) {
+    // timing out just means the camera isn't back yet
+    clientfd = accept_conn(sockfd);
+    if (clientfd < 0)
+      continue;
+
+    while (running && *ctx->main_running) {
+      struct rx_pkt pkt;
+      ret = wire_rx_recv_packet(&wire, clientfd, &pkt, ctx->conf->name);
+      if (ret)
+        break;
+
+      if (pkt.size == 0)
+        break;
+
+      ret = recorder_write(&rec, pkt.timestamp, pkt.data, pkt.size);
+      if (pkt.spilled)
+        wire_spill_put(pkt.data);
+
+      // a failing disk is no better for the other cameras
+      if (ret)
+        goto err_cleanup;
+    }
+
+    close(clientfd);
+    clientfd = -1;
+    wire_rx_reset(&wire);
+    ret = recorder_close_segment(&rec);
+    if (ret)
+      goto err_cleanup;
+
+    // a restarted camera's timestamps may start over
+    rec.last_timestamp = 0;
+
+    if (!running || !*ctx->main_running)
+      break;
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s stopped streaming, waiting for it to reconnect",
+      ctx->conf->name
+    );
+    log(WARNING, logstr);
+  }
+  goto shutdown_cleanup;
+
+err_cleanup:
+  *ctx->main_running = 0;
+
+shutdown_cleanup:
+  recorder_cleanup(&rec);
+  wire_rx_cleanup(&wire);
+  if (sockfd >= 0)
+    close(sockfd);
+  if (clientfd >= 0)
+    close(clientfd);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s recorded %lu frames, %lu MB in %lu segments, skipped %lu",
+    ctx->conf->name,
+    rec.packets,
+    rec.bytes >> 20,
+    rec.segments,
+    rec.skipped
+  );
+  log(INFO, logstr);
+
+  return NULL;
+}
@@ -0,0 +1,104 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "frameset_asm.h"
+#include "frameset_bus.h"
+#include "notify.h"
+#include "shm_layout.h"
+#include "stats.h"
+#include "stream_mgr.h"
+
+#define align_up(offset, align) (((offset) + (align-1)) & ~(align-1))
+
+static uint32_t next_pow2(uint32_t n) {
+  uint32_t pow2 = 1;
+  while (pow2 < n)
+    pow2 <<= 1;
+  return pow2;
+}
+
+size_t shm_layout(
+  struct shm_header* hdr,
+  uint32_t cam_count,
+  uint32_t frame_width,
+  uint32_t frame_height,
+  uint32_t fps,
+  uint32_t frame_bufs_count,
+  uint32_t frameset_slots,
+  uint64_t page_size
+) {
+  /**
+   * Computes the layout of the shared memory segment into hdr
+   *
+   * This is the only place the layout is computed, consumers read the
+   * offsets back out of the header. The ready flag is left clear, and
+   * cam_ids and pixel_format are left for the caller to fill in.
+   *
+   * The total is rounded up to page_size, since hugetlbfs segments can
+   * only be sized and mapped in whole pages.
+   *
+   * Returns:
+   * - size_t: the total size of the segment
+   */
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = SHM_MAGIC;
+  hdr->version = SHM_VERSION;
+  hdr->header_size = sizeof(*hdr);
+  hdr->cam_count = cam_count;
+  hdr->frame_width = frame_width;
+  hdr->frame_height = frame_height;
+  hdr->fps = fps;
+  hdr->frame_bufs_count = frame_bufs_count;
+  hdr->frameset_slots = frameset_slots;
+  hdr->frameset_ring_capacity = next_pow2(frameset_slots);
+  hdr->frame_buf_size = (uint64_t)frame_width * frame_height * 3 / 2;
+  hdr->frame_buf_stride = align_up(hdr->frame_buf_size, SHM_PAGE_ALIGN);
+  hdr->page_size = page_size;
+
+  size_t shm_size = sizeof(*hdr);
+
+  // frame buffers, page aligned so they can be written out with O_DIRECT
+  shm_size = align_up(shm_size, SHM_PAGE_ALIGN);
+  hdr->frame_bufs_offset = shm_size;
+  shm_size += hdr->frame_buf_stride * frame_bufs_count;
+
+  // timestamped structs with frame buffer offsets
+  shm_size = align_up(shm_size, _Alignof(struct ts_frame_buf));
+  hdr->ts_frame_bufs_offset = shm_size;
+  shm_size += sizeof(struct ts_frame_buf) * frame_bufs_count;
+
+  // frameset slots
+  shm_size = align_up(shm_size, _Alignof(struct frameset));
+  hdr->frameset_slots_offset = shm_size;
+  shm_size += sizeof(struct frameset) * frameset_slots;
+
+  // frameset slot reference counts
+  shm_size = align_up(shm_size, _Alignof(struct frameset_ref));
+  hdr->frameset_refs_offset = shm_size;
+  shm_size += sizeof(struct frameset_ref) * frameset_slots;
+
+  // broadcast ring of published frameset slots
+  shm_size = align_up(shm_size, _Alignof(struct frameset_bus));
+  hdr->frameset_bus_offset = shm_size;
+  shm_size += frameset_bus_size(hdr->frameset_ring_capacity);
+
+  // wakes consumers when a frameset is published
+  shm_size = align_up(shm_size, _Alignof(struct notifier));
+  hdr->filled_frameset_notify_offset = shm_size;
+  shm_size += sizeof(struct notifier);
+
+  // wakes the main thread on decoded frames and returned framesets
+  shm_size = align_up(shm_size, _Alignof(struct notifier));
+  hdr->server_notify_offset = shm_size;
+  shm_size += sizeof(struct notifier);
+
+  // counters for monitoring tools, written only by the server
+  shm_size = align_up(shm_size, _Alignof(struct server_stats));
+  hdr->stats_offset = shm_size;
+  shm_size += sizeof(struct server_stats);
+
+  shm_size = align_up(shm_size, page_size);
+  hdr->shm_size = shm_size;
+  return shm_size;
+}
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "shm_seg.h"
+
+#define align_up(offset, align) (((offset) + (align-1)) & ~(align-1))
+
+static void unlink_stale(const char* name) {
+  /**
+   * Removes segments a crashed session left under our name, in every
+   * place a consumer would look, so nobody attaches to a dead one
+   */
+  char path[PATH_MAX];
+
+  FILE* mounts = setmntent("/proc/mounts", "r");
+  if (mounts) {
+    struct mntent* mnt;
+    while ((mnt = getmntent(mounts)) != NULL) {
+      if (strcmp(mnt->mnt_type, "hugetlbfs") != 0)
+        continue;
+
+      snprintf(path, sizeof(path), "%s%s", mnt->mnt_dir, name);
+      unlink(path);
+    }
+    endmntent(mounts);
+  }
+
+  shm_unlink(name);
+}
+
+static int find_hugetlbfs(uint64_t page_size, char* dir, size_t dir_len) {
+  /**
+   * Finds a hugetlbfs mount whose page size matches, hugetlbfs
+   * reports its page size as the block size
+   *
+   * Returns:
+   * - int: 0 with dir set, or -ENOENT
+   */
+  FILE* mounts = setmntent("/proc/mounts", "r");
+  if (!mounts)
+    return -errno;
+
+  int ret = -ENOENT;
+  struct mntent* mnt;
+  while ((mnt = getmntent(mounts)) != NULL) {
+    if (strcmp(mnt->mnt_type, "hugetlbfs") != 0)
+      continue;
+
+    struct statfs sfs;
+    if (statfs(mnt->mnt_dir, &sfs) == -1)
+      continue;
+
+    if ((uint64_t)sfs.f_bsize != page_size)
+      continue;
+
+    snprintf(dir, dir_len, "%s", mnt->mnt_dir);
+    ret = 0;
+    break;
+  }
+
+  endmntent(mounts);
+  return ret;
+}
+
+int shm_seg_open(
+  struct shm_seg* seg,
+  const char* name,
+  uint32_t hugepage_size_mb
+) {
+  /**
+   * Creates the segment's backing file without sizing it, so the
+   * caller can lay it out around the page size before mapping
+   *
+   * Hugepages are best effort, without a hugetlbfs mount for the
+   * requested size this logs a warning and falls back to POSIX shm
+   *
+   * Parameters:
+   * - const char* name: the shm name, starting with a slash
+   * - uint32_t hugepage_size_mb: 2 or 1024, 0 for regular pages
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  seg->fd = -1;
+  seg->buf = NULL;
+  seg->size = 0;
+  seg->page_size = sysconf(_SC_PAGESIZE);
+  seg->name = name;
+  seg->hugetlb_path[0] = '\0';
+
+  unlink_stale(name);
+
+  if (hugepage_size_mb) {
+    uint64_t page_size = (uint64_t)hugepage_size_mb << 20;
+    char dir[PATH_MAX];
+
+    int ret = find_hugetlbfs(page_size, dir, sizeof(dir));
+    if (ret == 0) {
+      snprintf(seg->hugetlb_path, sizeof(seg->hugetlb_path), "%s%s", dir, name);
+      seg->fd = open(seg->hugetlb_path, O_CREAT | O_RDWR | O_EXCL, 0666);
+      if (seg->fd >= 0) {
+        seg->page_size = page_size;
+        return 0;
+      }
+
+      // mount points are short, and a long one is cut to leave the error room
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error creating hugepage segment in %.64s: %s",
+        dir,
+        strerror(errno)
+      );
+      log(WARNING, logstr);
+      seg->hugetlb_path[0] = '\0';
+    } else {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "No hugetlbfs mount with %u MB pages, using regular pages",
+        hugepage_size_mb
+      );
+      log(WARNING, logstr);
+    }
+  }
+
+  seg->fd = shm_open(
+    name,
+    O_CREAT | O_RDWR,
+    0666
+  );
+  if (seg->fd == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  return 0;
+}
+
+int shm_seg_map(
+  struct shm_seg* seg,
+  size_t size,
+  bool lock
+) {
+  /**
+   * Sizes and maps the segment
+   *
+   * Hugepage segments are always prefaulted, the pages are reserved
+   * at map time anyway and faulting them in here keeps the cost out
+   * of the first frames. Locking prefaults regular pages too and keeps
+   * them resident, and is best effort since it is bound by
+   * RLIMIT_MEMLOCK
+   *
+   * Parameters:
+   * - size_t size: the size of the layout, rounded up to the page size
+   * - bool lock: whether to prefault and mlock the segment
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  size = align_up(size, seg->page_size);
+
+  int ret = ftruncate(seg->fd, size);
+  if (ret == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error sizing shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  int flags = MAP_SHARED;
+  if (seg->hugetlb_path[0] || lock)
+    flags |= MAP_POPULATE;
+
+  uint8_t* buf = mmap(
+    NULL,
+    size,
+    PROT_READ | PROT_WRITE,
+    flags,
+    seg->fd,
+    0
+  );
+  if (buf == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+  seg->buf = buf;
+  seg->size = size;
+
+  if (lock && mlock(buf, size) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error locking %zu MB of shared memory: %s",
+      size >> 20,
+      strerror(errno)
+    );
+    log(WARNING, logstr);
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Mapped %zu MB of shared memory on %zu KB pages",
+    size >> 20,
+    seg->page_size >> 10
+  );
+  log(INFO, logstr);
+
+  return 0;
+}
+
+void shm_seg_close(struct shm_seg* seg) {
+  if (seg->buf)
+    munmap(seg->buf, seg->size);
+
+  if (seg->fd >= 0) {
+    close(seg->fd);
+
+    if (seg->hugetlb_path[0])
+      unlink(seg->hugetlb_path);
+    else
+      shm_unlink(seg->name);
+  }
+
+  seg->buf = NULL;
+  seg->fd = -1;
+}
@@ -0,0 +1,73 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_pool.h"
+#include "frameset_asm.h"
+#include "frameset_bus.h"
+#include "stats.h"
+
+void stats_init(struct server_stats* stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void stats_refresh(
+  struct server_stats* stats,
+  struct frameset_asm* fa,
+  struct frame_pool* pool,
+  struct frameset_pub* pub
+) {
+  /**
+   * Copies the main thread's private state into the stats region
+   *
+   * Assembly and publishing state is only ever touched by the main
+   * thread, so rather than writing shared memory per frame, it is
+   * published here every STATS_INTERVAL
+   */
+  for (uint32_t i = 0; i < fa->cam_count; i++) {
+    struct cam_stats* cam = &stats->cams[i];
+    struct cam_pool_state* pool_cam = &pool->cams[i];
+
+    // last_idx is the newest frame index seen + 1, 0 while unset
+    uint64_t last_capture = fa->last_idx[i] ?
+                            fa->t0 + (fa->last_idx[i] - 1) * fa->interval :
+                            0;
+
+    stat_set(&cam->frames, fa->stats[i].frames);
+    stat_set(&cam->dropped, fa->stats[i].dropped);
+    stat_set(&cam->late, fa->stats[i].late);
+    stat_set(&cam->pool_denied, atomic_load_explicit(&pool_cam->dropped, memory_order_relaxed));
+    stat_set(&cam->last_capture, last_capture);
+    atomic_store_explicit(
+      &cam->held,
+      atomic_load_explicit(&pool_cam->held, memory_order_relaxed),
+      memory_order_relaxed
+    );
+  }
+
+  stat_set(&stats->published, atomic_load_explicit(&pub->bus->head, memory_order_relaxed));
+  stat_set(&stats->complete_framesets, fa->complete_framesets);
+  stat_set(&stats->partial_framesets, fa->partial_framesets);
+  stat_set(&stats->expired_framesets, fa->expired_framesets);
+  stat_set(&stats->reaped_subscribers, pub->reaped_subscribers);
+  atomic_store_explicit(
+    &stats->pool_free,
+    atomic_load_explicit(&pool->free_count, memory_order_relaxed),
+    memory_order_relaxed
+  );
+  atomic_store_explicit(&stats->inflight_framesets, pub->inflight_count, memory_order_relaxed);
+
+  uint32_t held[MAX_SUBSCRIBERS];
+  frameset_pub_held(pub, held);
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++)
+    atomic_store_explicit(&stats->sub_held[i], held[i], memory_order_relaxed);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  atomic_store_explicit(
+    &stats->updated,
+    ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+    memory_order_release
+  );
+}
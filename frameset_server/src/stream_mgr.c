@@ -11,18 +11,65 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "queue.h"
+#include "frame_pool.h"
 #include "logging.h"
 #include "network.h"
+#include "notify.h"
+#include "placement.h"
+#include "shm_layout.h"
+#include "stats.h"
 #include "stream_mgr.h"
+#include "trace.h"
+#include "udp_rx.h"
+#include "uring_rx.h"
 #include "viddec.h"
+#include "wire.h"
 
-#define TS_Q_INIT_SIZE 8
-#define EMPTY_Q_WAIT 10000 // 0.01 ms
 
 static volatile sig_atomic_t running = 1;
 
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct rx_stats {
+  uint64_t frames;
+  uint64_t syscalls;
+};
+
+/**
+ * A camera thread's receive and decode state, which outlives each
+ * connection so a camera can reconnect into it
+ */
+struct cam_stream {
+  struct thread_ctx* ctx;
+  decoder viddec;
+  struct wire_rx wire;
+  struct uring_rx uring;
+  struct udp_rx udp;
+  struct wire_seq seq;
+  bool use_uring;
+  bool use_udp; // clientfd is the UDP socket, which outlives the stream
+  int clientfd;
+  struct ts_frame_buf* current_buf; // pool buffer the next frame is decoded into, unless zero copy
+  uint8_t* scratch_frame_buf; // frames the pool has no buffer for are decoded here and dropped
+  struct rx_stats rx_stats;
+  uint64_t syscalls_counted; // of rx_syscalls, already added to the stats region
+};
+
 static void shutdown_handler(int signum);
+static void interrupt_handler(int signum);
+static int receive_stream(struct cam_stream* stream);
+static void close_stream(struct cam_stream* stream);
+static void note_losses(struct cam_stream* stream, struct rx_pkt* pkt);
+static uint64_t rx_syscalls(struct cam_stream* stream);
+static void log_rx_stats(
+  const char* cam_name,
+  const char* backend,
+  struct rx_stats* stats
+);
 
 void* stream_mgr_fn(void* ptr) {
   int ret = 0;
@@ -35,17 +82,57 @@ void* stream_mgr_fn(void* ptr) {
   sigemptyset(&sa.sa_mask);
   sigaction(SIGUSR2, &sa, NULL);
 
-  int sockfd = -1;
-  int clientfd = -1;
+  // without SA_RESTART, so it breaks the thread out of whatever it's blocked in
+  struct sigaction stop_sa = {
+    .sa_handler = interrupt_handler,
+    .sa_flags = 0
+  };
+  sigemptyset(&stop_sa.sa_mask);
+  sigaction(CAM_STOP_SIGNAL, &stop_sa, NULL);
 
+  int sockfd = -1;
+  int udpfd = -1;
   struct thread_ctx* ctx = (struct thread_ctx*)ptr;
-
-  uint8_t* enc_frame_buf = malloc(ENCODED_FRAME_BUF_SIZE);
-  if (!enc_frame_buf) {
-    log(ERROR, "Failed to allocate encoded frame buffer in a thread");
+  struct cam_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.ctx = ctx;
+  stream.clientfd = -1;
+
+  size_t frame_buf_size = ctx->stream_conf->frame_width * ctx->stream_conf->frame_height * 3 / 2;
+  stream.scratch_frame_buf = malloc(frame_buf_size);
+  if (!stream.scratch_frame_buf) {
+    log(ERROR, "Failed to allocate scratch frame buffer in a thread");
+    ret = -ENOMEM;
     goto err_cleanup;
   }
 
+  char trace_name[16];
+  snprintf(trace_name, sizeof(trace_name), "cam-%s", ctx->conf->name);
+  trace_thread(trace_name, 1);
+
+  struct decoder_sink sink = {
+    .pool = ctx->pool,
+    .shm_base = ctx->shm_base,
+    .frame_buf_stride = ((struct shm_header*)ctx->shm_base)->frame_buf_stride,
+    .cam_idx = ctx->cam_idx
+  };
+  // the decoder's frame threads inherit the mask it's set up under,
+  // so they get the whole placement and this thread pins itself after
+  ret = placement_allow_all(ctx->placement);
+  if (ret)
+    goto err_cleanup;
+
+  ret = init_decoder(
+    &stream.viddec,
+    ctx->stream_conf->frame_width,
+    ctx->stream_conf->frame_height,
+    ctx->stream_conf->decoder_backend,
+    ctx->stream_conf->decoder_threads,
+    ctx->stream_conf->zero_copy_decode ? &sink : NULL
+  );
+  if (ret)
+    goto err_cleanup;
+
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
   CPU_SET(ctx->core, &cpuset);
@@ -68,190 +155,334 @@ void* stream_mgr_fn(void* ptr) {
     goto err_cleanup;
   }
 
-  queue timestamp_queue;
-  ret = init_queue(
-    &timestamp_queue,
-    sizeof(uint64_t),
-    TS_Q_INIT_SIZE
-  );
-  if (ret)
-    goto err_cleanup;
-
-  decoder viddec;
-  ret = init_decoder(
-    &viddec,
-    ctx->stream_conf->frame_width,
-    ctx->stream_conf->frame_height
-  );
-  if (ret)
-    goto err_cleanup;
-
   sockfd = setup_stream(ctx->conf);
   if (sockfd < 0) {
     ret = -EIO;
     goto err_cleanup;
   }
 
-  clientfd = accept_conn(sockfd);
-  if (clientfd < 0) {
-    ret = -EIO;
+  ret = wire_rx_init(&stream.wire);
+  if (ret)
     goto err_cleanup;
+
+  // the camera's config picks its transport, TCP keeps working without UDP
+  uint64_t jitter_ns = ctx->stream_conf->udp_jitter_ms ?
+                       ctx->stream_conf->udp_jitter_ms * 1000000ULL :
+                       1000000000ULL / ctx->stream_conf->fps;
+  udpfd = setup_udp_stream(ctx->conf);
+  if (udpfd >= 0 &&
+      udp_rx_init(&stream.udp, udpfd, jitter_ns, ctx->conf->eth_ip, ctx->conf->wifi_ip)) {
+    close(udpfd);
+    udpfd = -1;
   }
 
-  struct ts_frame_buf* current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
+  // a zero copy decoder takes its own buffers from the pool
+  if (!stream.viddec.zero_copy)
+    stream.current_buf = frame_pool_get(ctx->pool, ctx->cam_idx);
+
+  /*
+   * A camera whose stream drops, stalls or ends goes back to waiting
+   * for a connection. It misses the framesets until it reconnects and
+   * sends a keyframe, while the other cameras keep streaming
+   */
+  while (running && *ctx->main_running && !ctx->stop) {
+    // timing out just means the camera isn't back yet
+    stream.clientfd = accept_stream(sockfd, udpfd, &stream.use_udp);
+    if (stream.clientfd < 0)
+      continue;
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      stream.use_udp ? "Camera %s streaming over UDP" : "Camera %s connected",
+      ctx->conf->name
+    );
+    log(INFO, logstr);
+
+    ret = receive_stream(&stream);
+    close_stream(&stream);
+    if (ret == -EINTR)
+      continue;
+
+    if (ret == 0) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %s ended its stream, waiting for it to reconnect",
+        ctx->conf->name
+      );
+      log(INFO, logstr);
+      continue;
+    }
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s stream failed: %s, waiting for it to reconnect",
+      ctx->conf->name,
+      strerror(ret < 0 ? -ret : ret)
+    );
+    log(WARNING, logstr);
+    trace_error(logstr);
+  }
+  goto shutdown_cleanup;
+
+err_cleanup:
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s failed to start streaming: %s",
+    ctx->conf->name,
+    strerror(ret < 0 ? -ret : ret)
+  );
+  log(ERROR, logstr);
+  trace_error(logstr);
+
+shutdown_cleanup:
+  stream.rx_stats.syscalls = rx_syscalls(&stream);
+  log_rx_stats(
+    ctx->conf->name,
+    stream.use_udp ? "udp" : stream.use_uring ? "io_uring" : "recv",
+    &stream.rx_stats
+  );
+
+  wire_rx_cleanup(&stream.wire);
+  udp_rx_cleanup(&stream.udp);
+  if (udpfd >= 0)
+    close(udpfd);
+  if (stream.scratch_frame_buf)
+    free(stream.scratch_frame_buf);
+  if (stream.current_buf)
+    frame_pool_put(ctx->pool, ctx->cam_idx, stream.current_buf);
+  cleanup_decoder(&stream.viddec);
+  if (sockfd >= 0)
+    close(sockfd);
+
+  return NULL;
+}
+
+static int receive_stream(struct cam_stream* stream) {
+  /**
+   * Receives and decodes a connected camera's stream until it ends
+   *
+   * Returns:
+   * - int: 0 once the camera ended its stream and every frame is out of
+   *   the decoder, -EINTR when interrupted or stopped, or a negative
+   *   errno or decoder error when the stream failed
+   */
+  struct thread_ctx* ctx = stream->ctx;
+  decoder* viddec = &stream->viddec;
+  int ret = 0;
+
+  stream->use_uring = false;
+  if (ctx->stream_conf->uring_rx && !stream->use_udp) {
+    ret = uring_rx_init(&stream->uring, stream->clientfd);
+    if (ret)
+      log(WARNING, "Falling back to recv for the camera stream");
+    stream->use_uring = ret == 0;
+  }
 
-  uint32_t dequeue_retry_counter = 0;
   bool incoming_stream = true;
-  while (running && ctx->main_running) {
+  while (running && *ctx->main_running && !ctx->stop) {
     if (incoming_stream) {
-      uint64_t timestamp = 0;
-      ssize_t pkt_size = recv_from_stream(
-        clientfd,
-        (char*)&timestamp,
-        sizeof(timestamp)
-      );
+      struct rx_pkt pkt;
+      uint64_t trace_start = trace_begin();
+      if (stream->use_udp)
+        ret = udp_rx_recv_packet(&stream->udp, &pkt);
+      else if (stream->use_uring)
+        ret = uring_rx_next(&stream->uring, &pkt);
+      else
+        ret = wire_rx_recv_packet(&stream->wire, stream->clientfd, &pkt, ctx->conf->name);
+      if (ret)
+        return ret;
+      trace_end(TRACE_RECV, ctx->cam_idx, pkt.timestamp, trace_start);
+      note_losses(stream, &pkt);
 
-      if (pkt_size != sizeof(timestamp)) {
-        if (errno == -EINTR)
-          goto shutdown_cleanup;
-
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received unexpected timestamp size %zd from cam %s",
-          pkt_size,
-          ctx->conf->name
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
+      uint64_t syscalls = rx_syscalls(stream);
+      stat_add(&ctx->stats->recv_syscalls, syscalls - stream->syscalls_counted);
+      stream->syscalls_counted = syscalls;
 
-      if (memcmp(&timestamp, "EOSTREAM", 8) == 0) {
+      if (pkt.size == 0) {
         incoming_stream = false;
-        ret = flush_decoder(&viddec);
+        ret = flush_decoder(viddec);
         if (ret)
-          goto shutdown_cleanup;
+          return ret;
 
         continue;
       }
 
-      ret = enqueue(&timestamp_queue, (void*)&timestamp);
-      if (ret)
-        goto err_cleanup;
+      stat_add(&ctx->stats->bytes, pkt.size);
+      stat_add(&ctx->stats->packets, 1);
 
-      uint32_t frame_size = 0;
-      pkt_size = recv_from_stream(
-        clientfd,
-        (char*)&frame_size,
-        sizeof(frame_size)
+      uint64_t decode_start = now_ns();
+      ret = decode_packet(
+        viddec,
+        pkt.data,
+        pkt.size,
+        pkt.timestamp
       );
+      trace_end(TRACE_DECODE_SUBMIT, ctx->cam_idx, pkt.timestamp, decode_start);
+      stat_add(&ctx->stats->decode_ns, now_ns() - decode_start);
+      stat_add(&ctx->stats->decoded_packets, 1);
+      if (pkt.spilled)
+        wire_spill_put(pkt.data);
+      if (ret)
+        return ret;
 
-      if (pkt_size != sizeof(frame_size)) {
-        if (errno == -EINTR)
-          goto shutdown_cleanup;
-
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received unexpected frame size %ld from cam %s",
-          pkt_size,
-          ctx->conf->name
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
-
-      if (frame_size > ENCODED_FRAME_BUF_SIZE) {
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received frame size that is larger than the allocated buffer of %d bytes: %d",
-          ENCODED_FRAME_BUF_SIZE,
-          frame_size
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
-      }
+      stream->rx_stats.frames++;
+    }
 
-      pkt_size = recv_from_stream(
-        clientfd,
-        (char*)enc_frame_buf,
-        frame_size
+    struct ts_frame_buf* frame = NULL;
+    uint64_t timestamp;
+    uint64_t recv_start = now_ns();
+    if (viddec->zero_copy) {
+      ret = recv_pool_frame(viddec, &frame, &timestamp);
+    } else {
+      ret = recv_frame(
+        viddec,
+        stream->current_buf ?
+          ctx->shm_base + stream->current_buf->frame_offset :
+          stream->scratch_frame_buf,
+        &timestamp
       );
-
-      if (pkt_size != frame_size) {
-        if (errno == -EINTR)
-          goto shutdown_cleanup;
-
-        snprintf(
-          logstr,
-          sizeof(logstr),
-          "Received unexpected frame size with %zd bytes from cam %s",
-          pkt_size,
-          ctx->conf->name
-        );
-        log(ERROR, logstr);
-        goto err_cleanup;
+      if (ret == 0) {
+        frame = stream->current_buf;
+        stream->current_buf = frame_pool_get(ctx->pool, ctx->cam_idx);
       }
+    }
+    stat_add(&ctx->stats->decode_ns, now_ns() - recv_start);
+    if (ret == 0)
+      trace_end(TRACE_DECODE_OUTPUT, ctx->cam_idx, timestamp, recv_start);
 
-      ret = decode_packet(
-        &viddec,
-        enc_frame_buf,
-        frame_size
-      );
-      if (ret)
-        goto err_cleanup;
+    if (ret == EAGAIN || ret == ENOENT) {
+      continue;
+    } else if (ret == ENODATA) {
+      return 0;
+    } else if (ret) {
+      return ret;
+    } else if (frame) {
+      frame->timestamp = timestamp;
+      spsc_enqueue_notify(ctx->filled_bufs, ctx->filled_notify, (void*)frame);
     }
+  }
 
-    ret = recv_frame(
-      &viddec,
-      current_buf->frame_buf
+  return -EINTR;
+}
+
+static void close_stream(struct cam_stream* stream) {
+  /**
+   * Drops a camera's connection, leaving the parser and the decoder
+   * ready for its next one
+   */
+  char logstr[128];
+
+  if (stream->use_udp) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s udp frames given up on: %lu, stale fragments: %lu, foreign datagrams: %lu",
+      stream->ctx->conf->name,
+      stream->udp.expired,
+      stream->udp.stale,
+      stream->udp.foreign
     );
+    log(INFO, logstr);
 
-    if (ret == EAGAIN) {
-      continue;
-    } else if (ret) {
-      goto err_cleanup;
-    } else {
-      dequeue(&timestamp_queue, (void*)&current_buf->timestamp);
-      spsc_enqueue(ctx->filled_bufs, (void*)current_buf);
-
-      current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
-      while (!current_buf && running) {
-        if (++dequeue_retry_counter >= ctx->stream_conf->fps) {
-          log(ERROR, "Worker thread ran out of empty frame dequeue retries");
-          running = 0;
-          goto err_cleanup;
-        }
-        struct timespec ts = {
-          .tv_sec = 0,
-          .tv_nsec = EMPTY_Q_WAIT
-        };
-        nanosleep(&ts, NULL);
-        current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
-      }
+    udp_rx_reset(&stream->udp);
+    stream->clientfd = -1;
+    reset_decoder(&stream->viddec);
+    return;
+  }
 
-      dequeue_retry_counter = 0;
-    }
+  if (stream->use_uring) {
+    stream->rx_stats.syscalls += stream->uring.syscalls;
+    stream->uring.syscalls = 0;
+    uring_rx_cleanup(&stream->uring);
   }
 
-err_cleanup:
-  ctx->main_running = 0;
+  close(stream->clientfd);
+  stream->clientfd = -1;
+  wire_rx_reset(&stream->wire);
+  reset_decoder(&stream->viddec);
+}
 
-shutdown_cleanup:
-  if (enc_frame_buf)
-    free(enc_frame_buf);
-  cleanup_decoder(&viddec);
-  cleanup_queue(&timestamp_queue);
-  if (sockfd >= 0)
-    close(sockfd);
-  if (clientfd >= 0)
-    close(clientfd);
+static void note_losses(struct cam_stream* stream, struct rx_pkt* pkt) {
+  /**
+   * Counts the packets lost before this one, and has the decoder pick
+   * the stream back up at the next keyframe if there were any
+   */
+  char logstr[128];
+  struct thread_ctx* ctx = stream->ctx;
 
-  return NULL;
+  uint32_t lost = wire_seq_lost(&stream->seq, pkt, ctx->conf->id, ctx->conf->name);
+  if (lost) {
+    stat_add(&ctx->stats->lost, lost);
+    resync_decoder(&stream->viddec);
+  }
+
+  // over TCP the camera only sends a keyframe once it reconnects
+  if (stream->use_udp && stream->viddec.resyncing && !(pkt->flags & WIRE_FLAG_KEYFRAME))
+    udp_rx_request_keyframe(&stream->udp, ctx->conf->udp_port);
+
+  if (pkt->corrupt) {
+    stat_add(&ctx->stats->corrupt, pkt->corrupt);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s stream was corrupt, skipped to its next valid record",
+      ctx->conf->name
+    );
+    log(WARNING, logstr);
+  }
+}
+
+static uint64_t rx_syscalls(struct cam_stream* stream) {
+  /**
+   * Returns the receive syscalls the camera's streams took so far,
+   * whichever backend received them
+   */
+  uint64_t syscalls = stream->rx_stats.syscalls + stream->wire.recvs + stream->udp.recvs;
+  if (stream->use_uring)
+    syscalls += stream->uring.syscalls;
+
+  return syscalls;
+}
+
+static void log_rx_stats(
+  const char* cam_name,
+  const char* backend,
+  struct rx_stats* stats
+) {
+  /**
+   * Logs receive syscalls and thread cpu time per frame, so the recv
+   * and io_uring backends can be compared by running the same stream
+   * with uring_rx toggled
+   */
+  char logstr[128];
+
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  uint64_t cpu_ns = cpu.tv_sec * 1000000000ULL + cpu.tv_nsec;
+  uint64_t frames = stats->frames ? stats->frames : 1;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s %s rx frames: %lu, syscalls/frame: %.2f, cpu us/frame: %.1f",
+    cam_name,
+    backend,
+    stats->frames,
+    (double)stats->syscalls / frames,
+    cpu_ns / 1000.0 / frames
+  );
+  log(INFO, logstr);
 }
 
 static void shutdown_handler(int signum) {
   (void)signum;
   running = 0;
 }
+
+static void interrupt_handler(int signum) {
+  (void)signum;
+}
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "trace.h"
+
+#define TRACE_MIN_RING_EVENTS 1024
+#define TRACE_PATH_LEN 256
+
+_Thread_local struct trace_ring* thread_trace;
+
+static struct trace_ring rings[TRACE_MAX_THREADS];
+static pthread_key_t ring_key;
+static _Atomic bool error_dumped; // only the first error is worth a flight recording
+static bool enabled;
+static char trace_path[TRACE_PATH_LEN];
+static uint64_t window_ns;
+static uint64_t frame_events; // per camera handled, per second of window
+static struct cam_conf* cams;
+static uint32_t cams_count;
+
+static const char* stage_names[] = {
+  "recv",
+  "decode submit",
+  "decode output",
+  "assemble",
+  "publish"
+};
+
+static void release_ring(void* ptr) {
+  struct trace_ring* ring = (struct trace_ring*)ptr;
+  atomic_store(&ring->state, TRACE_RING_RELEASED);
+}
+
+static struct trace_ring* claim_ring(uint64_t capacity) {
+  /**
+   * Takes a ring no live thread owns, either never used or released
+   * by an exited thread with room for capacity events
+   */
+  for (uint32_t i = 0; i < TRACE_MAX_THREADS; i++) {
+    struct trace_ring* ring = &rings[i];
+
+    uint32_t expected = atomic_load(&ring->state);
+    if (expected == TRACE_RING_OWNED)
+      continue;
+    if (expected == TRACE_RING_RELEASED && ring->mask + 1 < capacity)
+      continue;
+    if (!atomic_compare_exchange_strong(&ring->state, &expected, TRACE_RING_OWNED))
+      continue;
+
+    return ring;
+  }
+
+  return NULL;
+}
+
+int trace_init(
+  const char* path,
+  uint32_t seconds,
+  uint32_t fps,
+  struct cam_conf* confs,
+  uint32_t cam_count
+) {
+  /**
+   * Enables tracing for the threads that register afterwards
+   *
+   * The trace covers the last seconds of the session, and is written
+   * as Chrome trace event JSON, which Perfetto and chrome://tracing
+   * both open, to path on a clean stop and to path.error on the first
+   * error.
+   *
+   * Returns:
+   * - int: 0 on success, -ENAMETOOLONG, or a negative errno
+   */
+  if (strlen(path) >= TRACE_PATH_LEN) {
+    log(ERROR, "Trace path is too long");
+    return -ENAMETOOLONG;
+  }
+  strcpy(trace_path, path);
+
+  int ret = pthread_key_create(&ring_key, release_ring);
+  if (ret) {
+    log(ERROR, "Failed to create the trace ring key");
+    return -ret;
+  }
+
+  if (!seconds)
+    seconds = TRACE_DEFAULT_SECONDS;
+  window_ns = seconds * 1000000000ULL;
+  frame_events = (uint64_t)seconds * fps * TRACE_EVENTS_PER_FRAME;
+  cams = confs;
+  cams_count = cam_count;
+  enabled = true;
+
+  return 0;
+}
+
+int trace_thread(const char* name, uint32_t cams_handled) {
+  /**
+   * Gives the calling thread a ring sized to hold the trace window for
+   * the cameras it handles, a no-op unless tracing is enabled
+   *
+   * The ring is released when the thread exits, so threads coming and
+   * going with config reloads don't run out of them.
+   *
+   * Returns:
+   * - int: 0 on success, -ENOSPC with TRACE_MAX_THREADS rings taken or
+   *   -ENOMEM
+   */
+  if (!enabled)
+    return 0;
+
+  uint64_t wanted = frame_events * (cams_handled ? cams_handled : 1);
+  uint64_t capacity = TRACE_MIN_RING_EVENTS;
+  while (capacity < wanted)
+    capacity <<= 1;
+
+  struct trace_ring* ring = claim_ring(capacity);
+  if (!ring) {
+    log(WARNING, "Out of trace rings, a thread won't be traced");
+    return -ENOSPC;
+  }
+
+  // hidden from dumps while it changes hands, the events stay where they are
+  atomic_store(&ring->ready, false);
+  if (!ring->events) {
+    ring->events = calloc(capacity, sizeof(struct trace_event));
+    if (!ring->events) {
+      atomic_store(&ring->state, TRACE_RING_FREE);
+      log(ERROR, "Failed to allocate a trace ring");
+      return -ENOMEM;
+    }
+    ring->mask = capacity - 1;
+  }
+  ring->base = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ring->tid = gettid();
+  snprintf(ring->name, sizeof(ring->name), "%s", name);
+  atomic_store_explicit(&ring->ready, true, memory_order_release);
+
+  thread_trace = ring;
+  pthread_setspecific(ring_key, ring);
+  return 0;
+}
+
+static bool read_event(
+  struct trace_ring* ring,
+  uint64_t idx,
+  struct trace_event* out
+) {
+  /**
+   * Copies out an event the owner may be overwriting, and reports
+   * whether the copy is whole
+   *
+   * The slot is only reused once head passes idx + capacity, so
+   * rereading head after the copy tells whether it could have been
+   */
+  *out = ring->events[idx & ring->mask];
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  return idx + ring->mask + 1 > head;
+}
+
+static void write_event(
+  FILE* f,
+  pid_t pid,
+  struct trace_ring* ring,
+  struct trace_event* ev
+) {
+  fprintf(
+    f,
+    ",\n{\"name\":\"%s\",\"cat\":\"server\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+    "\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"args\":{",
+    ev->stage < TRACE_STAGE_COUNT ? stage_names[ev->stage] : "unknown",
+    pid,
+    ring->tid,
+    ev->start / 1000,
+    ev->start % 1000,
+    (ev->end - ev->start) / 1000,
+    (ev->end - ev->start) % 1000
+  );
+
+  if (ev->cam < cams_count)
+    fprintf(f, "\"cam\":\"%s\"%s", cams[ev->cam].name, ev->frame_ts ? "," : "");
+  if (ev->frame_ts)
+    fprintf(f, "\"frame\":%lu", ev->frame_ts);
+  fputs("}}", f);
+}
+
+static int trace_dump(const char* path, const char* reason) {
+  /**
+   * Writes every thread's events from the last window of the session,
+   * which threads may still be recording into
+   *
+   * The window ends at the newest event of any thread, so a dump after
+   * a quiet period still shows what led up to it
+   */
+  char logstr[128];
+
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening trace file %s: %s",
+      path,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  pid_t pid = getpid();
+
+  uint64_t newest = 0;
+  for (uint32_t i = 0; i < TRACE_MAX_THREADS; i++) {
+    struct trace_ring* ring = &rings[i];
+    if (!atomic_load_explicit(&ring->ready, memory_order_acquire))
+      continue;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    struct trace_event ev;
+    if (head > ring->base && read_event(ring, head - 1, &ev) && ev.end > newest)
+      newest = ev.end;
+  }
+  uint64_t cutoff = newest > window_ns ? newest - window_ns : 0;
+
+  fprintf(
+    f,
+    "{\"otherData\":{\"reason\":\"%s\"},\"displayTimeUnit\":\"ms\",\"traceEvents\":["
+    "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"mocap-toolkit-server\"}}",
+    reason,
+    pid
+  );
+
+  uint64_t written = 0;
+  for (uint32_t i = 0; i < TRACE_MAX_THREADS; i++) {
+    struct trace_ring* ring = &rings[i];
+    if (!atomic_load_explicit(&ring->ready, memory_order_acquire))
+      continue;
+
+    fprintf(
+      f,
+      ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+      pid,
+      ring->tid,
+      ring->name
+    );
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t capacity = ring->mask + 1;
+    uint64_t idx = head > ring->base + capacity ? head - capacity : ring->base;
+    for (; idx < head; idx++) {
+      struct trace_event ev;
+      if (!read_event(ring, idx, &ev) || ev.end < cutoff)
+        continue;
+
+      write_event(f, pid, ring, &ev);
+      written++;
+    }
+  }
+
+  fputs("\n]}\n", f);
+  int ret = fclose(f) ? -errno : 0;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Wrote %lu trace events to %s",
+    written,
+    path
+  );
+  log(ret ? ERROR : INFO, logstr);
+  return ret;
+}
+
+void trace_error(const char* reason) {
+  /**
+   * Dumps the flight recording once, from the first thread to hit an
+   * error, while the rest of the pipeline keeps running
+   */
+  if (!enabled || atomic_exchange(&error_dumped, true))
+    return;
+
+  char path[TRACE_PATH_LEN + sizeof(".error")];
+  snprintf(path, sizeof(path), "%s.error", trace_path);
+  trace_dump(path, reason);
+}
+
+void trace_stop() {
+  if (enabled)
+    trace_dump(trace_path, "stop");
+}
+
+void trace_cleanup() {
+  /**
+   * Frees every ring, once the threads recording into them are joined
+   */
+  if (!enabled)
+    return;
+
+  for (uint32_t i = 0; i < TRACE_MAX_THREADS; i++) {
+    free(rings[i].events);
+    memset(&rings[i], 0, sizeof(rings[i]));
+  }
+
+  pthread_key_delete(ring_key);
+  enabled = false;
+}
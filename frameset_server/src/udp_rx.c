@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "logging.h"
+#include "udp_rx.h"
+#include "wire.h"
+
+#define SLOT_MASK (UDP_RX_SLOTS - 1)
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int udp_rx_init(
+  struct udp_rx* rx,
+  int fd,
+  uint64_t jitter_ns,
+  struct in_addr eth_ip,
+  struct in_addr wifi_ip
+) {
+  /**
+   * Sets up reassembly for the datagrams arriving on fd from either of
+   * the camera's addresses, giving up on a frame jitter_ns after its
+   * first fragment arrives
+   *
+   * The frame slots are a lazy reservation, so each only takes up
+   * memory for the largest frame that has landed in it.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  memset(rx, 0, sizeof(*rx));
+  rx->fd = fd;
+  rx->jitter_ns = jitter_ns;
+  rx->cam_ips[0] = eth_ip;
+  rx->cam_ips[1] = wifi_ip;
+
+  size_t frame_mem_size = (size_t)UDP_RX_SLOTS * WIRE_MAX_PAYLOAD;
+  size_t dgram_mem_size = (size_t)UDP_RX_BATCH * UDP_RX_DGRAM_SIZE;
+  rx->frame_mem = mmap(
+    NULL,
+    frame_mem_size + dgram_mem_size,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+    -1,
+    0
+  );
+  if (rx->frame_mem == MAP_FAILED) {
+    rx->frame_mem = NULL;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error reserving udp frame slots: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  for (uint32_t i = 0; i < UDP_RX_SLOTS; i++)
+    rx->frames[i].data = rx->frame_mem + (size_t)i * WIRE_MAX_PAYLOAD;
+
+  rx->dgrams = rx->frame_mem + frame_mem_size;
+  for (uint32_t i = 0; i < UDP_RX_BATCH; i++) {
+    rx->iovs[i].iov_base = rx->dgrams + (size_t)i * UDP_RX_DGRAM_SIZE;
+    rx->iovs[i].iov_len = UDP_RX_DGRAM_SIZE;
+    rx->msgs[i].msg_hdr.msg_iov = &rx->iovs[i];
+    rx->msgs[i].msg_hdr.msg_iovlen = 1;
+    rx->msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+  }
+
+  return 0;
+}
+
+void udp_rx_cleanup(struct udp_rx* rx) {
+  if (rx->frame_mem) {
+    munmap(
+      rx->frame_mem,
+      (size_t)UDP_RX_SLOTS * WIRE_MAX_PAYLOAD + (size_t)UDP_RX_BATCH * UDP_RX_DGRAM_SIZE
+    );
+  }
+  rx->frame_mem = NULL;
+}
+
+void udp_rx_reset(struct udp_rx* rx) {
+  /**
+   * Forgets the stream in progress, for the camera's next one
+   *
+   * Datagrams still queued on the socket are left to be parsed, a
+   * restarted camera's sequence numbers tell them apart.
+   */
+  for (uint32_t i = 0; i < UDP_RX_SLOTS; i++)
+    rx->frames[i].used = false;
+
+  rx->next_valid = false;
+  rx->ended = false;
+}
+
+static int parse_frag(
+  const uint8_t* buf,
+  uint32_t len,
+  struct wire_hdr* hdr,
+  uint16_t* idx,
+  uint16_t* count
+) {
+  /**
+   * Parses and checks a fragment's header against its CRC and its
+   * length
+   *
+   * Returns:
+   * - int: 0 on success, or -EBADMSG
+   */
+  if (len < WIRE_FRAG_HEADER_SIZE)
+    return -EBADMSG;
+
+  uint32_t crc;
+  memcpy(&crc, buf + WIRE_FRAG_HEADER_SIZE - sizeof(crc), sizeof(crc));
+  if (crc32c(0, buf, WIRE_FRAG_HEADER_SIZE - sizeof(crc)) != crc)
+    return -EBADMSG;
+
+  uint8_t version = 2;
+  if (wire_parse_header(&version, buf, len, hdr) != WIRE_V2_HEADER_SIZE)
+    return -EBADMSG;
+
+  memcpy(idx, buf + WIRE_V2_HEADER_SIZE, sizeof(*idx));
+  memcpy(count, buf + WIRE_V2_HEADER_SIZE + 2, sizeof(*count));
+
+  uint32_t want_count = hdr->size ?
+    (hdr->size + WIRE_FRAG_PAYLOAD - 1) / WIRE_FRAG_PAYLOAD :
+    1;
+  if (*count != want_count || *idx >= *count)
+    return -EBADMSG;
+
+  uint32_t offset = (uint32_t)*idx * WIRE_FRAG_PAYLOAD;
+  uint32_t want_len = hdr->size - offset < WIRE_FRAG_PAYLOAD ?
+    hdr->size - offset :
+    WIRE_FRAG_PAYLOAD;
+  if (len - WIRE_FRAG_HEADER_SIZE != want_len)
+    return -EBADMSG;
+
+  return 0;
+}
+
+static uint64_t oldest_deadline(struct udp_rx* rx) {
+  /**
+   * Returns the earliest deadline of the frames in reassembly, or 0
+   * with none in it
+   */
+  uint64_t deadline = 0;
+  for (uint32_t i = 0; i < UDP_RX_SLOTS; i++) {
+    struct udp_frame* f = &rx->frames[i];
+    if (f->used && (!deadline || f->deadline < deadline))
+      deadline = f->deadline;
+  }
+
+  return deadline;
+}
+
+static bool from_camera(struct udp_rx* rx, struct sockaddr_in* addr) {
+  /**
+   * Checks a datagram came from one of the camera's addresses
+   */
+  for (uint32_t i = 0; i < sizeof(rx->cam_ips) / sizeof(rx->cam_ips[0]); i++) {
+    if (rx->cam_ips[i].s_addr != INADDR_ANY && addr->sin_addr.s_addr == rx->cam_ips[i].s_addr)
+      return true;
+  }
+
+  return false;
+}
+
+static void restart_at(struct udp_rx* rx, uint32_t seq) {
+  /**
+   * Gives up on every frame in reassembly and picks the stream up from
+   * seq
+   */
+  for (uint32_t i = 0; i < UDP_RX_SLOTS; i++) {
+    if (rx->frames[i].used)
+      rx->expired++;
+  }
+
+  udp_rx_reset(rx);
+  rx->next = seq;
+  rx->next_valid = true;
+}
+
+static bool take_fragment(
+  struct udp_rx* rx,
+  const uint8_t* buf,
+  struct mmsghdr* msg,
+  uint64_t now
+) {
+  /**
+   * Copies a datagram's fragment into its frame
+   *
+   * Returns:
+   * - bool: false when the complete oldest frame has to be handed out
+   *   to make room for it, so the datagram is tried again after
+   */
+  struct wire_hdr hdr;
+  uint16_t idx;
+  uint16_t count;
+
+  struct sockaddr_in* from = (struct sockaddr_in*)msg->msg_hdr.msg_name;
+  if (!from_camera(rx, from)) {
+    rx->foreign++;
+    return true;
+  }
+
+  if ((msg->msg_hdr.msg_flags & MSG_TRUNC) ||
+      parse_frag(buf, msg->msg_len, &hdr, &idx, &count)) {
+    rx->corrupt++;
+    return true;
+  }
+
+  rx->peer = *from;
+  rx->have_peer = true;
+
+  bool eos = hdr.flags & WIRE_FLAG_EOS;
+  if (rx->ended) {
+    if (eos && hdr.seq == rx->eos_seq) {
+      rx->stale++;
+      return true;
+    }
+    rx->ended = false;
+  }
+
+  if (!rx->next_valid) {
+    rx->next = hdr.seq;
+    rx->next_valid = true;
+  }
+
+  /*
+   * A sequence number far behind is a restarted camera, and one far
+   * ahead a camera that went on through a long outage. Either way the
+   * frames in between are gone, and the gap the decoder sees in the
+   * sequence numbers has it ask for a keyframe
+   */
+  int32_t ahead = (int32_t)(hdr.seq - rx->next);
+  if (ahead < -UDP_RX_RESTART_GAP || ahead > UDP_RX_RESTART_GAP) {
+    restart_at(rx, hdr.seq);
+    ahead = 0;
+  } else if (ahead < 0) {
+    rx->stale++;
+    return true;
+  }
+
+  while (ahead >= UDP_RX_SLOTS) {
+    struct udp_frame* old = &rx->frames[rx->next & SLOT_MASK];
+    if (old->used && old->hdr.seq == rx->next && old->frags_have == old->frag_count)
+      return false;
+
+    if (old->used) {
+      old->used = false;
+      rx->expired++;
+    }
+    rx->next++;
+    ahead--;
+  }
+
+  // left over from a stream that ended
+  struct udp_frame* f = &rx->frames[hdr.seq & SLOT_MASK];
+  if (f->used && f->hdr.seq != hdr.seq) {
+    f->used = false;
+    rx->expired++;
+  }
+
+  if (!f->used) {
+    f->used = true;
+    f->hdr = hdr;
+    f->deadline = now + rx->jitter_ns;
+    f->frag_count = count;
+    f->frags_have = 0;
+    memset(f->frag_bits, 0, (count + 63) / 64 * sizeof(f->frag_bits[0]));
+  } else if (f->hdr.size != hdr.size || f->hdr.crc != hdr.crc) {
+    rx->corrupt++;
+    return true;
+  }
+
+  uint64_t bit = 1ULL << (idx & 63);
+  if (f->frag_bits[idx / 64] & bit) {
+    rx->stale++;
+    return true;
+  }
+  f->frag_bits[idx / 64] |= bit;
+  f->frags_have++;
+
+  memcpy(
+    f->data + (size_t)idx * WIRE_FRAG_PAYLOAD,
+    buf + WIRE_FRAG_HEADER_SIZE,
+    msg->msg_len - WIRE_FRAG_HEADER_SIZE
+  );
+  return true;
+}
+
+static int next_frame(struct udp_rx* rx, struct rx_pkt* pkt, uint64_t now) {
+  /**
+   * Hands out the oldest frame once it's complete, gives up on it once
+   * its deadline passes, and otherwise parses buffered datagrams until
+   * one of those happens
+   *
+   * A missing frame with no fragments in yet is given up on at the
+   * earliest deadline of the frames after it, since those can't go out
+   * before it does.
+   *
+   * Returns:
+   * - int: 0 with pkt filled, or -EAGAIN once the batch is parsed
+   */
+  while (true) {
+    if (rx->next_valid) {
+      struct udp_frame* f = &rx->frames[rx->next & SLOT_MASK];
+      bool present = f->used && f->hdr.seq == rx->next;
+
+      if (present && f->frags_have == f->frag_count) {
+        f->used = false;
+        rx->next++;
+        if (!wire_payload_ok(&f->hdr, f->data)) {
+          rx->corrupt++;
+          continue;
+        }
+
+        wire_hdr_pkt(&f->hdr, pkt);
+        pkt->data = f->data;
+        pkt->spilled = false;
+        pkt->dropped = 0;
+        pkt->corrupt = rx->corrupt;
+        rx->corrupt = 0;
+
+        if (f->hdr.flags & WIRE_FLAG_EOS) {
+          udp_rx_reset(rx);
+          rx->ended = true;
+          rx->eos_seq = f->hdr.seq;
+          rx->next_valid = false;
+        }
+        return 0;
+      }
+
+      uint64_t deadline = present ? f->deadline : oldest_deadline(rx);
+      if (deadline && now >= deadline) {
+        if (present) {
+          f->used = false;
+          rx->expired++;
+        }
+        rx->next++;
+        continue;
+      }
+    }
+
+    if (rx->batch_pos == rx->batch_len)
+      return -EAGAIN;
+
+    uint32_t pos = rx->batch_pos;
+    if (take_fragment(rx, rx->dgrams + (size_t)pos * UDP_RX_DGRAM_SIZE, &rx->msgs[pos], now))
+      rx->batch_pos++;
+  }
+}
+
+static int recv_batch(struct udp_rx* rx) {
+  /**
+   * Takes whatever datagrams are queued, up to UDP_RX_BATCH
+   *
+   * Returns:
+   * - int: datagrams received, -EAGAIN with none queued, or a negative
+   *   errno
+   */
+  char logstr[128];
+
+  for (uint32_t i = 0; i < UDP_RX_BATCH; i++)
+    rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->addrs[i]);
+
+  int count = recvmmsg(rx->fd, rx->msgs, UDP_RX_BATCH, MSG_DONTWAIT, NULL);
+  rx->recvs++;
+  if (count < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return -EAGAIN;
+    if (errno == EINTR)
+      return -EINTR;
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error receiving datagrams from stream: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  rx->batch_len = count;
+  rx->batch_pos = 0;
+  return count;
+}
+
+int udp_rx_recv_packet(struct udp_rx* rx, struct rx_pkt* pkt) {
+  /**
+   * Receives the next frame in sequence order, waiting for datagrams
+   * no longer than the oldest incomplete frame's deadline
+   *
+   * Returns:
+   * - int: 0 with pkt filled, its size 0 marking the end of the stream,
+   *   -ETIMEDOUT after UDP_RX_IDLE_TIMEOUT without a frame, -EINTR when
+   *   interrupted, or a negative errno
+   */
+  uint64_t idle_since = now_ns();
+
+  while (true) {
+    uint64_t now = now_ns();
+    int ret = next_frame(rx, pkt, now);
+    if (ret == 0)
+      return 0;
+
+    ret = recv_batch(rx);
+    if (ret > 0)
+      continue;
+    if (ret != -EAGAIN)
+      return ret;
+
+    uint64_t deadline = oldest_deadline(rx);
+    if (!deadline) {
+      if (now - idle_since >= UDP_RX_IDLE_TIMEOUT)
+        return -ETIMEDOUT;
+      deadline = idle_since + UDP_RX_IDLE_TIMEOUT;
+    }
+
+    uint64_t wait = deadline > now ? deadline - now : 0;
+    struct timespec timeout = {
+      .tv_sec = wait / 1000000000ULL,
+      .tv_nsec = wait % 1000000000ULL
+    };
+    struct pollfd pfd = {
+      .fd = rx->fd,
+      .events = POLLIN
+    };
+    if (ppoll(&pfd, 1, &timeout, NULL) < 0)
+      return errno == EINTR ? -EINTR : -errno;
+  }
+}
+
+void udp_rx_request_keyframe(struct udp_rx* rx, uint16_t cam_port) {
+  /**
+   * Asks the camera for a keyframe on its control port, at the address
+   * its fragments come from, at most every UDP_KEYFRAME_REQ_INTERVAL
+   *
+   * The request is a single datagram, if it's lost the next one goes
+   * out once the interval has passed.
+   */
+  uint64_t now = now_ns();
+  if (!rx->have_peer || now - rx->last_keyframe_req < UDP_KEYFRAME_REQ_INTERVAL)
+    return;
+  rx->last_keyframe_req = now;
+
+  struct sockaddr_in addr = rx->peer;
+  addr.sin_port = htons(cam_port);
+  sendto(
+    rx->fd,
+    UDP_KEYFRAME_REQ,
+    strlen(UDP_KEYFRAME_REQ),
+    MSG_DONTWAIT,
+    (struct sockaddr*)&addr,
+    sizeof(addr)
+  );
+}
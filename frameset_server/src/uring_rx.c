@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <liburing.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "stream_mgr.h"
+#include "uring_rx.h"
+#include "wire.h"
+
+#define RING_ENTRIES 4
+#define RECV_TIMEOUT_SEC 1
+
+#define FIELD_HEADER 0
+#define FIELD_PAYLOAD 1
+
+static void recycle_buf(struct uring_rx* rx, int bid) {
+  io_uring_buf_ring_add(
+    rx->br,
+    rx->bufs + (size_t)bid * URING_RX_BUF_SIZE,
+    URING_RX_BUF_SIZE,
+    bid,
+    io_uring_buf_ring_mask(URING_RX_BUFS),
+    0
+  );
+  io_uring_buf_ring_advance(rx->br, 1);
+}
+
+int uring_rx_init(struct uring_rx* rx, int clientfd) {
+  /**
+   * Sets up an io_uring with a provided buffer ring for a connected
+   * camera socket
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno, in which case the caller
+   *   can fall back to plain recv on the same socket
+   */
+  char logstr[128];
+
+  memset(rx, 0, sizeof(*rx));
+  rx->fd = clientfd;
+  rx->cur_bid = -1;
+  rx->lent_bid = -1;
+
+  rx->bufs = aligned_alloc(4096, (size_t)URING_RX_BUFS * URING_RX_BUF_SIZE);
+  rx->asm_buf = malloc(ENCODED_FRAME_BUF_SIZE);
+  if (!rx->bufs || !rx->asm_buf) {
+    log(ERROR, "Failed to allocate io_uring receive buffers");
+    uring_rx_cleanup(rx);
+    return -ENOMEM;
+  }
+
+  int ret = io_uring_queue_init(RING_ENTRIES, &rx->ring, 0);
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating io_uring: %s",
+      strerror(-ret)
+    );
+    log(ERROR, logstr);
+    uring_rx_cleanup(rx);
+    return ret;
+  }
+  rx->ring_initialized = true;
+
+  rx->br = io_uring_setup_buf_ring(
+    &rx->ring,
+    URING_RX_BUFS,
+    URING_RX_BGID,
+    0,
+    &ret
+  );
+  if (!rx->br) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error registering io_uring buffer ring: %s",
+      strerror(-ret)
+    );
+    log(ERROR, logstr);
+    uring_rx_cleanup(rx);
+    return ret;
+  }
+
+  for (int i = 0; i < URING_RX_BUFS; i++)
+    recycle_buf(rx, i);
+
+  return 0;
+}
+
+void uring_rx_cleanup(struct uring_rx* rx) {
+  if (rx->payload_buf && rx->payload_buf != rx->asm_buf)
+    wire_spill_put(rx->payload_buf);
+  rx->payload_buf = NULL;
+  if (rx->br)
+    io_uring_free_buf_ring(&rx->ring, rx->br, URING_RX_BUFS, URING_RX_BGID);
+  if (rx->ring_initialized)
+    io_uring_queue_exit(&rx->ring);
+  free(rx->bufs);
+  free(rx->asm_buf);
+  rx->br = NULL;
+  rx->bufs = NULL;
+  rx->asm_buf = NULL;
+  rx->ring_initialized = false;
+}
+
+static int arm_recv(struct uring_rx* rx) {
+  struct io_uring_sqe* sqe = io_uring_get_sqe(&rx->ring);
+  if (!sqe)
+    return -EBUSY;
+
+  io_uring_prep_recv_multishot(sqe, rx->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_RX_BGID;
+
+  rx->syscalls++;
+  int ret = io_uring_submit(&rx->ring);
+  if (ret < 0)
+    return ret;
+
+  rx->armed = true;
+  return 0;
+}
+
+static int next_completion(struct uring_rx* rx) {
+  /**
+   * Makes the next received chunk the current buffer, re-arming the
+   * multishot recv whenever the kernel ended it
+   *
+   * Returns:
+   * - int: 0 on success, -EINTR when interrupted by a signal,
+   *   -ETIMEDOUT after a second without data, -ECONNRESET when the
+   *   camera disconnected, or another negative errno
+   */
+  char logstr[128];
+
+  while (true) {
+    int ret = 0;
+    if (!rx->armed) {
+      ret = arm_recv(rx);
+      if (ret)
+        return ret;
+    }
+
+    struct io_uring_cqe* cqe;
+    ret = io_uring_peek_cqe(&rx->ring, &cqe);
+    if (ret == -EAGAIN) {
+      struct __kernel_timespec timeout = {
+        .tv_sec = RECV_TIMEOUT_SEC,
+        .tv_nsec = 0
+      };
+      rx->syscalls++;
+      ret = io_uring_wait_cqe_timeout(&rx->ring, &cqe, &timeout);
+    }
+
+    if (ret == -EINTR)
+      return -EINTR;
+    if (ret == -ETIME) {
+      log(WARNING, "Timed out waiting for packet from client");
+      return -ETIMEDOUT;
+    }
+    if (ret < 0)
+      return ret;
+
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+    io_uring_cqe_seen(&rx->ring, cqe);
+
+    if (!(flags & IORING_CQE_F_MORE))
+      rx->armed = false;
+
+    // every buffer was in flight, the re-arm picks up recycled ones
+    if (res == -ENOBUFS)
+      continue;
+
+    if (res == 0) {
+      log(WARNING, "Client has disconnected");
+      return -ECONNRESET;
+    }
+
+    if (res < 0) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error receiving packet from stream: %s",
+        strerror(-res)
+      );
+      log(ERROR, logstr);
+      return res;
+    }
+
+    rx->cur_bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    rx->cur = rx->bufs + (size_t)rx->cur_bid * URING_RX_BUF_SIZE;
+    rx->cur_len = res;
+    rx->cur_pos = 0;
+    return 0;
+  }
+}
+
+static void take_counts(struct uring_rx* rx, struct rx_pkt* pkt) {
+  pkt->dropped = rx->dropped;
+  pkt->corrupt = rx->corrupt;
+  rx->dropped = 0;
+  rx->corrupt = 0;
+}
+
+static int parse_header(struct uring_rx* rx, struct rx_pkt* pkt) {
+  /**
+   * Acts on the header bytes gathered so far
+   *
+   * Returns:
+   * - int: 0 with pkt filled at the end of the stream, -EAGAIN to keep
+   *   parsing, or -EPROTO on a malformed v1 stream
+   */
+  char logstr[128];
+
+  int hdr_size = wire_parse_header(&rx->version, rx->hdr_buf, rx->parsed, &rx->hdr);
+  if (hdr_size == -EBADMSG) {
+    if (!rx->resyncing)
+      rx->corrupt++;
+    rx->resyncing = true;
+
+    // slide the window a byte along towards the next header
+    rx->parsed--;
+    memmove(rx->hdr_buf, rx->hdr_buf + 1, rx->parsed);
+    return -EAGAIN;
+  }
+  if (hdr_size == -EAGAIN || hdr_size == -EPROTO)
+    return hdr_size;
+
+  rx->parsed = 0;
+  if (hdr_size == 0)
+    return -EAGAIN;
+  rx->resyncing = false;
+
+  if (rx->hdr.size == 0) {
+    wire_hdr_pkt(&rx->hdr, pkt);
+    pkt->data = NULL;
+    pkt->spilled = false;
+    take_counts(rx, pkt);
+    return 0;
+  }
+
+  rx->payload_buf = rx->asm_buf;
+  if (rx->hdr.size > ENCODED_FRAME_BUF_SIZE) {
+    rx->payload_buf = wire_spill_get();
+    if (!rx->payload_buf) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "No spill buffer free for a %u byte frame, dropping it",
+        rx->hdr.size
+      );
+      log(WARNING, logstr);
+    }
+  }
+  rx->field = FIELD_PAYLOAD;
+  return -EAGAIN;
+}
+
+int uring_rx_next(struct uring_rx* rx, struct rx_pkt* pkt) {
+  /**
+   * Receives the next record of the wire format, in either version
+   *
+   * The buffer the previous packet's payload was lent from goes back
+   * to the kernel here, so callers must be done with pkt->data first.
+   * Corrupt v2 records are dropped as in wire_rx_next.
+   *
+   * Returns:
+   * - int: 0 with pkt filled, a size of 0 marking the end of the
+   *   stream, or a negative errno as from next_completion, or -EPROTO
+   *   on a malformed v1 stream
+   */
+  if (rx->lent_bid >= 0 && rx->lent_bid != rx->cur_bid)
+    recycle_buf(rx, rx->lent_bid);
+  rx->lent_bid = -1;
+
+  while (true) {
+    if (rx->cur_pos == rx->cur_len) {
+      if (rx->cur_bid >= 0 && rx->cur_bid != rx->lent_bid)
+        recycle_buf(rx, rx->cur_bid);
+      rx->cur_bid = -1;
+
+      int ret = next_completion(rx);
+      if (ret)
+        return ret;
+    }
+
+    uint8_t* src = rx->cur + rx->cur_pos;
+    uint32_t avail = rx->cur_len - rx->cur_pos;
+    uint32_t size = rx->hdr.size;
+
+    if (rx->field == FIELD_PAYLOAD && rx->parsed == 0 && avail >= size &&
+        rx->payload_buf == rx->asm_buf) {
+      rx->cur_pos += size;
+      rx->field = FIELD_HEADER;
+      if (!wire_payload_ok(&rx->hdr, src)) {
+        rx->corrupt++;
+        continue;
+      }
+
+      // the whole payload sits in this buffer, so lend it out in place
+      wire_hdr_pkt(&rx->hdr, pkt);
+      pkt->data = src;
+      pkt->spilled = false;
+      take_counts(rx, pkt);
+      rx->lent_bid = rx->cur_bid;
+      return 0;
+    }
+
+    uint8_t* dst = rx->payload_buf;
+    uint32_t want = size;
+    if (rx->field == FIELD_HEADER) {
+      dst = rx->hdr_buf;
+      want = rx->parsed < WIRE_PROBE_SIZE ? WIRE_PROBE_SIZE : wire_header_size(rx->version);
+    }
+
+    uint32_t n = want - rx->parsed < avail ? want - rx->parsed : avail;
+    if (dst)
+      memcpy(dst + rx->parsed, src, n);
+    rx->parsed += n;
+    rx->cur_pos += n;
+    if (rx->parsed < want)
+      continue;
+
+    if (rx->field == FIELD_HEADER) {
+      int ret = parse_header(rx, pkt);
+      if (ret == -EAGAIN)
+        continue;
+      return ret;
+    }
+
+    rx->parsed = 0;
+    rx->field = FIELD_HEADER;
+    if (!rx->payload_buf) {
+      rx->discarded++;
+      rx->dropped++;
+      continue;
+    }
+
+    bool spilled = rx->payload_buf != rx->asm_buf;
+    if (!wire_payload_ok(&rx->hdr, rx->payload_buf)) {
+      if (spilled)
+        wire_spill_put(rx->payload_buf);
+      rx->payload_buf = rx->asm_buf;
+      rx->corrupt++;
+      continue;
+    }
+
+    wire_hdr_pkt(&rx->hdr, pkt);
+    pkt->data = rx->payload_buf;
+    pkt->spilled = spilled;
+    take_counts(rx, pkt);
+    rx->payload_buf = rx->asm_buf;
+    return 0;
+  }
+}
@@ -1,22 +1,158 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "frame_pool.h"
 #include "logging.h"
+#include "stream_mgr.h"
 #include "viddec.h"
 
+#define SELF_TEST_FRAMES 30
+#define SELF_TEST_GOP 10
+#define PLANE_ALIGN 64 // the widest simd alignment libavcodec may assume
+#define H264_NAL_SLICE 1
+#define H264_NAL_IDR 5
+
+/**
+ * A decoder backend opens the codec context for a decoder and moves
+ * each decoded frame into a caller's NV12 buffer
+ */
+struct backend_ops {
+  const char* name;
+  int (*open)(decoder* dec, uint32_t threads);
+  int (*transfer)(decoder* dec, uint8_t* out_buf);
+};
+
+static int cuvid_open(decoder* dec, uint32_t threads);
+static int cuvid_transfer(decoder* dec, uint8_t* out_buf);
+static int sw_open(decoder* dec, uint32_t threads);
+static int sw_transfer(decoder* dec, uint8_t* out_buf);
+
+static const struct backend_ops backends[DECODER_BACKEND_COUNT] = {
+  [DECODER_AUTO] = { "auto", NULL, NULL },
+  [DECODER_CUVID] = { "cuvid", cuvid_open, cuvid_transfer },
+  [DECODER_SOFTWARE] = { "software", sw_open, sw_transfer }
+};
+
+const char* decoder_backend_name(enum decoder_backend backend) {
+  if (backend >= DECODER_BACKEND_COUNT)
+    return "unknown";
+  return backends[backend].name;
+}
+
 int init_decoder(
   decoder* dec,
   uint32_t width,
-  uint32_t height
+  uint32_t height,
+  enum decoder_backend backend,
+  uint32_t threads,
+  struct decoder_sink* sink
 ) {
+  /**
+   * Opens an H.264 decoder with the given backend
+   *
+   * Parameters:
+   * - enum decoder_backend backend: resolved backend, DECODER_AUTO is
+   *   not valid here, run decoder_self_test to resolve it first
+   * - uint32_t threads: decode threads for the software backend,
+   *   0 uses DEFAULT_DECODER_THREADS
+   * - struct decoder_sink* sink: decode straight into the frame pool,
+   *   or NULL to copy into the buffer passed to recv_frame, only the
+   *   software backend supports it
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
   int ret = 0;
   char logstr[128];
 
   memset(dec, 0, sizeof(*dec));
   dec->width = width;
   dec->height = height;
+  dec->backend = backend;
+
+  if (sink && backend != DECODER_SOFTWARE) {
+    log(ERROR, "Zero copy decoding needs the software decoder backend");
+    return -EINVAL;
+  }
+  if (sink) {
+    dec->sink = *sink;
+    dec->zero_copy = true;
+    dec->sink_compatible = true;
+  }
+
+  if (backend == DECODER_AUTO || backend >= DECODER_BACKEND_COUNT) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Invalid decoder backend %d",
+      backend
+    );
+    log(ERROR, logstr);
+    return -EINVAL;
+  }
+
+  ret = backends[backend].open(dec, threads ? threads : DEFAULT_DECODER_THREADS);
+  if (ret)
+    goto cleanup;
+
+  dec->frame = av_frame_alloc();
+  dec->hw_frame = av_frame_alloc();
+  dec->pkt = av_packet_alloc();
+  if (!dec->frame || !dec->hw_frame || !dec->pkt) {
+    log(ERROR, "Failed to allocate frame/packet");
+    ret = -ENOMEM;
+    goto cleanup;
+  }
+
+  dec->frame->format = AV_PIX_FMT_NV12;
+  dec->frame->width = width;
+  dec->frame->height = height;
+  ret = av_frame_get_buffer(dec->frame, 0);
+  if (ret < 0) {
+    log(ERROR, "Failed to allocate frame buffer");
+    goto cleanup;
+  }
+
+  return 0;
+
+  cleanup:
+  cleanup_decoder(dec);
+  return ret < 0 ? ret : -ENODEV;
+}
+
+static int open_codec(decoder* dec, const AVCodec* codec) {
+  char logstr[128];
+
+  int ret = avcodec_open2(
+    dec->ctx,
+    codec,
+    NULL
+  );
+  if (ret < 0) {
+    char err[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, err, AV_ERROR_MAX_STRING_SIZE);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to open codec: %s",
+      err
+    );
+    log(ERROR, logstr);
+    return ret;
+  }
+
+  return 0;
+}
+
+static int cuvid_open(decoder* dec, uint32_t threads) {
+  (void)threads;
+  int ret = 0;
+  char logstr[128];
 
   const AVCodec* codec = avcodec_find_decoder_by_name("h264_cuvid");
   if (!codec) {
@@ -38,65 +174,236 @@ int init_decoder(
     0
   );
   if (ret < 0) {
+    char err[AV_ERROR_MAX_STRING_SIZE];
+    av_strerror(ret, err, AV_ERROR_MAX_STRING_SIZE);
     snprintf(
       logstr,
       sizeof(logstr),
       "Failed to create CUDA device: %s",
-      strerror(ret)
+      err
     );
     log(ERROR, logstr);
-    goto cleanup;
+    return ret;
   }
 
   dec->ctx->hw_device_ctx = av_buffer_ref(dec->hw_device_ctx);
   if (!dec->ctx->hw_device_ctx) {
     log(ERROR, "Failed to reference hw device context");
-    goto cleanup;
+    return -ENOMEM;
   }
 
-  dec->ctx->width = width;
-  dec->ctx->height = height;
+  dec->ctx->width = dec->width;
+  dec->ctx->height = dec->height;
   dec->ctx->pix_fmt = AV_PIX_FMT_CUDA;
   dec->ctx->pkt_timebase = (AVRational){1, 90000}; // 90 KHz
   dec->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
 
-  ret = avcodec_open2(
-    dec->ctx,
-    codec,
-    NULL
-  );
+  return open_codec(dec, codec);
+}
+
+static int cuvid_transfer(decoder* dec, uint8_t* out_buf) {
+  dec->frame->data[0] = out_buf;
+  dec->frame->data[1] = out_buf + (dec->width * dec->height);
+  dec->frame->linesize[0] = dec->width;
+  dec->frame->linesize[1] = dec->width;
+
+  int ret = av_hwframe_transfer_data(dec->frame, dec->hw_frame, 0);
   if (ret < 0) {
+    log(ERROR, "Error transferring frame from GPU to CPU");
+    return ret;
+  }
+
+  return 0;
+}
+
+static struct ts_frame_buf* sink_buf(decoder* dec, uint8_t* data) {
+  // frame buffers sit frame_buf_stride apart in the segment, see shm_layout
+  struct frame_pool* pool = dec->sink.pool;
+  uint64_t offset = data - dec->sink.shm_base;
+  return &pool->bufs[(offset - pool->bufs[0].frame_offset) / dec->sink.frame_buf_stride];
+}
+
+static void sink_buf_free(void* opaque, uint8_t* data) {
+  decoder* dec = (decoder*)opaque;
+  frame_pool_put(dec->sink.pool, dec->sink.cam_idx, sink_buf(dec, data));
+}
+
+static bool sink_fits(decoder* dec, AVCodecContext* ctx, AVFrame* frame) {
+  /**
+   * Checks a frame the decoder is about to allocate can live in a frame
+   * buffer as is, which needs the coded size to match the frame size
+   * exactly and every plane to meet the decoder's stride alignment
+   */
+  if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P)
+    return false;
+  if ((uint32_t)frame->width != dec->width || (uint32_t)frame->height != dec->height)
+    return false;
+
+  int width = frame->width;
+  int height = frame->height;
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  avcodec_align_dimensions2(ctx, &width, &height, linesize_align);
+
+  uint32_t chroma_width = dec->width / 2;
+  uint64_t luma_size = (uint64_t)dec->width * dec->height;
+  return dec->width % PLANE_ALIGN == 0 &&
+         dec->width % linesize_align[0] == 0 &&
+         chroma_width % linesize_align[1] == 0 &&
+         chroma_width % linesize_align[2] == 0 &&
+         luma_size % PLANE_ALIGN == 0 &&
+         (luma_size / 4) % PLANE_ALIGN == 0;
+}
+
+static int sink_get_buffer(AVCodecContext* ctx, AVFrame* frame, int flags) {
+  /**
+   * Hands the decoder a frame pool buffer to decode into
+   *
+   * Called from the decoder's own threads with frame threading, which
+   * the pool is safe for. Falls back to the decoder's allocator when
+   * the stream can't be decoded in place or the pool denies the camera
+   * a buffer, in which case recv_pool_frame sorts the frame out.
+   */
+  decoder* dec = (decoder*)ctx->opaque;
+
+  if (!dec->sink_compatible || !sink_fits(dec, ctx, frame)) {
+    dec->sink_compatible = false;
+    return avcodec_default_get_buffer2(ctx, frame, flags);
+  }
+
+  struct ts_frame_buf* buf = frame_pool_get(dec->sink.pool, dec->sink.cam_idx);
+  if (!buf)
+    return avcodec_default_get_buffer2(ctx, frame, flags);
+
+  uint8_t* data = dec->sink.shm_base + buf->frame_offset;
+  uint64_t luma_size = (uint64_t)dec->width * dec->height;
+  frame->buf[0] = av_buffer_create(
+    data,
+    luma_size * 3 / 2,
+    sink_buf_free,
+    dec,
+    0
+  );
+  if (!frame->buf[0]) {
+    frame_pool_put(dec->sink.pool, dec->sink.cam_idx, buf);
+    return AVERROR(ENOMEM);
+  }
+
+  frame->data[0] = data;
+  frame->data[1] = data + luma_size;
+  frame->data[2] = data + luma_size * 5 / 4;
+  frame->linesize[0] = dec->width;
+  frame->linesize[1] = dec->width / 2;
+  frame->linesize[2] = dec->width / 2;
+  frame->extended_data = frame->data;
+
+  return 0;
+}
+
+static int sw_open(decoder* dec, uint32_t threads) {
+  /**
+   * Opens libavcodec's software H.264 decoder
+   *
+   * Frame threading decodes several frames at once, which is where
+   * most of the throughput comes from, at the cost of a frame of
+   * latency per thread. Low delay mode would turn it off, so unlike
+   * cuvid it is only set when running single threaded.
+   */
+  const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  if (!codec) {
+    log(ERROR, "Could not find software H.264 decoder");
+    return -ENODEV;
+  }
+
+  dec->ctx = avcodec_alloc_context3(codec);
+  if (!dec->ctx) {
+    log(ERROR, "Could not allocate decoder context");
+    return -ENOMEM;
+  }
+
+  dec->ctx->width = dec->width;
+  dec->ctx->height = dec->height;
+  dec->ctx->pkt_timebase = (AVRational){1, 90000}; // 90 KHz
+  dec->ctx->thread_count = threads;
+  dec->ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (threads == 1)
+    dec->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+  if (dec->zero_copy) {
+    dec->ctx->opaque = dec;
+    dec->ctx->get_buffer2 = sink_get_buffer;
+  }
+
+  return open_codec(dec, codec);
+}
+
+static int sw_transfer(decoder* dec, uint8_t* out_buf) {
+  /**
+   * Repacks a planar 4:2:0 frame into NV12, the layout every frame
+   * buffer in the shared memory segment uses
+   */
+  char logstr[128];
+  AVFrame* src = dec->hw_frame;
+
+  if ((uint32_t)src->width != dec->width || (uint32_t)src->height != dec->height) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Failed to open codec: %s",
-      strerror(ret)
+      "Decoded frame is %dx%d, expected %ux%u",
+      src->width,
+      src->height,
+      dec->width,
+      dec->height
     );
-    goto cleanup;
+    log(ERROR, logstr);
+    return -EINVAL;
   }
 
-  dec->frame = av_frame_alloc();
-  dec->hw_frame = av_frame_alloc();
-  dec->pkt = av_packet_alloc();
-  if (!dec->frame || !dec->hw_frame || !dec->pkt) {
-    log(ERROR, "Failed to allocate frame/packet");
-    goto cleanup;
+  for (uint32_t y = 0; y < dec->height; y++)
+    memcpy(out_buf + y * dec->width, src->data[0] + y * src->linesize[0], dec->width);
+
+  uint8_t* uv = out_buf + dec->width * dec->height;
+  if (src->format == AV_PIX_FMT_NV12) {
+    for (uint32_t y = 0; y < dec->height / 2; y++)
+      memcpy(uv + y * dec->width, src->data[1] + y * src->linesize[1], dec->width);
+    return 0;
   }
 
-  dec->frame->format = AV_PIX_FMT_NV12;
-  dec->frame->width = width;
-  dec->frame->height = height;
-  ret = av_frame_get_buffer(dec->frame, 0);
-  if (ret < 0) {
-    log(ERROR, "Failed to allocate frame buffer");
-    goto cleanup;
+  if (src->format != AV_PIX_FMT_YUV420P && src->format != AV_PIX_FMT_YUVJ420P) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Unsupported decoded pixel format %s",
+      av_get_pix_fmt_name(src->format)
+    );
+    log(ERROR, logstr);
+    return -EINVAL;
+  }
+
+  for (uint32_t y = 0; y < dec->height / 2; y++) {
+    uint8_t* dst = uv + y * dec->width;
+    uint8_t* u = src->data[1] + y * src->linesize[1];
+    uint8_t* v = src->data[2] + y * src->linesize[2];
+    for (uint32_t x = 0; x < dec->width / 2; x++) {
+      dst[2 * x] = u[x];
+      dst[2 * x + 1] = v[x];
+    }
   }
 
   return 0;
+}
 
-  cleanup:
-  cleanup_decoder(dec);
-  return ret;
+static void copy_i420(decoder* dec, AVFrame* src, uint8_t* out_buf) {
+  uint32_t chroma_width = dec->width / 2;
+  uint8_t* u = out_buf + dec->width * dec->height;
+  uint8_t* v = u + chroma_width * (dec->height / 2);
+
+  for (uint32_t y = 0; y < dec->height; y++)
+    memcpy(out_buf + y * dec->width, src->data[0] + y * src->linesize[0], dec->width);
+
+  for (uint32_t y = 0; y < dec->height / 2; y++) {
+    memcpy(u + y * chroma_width, src->data[1] + y * src->linesize[1], chroma_width);
+    memcpy(v + y * chroma_width, src->data[2] + y * src->linesize[2], chroma_width);
+  }
 }
 
 void cleanup_decoder(decoder* dec) {
@@ -117,11 +424,60 @@ void cleanup_decoder(decoder* dec) {
   }
 }
 
-int decode_packet(decoder* dec, uint8_t* data, uint32_t size) {
+static bool h264_keyframe(const uint8_t* data, uint32_t size) {
+  /**
+   * Reports whether an Annex B access unit holds an IDR picture
+   *
+   * Parameter sets and SEI come ahead of the picture's slices, so the
+   * scan stops at the first slice
+   */
+  for (uint32_t i = 0; i + 3 < size; i++) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+      continue;
+
+    uint8_t nal_type = data[i + 3] & 0x1f;
+    if (nal_type == H264_NAL_IDR)
+      return true;
+    if (nal_type == H264_NAL_SLICE)
+      return false;
+    i += 3;
+  }
+
+  return false;
+}
+
+int decode_packet(
+  decoder* dec,
+  uint8_t* data,
+  uint32_t size,
+  uint64_t timestamp
+) {
+  /**
+   * Sends a packet to the decoder, labelled with its capture timestamp
+   * for the frame decoded from it to be matched back up with
+   *
+   * After a reset, packets are skipped until the next keyframe, since
+   * the frames they predict from went with the old stream
+   */
   char logstr[128];
 
+  if (dec->resyncing) {
+    if (!h264_keyframe(data, size)) {
+      dec->skipped++;
+      return 0;
+    }
+    dec->resyncing = false;
+  }
+
+  // pts 0 would match the zeroed slots, so sequence numbers start at 1
+  int64_t pts = ++dec->next_pts;
+  struct ts_slot* slot = &dec->ts_slots[pts & (DECODER_TS_SLOTS - 1)];
+  slot->pts = pts;
+  slot->timestamp = timestamp;
+
   dec->pkt->data = data;
   dec->pkt->size = size;
+  dec->pkt->pts = pts;
 
   int ret = avcodec_send_packet(dec->ctx, dec->pkt);
   if (ret < 0) {
@@ -140,7 +496,43 @@ int decode_packet(decoder* dec, uint8_t* data, uint32_t size) {
   return 0;
 }
 
-int recv_frame(decoder* dec, uint8_t* out_buf) {
+static int frame_timestamp(decoder* dec, AVFrame* frame, uint64_t* timestamp) {
+  /**
+   * Looks up the capture timestamp of the packet a frame was decoded from
+   *
+   * Returns:
+   * - int: 0 with timestamp set, or ENOENT when the frame carries no pts
+   *   or its slot was reused by a later packet, after a warning
+   */
+  char logstr[128];
+
+  int64_t pts = frame->pts;
+  struct ts_slot* slot = &dec->ts_slots[pts & (DECODER_TS_SLOTS - 1)];
+  if (pts != AV_NOPTS_VALUE && slot->pts == pts) {
+    *timestamp = slot->timestamp;
+    return 0;
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Decoded frame with unknown pts %ld, dropping it",
+    pts
+  );
+  log(WARNING, logstr);
+  return ENOENT;
+}
+
+int recv_frame(decoder* dec, uint8_t* out_buf, uint64_t* timestamp) {
+  /**
+   * Receives a decoded frame into out_buf as NV12
+   *
+   * Returns:
+   * - int: 0 with timestamp set to the frame's capture timestamp, EAGAIN
+   *   when the decoder needs more packets, ENODATA at the end of the
+   *   stream, ENOENT when the frame was dropped for not matching any
+   *   packet, or a negative error code
+   */
   int ret = 0;
 
   ret = avcodec_receive_frame(dec->ctx, dec->hw_frame);
@@ -153,18 +545,61 @@ int recv_frame(decoder* dec, uint8_t* out_buf) {
     return ret;
   }
 
-  dec->frame->data[0] = out_buf;
-  dec->frame->data[1] = out_buf + (dec->width * dec->height);
-  dec->frame->linesize[0] = dec->width;
-  dec->frame->linesize[1] = dec->width;
+  ret = frame_timestamp(dec, dec->hw_frame, timestamp);
+  if (ret) {
+    av_frame_unref(dec->hw_frame);
+    return ret;
+  }
 
-  ret = av_hwframe_transfer_data(dec->frame, dec->hw_frame, 0);
-  if (ret < 0) {
-    log(ERROR, "Error transferring frame from GPU to CPU");
+  return backends[dec->backend].transfer(dec, out_buf);
+}
+
+int recv_pool_frame(
+  decoder* dec,
+  struct ts_frame_buf** out,
+  uint64_t* timestamp
+) {
+  /**
+   * Receives a frame from a zero copy decoder
+   *
+   * A frame decoded in place comes back as the pool buffer it lives
+   * in, with a pool reference of its own for the caller on top of the
+   * decoder's. A stream that can't be decoded in place is copied into a
+   * pool buffer instead, still as I420.
+   *
+   * Returns:
+   * - int: 0 with out and timestamp set, out left NULL when the pool
+   *   had no buffer for the frame and it was dropped, or as from
+   *   recv_frame
+   */
+  *out = NULL;
+
+  int ret = avcodec_receive_frame(dec->ctx, dec->hw_frame);
+  if (ret == AVERROR(EAGAIN)) {
+    return EAGAIN; // need more frames
+  } else if (ret == AVERROR_EOF) {
+    return ENODATA; // end of stream
+  } else if (ret < 0) {
+    log(ERROR, "Error receiving frame from decoder");
     return ret;
   }
 
-  return 0;
+  // a frame dropped here releases its pool buffer with the unref below
+  AVFrame* frame = dec->hw_frame;
+  ret = frame_timestamp(dec, frame, timestamp);
+  bool in_pool = frame->buf[0] && av_buffer_get_opaque(frame->buf[0]) == dec;
+  if (ret == 0 && in_pool) {
+    *out = sink_buf(dec, frame->data[0]);
+    frame_pool_ref(dec->sink.pool, *out);
+  } else if (ret == 0 && !dec->sink_compatible) {
+    // a denied buffer was already counted as a drop, so only retry here
+    *out = frame_pool_get(dec->sink.pool, dec->sink.cam_idx);
+    if (*out)
+      copy_i420(dec, frame, dec->sink.shm_base + (*out)->frame_offset);
+  }
+
+  av_frame_unref(frame);
+  return ret;
 }
 
 int flush_decoder(decoder* dec) {
@@ -176,3 +611,252 @@ int flush_decoder(decoder* dec) {
 
   return 0;
 }
+
+void reset_decoder(decoder* dec) {
+  /**
+   * Readies the decoder for a camera's stream to start over, like after
+   * a reconnect
+   *
+   * Frames still in the decoder are dropped, releasing any pool buffers
+   * they hold, and the end of stream state left by flush_decoder is
+   * cleared. Decoding resumes at the next keyframe.
+   */
+  avcodec_flush_buffers(dec->ctx);
+  av_frame_unref(dec->hw_frame);
+  dec->resyncing = true;
+}
+
+void resync_decoder(decoder* dec) {
+  /**
+   * Skips packets up to the next keyframe after some of the stream was
+   * lost, since the ones in between predict from frames that never
+   * arrived. Frames already sent to the decoder still come out.
+   */
+  dec->resyncing = true;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int encode_test_clip(
+  uint32_t width,
+  uint32_t height,
+  AVPacket** pkts,
+  int* pkt_count
+) {
+  /**
+   * Encodes a short moving gradient with whatever H.264 encoder this
+   * libavcodec has, giving the self-test a stream to decode
+   *
+   * Returns:
+   * - int: 0 on success, or -ENODEV when there is no encoder
+   */
+  int ret = 0;
+  *pkt_count = 0;
+
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec)
+    return -ENODEV;
+
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  AVFrame* frame = av_frame_alloc();
+  if (!ctx || !frame) {
+    ret = -ENOMEM;
+    goto cleanup;
+  }
+
+  ctx->width = width;
+  ctx->height = height;
+  ctx->time_base = (AVRational){1, 30};
+  ctx->framerate = (AVRational){30, 1};
+  ctx->gop_size = SELF_TEST_GOP;
+  ctx->max_b_frames = 0;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+
+  ret = avcodec_open2(ctx, codec, NULL);
+  if (ret < 0)
+    goto cleanup;
+
+  frame->format = ctx->pix_fmt;
+  frame->width = width;
+  frame->height = height;
+  ret = av_frame_get_buffer(frame, 0);
+  if (ret < 0)
+    goto cleanup;
+
+  for (int i = 0; i <= SELF_TEST_FRAMES; i++) {
+    AVFrame* in = NULL;
+    if (i < SELF_TEST_FRAMES) {
+      ret = av_frame_make_writable(frame);
+      if (ret < 0)
+        goto cleanup;
+
+      for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++)
+          frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
+      }
+      for (uint32_t y = 0; y < height / 2; y++) {
+        for (uint32_t x = 0; x < width / 2; x++) {
+          frame->data[1][y * frame->linesize[1] + x] = 128 + y + i * 2;
+          frame->data[2][y * frame->linesize[2] + x] = 64 + x + i * 5;
+        }
+      }
+      frame->pts = i;
+      in = frame;
+    }
+
+    ret = avcodec_send_frame(ctx, in);
+    if (ret < 0)
+      goto cleanup;
+
+    while (*pkt_count < SELF_TEST_FRAMES) {
+      AVPacket* pkt = av_packet_alloc();
+      if (!pkt) {
+        ret = -ENOMEM;
+        goto cleanup;
+      }
+
+      ret = avcodec_receive_packet(ctx, pkt);
+      if (ret < 0) {
+        av_packet_free(&pkt);
+        break;
+      }
+      pkts[(*pkt_count)++] = pkt;
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF && ret < 0)
+      goto cleanup;
+  }
+  ret = 0;
+
+cleanup:
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+  return ret;
+}
+
+static int time_backend(
+  enum decoder_backend backend,
+  uint32_t width,
+  uint32_t height,
+  uint32_t threads,
+  AVPacket** pkts,
+  int pkt_count,
+  uint8_t* out_buf,
+  uint64_t* elapsed
+) {
+  decoder dec;
+  int ret = init_decoder(&dec, width, height, backend, threads, NULL);
+  if (ret)
+    return ret;
+
+  // nothing to time without a clip, opening is the whole test
+  if (pkt_count == 0) {
+    cleanup_decoder(&dec);
+    *elapsed = 0;
+    return 0;
+  }
+
+  uint64_t start = now_ns();
+  int frames = 0;
+  uint64_t timestamp;
+  for (int i = 0; i <= pkt_count && ret == 0; i++) {
+    ret = i < pkt_count ?
+      decode_packet(&dec, pkts[i]->data, pkts[i]->size, i) :
+      flush_decoder(&dec);
+
+    while (ret == 0) {
+      ret = recv_frame(&dec, out_buf, &timestamp);
+      if (ret == 0)
+        frames++;
+    }
+    if (ret == EAGAIN || ret == ENODATA)
+      ret = 0;
+  }
+  *elapsed = now_ns() - start;
+
+  cleanup_decoder(&dec);
+  if (ret)
+    return ret;
+  return frames == pkt_count ? 0 : -EIO;
+}
+
+enum decoder_backend decoder_self_test(
+  uint32_t width,
+  uint32_t height,
+  uint32_t threads
+) {
+  /**
+   * Picks the fastest backend that works on this machine
+   *
+   * Every backend decodes the same short clip and the fastest one
+   * that decodes all of it wins. Without an H.264 encoder to make the
+   * clip, backends are only checked for opening, and cuvid is
+   * preferred over software when both open.
+   *
+   * Returns:
+   * - enum decoder_backend: the chosen backend, or DECODER_AUTO when
+   *   none of them work
+   */
+  char logstr[128];
+
+  AVPacket* pkts[SELF_TEST_FRAMES];
+  int pkt_count = 0;
+  if (encode_test_clip(width, height, pkts, &pkt_count)) {
+    for (int i = 0; i < pkt_count; i++)
+      av_packet_free(&pkts[i]);
+    pkt_count = 0;
+    log(WARNING, "Could not encode a clip for the decoder self-test, only checking backends open");
+  }
+
+  uint8_t* out_buf = malloc((size_t)width * height * 3 / 2);
+  enum decoder_backend best = DECODER_AUTO;
+  uint64_t best_elapsed = UINT64_MAX;
+
+  for (int b = DECODER_AUTO + 1; out_buf && b < DECODER_BACKEND_COUNT; b++) {
+    uint64_t elapsed;
+    int ret = time_backend(
+      b,
+      width,
+      height,
+      threads,
+      pkts,
+      pkt_count,
+      out_buf,
+      &elapsed
+    );
+    if (ret) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Decoder backend %s is unavailable",
+        backends[b].name
+      );
+      log(INFO, logstr);
+      continue;
+    }
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Decoder backend %s decoded %d test frames in %lu us",
+      backends[b].name,
+      pkt_count,
+      elapsed / 1000
+    );
+    log(INFO, logstr);
+
+    if (best == DECODER_AUTO || (pkt_count && elapsed < best_elapsed)) {
+      best = b;
+      best_elapsed = elapsed;
+    }
+  }
+
+  for (int i = 0; i < pkt_count; i++)
+    av_packet_free(&pkts[i]);
+  free(out_buf);
+
+  return best;
+}
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "logging.h"
+#include "network.h"
+#include "stream_mgr.h"
+#include "wire.h"
+
+#define RING_MASK (WIRE_RING_SIZE - 1)
+#define SPILL_ALL_FREE ((uint32_t)((1ULL << WIRE_SPILL_BUFS) - 1))
+
+static uint8_t* spill_mem = NULL;
+static _Atomic uint32_t spill_free = 0; // bit per free spill buffer
+
+int wire_spill_init() {
+  /**
+   * Reserves the spill buffers shared by every camera
+   *
+   * The reservation is lazy, so only spill buffers a large keyframe
+   * actually landed in ever take up memory.
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  spill_mem = mmap(
+    NULL,
+    (size_t)WIRE_SPILL_BUFS * WIRE_MAX_PAYLOAD,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+    -1,
+    0
+  );
+  if (spill_mem == MAP_FAILED) {
+    spill_mem = NULL;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error reserving spill buffers: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  atomic_store(&spill_free, SPILL_ALL_FREE);
+  return 0;
+}
+
+void wire_spill_cleanup() {
+  if (spill_mem)
+    munmap(spill_mem, (size_t)WIRE_SPILL_BUFS * WIRE_MAX_PAYLOAD);
+  spill_mem = NULL;
+  atomic_store(&spill_free, 0);
+}
+
+uint8_t* wire_spill_get() {
+  /**
+   * Takes a spill buffer, or returns NULL when every one is in use
+   */
+  uint32_t free_bufs = atomic_load(&spill_free);
+  while (free_bufs) {
+    uint32_t bit = free_bufs & -free_bufs;
+    if (atomic_compare_exchange_weak(&spill_free, &free_bufs, free_bufs & ~bit))
+      return spill_mem + (size_t)__builtin_ctz(bit) * WIRE_MAX_PAYLOAD;
+  }
+
+  return NULL;
+}
+
+void wire_spill_put(uint8_t* buf) {
+  uint32_t idx = (buf - spill_mem) / WIRE_MAX_PAYLOAD;
+  atomic_fetch_or(&spill_free, 1U << idx);
+}
+
+int wire_parse_header(
+  uint8_t* version,
+  const uint8_t* buf,
+  uint32_t avail,
+  struct wire_hdr* hdr
+) {
+  /**
+   * Parses the header at the start of buf, in the version of the
+   * connection's stream, which the first call for it settles
+   *
+   * Returns:
+   * - int: the header's size with hdr filled in, 0 on the v2 hello,
+   *   which takes WIRE_PROBE_SIZE bytes, -EAGAIN when more than avail
+   *   bytes are needed, -EBADMSG when a v2 stream has no valid header
+   *   at buf, so the caller skips ahead to the next WIRE_MAGIC, or
+   *   -EPROTO on a v1 header with an invalid size, which v1 can't
+   *   recover from
+   */
+  char logstr[128];
+
+  if (avail < WIRE_PROBE_SIZE)
+    return -EAGAIN;
+
+  if (*version == 0) {
+    if (memcmp(buf, WIRE_HELLO, WIRE_PROBE_SIZE) == 0) {
+      *version = 2;
+      return 0;
+    }
+    *version = 1;
+  }
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->version = *version;
+
+  if (*version == 1) {
+    if (memcmp(buf, WIRE_V1_EOS, WIRE_PROBE_SIZE) == 0) {
+      hdr->flags = WIRE_FLAG_EOS;
+      return WIRE_PROBE_SIZE;
+    }
+
+    if (avail < WIRE_V1_HEADER_SIZE)
+      return -EAGAIN;
+
+    memcpy(&hdr->timestamp, buf, sizeof(hdr->timestamp));
+    memcpy(&hdr->size, buf + 8, sizeof(hdr->size));
+    if (hdr->size == 0 || hdr->size > WIRE_MAX_PAYLOAD) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Received invalid frame size %u",
+        hdr->size
+      );
+      log(ERROR, logstr);
+      return -EPROTO;
+    }
+
+    return WIRE_V1_HEADER_SIZE;
+  }
+
+  uint32_t magic;
+  memcpy(&magic, buf, sizeof(magic));
+  if (magic != WIRE_MAGIC)
+    return -EBADMSG;
+
+  if (avail < WIRE_V2_HEADER_SIZE)
+    return -EAGAIN;
+
+  hdr->flags = buf[5];
+  hdr->cam_id = buf[6];
+  memcpy(&hdr->timestamp, buf + 8, sizeof(hdr->timestamp));
+  memcpy(&hdr->seq, buf + 16, sizeof(hdr->seq));
+  memcpy(&hdr->size, buf + 20, sizeof(hdr->size));
+  memcpy(&hdr->crc, buf + 24, sizeof(hdr->crc));
+
+  bool eos = hdr->flags & WIRE_FLAG_EOS;
+  if (buf[4] != 2 || hdr->size > WIRE_MAX_PAYLOAD || (hdr->size == 0) != eos)
+    return -EBADMSG;
+
+  hdr->hdr_crc = crc32c(0, buf, WIRE_V2_HEADER_SIZE - sizeof(hdr->crc));
+  if (eos && hdr->crc != hdr->hdr_crc)
+    return -EBADMSG;
+
+  return WIRE_V2_HEADER_SIZE;
+}
+
+uint32_t wire_header_size(uint8_t version) {
+  /**
+   * Returns the bytes wire_parse_header needs to parse a header in
+   * version, or to tell which version a stream is in
+   */
+  if (version == 1)
+    return WIRE_V1_HEADER_SIZE;
+  if (version == 2)
+    return WIRE_V2_HEADER_SIZE;
+  return WIRE_PROBE_SIZE;
+}
+
+bool wire_payload_ok(struct wire_hdr* hdr, const uint8_t* payload) {
+  /**
+   * Checks a payload against its header's CRC, v1 has none to check
+   */
+  if (hdr->version != 2)
+    return true;
+
+  return crc32c(hdr->hdr_crc, payload, hdr->size) == hdr->crc;
+}
+
+void wire_hdr_pkt(struct wire_hdr* hdr, struct rx_pkt* pkt) {
+  /**
+   * Fills in the fields of a packet that come from its header
+   */
+  pkt->timestamp = hdr->timestamp;
+  pkt->size = hdr->size;
+  pkt->version = hdr->version;
+  pkt->flags = hdr->flags;
+  pkt->cam_id = hdr->cam_id;
+  pkt->seq = hdr->seq;
+}
+
+uint32_t wire_seq_lost(
+  struct wire_seq* seq,
+  struct rx_pkt* pkt,
+  uint8_t cam_id,
+  const char* cam_name
+) {
+  /**
+   * Counts the records lost just before a packet
+   *
+   * For v2 that's the gap in sequence numbers, which takes in records
+   * lost anywhere from the camera's encoder on, and for v1 only the
+   * records the parser dropped. A camera's numbering starts from 0, so
+   * the first packet after it starts, or restarts, counts the ones
+   * before it as lost.
+   */
+  char logstr[128];
+
+  if (pkt->version != 2)
+    return pkt->dropped;
+
+  if (!seq->id_warned && pkt->cam_id != WIRE_CAM_UNSET && pkt->cam_id != cam_id) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s streams as camera id %u rather than %u, check its config",
+      cam_name,
+      pkt->cam_id,
+      cam_id
+    );
+    log(WARNING, logstr);
+    seq->id_warned = true;
+  }
+
+  uint32_t lost = pkt->seq - seq->next;
+  if (!seq->valid || (int32_t)lost < 0)
+    lost = pkt->seq;
+
+  seq->valid = true;
+  seq->next = pkt->seq + (pkt->size ? 1 : 0);
+  return lost;
+}
+
+int wire_rx_init(struct wire_rx* rx) {
+  /**
+   * Maps a receive ring as the same memfd pages twice in a row
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+  int ret = 0;
+
+  memset(rx, 0, sizeof(*rx));
+
+  int fd = memfd_create("wire_rx", MFD_CLOEXEC);
+  if (fd == -1) {
+    ret = -errno;
+    goto err;
+  }
+
+  if (ftruncate(fd, WIRE_RING_SIZE) == -1) {
+    ret = -errno;
+    goto err;
+  }
+
+  // reserve both halves first so nothing else can land in the second
+  uint8_t* base = mmap(
+    NULL,
+    2 * WIRE_RING_SIZE,
+    PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS,
+    -1,
+    0
+  );
+  if (base == MAP_FAILED) {
+    ret = -errno;
+    goto err;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    void* half = mmap(
+      base + i * WIRE_RING_SIZE,
+      WIRE_RING_SIZE,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_FIXED,
+      fd,
+      0
+    );
+    if (half == MAP_FAILED) {
+      ret = -errno;
+      munmap(base, 2 * WIRE_RING_SIZE);
+      goto err;
+    }
+  }
+
+  close(fd);
+  rx->ring = base;
+  return 0;
+
+err:
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Error mapping receive ring: %s",
+    strerror(-ret)
+  );
+  log(ERROR, logstr);
+  if (fd >= 0)
+    close(fd);
+  return ret;
+}
+
+void wire_rx_cleanup(struct wire_rx* rx) {
+  if (rx->ring)
+    munmap(rx->ring, 2 * WIRE_RING_SIZE);
+  if (rx->spill)
+    wire_spill_put(rx->spill);
+  rx->ring = NULL;
+  rx->spill = NULL;
+}
+
+void wire_rx_reset(struct wire_rx* rx) {
+  /**
+   * Drops a partly received record, so a new connection's stream is
+   * parsed from its first record, in whichever version it turns out
+   * to be
+   */
+  if (rx->spill)
+    wire_spill_put(rx->spill);
+  rx->spill = NULL;
+  rx->in_spill = false;
+  rx->resyncing = false;
+  rx->version = 0;
+  rx->head = 0;
+  rx->tail = 0;
+}
+
+ssize_t wire_rx_recv(struct wire_rx* rx, int fd) {
+  /**
+   * Receives as many bytes as are available and fit in one call
+   *
+   * The remainder of an oversized record goes straight into its spill
+   * buffer. Everything else goes into the free part of the ring, which
+   * includes the space of records already handed out, so those are
+   * only valid until this is called again.
+   *
+   * Returns:
+   * - ssize_t: as from recv_nonblock
+   */
+  ssize_t bytes;
+  rx->recvs++;
+
+  if (rx->in_spill && rx->spill && rx->head == rx->tail) {
+    bytes = recv_nonblock(
+      fd,
+      (char*)rx->spill + rx->spill_have,
+      rx->spill_hdr.size - rx->spill_have
+    );
+    if (bytes > 0)
+      rx->spill_have += bytes;
+    return bytes;
+  }
+
+  bytes = recv_nonblock(
+    fd,
+    (char*)rx->ring + (rx->head & RING_MASK),
+    WIRE_RING_SIZE - (rx->head - rx->tail)
+  );
+  if (bytes > 0)
+    rx->head += bytes;
+  return bytes;
+}
+
+static void take_counts(struct wire_rx* rx, struct rx_pkt* pkt) {
+  pkt->dropped = rx->dropped;
+  pkt->corrupt = rx->corrupt;
+  rx->dropped = 0;
+  rx->corrupt = 0;
+}
+
+int wire_rx_next(struct wire_rx* rx, struct rx_pkt* pkt) {
+  /**
+   * Parses the next complete record out of the received bytes
+   *
+   * A corrupt v2 record is dropped, and bytes are skipped up to the
+   * next WIRE_MAGIC that starts a valid header.
+   *
+   * Returns:
+   * - int: 0 with pkt filled, a size of 0 marking the end of the
+   *   stream, -EAGAIN when no complete record has been received yet,
+   *   or -EPROTO on a malformed v1 stream
+   */
+  char logstr[128];
+
+  while (true) {
+    uint64_t avail = rx->head - rx->tail;
+    uint8_t* rec = rx->ring + (rx->tail & RING_MASK);
+
+    if (rx->in_spill) {
+      struct wire_hdr* hdr = &rx->spill_hdr;
+      uint32_t n = hdr->size - rx->spill_have;
+      if (n > avail)
+        n = avail;
+      if (rx->spill)
+        memcpy(rx->spill + rx->spill_have, rec, n);
+      rx->spill_have += n;
+      rx->tail += n;
+
+      if (rx->spill_have < hdr->size)
+        return -EAGAIN;
+
+      rx->in_spill = false;
+      if (!rx->spill) {
+        rx->discarded++;
+        rx->dropped++;
+        continue;
+      }
+
+      if (!wire_payload_ok(hdr, rx->spill)) {
+        wire_spill_put(rx->spill);
+        rx->spill = NULL;
+        rx->corrupt++;
+        continue;
+      }
+
+      wire_hdr_pkt(hdr, pkt);
+      pkt->data = rx->spill;
+      pkt->spilled = true;
+      take_counts(rx, pkt);
+      rx->spill = NULL;
+      return 0;
+    }
+
+    struct wire_hdr hdr;
+    int hdr_size = wire_parse_header(
+      &rx->version,
+      rec,
+      avail < UINT32_MAX ? avail : UINT32_MAX,
+      &hdr
+    );
+    if (hdr_size == -EBADMSG) {
+      if (!rx->resyncing)
+        rx->corrupt++;
+      rx->resyncing = true;
+
+      // the magic might straddle the end of what has been received
+      uint32_t magic = WIRE_MAGIC;
+      uint8_t* next = memmem(rec + 1, avail - 1, &magic, sizeof(magic));
+      rx->tail += next ? (uint64_t)(next - rec) : avail - (sizeof(magic) - 1);
+      continue;
+    }
+    if (hdr_size < 0)
+      return hdr_size;
+    if (hdr_size == 0) {
+      rx->tail += WIRE_PROBE_SIZE;
+      continue;
+    }
+    rx->resyncing = false;
+
+    if (hdr.size > ENCODED_FRAME_BUF_SIZE) {
+      rx->tail += hdr_size;
+      rx->in_spill = true;
+      rx->spill_hdr = hdr;
+      rx->spill_have = 0;
+      rx->spill = wire_spill_get();
+      if (!rx->spill) {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "No spill buffer free for a %u byte frame, dropping it",
+          hdr.size
+        );
+        log(WARNING, logstr);
+      }
+      continue;
+    }
+
+    if (avail < hdr_size + hdr.size)
+      return -EAGAIN;
+
+    rx->tail += hdr_size + hdr.size;
+    if (!wire_payload_ok(&hdr, rec + hdr_size)) {
+      rx->corrupt++;
+      continue;
+    }
+
+    wire_hdr_pkt(&hdr, pkt);
+    pkt->data = hdr.size ? rec + hdr_size : NULL;
+    pkt->spilled = false;
+    take_counts(rx, pkt);
+    return 0;
+  }
+}
+
+int wire_rx_recv_packet(
+  struct wire_rx* wire,
+  int clientfd,
+  struct rx_pkt* pkt,
+  const char* cam_name
+) {
+  /**
+   * Returns the next record from a blocking socket, receiving only
+   * when none is buffered
+   *
+   * Returns:
+   * - int: 0 with pkt filled, a size of 0 marking the end of the
+   *   stream, -EINTR when interrupted by a signal, or a negative errno
+   */
+  char logstr[128];
+
+  while (true) {
+    int ret = wire_rx_next(wire, pkt);
+    if (ret != -EAGAIN)
+      return ret;
+
+    // the socket's receive timeout surfaces as -EAGAIN
+    ssize_t bytes = wire_rx_recv(wire, clientfd);
+    if (bytes == -EAGAIN) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Timed out waiting for packet from cam %s",
+        cam_name
+      );
+      log(WARNING, logstr);
+      return -ETIMEDOUT;
+    }
+    if (bytes == 0)
+      return -ECONNRESET;
+    if (bytes < 0)
+      return bytes;
+  }
+}
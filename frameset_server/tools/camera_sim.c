@@ -0,0 +1,766 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "logging.h"
+#include "parse_conf.h"
+#include "shm_layout.h"
+#include "wire.h"
+
+/*
+ * Stands in for a set of picam cameras so the server can be run and
+ * benchmarked without any hardware
+ *
+ * Each simulated camera listens for the server's UDP start timestamp
+ * on its configured port, connects to the server's TCP port for it,
+ * and streams a looping H.264 clip in the picam wire format, v2 as
+ * described in wire.h or v1 with -1, ending the stream once the server
+ * sends "STOP". Frames are stamped and by default paced at
+ * start + n * frame interval like a real camera, or sent back to back
+ * with -a.
+ *
+ * The clip is a recording, anything libavformat can demux including the
+ * server's record mode output, or else a moving test pattern encoded at
+ * startup with whichever H.264 encoder is available.
+ *
+ * Running on one host takes a config with every camera on 127.0.0.1
+ * and a port pair of its own, which -g prints:
+ *
+ *   camera_sim -g 16 > /tmp/cams16.yaml
+ *   camera_sim -c /tmp/cams16.yaml
+ *
+ * Once every camera's UDP port is bound it prints "ready" on stdout, so
+ * a script or benchmark driving it knows when the server can be started.
+ */
+
+#define LOG_PATH "/dev/stderr"
+#define CAM_CONF_PATH "/etc/mocap-toolkit/cams.yaml"
+#define DEFAULT_SERVER_IP "127.0.0.1"
+#define SYNTH_CLIP_SEC 2
+#define UDP_POLL_TIMEOUT_US 100000 // bounds how long a stop goes unnoticed
+#define GEN_BASE_TCP_PORT 12345
+#define GEN_BASE_UDP_PORT 22345
+
+struct clip {
+  uint8_t** pkts;
+  uint32_t* sizes;
+  bool* keyframes;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+struct sim_cam {
+  struct cam_conf* conf;
+  struct clip* clip;
+  struct in_addr server_ip;
+  uint64_t interval;
+  bool fast;
+  uint8_t wire_version;
+  int udpfd;
+  pthread_t thread;
+
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t max_lag; // furthest a paced frame went out behind its timestamp
+  uint64_t elapsed;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int clip_append(
+  struct clip* clip,
+  uint8_t* data,
+  uint32_t size,
+  bool keyframe
+) {
+  if (clip->count == clip->capacity) {
+    uint32_t capacity = clip->capacity ? clip->capacity * 2 : 64;
+    uint8_t** pkts = realloc(clip->pkts, capacity * sizeof(uint8_t*));
+    if (pkts)
+      clip->pkts = pkts;
+    uint32_t* sizes = realloc(clip->sizes, capacity * sizeof(uint32_t));
+    if (sizes)
+      clip->sizes = sizes;
+    bool* keyframes = realloc(clip->keyframes, capacity * sizeof(bool));
+    if (keyframes)
+      clip->keyframes = keyframes;
+    if (!pkts || !sizes || !keyframes)
+      return -ENOMEM;
+    clip->capacity = capacity;
+  }
+
+  uint8_t* copy = malloc(size);
+  if (!copy)
+    return -ENOMEM;
+  memcpy(copy, data, size);
+
+  clip->pkts[clip->count] = copy;
+  clip->sizes[clip->count] = size;
+  clip->keyframes[clip->count] = keyframe;
+  clip->count++;
+  return 0;
+}
+
+static void clip_cleanup(struct clip* clip) {
+  for (uint32_t i = 0; i < clip->count; i++)
+    free(clip->pkts[i]);
+  free(clip->pkts);
+  free(clip->sizes);
+  free(clip->keyframes);
+  memset(clip, 0, sizeof(*clip));
+}
+
+static int load_clip(struct clip* clip, const char* path) {
+  /**
+   * Reads the first video stream of a recording into memory as Annex B
+   * packets, the way picam sends them, starting from its first keyframe
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+  AVFormatContext* fmt = NULL;
+  AVBSFContext* bsf = NULL;
+  AVPacket* pkt = av_packet_alloc();
+  if (!pkt)
+    return -ENOMEM;
+
+  int ret = avformat_open_input(&fmt, path, NULL, NULL);
+  if (ret < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening clip %s",
+      path
+    );
+    log(ERROR, logstr);
+    goto cleanup;
+  }
+
+  ret = avformat_find_stream_info(fmt, NULL);
+  if (ret < 0)
+    goto cleanup;
+
+  int stream_idx = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (stream_idx < 0 || fmt->streams[stream_idx]->codecpar->codec_id != AV_CODEC_ID_H264) {
+    log(ERROR, "Clip has no H.264 video stream");
+    ret = -EINVAL;
+    goto cleanup;
+  }
+
+  // containers store length prefixed NALs, the wire carries start codes
+  const AVBitStreamFilter* filter = av_bsf_get_by_name("h264_mp4toannexb");
+  ret = filter ? av_bsf_alloc(filter, &bsf) : -ENODEV;
+  if (ret < 0)
+    goto cleanup;
+  avcodec_parameters_copy(bsf->par_in, fmt->streams[stream_idx]->codecpar);
+  bsf->time_base_in = fmt->streams[stream_idx]->time_base;
+  ret = av_bsf_init(bsf);
+  if (ret < 0)
+    goto cleanup;
+
+  while (av_read_frame(fmt, pkt) >= 0) {
+    if (pkt->stream_index != stream_idx) {
+      av_packet_unref(pkt);
+      continue;
+    }
+
+    ret = av_bsf_send_packet(bsf, pkt);
+    if (ret < 0)
+      goto cleanup;
+
+    while (av_bsf_receive_packet(bsf, pkt) == 0) {
+      bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+      if (clip->count > 0 || keyframe)
+        ret = clip_append(clip, pkt->data, pkt->size, keyframe);
+      av_packet_unref(pkt);
+      if (ret)
+        goto cleanup;
+    }
+  }
+
+  if (clip->count == 0) {
+    log(ERROR, "Clip has no keyframe to start from");
+    ret = -EINVAL;
+  }
+
+cleanup:
+  av_bsf_free(&bsf);
+  avformat_close_input(&fmt);
+  av_packet_free(&pkt);
+  return ret < 0 ? ret : 0;
+}
+
+static void draw_pattern(AVFrame* frame, int n) {
+  // diagonal bars scrolling under a bouncing box, enough motion to cost real decode work
+  int box = frame->height / 4;
+  int span = frame->width - box;
+  int box_x = (n * 8) % (2 * span);
+  if (box_x > span)
+    box_x = 2 * span - box_x;
+  int box_y = (frame->height - box) / 2;
+
+  for (int y = 0; y < frame->height; y++) {
+    uint8_t* row = frame->data[0] + y * frame->linesize[0];
+    bool in_rows = y >= box_y && y < box_y + box;
+    for (int x = 0; x < frame->width; x++) {
+      bool in_box = in_rows && x >= box_x && x < box_x + box;
+      row[x] = in_box ? 235 : (uint8_t)((x + y + n * 4) & 0xff);
+    }
+  }
+
+  for (int plane = 1; plane < 3; plane++) {
+    for (int y = 0; y < frame->height / 2; y++) {
+      uint8_t* row = frame->data[plane] + y * frame->linesize[plane];
+      for (int x = 0; x < frame->width / 2; x++)
+        row[x] = (uint8_t)(128 + (plane == 1 ? x - n : y + n) % 64);
+    }
+  }
+}
+
+static int synth_clip(struct clip* clip, struct stream_conf* stream_conf) {
+  /**
+   * Encodes SYNTH_CLIP_SEC of test pattern, a keyframe per second and no
+   * b-frames, with the parameter sets in every keyframe like picam
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  char logstr[128];
+  int ret = 0;
+  AVFrame* frame = NULL;
+  AVPacket* pkt = NULL;
+
+  const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+  if (!codec) {
+    log(ERROR, "No H.264 encoder available, pass a clip with -f");
+    return -ENODEV;
+  }
+
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  frame = av_frame_alloc();
+  pkt = av_packet_alloc();
+  if (!ctx || !frame || !pkt) {
+    ret = -ENOMEM;
+    goto cleanup;
+  }
+
+  ctx->width = stream_conf->frame_width;
+  ctx->height = stream_conf->frame_height;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  ctx->time_base = (AVRational){1, stream_conf->fps};
+  ctx->framerate = (AVRational){stream_conf->fps, 1};
+  ctx->gop_size = stream_conf->fps;
+  ctx->max_b_frames = 0;
+  av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+  av_opt_set(ctx->priv_data, "preset", "veryfast", 0);
+
+  ret = avcodec_open2(ctx, codec, NULL);
+  if (ret < 0) {
+    log(ERROR, "Error opening the H.264 encoder");
+    goto cleanup;
+  }
+
+  frame->format = ctx->pix_fmt;
+  frame->width = ctx->width;
+  frame->height = ctx->height;
+  ret = av_frame_get_buffer(frame, 0);
+  if (ret < 0)
+    goto cleanup;
+
+  int frame_count = SYNTH_CLIP_SEC * stream_conf->fps;
+  for (int i = 0; i <= frame_count; i++) {
+    if (i < frame_count) {
+      ret = av_frame_make_writable(frame);
+      if (ret < 0)
+        goto cleanup;
+      draw_pattern(frame, i);
+      frame->pts = i;
+    }
+
+    ret = avcodec_send_frame(ctx, i < frame_count ? frame : NULL);
+    if (ret < 0)
+      goto cleanup;
+
+    while ((ret = avcodec_receive_packet(ctx, pkt)) == 0) {
+      ret = clip_append(clip, pkt->data, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+      av_packet_unref(pkt);
+      if (ret)
+        goto cleanup;
+    }
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      ret = 0;
+    if (ret < 0)
+      goto cleanup;
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Encoded a %u frame test clip with %s",
+    clip->count,
+    codec->name
+  );
+  log(INFO, logstr);
+
+cleanup:
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&ctx);
+  return ret < 0 ? ret : 0;
+}
+
+static int bind_udp(uint16_t port) {
+  char logstr[128];
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -errno;
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_ANY)
+  };
+  struct timeval timeout = {
+    .tv_sec = 0,
+    .tv_usec = UDP_POLL_TIMEOUT_US
+  };
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+    int ret = -errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error binding udp port %u: %s",
+      port,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    close(fd);
+    return ret;
+  }
+
+  return fd;
+}
+
+static int conn_tcp(struct in_addr ip, uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -errno;
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr = ip
+  };
+  while (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (errno == EINTR)
+      continue;
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  return fd;
+}
+
+static int send_all(int fd, struct iovec* iov, int iov_count) {
+  while (iov_count > 0) {
+    ssize_t n = writev(fd, iov, iov_count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -errno;
+
+    while (iov_count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iov_count--;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = (uint8_t*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+static void put_v2_header(
+  uint8_t* hdr,
+  uint64_t timestamp,
+  uint32_t seq,
+  uint8_t flags,
+  uint8_t cam_id,
+  const uint8_t* payload,
+  uint32_t size
+) {
+  uint32_t magic = WIRE_MAGIC;
+  memset(hdr, 0, WIRE_V2_HEADER_SIZE);
+  memcpy(hdr, &magic, sizeof(magic));
+  hdr[4] = 2;
+  hdr[5] = flags;
+  hdr[6] = cam_id;
+  memcpy(hdr + 8, &timestamp, sizeof(timestamp));
+  memcpy(hdr + 16, &seq, sizeof(seq));
+  memcpy(hdr + 20, &size, sizeof(size));
+
+  uint32_t crc = crc32c(0, hdr, WIRE_V2_HEADER_SIZE - sizeof(crc));
+  crc = crc32c(crc, payload, size);
+  memcpy(hdr + 24, &crc, sizeof(crc));
+}
+
+static bool stop_received(int udpfd) {
+  char msg[8];
+  ssize_t n = recv(udpfd, msg, sizeof(msg), MSG_DONTWAIT);
+  return n == 4 && memcmp(msg, "STOP", 4) == 0;
+}
+
+static int stream_clip(struct sim_cam* cam, int udpfd, uint64_t start) {
+  /**
+   * Streams the clip on a loop from the given start timestamp until
+   * the server sends a stop
+   *
+   * Returns:
+   * - int: 0 after a stop, or a negative errno
+   */
+  char logstr[128];
+
+  int tcpfd = conn_tcp(cam->server_ip, cam->conf->tcp_port);
+  if (tcpfd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %s failed to connect to the server: %s",
+      cam->conf->name,
+      strerror(-tcpfd)
+    );
+    log(ERROR, logstr);
+    return tcpfd;
+  }
+
+  int ret = 0;
+  uint8_t hdr[WIRE_V2_HEADER_SIZE];
+  struct iovec hello = { .iov_base = WIRE_HELLO, .iov_len = WIRE_PROBE_SIZE };
+  bool greet = cam->wire_version == 2;
+
+  uint64_t n = 0;
+  uint64_t began = realtime_ns();
+  for (; running; n++) {
+    uint64_t timestamp = start + n * cam->interval;
+
+    if (!cam->fast) {
+      struct timespec target = {
+        .tv_sec = timestamp / 1000000000ULL,
+        .tv_nsec = timestamp % 1000000000ULL
+      };
+      while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &target, NULL) == EINTR && running);
+
+      uint64_t now = realtime_ns();
+      if (now > timestamp && now - timestamp > cam->max_lag)
+        cam->max_lag = now - timestamp;
+    }
+
+    if (stop_received(udpfd))
+      break;
+
+    uint32_t idx = n % cam->clip->count;
+    uint32_t size = cam->clip->sizes[idx];
+    struct iovec iov[3] = {
+      { .iov_base = &timestamp, .iov_len = sizeof(timestamp) },
+      { .iov_base = &size, .iov_len = sizeof(size) },
+      { .iov_base = cam->clip->pkts[idx], .iov_len = size }
+    };
+    int iov_count = 3;
+    if (cam->wire_version == 2) {
+      put_v2_header(
+        hdr,
+        timestamp,
+        n,
+        cam->clip->keyframes[idx] ? WIRE_FLAG_KEYFRAME : 0,
+        cam->conf->id,
+        cam->clip->pkts[idx],
+        size
+      );
+      iov[0] = (struct iovec){ .iov_base = hdr, .iov_len = WIRE_V2_HEADER_SIZE };
+      iov[1] = iov[2];
+      iov_count = 2;
+    }
+
+    ret = greet ? send_all(tcpfd, &hello, 1) : 0;
+    greet = false;
+    if (ret == 0)
+      ret = send_all(tcpfd, iov, iov_count);
+    if (ret) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %s lost the server: %s",
+        cam->conf->name,
+        strerror(-ret)
+      );
+      log(WARNING, logstr);
+      break;
+    }
+
+    cam->frames++;
+    cam->bytes += size;
+  }
+  cam->elapsed += realtime_ns() - began;
+
+  if (ret == 0) {
+    struct iovec eos = { .iov_base = WIRE_V1_EOS, .iov_len = WIRE_PROBE_SIZE };
+    if (cam->wire_version == 2) {
+      put_v2_header(hdr, 0, n, WIRE_FLAG_EOS, cam->conf->id, NULL, 0);
+      eos = (struct iovec){ .iov_base = hdr, .iov_len = WIRE_V2_HEADER_SIZE };
+    }
+    send_all(tcpfd, &eos, 1);
+  }
+  close(tcpfd);
+  return ret;
+}
+
+static void* sim_cam_fn(void* ptr) {
+  /**
+   * Waits for start timestamps like a camera's framecap service,
+   * streaming from each until it's stopped
+   */
+  struct sim_cam* cam = (struct sim_cam*)ptr;
+  int udpfd = cam->udpfd;
+
+  while (running) {
+    char msg[8];
+    ssize_t n = recv(udpfd, msg, sizeof(msg), 0);
+    if (n != sizeof(uint64_t))
+      continue; // poll timeout, or a stop while already idle
+
+    uint64_t start;
+    memcpy(&start, msg, sizeof(start));
+    stream_clip(cam, udpfd, start);
+  }
+
+  close(udpfd);
+  return NULL;
+}
+
+static void print_conf(int cam_count, struct stream_conf* stream_conf) {
+  printf("stream_params:\n");
+  printf("  frame_width: %u\n", stream_conf->frame_width);
+  printf("  frame_height: %u\n", stream_conf->frame_height);
+  printf("  fps: %u\n", stream_conf->fps);
+  printf("cameras:\n");
+  for (int i = 0; i < cam_count; i++) {
+    printf("  - name: rpicam%02d\n", i);
+    printf("    id: %d\n", i + 1);
+    printf("    eth_ip: 127.0.0.1\n");
+    printf("    wifi_ip: 127.0.0.1\n");
+    printf("    tcp_port: %d\n", GEN_BASE_TCP_PORT + i);
+    printf("    udp_port: %d\n", GEN_BASE_UDP_PORT + i);
+  }
+}
+
+static void log_cam_stats(struct sim_cam* cam) {
+  char logstr[128];
+
+  double secs = cam->elapsed ? cam->elapsed / 1e9 : 1;
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Camera %s sent %lu frames, %.1f fps, %.1f Mbit/s, max lag %.2f ms",
+    cam->conf->name,
+    cam->frames,
+    cam->frames / secs,
+    cam->bytes * 8 / secs / 1e6,
+    cam->max_lag / 1e6
+  );
+  log(INFO, logstr);
+}
+
+int main(int argc, char* argv[]) {
+  int ret = 0;
+  char logstr[128];
+
+  const char* conf_path = CAM_CONF_PATH;
+  const char* clip_path = NULL;
+  const char* server_ip = DEFAULT_SERVER_IP;
+  int sim_count = 0;
+  int gen_count = 0;
+  bool fast = false;
+  uint8_t wire_version = 2;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:f:s:n:g:a1")) != -1) {
+    switch (opt) {
+      case 'c':
+        conf_path = optarg;
+        break;
+      case 'f':
+        clip_path = optarg;
+        break;
+      case 's':
+        server_ip = optarg;
+        break;
+      case 'n':
+        sim_count = atoi(optarg);
+        break;
+      case 'g':
+        gen_count = atoi(optarg);
+        break;
+      case 'a':
+        fast = true;
+        break;
+      case '1':
+        wire_version = 1;
+        break;
+      default:
+        fprintf(
+          stderr,
+          "Usage: camera_sim [-c cams.yaml] [-f clip] [-s server_ip] [-n cams] [-a] [-1]\n"
+          "       camera_sim -g cams\n"
+        );
+        return -EINVAL;
+    }
+  }
+
+  if (gen_count > 0) {
+    struct stream_conf defaults = {
+      .frame_width = 1280,
+      .frame_height = 720,
+      .fps = 30
+    };
+    if (gen_count > MAX_CAMS || gen_count > 100) {
+      fprintf(stderr, "At most %d cameras\n", MAX_CAMS < 100 ? MAX_CAMS : 100);
+      return -EINVAL;
+    }
+    print_conf(gen_count, &defaults);
+    return 0;
+  }
+
+  ret = setup_logging(LOG_PATH);
+  if (ret) {
+    printf("Error opening log file: %s\n", strerror(-ret));
+    return ret;
+  }
+
+  struct sigaction sa = {
+    .sa_handler = shutdown_handler,
+    .sa_flags = 0
+  };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int cam_count = count_cameras(conf_path);
+  if (cam_count <= 0) {
+    cleanup_logging();
+    return cam_count ? cam_count : -EINVAL;
+  }
+
+  struct stream_conf stream_conf;
+  struct cam_conf confs[cam_count];
+  ret = parse_conf(&stream_conf, confs, cam_count);
+  if (ret) {
+    cleanup_logging();
+    return ret;
+  }
+
+  if (sim_count <= 0 || sim_count > cam_count)
+    sim_count = cam_count;
+
+  struct in_addr ip;
+  if (inet_pton(AF_INET, server_ip, &ip) != 1) {
+    log(ERROR, "Invalid server ip");
+    cleanup_logging();
+    return -EINVAL;
+  }
+
+  struct clip clip = {0};
+  ret = clip_path ? load_clip(&clip, clip_path) : synth_clip(&clip, &stream_conf);
+  if (ret) {
+    clip_cleanup(&clip);
+    cleanup_logging();
+    return ret;
+  }
+
+  struct sim_cam cams[sim_count];
+  memset(cams, 0, sizeof(cams));
+  int spawned = 0;
+  for (int i = 0; i < sim_count; i++, spawned++) {
+    cams[i].conf = &confs[i];
+    cams[i].clip = &clip;
+    cams[i].server_ip = ip;
+    cams[i].interval = 1000000000ULL / stream_conf.fps;
+    cams[i].fast = fast;
+    cams[i].wire_version = wire_version;
+
+    // bound before any thread starts, so no start timestamp is missed
+    // once ready has been printed
+    cams[i].udpfd = bind_udp(confs[i].udp_port);
+    if (cams[i].udpfd < 0) {
+      ret = cams[i].udpfd;
+      running = 0;
+      break;
+    }
+
+    ret = pthread_create(&cams[i].thread, NULL, sim_cam_fn, &cams[i]);
+    if (ret) {
+      log(ERROR, "Error spawning camera thread");
+      close(cams[i].udpfd);
+      running = 0;
+      break;
+    }
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Simulating %d cameras with a %u frame clip%s",
+    spawned,
+    clip.count,
+    fast ? ", unpaced" : ""
+  );
+  log(INFO, logstr);
+
+  if (running) {
+    printf("ready\n");
+    fflush(stdout);
+  }
+
+  for (int i = 0; i < spawned; i++) {
+    pthread_join(cams[i].thread, NULL);
+    log_cam_stats(&cams[i]);
+  }
+
+  clip_cleanup(&clip);
+  cleanup_logging();
+  return ret;
+}
@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frameset_bus.h"
+#include "logging.h"
+#include "shm_layout.h"
+#include "stats.h"
+
+/*
+ * Watches a running server through the stats region of its shared
+ * memory segment
+ *
+ * Maps the segment read only, so it never subscribes, never holds a
+ * frameset and can't disturb the session it is watching. Every
+ * interval it takes the difference between two snapshots of the
+ * server's counters and shows per camera rates next to the pipeline's
+ * frameset rate and how far behind each subscriber is:
+ *
+ *   mocap-stat                 live view, refreshed every second
+ *   mocap-stat -j -c 1         one JSON snapshot
+ *   mocap-stat -j -i 500       a JSON line every 500 ms until stopped
+ *
+ * A camera whose age keeps growing has stopped delivering, one with
+ * queued packets piling up is decoding slower than it receives, one
+ * losing packets has a lossy link and resyncs at each keyframe after
+ * a loss, and a subscriber whose held count stays high is a slow
+ * consumer.
+ */
+
+#define LOG_PATH "/dev/stderr"
+#define DEFAULT_INTERVAL_MS 1000
+
+struct cam_snap {
+  uint64_t bytes;
+  uint64_t packets;
+  uint64_t lost;
+  uint64_t corrupt;
+  uint64_t recv_syscalls;
+  uint64_t decoded_packets;
+  uint64_t decode_ns;
+  uint64_t frames;
+  uint64_t dropped;
+  uint64_t late;
+  uint64_t pool_denied;
+  uint64_t last_capture;
+  uint32_t held;
+};
+
+struct sub_snap {
+  uint32_t state;
+  int32_t pid;
+  uint32_t held;
+};
+
+struct stats_snap {
+  uint64_t taken; // realtime ns
+  uint64_t updated;
+  uint64_t published;
+  uint64_t complete_framesets;
+  uint64_t partial_framesets;
+  uint64_t expired_framesets;
+  uint64_t reaped_subscribers;
+  int64_t pool_free;
+  uint32_t inflight_framesets;
+  uint64_t active_mask; // frameset positions with a camera streaming
+  struct sub_snap subs[MAX_SUBSCRIBERS];
+  struct cam_snap cams[MAX_CAMS];
+};
+
+struct stat_seg {
+  int fd;
+  uint8_t* buf;
+  size_t size;
+  struct shm_header* hdr;
+  struct server_stats* stats;
+  struct frameset_bus* bus;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int open_segment(const char* name) {
+  /**
+   * Opens the server's segment where a consumer would find it, on a
+   * hugetlbfs mount under its name, or else as a POSIX shm object
+   */
+  char path[PATH_MAX];
+
+  FILE* mounts = setmntent("/proc/mounts", "r");
+  if (mounts) {
+    struct mntent* mnt;
+    while ((mnt = getmntent(mounts)) != NULL) {
+      if (strcmp(mnt->mnt_type, "hugetlbfs") != 0)
+        continue;
+
+      snprintf(path, sizeof(path), "%s%s", mnt->mnt_dir, name);
+      int fd = open(path, O_RDONLY);
+      if (fd >= 0) {
+        endmntent(mounts);
+        return fd;
+      }
+    }
+    endmntent(mounts);
+  }
+
+  int fd = shm_open(name, O_RDONLY, 0);
+  return fd >= 0 ? fd : -errno;
+}
+
+static int map_segment(struct stat_seg* seg, const char* name) {
+  /**
+   * Maps the header to check the segment is a ready one from a server
+   * with our layout, then maps all of it read only
+   *
+   * Returns:
+   * - int: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  memset(seg, 0, sizeof(*seg));
+  seg->fd = open_segment(name);
+  if (seg->fd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening %s, is the server running: %s",
+      name,
+      strerror(-seg->fd)
+    );
+    log(ERROR, logstr);
+    return seg->fd;
+  }
+
+  // hugetlbfs reports its page size as the block size, and only maps whole pages
+  struct stat sb;
+  struct statfs sfs;
+  if (fstat(seg->fd, &sb) == -1 || fstatfs(seg->fd, &sfs) == -1)
+    return -errno;
+  size_t header_map_size = (sizeof(struct shm_header) + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+  if ((size_t)sb.st_size < header_map_size) {
+    log(ERROR, "Shared memory segment is not initialized yet");
+    return -EAGAIN;
+  }
+
+  struct shm_header* hdr = mmap(NULL, header_map_size, PROT_READ, MAP_SHARED, seg->fd, 0);
+  if (hdr == MAP_FAILED)
+    return -errno;
+
+  const char* invalid = NULL;
+  if (hdr->magic != SHM_MAGIC)
+    invalid = "Shared memory segment was not created by the stream server";
+  else if (hdr->version != SHM_VERSION || hdr->header_size != sizeof(struct shm_header))
+    invalid = "Shared memory layout version does not match this build";
+  else if (!atomic_load_explicit(&hdr->ready, memory_order_acquire))
+    invalid = "Shared memory segment is not initialized yet";
+  else if ((uint64_t)sb.st_size != hdr->shm_size)
+    invalid = "Shared memory size does not match its header";
+
+  size_t size = hdr->shm_size;
+  munmap(hdr, header_map_size);
+
+  if (invalid) {
+    log(ERROR, invalid);
+    return -EINVAL;
+  }
+
+  seg->buf = mmap(NULL, size, PROT_READ, MAP_SHARED, seg->fd, 0);
+  if (seg->buf == MAP_FAILED) {
+    seg->buf = NULL;
+    return -errno;
+  }
+  seg->size = size;
+  seg->hdr = (struct shm_header*)seg->buf;
+  seg->stats = (struct server_stats*)(seg->buf + seg->hdr->stats_offset);
+  seg->bus = (struct frameset_bus*)(seg->buf + seg->hdr->frameset_bus_offset);
+  return 0;
+}
+
+static void unmap_segment(struct stat_seg* seg) {
+  if (seg->buf)
+    munmap(seg->buf, seg->size);
+  if (seg->fd >= 0)
+    close(seg->fd);
+}
+
+#define load(field) atomic_load_explicit(&(field), memory_order_relaxed)
+
+static void take_snapshot(struct stat_seg* seg, struct stats_snap* snap) {
+  struct server_stats* stats = seg->stats;
+
+  snap->taken = realtime_ns();
+  snap->updated = atomic_load_explicit(&stats->updated, memory_order_acquire);
+  snap->published = load(stats->published);
+  snap->complete_framesets = load(stats->complete_framesets);
+  snap->partial_framesets = load(stats->partial_framesets);
+  snap->expired_framesets = load(stats->expired_framesets);
+  snap->reaped_subscribers = load(stats->reaped_subscribers);
+  snap->pool_free = load(stats->pool_free);
+  snap->inflight_framesets = load(stats->inflight_framesets);
+  snap->active_mask = load(seg->hdr->active_mask);
+
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    snap->subs[i].state = load(seg->bus->subs[i].state);
+    snap->subs[i].pid = load(seg->bus->subs[i].pid);
+    snap->subs[i].held = load(stats->sub_held[i]);
+  }
+
+  for (uint32_t i = 0; i < seg->hdr->cam_count; i++) {
+    struct cam_stats* cam = &stats->cams[i];
+    struct cam_snap* out = &snap->cams[i];
+    out->bytes = load(cam->bytes);
+    out->packets = load(cam->packets);
+    out->lost = load(cam->lost);
+    out->corrupt = load(cam->corrupt);
+    out->recv_syscalls = load(cam->recv_syscalls);
+    out->decoded_packets = load(cam->decoded_packets);
+    out->decode_ns = load(cam->decode_ns);
+    out->frames = load(cam->frames);
+    out->dropped = load(cam->dropped);
+    out->late = load(cam->late);
+    out->pool_denied = load(cam->pool_denied);
+    out->last_capture = load(cam->last_capture);
+    out->held = load(cam->held);
+  }
+}
+
+static double rate(uint64_t now, uint64_t then, double secs) {
+  return now >= then && secs > 0 ? (now - then) / secs : 0;
+}
+
+static double age_ms(uint64_t now, uint64_t then) {
+  return then && now > then ? (now - then) / 1e6 : 0;
+}
+
+static const char* sub_mode_name(uint32_t state) {
+  switch (state) {
+    case SUB_RELIABLE:
+      return "reliable";
+    case SUB_LATEST:
+      return "latest";
+    default:
+      return "claimed";
+  }
+}
+
+static void print_live(
+  const char* name,
+  struct shm_header* hdr,
+  struct stats_snap* prev,
+  struct stats_snap* cur
+) {
+  double secs = (cur->taken - prev->taken) / 1e9;
+  uint64_t emitted = cur->complete_framesets + cur->partial_framesets;
+  uint64_t prev_emitted = prev->complete_framesets + prev->partial_framesets;
+  uint64_t complete = cur->complete_framesets - prev->complete_framesets;
+
+  // home the cursor and clear, like top
+  printf("\033[H\033[2J");
+  printf(
+    "%s  %d cams  %ux%u@%u  updated %.0f ms ago\n",
+    name,
+    __builtin_popcountll(cur->active_mask),
+    hdr->frame_width,
+    hdr->frame_height,
+    hdr->fps,
+    age_ms(cur->taken, cur->updated)
+  );
+  printf(
+    "framesets %.1f/s  complete %.1f%%  partial %.1f/s  expired %.1f/s  pool free %ld/%u  in flight %u\n",
+    rate(cur->published, prev->published, secs),
+    emitted > prev_emitted ? 100.0 * complete / (emitted - prev_emitted) : 100.0,
+    rate(cur->partial_framesets, prev->partial_framesets, secs),
+    rate(cur->expired_framesets, prev->expired_framesets, secs),
+    cur->pool_free,
+    hdr->frame_bufs_count,
+    cur->inflight_framesets
+  );
+
+  printf("subscribers:");
+  bool any = false;
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (cur->subs[i].state == SUB_FREE)
+      continue;
+    printf(
+      "  #%u pid %d %s held %u",
+      i,
+      cur->subs[i].pid,
+      sub_mode_name(cur->subs[i].state),
+      cur->subs[i].held
+    );
+    any = true;
+  }
+  printf("%s\n\n", any ? "" : "  none");
+
+  printf(
+    "%4s %8s %7s %7s %9s %6s %7s %7s %7s %8s %5s %8s\n",
+    "cam", "Mbit/s", "pkt/s", "lost/s", "decode ms", "queued",
+    "fps", "drop/s", "late/s", "denied/s", "held", "age ms"
+  );
+  for (uint32_t i = 0; i < hdr->cam_count; i++) {
+    if (!(cur->active_mask & (1ULL << i)))
+      continue;
+
+    struct cam_snap* c = &cur->cams[i];
+    struct cam_snap* p = &prev->cams[i];
+    uint64_t decoded = c->decoded_packets - p->decoded_packets;
+
+    printf(
+      "%4u %8.2f %7.1f %7.1f %9.2f %6ld %7.1f %7.1f %7.1f %8.1f %5u %8.0f\n",
+      hdr->cam_ids[i],
+      rate(c->bytes, p->bytes, secs) * 8 / 1e6,
+      rate(c->packets, p->packets, secs),
+      rate(c->lost, p->lost, secs),
+      decoded ? (c->decode_ns - p->decode_ns) / 1e6 / decoded : 0,
+      (int64_t)(c->packets - c->decoded_packets),
+      rate(c->frames, p->frames, secs),
+      rate(c->dropped, p->dropped, secs),
+      rate(c->late, p->late, secs),
+      rate(c->pool_denied, p->pool_denied, secs),
+      c->held,
+      age_ms(cur->taken, c->last_capture)
+    );
+  }
+  fflush(stdout);
+}
+
+static void print_json(
+  struct shm_header* hdr,
+  struct stats_snap* prev,
+  struct stats_snap* cur
+) {
+  /**
+   * Prints the snapshot as a single line JSON object, cumulative
+   * counters as they are with rates over the interval next to them
+   */
+  double secs = (cur->taken - prev->taken) / 1e9;
+
+  printf(
+    "{\"timestamp\":%lu,\"updated\":%lu,\"interval_s\":%.3f"
+    ",\"cams\":%d,\"width\":%u,\"height\":%u,\"fps\":%u",
+    cur->taken,
+    cur->updated,
+    secs,
+    __builtin_popcountll(cur->active_mask),
+    hdr->frame_width,
+    hdr->frame_height,
+    hdr->fps
+  );
+  printf(
+    ",\"published\":%lu,\"framesets_per_sec\":%.2f,\"complete\":%lu,\"partial\":%lu"
+    ",\"expired\":%lu,\"reaped_subscribers\":%lu,\"pool_free\":%ld,\"inflight\":%u",
+    cur->published,
+    rate(cur->published, prev->published, secs),
+    cur->complete_framesets,
+    cur->partial_framesets,
+    cur->expired_framesets,
+    cur->reaped_subscribers,
+    cur->pool_free,
+    cur->inflight_framesets
+  );
+
+  printf(",\"subscribers\":[");
+  bool first = true;
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (cur->subs[i].state == SUB_FREE)
+      continue;
+    printf(
+      "%s{\"idx\":%u,\"pid\":%d,\"mode\":\"%s\",\"held\":%u}",
+      first ? "" : ",",
+      i,
+      cur->subs[i].pid,
+      sub_mode_name(cur->subs[i].state),
+      cur->subs[i].held
+    );
+    first = false;
+  }
+
+  printf("],\"cameras\":[");
+  first = true;
+  for (uint32_t i = 0; i < hdr->cam_count; i++) {
+    if (!(cur->active_mask & (1ULL << i)))
+      continue;
+
+    struct cam_snap* c = &cur->cams[i];
+    struct cam_snap* p = &prev->cams[i];
+    uint64_t decoded = c->decoded_packets - p->decoded_packets;
+    uint64_t packets = c->packets - p->packets;
+
+    printf(
+      "%s{\"id\":%u,\"bytes\":%lu,\"packets\":%lu,\"lost\":%lu,\"corrupt\":%lu"
+      ",\"recv_syscalls\":%lu,\"decoded_packets\":%lu,\"frames\":%lu,\"dropped\":%lu,\"late\":%lu"
+      ",\"pool_denied\":%lu,\"held\":%u",
+      first ? "" : ",",
+      hdr->cam_ids[i],
+      c->bytes,
+      c->packets,
+      c->lost,
+      c->corrupt,
+      c->recv_syscalls,
+      c->decoded_packets,
+      c->frames,
+      c->dropped,
+      c->late,
+      c->pool_denied,
+      c->held
+    );
+    printf(
+      ",\"mbit_per_sec\":%.3f,\"packets_per_sec\":%.2f,\"syscalls_per_packet\":%.2f,\"decode_ms\":%.3f"
+      ",\"fps\":%.2f,\"queued\":%ld,\"age_ms\":%.1f}",
+      rate(c->bytes, p->bytes, secs) * 8 / 1e6,
+      rate(c->packets, p->packets, secs),
+      packets ? (double)(c->recv_syscalls - p->recv_syscalls) / packets : 0,
+      decoded ? (c->decode_ns - p->decode_ns) / 1e6 / decoded : 0,
+      rate(c->frames, p->frames, secs),
+      (int64_t)(c->packets - c->decoded_packets),
+      age_ms(cur->taken, c->last_capture)
+    );
+    first = false;
+  }
+  printf("]}\n");
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  int ret = 0;
+
+  const char* shm_name = DEFAULT_SHM_NAME;
+  uint32_t interval_ms = DEFAULT_INTERVAL_MS;
+  int count = -1;
+  bool json = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:i:c:j")) != -1) {
+    switch (opt) {
+      case 's':
+        shm_name = optarg;
+        break;
+      case 'i':
+        interval_ms = atoi(optarg);
+        break;
+      case 'c':
+        count = atoi(optarg);
+        break;
+      case 'j':
+        json = true;
+        break;
+      default:
+        fprintf(stderr, "Usage: mocap-stat [-s shm_name] [-i interval_ms] [-c count] [-j]\n");
+        return -EINVAL;
+    }
+  }
+  if (interval_ms == 0)
+    interval_ms = DEFAULT_INTERVAL_MS;
+
+  ret = setup_logging(LOG_PATH);
+  if (ret) {
+    printf("Error opening log file: %s\n", strerror(-ret));
+    return ret;
+  }
+
+  struct sigaction sa = {
+    .sa_handler = shutdown_handler,
+    .sa_flags = 0
+  };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  struct stat_seg seg;
+  ret = map_segment(&seg, shm_name);
+  if (ret) {
+    unmap_segment(&seg);
+    cleanup_logging();
+    return ret;
+  }
+
+  struct stats_snap snaps[2];
+  struct stats_snap* prev = &snaps[0];
+  struct stats_snap* cur = &snaps[1];
+  take_snapshot(&seg, prev);
+
+  struct timespec wait = {
+    .tv_sec = interval_ms / 1000,
+    .tv_nsec = (interval_ms % 1000) * 1000000L
+  };
+  for (int i = 0; running && (count < 0 || i < count); i++) {
+    nanosleep(&wait, NULL);
+    if (!running)
+      break;
+
+    take_snapshot(&seg, cur);
+    if (json)
+      print_json(seg.hdr, prev, cur);
+    else
+      print_live(shm_name, seg.hdr, prev, cur);
+
+    struct stats_snap* tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  unmap_segment(&seg);
+  cleanup_logging();
+  return 0;
+}
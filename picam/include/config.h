@@ -19,6 +19,9 @@ struct config {
   int frame_duration_min;
   int frame_duration_max;
   int fps;
+  int cam_id = 255; // 255 leaves the server unable to check it
+  int wire_version = 2; // 1 for servers from before the v2 stream format
+  std::string transport = "tcp"; // "udp" trades retransmits for latency, v2 only
 };
 
 config parse_config(const std::string& filename);
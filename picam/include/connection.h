@@ -5,8 +5,11 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <cstdint>
 #include <queue>
 #include <string>
+#include <sys/socket.h>
+#include <vector>
 #include "config.h"
 
 class connection {
@@ -17,7 +20,7 @@ public:
 
   int tcpfd;
   int conn_tcp();
-  int stream_pkt(const uint8_t* data, uint32_t size);
+  int stream_pkt(const uint8_t* data, uint32_t size, bool keyframe);
   int end_stream();
   void discon_tcp();
 
@@ -31,6 +34,26 @@ private:
   std::string server_ip;
   std::string tcp_port;
   std::string udp_port;
+  uint8_t cam_id;
+  int wire_version;
+  uint32_t seq; // of the next packet, counting ones that failed to send
+
+  bool udp_transport;
+  int datagramfd; // streams packets with udp_transport, separate from the control socket
+  std::vector<uint8_t> frag_hdrs;
+  std::vector<struct iovec> frag_iovs;
+  std::vector<struct mmsghdr> frag_msgs;
+
+  int conn_datagram();
+  int send_frags(const uint8_t* hdr, const uint8_t* data, uint32_t size);
+
+  size_t put_header(
+    uint8_t* buf,
+    uint64_t timestamp,
+    const uint8_t* data,
+    uint32_t size,
+    uint8_t flags
+  );
 };
 
 #endif
@@ -20,13 +20,15 @@ public:
   ~videnc();
 
   void encode_frame(uint8_t* data);
+  void force_keyframe();
   void flush();
-  uint8_t* recv_frame(int& size);
+  uint8_t* recv_frame(int& size, bool& keyframe);
 
 private:
   int width;
   int height;
   int64_t pts_counter;
+  bool keyframe_requested;
   const AVCodec* codec;
   AVCodecContext* ctx;
   AVFrame* frame;
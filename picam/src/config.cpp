@@ -63,6 +63,9 @@ config parse_config(const std::string& filename) {
    * Throws:
    *   std::runtime_error: If file cannot be opened
    *   std::runtime_error: If an unknown configuration key is found
+   *   std::runtime_error: If CAM_ID or WIRE_VERSION is out of range
+   *   std::runtime_error: If TRANSPORT isn't tcp or udp, or is udp
+   *                       with WIRE_VERSION 1
    *   std::invalid_argument: If numeric conversion fails (via std::stoi)
    *   std::out_of_range: If numeric value exceeds integer limits
    */
@@ -105,10 +108,25 @@ config parse_config(const std::string& filename) {
         config.frame_duration_max = std::stoi(value);
       else if (key == "FPS")
         config.fps = std::stoi(value);
+      else if (key == "CAM_ID")
+        config.cam_id = std::stoi(value);
+      else if (key == "WIRE_VERSION")
+        config.wire_version = std::stoi(value);
+      else if (key == "TRANSPORT")
+        config.transport = value;
       else
         throw std::runtime_error("Unknown config key: " + key);
     }
   }
 
+  if (config.cam_id < 0 || config.cam_id > 255)
+    throw std::runtime_error("CAM_ID must be between 0 and 255");
+  if (config.wire_version != 1 && config.wire_version != 2)
+    throw std::runtime_error("WIRE_VERSION must be 1 or 2");
+  if (config.transport != "tcp" && config.transport != "udp")
+    throw std::runtime_error("TRANSPORT must be tcp or udp");
+  if (config.transport == "udp" && config.wire_version != 2)
+    throw std::runtime_error("TRANSPORT=udp needs WIRE_VERSION=2");
+
   return config;
 }
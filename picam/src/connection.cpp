@@ -3,6 +3,7 @@
 // See LICENSE file in the project root for full license information.
 
 #include <arpa/inet.h>
+#include <array>
 #include <cstring>
 #include <errno.h>
 #include <stdexcept>
@@ -10,10 +11,65 @@
 #include <memory>
 #include <unistd.h>
 
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
 #include "connection.h"
 #include "logging.h"
 
 static constexpr char END_STREAM[] = "EOSTREAM";
+static constexpr suseconds_t CONNECT_TIMEOUT_US = 100'000; // the capture loop waits on it
+
+// the v2 stream format, laid out in the server's wire.h
+static constexpr char WIRE_HELLO[] = "MOCAPWV2";
+static constexpr uint32_t WIRE_MAGIC = 0x3257434d; // "MCW2"
+static constexpr size_t WIRE_V1_HEADER_SIZE = 12;
+static constexpr size_t WIRE_V2_HEADER_SIZE = 28;
+static constexpr uint8_t WIRE_FLAG_KEYFRAME = 0x01;
+static constexpr uint8_t WIRE_FLAG_EOS = 0x02;
+static constexpr size_t WIRE_FRAG_HEADER_SIZE = WIRE_V2_HEADER_SIZE + 8;
+static constexpr uint32_t WIRE_FRAG_PAYLOAD = 1400;
+static constexpr int UDP_EOS_REPEATS = 3; // the end of stream has no retransmits to fall back on
+
+static constexpr std::array<uint32_t, 256> make_crc32c_table() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int i = 0; i < 8; i++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    table[b] = crc;
+  }
+  return table;
+}
+
+static constexpr std::array<uint32_t, 256> crc32c_table = make_crc32c_table();
+
+static uint32_t crc32c(uint32_t crc, const uint8_t* buf, size_t len) {
+  /**
+   * Extends a CRC32C over len more bytes, starting from 0 for a new one.
+   *
+   * Uses the ARMv8 crc32c instructions when the build targets them, and
+   * a table a byte at a time otherwise, which keeps up with the encoder
+   * at any bitrate it produces.
+   */
+  crc = ~crc;
+
+#ifdef __ARM_FEATURE_CRC32
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint64_t word;
+    memcpy(&word, buf, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; len; len--, buf++)
+    crc = __crc32cb(crc, *buf);
+#else
+  for (; len; len--, buf++)
+    crc = (crc >> 8) ^ crc32c_table[(crc ^ *buf) & 0xff];
+#endif
+
+  return ~crc;
+}
 
 connection::connection()
   noexcept :
@@ -29,7 +85,12 @@ connection::connection()
   udpfd(-1),
   server_ip("UNSET_SERVER"),
   tcp_port("UNSET_PORT"),
-  udp_port("UNSET_PORT") {}
+  udp_port("UNSET_PORT"),
+  cam_id(255),
+  wire_version(2),
+  seq(0),
+  udp_transport(false),
+  datagramfd(-1) {}
 
 connection::connection(
   config& config
@@ -43,15 +104,23 @@ connection::connection(
    * allow for error handling and reconnection attempts.
    *
    * Parameters:
-   *   server_ip: IPv4 address of the streaming server
-   *   tcp_port:  Port number for streaming video data
-   *   udp_port:  Port number for receiving control messages
+   *   server_ip:    IPv4 address of the streaming server
+   *   tcp_port:     Port number for streaming video data
+   *   udp_port:     Port number for receiving control messages
+   *   cam_id:       Id the server knows the camera by, sent with v2
+   *   wire_version: Stream format, 2 unless the server predates it
+   *   transport:    tcp, or udp to stream datagrams to tcp_port
    */
   tcpfd(-1),
   udpfd(-1),
   server_ip(config.server_ip),
   tcp_port(config.tcp_port),
-  udp_port(config.udp_port) {}
+  udp_port(config.udp_port),
+  cam_id(config.cam_id),
+  wire_version(config.wire_version),
+  seq(0),
+  udp_transport(config.transport == "udp"),
+  datagramfd(-1) {}
 
 connection::~connection() noexcept {
   /**
@@ -70,6 +139,10 @@ connection::~connection() noexcept {
     close(udpfd);
     udpfd = -1;
   }
+  if (datagramfd >= 0) {
+    close(datagramfd);
+    datagramfd = -1;
+  }
 }
 
 int connection::conn_tcp() {
@@ -81,7 +154,11 @@ int connection::conn_tcp() {
    * 1. Socket creation with IPv4 and TCP protocol
    * 2. Port number validation (1-65535)
    * 3. IP address parsing and validation
-   * 4. Connection establishment with retry on EINTR
+   * 4. Connection establishment with retry on EINTR, bounded by
+   *    CONNECT_TIMEOUT_US so an unreachable server costs a frame or
+   *    so rather than stalling capture
+   * 5. With wire_version 2, the hello that tells the server the
+   *    stream is in the v2 format
    *
    * The method is idempotent - if a connection exists, it returns
    * success without creating a new one. This allows repeated calls
@@ -113,60 +190,130 @@ int connection::conn_tcp() {
   int tcp_port_num = std::stoi(tcp_port);
   if (tcp_port_num < 1 || tcp_port_num > 65535) {
     LOG(ERROR, "Invalid tcp_port number");
+    discon_tcp();
     return -EINVAL;
   }
 
   server_addr.sin_port = htons(tcp_port_num);
 
   if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
-    if (errno == 0) {
+    int err = errno;
+    if (err == 0) {
       LOG(ERROR, "Invalid IP address format");
+      discon_tcp();
       return -EINVAL;
     } else {
       snprintf(
         logstr,
         sizeof(logstr),
         "Error during IP address conversion: %s",
-        strerror(errno)
+        strerror(err)
       );
       LOG(ERROR, logstr);
-      return -errno;
+      discon_tcp();
+      return -err;
     }
   }
 
+  // linux bounds a blocking connect by the send timeout
+  struct timeval connect_timeout = { 0, CONNECT_TIMEOUT_US };
+  setsockopt(tcpfd, SOL_SOCKET, SO_SNDTIMEO, &connect_timeout, sizeof(connect_timeout));
+
   while (connect(tcpfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
     if (errno == EINTR) continue;
+    int err = errno;
     LOG(ERROR, "Failed to connect to server");
-    return -errno;
+    discon_tcp();
+    return -err;
+  }
+
+  // streaming goes back to blocking sends
+  struct timeval no_timeout = { 0, 0 };
+  setsockopt(tcpfd, SOL_SOCKET, SO_SNDTIMEO, &no_timeout, sizeof(no_timeout));
+
+  // the socket buffer is empty, so the hello goes out whole or not at all
+  if (wire_version == 2 &&
+      write(tcpfd, WIRE_HELLO, sizeof(WIRE_HELLO) - 1) != sizeof(WIRE_HELLO) - 1) {
+    int err = errno;
+    LOG(ERROR, "Failed to send the stream hello");
+    discon_tcp();
+    return -err;
   }
 
   LOG(DEBUG, "Connected to server");
   return 0;
 }
 
-int connection::stream_pkt(const uint8_t* data, uint32_t size) {
+size_t connection::put_header(
+  uint8_t* buf,
+  uint64_t timestamp,
+  const uint8_t* data,
+  uint32_t size,
+  uint8_t flags
+) {
+  /**
+   * Writes a packet's header in the configured stream format.
+   *
+   * A v2 header carries the camera id, the packet's sequence number,
+   * its flags and a CRC32C over the header and payload, which let the
+   * server count exactly the packets that never reached it and drop
+   * corrupt ones.
+   *
+   * Returns:
+   *   The header's size
+   */
+  if (wire_version == 1) {
+    memcpy(buf, &timestamp, sizeof(timestamp));
+    memcpy(buf + sizeof(timestamp), &size, sizeof(size));
+    return WIRE_V1_HEADER_SIZE;
+  }
+
+  memset(buf, 0, WIRE_V2_HEADER_SIZE);
+  memcpy(buf, &WIRE_MAGIC, sizeof(WIRE_MAGIC));
+  buf[4] = 2;
+  buf[5] = flags;
+  buf[6] = cam_id;
+  memcpy(buf + 8, &timestamp, sizeof(timestamp));
+  memcpy(buf + 16, &seq, sizeof(seq));
+  memcpy(buf + 20, &size, sizeof(size));
+
+  uint32_t crc = crc32c(0, buf, WIRE_V2_HEADER_SIZE - sizeof(crc));
+  crc = crc32c(crc, data, size);
+  memcpy(buf + 24, &crc, sizeof(crc));
+  return WIRE_V2_HEADER_SIZE;
+}
+
+int connection::stream_pkt(const uint8_t* data, uint32_t size, bool keyframe) {
+  /**
+   * Sends an encoded packet, stamped with the capture timestamp queued
+   * for it, reconnecting first if the connection was lost.
+   *
+   * Each packet takes the next sequence number whether or not it gets
+   * sent, so the server sees the gap.
+   *
+   * Returns:
+   *   0 on success
+   *   -ECONNRESET when the packet was lost with the connection, or
+   *   any of its datagrams failed to send
+   */
   char logstr[128];
 
   uint64_t timestamp = frame_timestamps.front();
   frame_timestamps.pop();
-  uint64_t pkt_size = size + sizeof(size) + sizeof(timestamp);
-  uint8_t pkt[pkt_size];
+  uint8_t flags = keyframe ? WIRE_FLAG_KEYFRAME : 0;
 
-  memcpy(
-    pkt,
-    (const uint8_t*)&timestamp,
-    sizeof(timestamp)
-  );
-  memcpy(
-    pkt + sizeof(timestamp),
-    (const uint8_t*)&size,
-    sizeof(size)
-  );
-  memcpy(
-    pkt + sizeof(timestamp) + sizeof(size),
-    data,
-    size
-  );
+  if (udp_transport) {
+    uint8_t hdr[WIRE_V2_HEADER_SIZE];
+    put_header(hdr, timestamp, data, size, flags);
+    seq++;
+    return send_frags(hdr, data, size);
+  }
+
+  uint8_t pkt[WIRE_V2_HEADER_SIZE + size];
+  size_t hdr_size = put_header(pkt, timestamp, data, size, flags);
+  seq++;
+  memcpy(pkt + hdr_size, data, size);
+  size_t pkt_size = hdr_size + size;
 
   size_t total_written = 0;
   while (total_written < pkt_size) {
@@ -186,18 +333,19 @@ int connection::stream_pkt(const uint8_t* data, uint32_t size) {
       if (errno == EINTR) continue;
       if (errno == EPIPE || errno == ECONNRESET) {
         LOG(WARNING, "Server disconnected while streaming a frame packet");
-        close(tcpfd);
-        tcpfd = -1;
-        return -ECONNRESET;
+      } else {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Error transmitting frame packet: %s",
+          strerror(errno)
+        );
+        LOG(ERROR, logstr);
       }
-      snprintf(
-        logstr,
-        sizeof(logstr),
-        "Error transmitting frame packet: %s",
-        strerror(errno)
-      );
-      LOG(ERROR, logstr);
-      return -errno;
+
+      // a partly written packet leaves the stream unparseable, so start over
+      discon_tcp();
+      return -ECONNRESET;
     }
 
     total_written += result;
@@ -206,8 +354,35 @@ int connection::stream_pkt(const uint8_t* data, uint32_t size) {
 }
 
 int connection::end_stream() {
+  /**
+   * Tells the server the stream is over, with "EOSTREAM" in v1 or a
+   * header flagged WIRE_FLAG_EOS without a payload in v2.
+   *
+   * Over UDP the end of stream is sent UDP_EOS_REPEATS times, and the
+   * server ignores the repeats.
+   *
+   * Returns:
+   *   0 on success
+   *   -ECONNRESET when the server is gone
+   *   -errno on other write failures
+   */
   char logstr[128];
+  uint8_t eos[WIRE_V2_HEADER_SIZE];
+
+  if (udp_transport) {
+    put_header(eos, 0, nullptr, 0, WIRE_FLAG_EOS);
+    int ret = 0;
+    for (int i = 0; i < UDP_EOS_REPEATS; i++)
+      ret = send_frags(eos, nullptr, 0);
+    return ret;
+  }
+
+  const uint8_t* end_stream_pkt = reinterpret_cast<const uint8_t*>(END_STREAM);
   size_t end_stream_size = sizeof(END_STREAM) - 1;
+  if (wire_version == 2) {
+    end_stream_size = put_header(eos, 0, nullptr, 0, WIRE_FLAG_EOS);
+    end_stream_pkt = eos;
+  }
 
   size_t total_written = 0;
   while (total_written < end_stream_size) {
@@ -219,7 +394,7 @@ int connection::end_stream() {
 
     ssize_t result = write(
       tcpfd,
-      END_STREAM + total_written,
+      end_stream_pkt + total_written,
       end_stream_size - total_written
     );
 
@@ -247,6 +422,132 @@ int connection::end_stream() {
   return 0;
 }
 
+int connection::conn_datagram() {
+  /**
+   * Opens the socket the UDP transport streams over.
+   *
+   * The socket is connected to the server's tcp_port, so sends need no
+   * address, and a server that isn't listening shows up as
+   * ECONNREFUSED on a later send. Keyframe requests come back to the
+   * control socket rather than this one.
+   *
+   * Returns:
+   *   0 on success
+   *   -errno on system call failures
+   *   -EINVAL on invalid port or IP address
+   */
+  if (datagramfd >= 0) return 0;
+  char logstr[128];
+
+  datagramfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (datagramfd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to create stream socket: %s",
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    return -errno;
+  }
+
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+
+  int tcp_port_num = std::stoi(tcp_port);
+  if (tcp_port_num < 1 || tcp_port_num > 65535 ||
+      inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
+    LOG(ERROR, "Invalid server address for the udp stream");
+    close(datagramfd);
+    datagramfd = -1;
+    return -EINVAL;
+  }
+  server_addr.sin_port = htons(tcp_port_num);
+
+  if (connect(datagramfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    int err = errno;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to set the udp stream destination: %s",
+      strerror(err)
+    );
+    LOG(ERROR, logstr);
+    close(datagramfd);
+    datagramfd = -1;
+    return -err;
+  }
+
+  return 0;
+}
+
+int connection::send_frags(const uint8_t* hdr, const uint8_t* data, uint32_t size) {
+  /**
+   * Sends a packet over UDP as fragments of WIRE_FRAG_PAYLOAD bytes,
+   * each a datagram carrying the packet's header, its index, the
+   * fragment count and a CRC of all three, batched through sendmmsg.
+   *
+   * The header and payload go out through an iovec each, so the
+   * payload is never copied.
+   *
+   * Returns:
+   *   0 on success
+   *   -ECONNRESET when a fragment didn't go out, which loses the packet
+   */
+  char logstr[128];
+
+  if (datagramfd < 0 && conn_datagram() < 0)
+    return -ECONNRESET;
+
+  uint16_t count = size ? (size + WIRE_FRAG_PAYLOAD - 1) / WIRE_FRAG_PAYLOAD : 1;
+  frag_hdrs.resize(count * WIRE_FRAG_HEADER_SIZE);
+  frag_iovs.resize(count * 2);
+  frag_msgs.resize(count);
+
+  for (uint16_t i = 0; i < count; i++) {
+    uint8_t* frag_hdr = frag_hdrs.data() + i * WIRE_FRAG_HEADER_SIZE;
+    memcpy(frag_hdr, hdr, WIRE_V2_HEADER_SIZE);
+    memcpy(frag_hdr + WIRE_V2_HEADER_SIZE, &i, sizeof(i));
+    memcpy(frag_hdr + WIRE_V2_HEADER_SIZE + 2, &count, sizeof(count));
+    uint32_t crc = crc32c(0, frag_hdr, WIRE_FRAG_HEADER_SIZE - sizeof(crc));
+    memcpy(frag_hdr + WIRE_FRAG_HEADER_SIZE - sizeof(crc), &crc, sizeof(crc));
+
+    uint32_t offset = i * WIRE_FRAG_PAYLOAD;
+    uint32_t len = size - offset < WIRE_FRAG_PAYLOAD ? size - offset : WIRE_FRAG_PAYLOAD;
+    frag_iovs[i * 2] = { frag_hdr, WIRE_FRAG_HEADER_SIZE };
+    frag_iovs[i * 2 + 1] = { const_cast<uint8_t*>(data) + offset, len };
+
+    memset(&frag_msgs[i], 0, sizeof(frag_msgs[i]));
+    frag_msgs[i].msg_hdr.msg_iov = &frag_iovs[i * 2];
+    frag_msgs[i].msg_hdr.msg_iovlen = len ? 2 : 1;
+  }
+
+  uint16_t sent = 0;
+  while (sent < count) {
+    int ret = sendmmsg(datagramfd, &frag_msgs[sent], count - sent, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      if (errno == ECONNREFUSED) {
+        LOG(WARNING, "Server isn't receiving the udp stream");
+      } else {
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Error transmitting frame fragments: %s",
+          strerror(errno)
+        );
+        LOG(ERROR, logstr);
+      }
+      return -ECONNRESET;
+    }
+
+    sent += ret;
+  }
+
+  return 0;
+}
+
 void connection::discon_tcp() {
   /**
    * Disconnects from the tcp socket
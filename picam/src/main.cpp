@@ -29,6 +29,7 @@ volatile static uint64_t timestamp = 0;
 volatile static sig_atomic_t running = 1;
 volatile static sig_atomic_t stream_end = 0;
 volatile static sig_atomic_t frame_rdy = 0;
+volatile static sig_atomic_t keyframe_req = 0;
 
 static std::unique_ptr<sem_t, sem_deleter> loop_ctl_sem;
 static std::unique_ptr<camera_handler_t> cam;
@@ -56,6 +57,10 @@ int main() {
       return -errno;
     }
 
+    // records wait in the rings for the flusher, so every way out of
+    // main writes them before the process goes, the reason it died included
+    atexit(cleanup_logging);
+
     config config = parse_config("config.txt");
 
     uint64_t frame_counter = 0;
@@ -93,25 +98,29 @@ int main() {
         ret = flush_encoder(*encoder, *conn);
         if (ret == 0)
           conn->end_stream();
-        cleanup_logging();
         return 0;
       }
 
       if (frame_rdy) {
         frame_rdy = 0;
+        if (keyframe_req) {
+          keyframe_req = 0;
+          encoder->force_keyframe();
+        }
         encoder->encode_frame(cam->frame_buffer);
 
         int pkt_size = 0;
-        uint8_t* ptr = encoder->recv_frame(pkt_size);
+        bool keyframe = false;
+        uint8_t* ptr = encoder->recv_frame(pkt_size, keyframe);
         if (ptr == nullptr)
           continue;
 
-        ret = conn->stream_pkt(ptr, pkt_size);
-        if (ret != -ECONNRESET)
-          continue;
-
-        cleanup_logging();
-        return EXIT_FAILURE;
+        // the packet is lost either way, and the connection is retried
+        // with the next one, which the server needs to be a keyframe to
+        // pick the stream back up
+        ret = conn->stream_pkt(ptr, pkt_size, keyframe);
+        if (ret == -ECONNRESET)
+          encoder->force_keyframe();
       }
     }
   } catch (const std::exception& e) {
@@ -162,6 +171,12 @@ void io_signal_handler(int signo, siginfo_t* info, void* context) {
     return;
   }
 
+  // the server lost frames of a udp stream and needs a keyframe to resume
+  if (size == 3 && strncmp(buf, "IDR", 3) == 0) {
+    keyframe_req = 1;
+    return;
+  }
+
   LOG(ERROR, "Unexpected udp message size");
 }
 
@@ -375,7 +390,7 @@ inline int init_signals() {
   /**
    * Sets the sa_mask for the process
    *
-   * There are 4 signals handled:
+   * There are 5 signals handled:
    *
    * SIGUSR1 - emitted when the timer (see init_timer(), arm_timer())
    *           reaches the assigned timestamp, handled by enqueueing
@@ -391,6 +406,10 @@ inline int init_signals() {
    *
    * SIGTERM - emitted by the os to signal for exit
    *
+   * SIGPIPE - ignored, so writing to a connection the server dropped
+   *           fails with EPIPE and the stream reconnects, rather than
+   *           the process being killed
+   *
    * SA_RESTART flag is set, which means any interrupted syscalls
    * will be retried.
    */
@@ -411,10 +430,16 @@ inline int init_signals() {
   exit_action.sa_flags = SA_SIGINFO | SA_RESTART;
   sigemptyset(&exit_action.sa_mask);
 
+  struct sigaction pipe_action;
+  pipe_action.sa_handler = SIG_IGN;
+  pipe_action.sa_flags = 0;
+  sigemptyset(&pipe_action.sa_mask);
+
   if (sigaction(SIGUSR1, &action, NULL) < 0 ||
       sigaction(SIGIO, &io_action, NULL) < 0 ||
       sigaction(SIGINT, &exit_action, NULL) < 0 ||
-      sigaction(SIGTERM, &exit_action, NULL) < 0) {
+      sigaction(SIGTERM, &exit_action, NULL) < 0 ||
+      sigaction(SIGPIPE, &pipe_action, NULL) < 0) {
       snprintf(
         logstr,
         sizeof(logstr),
@@ -431,9 +456,10 @@ inline int init_signals() {
 inline int flush_encoder(videnc& encoder, connection& conn) {
     encoder.flush();
     int pkt_size = 0;
+    bool keyframe = false;
     uint8_t* ptr = nullptr;
-    while ((ptr = encoder.recv_frame(pkt_size)) != nullptr) {
-      int ret = conn.stream_pkt(ptr, pkt_size);
+    while ((ptr = encoder.recv_frame(pkt_size, keyframe)) != nullptr) {
+      int ret = conn.stream_pkt(ptr, pkt_size, keyframe);
       if (ret == -ECONNRESET) return ret;
     }
     return 0;
@@ -12,7 +12,8 @@
 videnc::videnc(const config& config)
   : width(config.frame_width),
     height(config.frame_height),
-    pts_counter(0) {
+    pts_counter(0),
+    keyframe_requested(false) {
   /**
    * Initializes an H.264 video encoder using libavcodec.
    *
@@ -60,6 +61,7 @@ videnc::videnc(const config& config)
   av_dict_set(&opts, "preset", config.enc_speed.c_str(), 0);
   av_dict_set(&opts, "crf", config.enc_quality.c_str(), 0);
   av_dict_set(&opts, "tune", "zerolatency", 0);
+  av_dict_set(&opts, "forced-idr", "1", 0);
 
   if (avcodec_open2(ctx, codec, &opts) < 0) {
     av_dict_free(&opts);
@@ -132,6 +134,8 @@ void videnc::encode_frame(uint8_t* data) {
   frame->data[2] = data + y_size + uv_size;
 
   frame->pts = pts_counter++;
+  frame->pict_type = keyframe_requested ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+  keyframe_requested = false;
 
   if (avcodec_send_frame(ctx, frame) < 0) {
     const char* err = "Error sending frame for encoding";
@@ -140,6 +144,14 @@ void videnc::encode_frame(uint8_t* data) {
   }
 }
 
+void videnc::force_keyframe() {
+  /**
+   * Makes the next frame encoded an IDR frame, which a decoder can
+   * start from without any of the frames before it
+   */
+  keyframe_requested = true;
+}
+
 void videnc::flush() {
   int ret = avcodec_send_frame(ctx, nullptr); // signal end of stream
   if (ret < 0) {
@@ -149,7 +161,7 @@ void videnc::flush() {
   }
 }
 
-uint8_t* videnc::recv_frame(int& size) {
+uint8_t* videnc::recv_frame(int& size, bool& keyframe) {
   int ret = avcodec_receive_packet(ctx, pkt);
   if (ret == AVERROR(EAGAIN)) return nullptr; // no packets available yet
   if (ret == AVERROR_EOF) return nullptr; // no more packets
@@ -159,5 +171,6 @@ uint8_t* videnc::recv_frame(int& size) {
     throw std::runtime_error(err);
   }
   size = pkt->size;
+  keyframe = pkt->flags & AV_PKT_FLAG_KEY;
   return pkt->data;
 }
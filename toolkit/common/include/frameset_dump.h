@@ -0,0 +1,70 @@
+#ifndef FRAMESET_DUMP_H
+#define FRAMESET_DUMP_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "stream_ctl.h"
+
+// the following constants need to match the stream server identically:
+constexpr uint64_t DUMP_MAGIC = 0x504d55445346434dULL; // "MCFSDUMP"
+constexpr uint32_t DUMP_VERSION = 1;
+
+// the following structs need to match the stream server identically:
+struct dump_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t cam_count; // frameset positions
+  uint32_t frame_width;
+  uint32_t frame_height;
+  uint32_t pixel_format; // frame_format
+  uint32_t fps;
+  uint32_t chunk_seq; // counts up from 0 over the chunks of one server run
+  uint64_t frame_size;
+  uint64_t frame_stride; // frame_size rounded up to a page
+  uint64_t index_offset;
+  uint64_t index_capacity;
+  uint64_t data_offset;
+  uint64_t frameset_count; // 0 when the server never closed the chunk
+  uint8_t cam_ids[MAX_CAMS]; // config id of the camera in each position
+};
+
+struct dump_entry {
+  uint64_t timestamp; // 0 past the last frameset written
+  uint64_t cam_mask;
+  uint64_t active_mask;
+  uint64_t offset; // of the frameset's first frame, from the start of the chunk
+};
+
+/**
+ * A chunk of a frameset dump written by the server with -d, mapped
+ * read only
+ */
+struct dump_chunk {
+  int32_t fd;
+  uint64_t size;
+  uint8_t* map;
+  const dump_header* header;
+  const dump_entry* index;
+  uint64_t count; // framesets in the chunk
+};
+
+/**
+ * A frameset in a mapped chunk, pointing straight into the mapping, so
+ * it stays valid until the chunk is closed
+ */
+struct dump_frameset {
+  uint64_t timestamp; // scheduled capture timestamp of the frame index
+  uint64_t cam_mask; // bit i is set when frames[i] holds a frame
+  uint64_t active_mask; // bit i is set when camera i was streaming for the frame index
+  const uint8_t* frames[MAX_CAMS]; // laid out as header->pixel_format says, nullptr without a frame
+};
+
+int32_t list_dump_chunks(const char* dir, std::vector<std::string>& paths);
+int32_t open_dump_chunk(dump_chunk& chunk, const char* path);
+int32_t read_dump_frameset(dump_chunk& chunk, uint64_t i, dump_frameset& frameset);
+void close_dump_chunk(dump_chunk& chunk);
+
+#endif // FRAMESET_DUMP_H
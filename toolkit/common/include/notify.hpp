@@ -0,0 +1,20 @@
+#ifndef NOTIFY_HPP
+#define NOTIFY_HPP
+
+#include <atomic>
+#include <cstdint>
+
+// needs to match the stream server's struct notifier identically
+struct notifier {
+  alignas(64) std::atomic<uint32_t> seq;
+  std::atomic<uint32_t> waiters;
+};
+
+void notify(notifier* n);
+int32_t notify_wait(
+  notifier* n,
+  uint32_t seq,
+  uint64_t timeout_ns
+);
+
+#endif // NOTIFY_HPP
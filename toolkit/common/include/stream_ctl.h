@@ -1,39 +1,180 @@
 #ifndef STREAM_CTL_H
 #define STREAM_CTL_H
 
+#include <atomic>
 #include <cstdint>
 #include <sys/types.h>
 
-#include "spsc_queue.hpp"
+#include "notify.hpp"
 
 // the following constants need to match the stream server identically:
 constexpr const char* SERVER_EXE = "/usr/local/bin/mocap-toolkit-server";
-constexpr const char* SHM_NAME = "/mocap-toolkit_shm";
-#define SHM_ADDR ((void*)0x7f0000000000)
-constexpr uint32_t FRAME_BUFS_PER_THREAD = 512;
-constexpr uint32_t FRAMESET_SLOTS_PER_THREAD = 8;
+constexpr const char* DEFAULT_SHM_NAME = "/mocap-toolkit_shm";
+constexpr uint64_t SHM_MAGIC = 0x4d535041434f4dULL;
+constexpr uint32_t SHM_VERSION = 10;
+constexpr uint32_t MAX_CAMS = 64;
+constexpr uint32_t MAX_SUBSCRIBERS = 31;
+
+constexpr uint32_t FRAMESET_WAIT_MS = 100; // bounds how long a stop signal goes unnoticed
+constexpr uint32_t ATTACH_TIMEOUT_MS = 30000; // a starting server runs its decoder self-test first
+constexpr uint32_t ATTACH_RETRY_MAX_US = 100000;
+
+// the following structs need to match the stream server identically:
+enum frame_format : uint32_t {
+  FRAME_FORMAT_NV12 = 0, // luma plane, then interleaved chroma
+  FRAME_FORMAT_I420 // luma plane, then the two chroma planes, from zero copy decoding
+};
+
+struct shm_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  std::atomic<uint32_t> ready; // set once every region is initialized
+  uint32_t cam_count; // frameset positions, some may have no camera while the config allows more
+  uint32_t frame_width;
+  uint32_t frame_height;
+  uint32_t pixel_format; // frame_format, every frame buffer is frame_width * frame_height * 3 / 2 either way
+  uint32_t fps;
+  uint32_t frame_bufs_count;
+  uint32_t frameset_slots;
+  uint32_t frameset_ring_capacity;
+  uint32_t consumer_cpu; // for a consumer's main thread, on the server's L3 domain past its threads
+  uint64_t frame_buf_size;
+  uint64_t frame_buf_stride; // frame_buf_size rounded up to a page, so every frame starts page aligned
+  uint64_t page_size; // the segment is mapped in multiples of this
+  uint64_t shm_size;
+
+  uint64_t frame_bufs_offset;
+  uint64_t ts_frame_bufs_offset;
+  uint64_t frameset_slots_offset;
+  uint64_t frameset_refs_offset;
+  uint64_t frameset_bus_offset;
+  uint64_t filled_frameset_notify_offset;
+  uint64_t server_notify_offset;
+  uint64_t stats_offset;
+
+  std::atomic<uint64_t> active_mask; // positions with a camera, which change when the config is reloaded
+  uint8_t cam_ids[MAX_CAMS]; // config id of the camera in each frameset position, set before its bit
+};
+
+struct ts_frame_buf {
+  uint64_t timestamp;
+  uint64_t frame_offset; // from the start of the shared memory segment
+};
+
+struct frameset {
+  uint64_t timestamp; // scheduled capture timestamp of the frame index
+  uint64_t cam_mask; // bit i is set when frame_idx[i] holds a frame
+  uint64_t active_mask; // bit i is set when camera i was streaming for the frame index
+  uint32_t frame_idx[MAX_CAMS]; // index into the shared ts_frame_buf array
+};
+
+enum sub_state : uint32_t {
+  SUB_FREE = 0,
+  SUB_CLAIMED, // being set up by a consumer
+  SUB_RELIABLE, // sees every frameset, pins what it has not released
+  SUB_LATEST // only ever takes the newest frameset, never pins the pipeline
+};
+
+struct bus_sub {
+  std::atomic<uint32_t> state;
+  std::atomic<int32_t> pid;
+};
+
+struct frameset_ref {
+  alignas(64) std::atomic<uint32_t> refs; // a bit per subscriber still reading the slot
+  std::atomic<uint64_t> seq; // publish sequence number the slot holds
+};
+
+struct frameset_bus {
+  alignas(64) std::atomic<uint64_t> head; // sequence number of the next publish
+  std::atomic<uint32_t> reliable_mask;
+  uint32_t mask; // ring capacity - 1
+  bus_sub subs[MAX_SUBSCRIBERS];
+  alignas(64) std::atomic<uint32_t> entries[1]; // sized by the server, capacity is mask + 1
+};
+
+struct cam_stats {
+  alignas(64) std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> packets;
+  std::atomic<uint64_t> lost;
+  std::atomic<uint64_t> corrupt;
+  std::atomic<uint64_t> recv_syscalls; // taken to receive them, io_uring enters included
+
+  alignas(64) std::atomic<uint64_t> decoded_packets;
+  std::atomic<uint64_t> decode_ns;
+
+  alignas(64) std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> late;
+  std::atomic<uint64_t> pool_denied;
+  std::atomic<uint64_t> last_capture;
+  std::atomic<uint32_t> held;
+};
+
+struct server_stats {
+  std::atomic<uint64_t> updated;
+  std::atomic<uint64_t> published;
+  std::atomic<uint64_t> complete_framesets;
+  std::atomic<uint64_t> partial_framesets;
+  std::atomic<uint64_t> expired_framesets;
+  std::atomic<uint64_t> reaped_subscribers;
+  std::atomic<int64_t> pool_free;
+  std::atomic<uint32_t> inflight_framesets;
+  std::atomic<uint32_t> sub_held[MAX_SUBSCRIBERS];
+  cam_stats cams[MAX_CAMS]; // counters are cumulative since the server started
+};
+
+enum class sub_mode {
+  reliable, // every frameset in order, the server keeps them until released
+  latest // newest frameset only, for display clients that must not hold up others
+};
 
 struct stream_ctx {
   pid_t server_pid;
   int32_t shm_fd;
   uint64_t shm_size;
   void* mmap_buf;
-  consumer_q* filled_frameset_q;
-  producer_q* empty_frameset_q;
+  shm_header* header;
+  ts_frame_buf* ts_frame_bufs;
+  struct frameset* frameset_slots;
+  frameset_ref* frameset_refs;
+  frameset_bus* bus;
+  notifier* filled_frameset_notify;
+  notifier* server_notify;
+  server_stats* stats;
+  sub_mode mode;
+  int32_t sub_idx; // our subscriber slot and reference bit, -1 when unsubscribed
+  uint64_t cursor; // sequence number of the next publish to read
 };
 
-struct ts_frame_buf {
-  uint64_t timestamp;
-  uint8_t* frame_buf;
-};
+inline uint64_t full_cam_mask(uint32_t cam_count) {
+  return cam_count >= MAX_CAMS ? ~0ULL : (1ULL << cam_count) - 1;
+}
 
 int32_t start_streams(
   stream_ctx& ctx,
   uint32_t frame_width,
   uint32_t frame_height,
   uint32_t cam_count,
-  char* target_id
+  char* target_id,
+  const char* shm_name = DEFAULT_SHM_NAME,
+  sub_mode mode = sub_mode::reliable,
+  const char* conf_path = nullptr
+);
+int32_t attach_streams(
+  stream_ctx& ctx,
+  uint32_t frame_width,
+  uint32_t frame_height,
+  uint32_t cam_count,
+  const char* shm_name = DEFAULT_SHM_NAME,
+  sub_mode mode = sub_mode::reliable
 );
+struct frameset* wait_frameset(stream_ctx& ctx, uint32_t timeout_ms);
+void release_frameset(stream_ctx& ctx, struct frameset* frameset);
+uint8_t* frameset_frame(stream_ctx& ctx, struct frameset* frameset, uint32_t cam);
+int32_t frameset_position(stream_ctx& ctx, struct frameset* frameset, uint8_t cam_id);
+int32_t pin_consumer(stream_ctx& ctx);
 void cleanup_streams(stream_ctx& ctx);
 
 #endif // STREAM_CTL_H
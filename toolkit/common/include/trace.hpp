@@ -0,0 +1,24 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+
+constexpr const char* TRACE_ENV = "MOCAP_TRACE"; // path of the trace, tracing is off without it
+constexpr uint32_t TRACE_SECONDS = 10; // how far back a dump reaches
+constexpr uint32_t TRACE_EVENTS_PER_FRAMESET = 4;
+constexpr uint32_t TRACE_STALL_MS = 1000; // without a frameset once they flow, dumped as an error
+
+enum class trace_stage : uint32_t {
+  dequeue, // waiting on and taking a frameset
+  preprocess,
+  inference
+};
+
+int32_t trace_init(const char* process_name, uint32_t fps);
+const char* trace_path();
+uint64_t trace_begin();
+void trace_end(trace_stage stage, uint64_t frame_ts, uint64_t start);
+void trace_error(const char* reason);
+void trace_stop();
+
+#endif // TRACE_HPP
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "frameset_dump.h"
+#include "logging.h"
+
+constexpr const char* DUMP_PREFIX = "frameset_";
+constexpr const char* DUMP_EXT = ".dump";
+
+int32_t list_dump_chunks(const char* dir, std::vector<std::string>& paths) {
+  /**
+   * Collects the chunks in a dump directory in the order they were
+   * written, which is the order of the timestamps they're named after
+   *
+   * Returns:
+   * - int32_t: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  DIR* d = opendir(dir);
+  if (d == nullptr) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening dump directory %s: %s",
+      dir,
+      strerror(errno)
+    );
+    log_write(ERROR, logstr);
+    return -errno;
+  }
+
+  std::vector<std::pair<uint64_t, std::string>> chunks;
+  struct dirent* ent;
+  while ((ent = readdir(d)) != nullptr) {
+    std::string name(ent->d_name);
+    size_t ext = name.size() - strlen(DUMP_EXT);
+    if (name.size() <= strlen(DUMP_PREFIX) + strlen(DUMP_EXT) ||
+        name.compare(0, strlen(DUMP_PREFIX), DUMP_PREFIX) != 0 ||
+        name.compare(ext, std::string::npos, DUMP_EXT) != 0)
+      continue;
+
+    uint64_t timestamp = strtoull(name.c_str() + strlen(DUMP_PREFIX), nullptr, 10);
+    chunks.emplace_back(timestamp, std::string(dir) + "/" + name);
+  }
+  closedir(d);
+
+  std::sort(chunks.begin(), chunks.end());
+  paths.clear();
+  for (auto& chunk : chunks)
+    paths.push_back(chunk.second);
+
+  return 0;
+}
+
+int32_t open_dump_chunk(dump_chunk& chunk, const char* path) {
+  /**
+   * Maps a chunk and checks it was laid out by a matching server
+   *
+   * A chunk the server never closed, because it crashed or was killed,
+   * is read up to the last index entry that made it to disk.
+   *
+   * Returns:
+   * - int32_t: 0 on success, -EINVAL for a file that is not a valid
+   *   chunk, or a negative errno
+   */
+  char logstr[128];
+
+  chunk.map = nullptr;
+  chunk.fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (chunk.fd < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening dump chunk %s: %s",
+      path,
+      strerror(errno)
+    );
+    log_write(ERROR, logstr);
+    return -errno;
+  }
+
+  struct stat sb;
+  if (fstat(chunk.fd, &sb) == -1) {
+    int32_t ret = -errno;
+    close_dump_chunk(chunk);
+    return ret;
+  }
+  chunk.size = sb.st_size;
+
+  if (chunk.size < sizeof(dump_header)) {
+    log_write(ERROR, "Dump chunk is too short to hold its header");
+    close_dump_chunk(chunk);
+    return -EINVAL;
+  }
+
+  void* map = mmap(nullptr, chunk.size, PROT_READ, MAP_SHARED, chunk.fd, 0);
+  if (map == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping dump chunk %s: %s",
+      path,
+      strerror(errno)
+    );
+    log_write(ERROR, logstr);
+    int32_t ret = -errno;
+    close_dump_chunk(chunk);
+    return ret;
+  }
+  chunk.map = static_cast<uint8_t*>(map);
+
+  // framesets are usually read front to back, so have the kernel read well ahead
+  madvise(chunk.map, chunk.size, MADV_SEQUENTIAL);
+
+  const dump_header* header = reinterpret_cast<const dump_header*>(chunk.map);
+  const char* invalid = nullptr;
+  if (header->magic != DUMP_MAGIC)
+    invalid = "File is not a frameset dump chunk";
+  else if (header->version != DUMP_VERSION || header->header_size != sizeof(dump_header))
+    invalid = "Dump chunk layout version does not match this build";
+  else if (header->cam_count > MAX_CAMS || header->frame_stride < header->frame_size)
+    invalid = "Dump chunk header is corrupt";
+  else if (header->index_offset + header->index_capacity * sizeof(dump_entry) > header->data_offset ||
+           header->data_offset > chunk.size ||
+           header->frameset_count > header->index_capacity)
+    invalid = "Dump chunk is truncated or its header is corrupt";
+
+  if (invalid) {
+    log_write(ERROR, invalid);
+    close_dump_chunk(chunk);
+    return -EINVAL;
+  }
+
+  chunk.header = header;
+  chunk.index = reinterpret_cast<const dump_entry*>(chunk.map + header->index_offset);
+  chunk.count = header->frameset_count;
+  if (chunk.count == 0) {
+    while (chunk.count < header->index_capacity && chunk.index[chunk.count].timestamp != 0)
+      chunk.count++;
+  }
+
+  return 0;
+}
+
+int32_t read_dump_frameset(dump_chunk& chunk, uint64_t i, dump_frameset& frameset) {
+  /**
+   * Points frameset at the i'th frameset in the chunk, without copying
+   * any frame
+   *
+   * Returns:
+   * - int32_t: 0 on success, -ERANGE past the last frameset, or
+   *   -EINVAL when its frames lie past the end of the chunk, as they
+   *   can in a chunk the server never closed
+   */
+  if (i >= chunk.count)
+    return -ERANGE;
+
+  const dump_entry* entry = &chunk.index[i];
+  uint64_t stride = chunk.header->frame_stride;
+  uint64_t frames = __builtin_popcountll(entry->cam_mask);
+  if (entry->offset < chunk.header->data_offset ||
+      entry->offset + frames * stride > chunk.size)
+    return -EINVAL;
+
+  frameset.timestamp = entry->timestamp;
+  frameset.cam_mask = entry->cam_mask;
+  frameset.active_mask = entry->active_mask;
+
+  const uint8_t* frame = chunk.map + entry->offset;
+  for (uint32_t cam = 0; cam < MAX_CAMS; cam++) {
+    if (entry->cam_mask & (1ULL << cam)) {
+      frameset.frames[cam] = frame;
+      frame += stride;
+    } else {
+      frameset.frames[cam] = nullptr;
+    }
+  }
+
+  return 0;
+}
+
+void close_dump_chunk(dump_chunk& chunk) {
+  if (chunk.map != nullptr)
+    munmap(chunk.map, chunk.size);
+  if (chunk.fd >= 0)
+    close(chunk.fd);
+  chunk.map = nullptr;
+  chunk.fd = -1;
+  chunk.header = nullptr;
+  chunk.index = nullptr;
+  chunk.count = 0;
+}
@@ -2,28 +2,222 @@
 // MIT License
 // See LICENSE file in the project root for full license information.
 
+#include <atomic>
 #include <fcntl.h>
 #include <errno.h>
-#include <stdbool.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "logging.h"
 
+constexpr size_t LOG_MSG_LEN = 128; // the size callers format their messages into
+constexpr int LOG_FILE_LEN = 64;
+constexpr uint64_t LOG_RING_RECORDS = 256; // per thread, must be a power of 2
+constexpr uint32_t LOG_MAX_THREADS = 64;
+constexpr long LOG_FLUSH_INTERVAL = 10000000; // 10 ms, how long a record can wait to reach the file
+constexpr size_t LOG_OUT_BUF_SIZE = 65536;
+constexpr size_t LOG_LINE_MAX = LOG_MSG_LEN + LOG_FILE_LEN + 64; // timestamp, level and line number included
+
+/**
+ * A log entry as the logging thread captured it, formatted later
+ *
+ * seq is the ring index the record was reserved at + 1, stored last,
+ * so the flusher can tell a complete record from one still being
+ * written or from a lap ago.
+ */
+struct log_record {
+  std::atomic<uint64_t> seq;
+  uint64_t timestamp; // realtime ns
+  const char* file; // a __FILE__ literal, which lives as long as the process
+  int32_t line;
+  uint32_t lvl;
+  char msg[LOG_MSG_LEN];
+};
+
+enum ring_state {
+  RING_FREE,
+  RING_OWNED, // claimed by a live thread
+  RING_RELEASED // its thread exited, free once the flusher drains it
+};
+
+/**
+ * A single thread's records on their way to the flusher
+ *
+ * Only the owning thread reserves, but a signal handler logging on the
+ * same thread can interrupt it between reserving and committing, so
+ * reservations are a compare and swap and commits can land out of
+ * order. The flusher only consumes in order, waiting on the
+ * interrupted record.
+ */
+struct log_ring {
+  alignas(64) std::atomic<uint64_t> reserve; // next index to record into
+  std::atomic<uint64_t> dropped; // records lost to a full ring
+  alignas(64) std::atomic<uint64_t> tail; // next index the flusher formats
+  std::atomic<uint32_t> state;
+  log_record records[LOG_RING_RECORDS];
+};
+
 static int fd = -1;
+static log_ring rings[LOG_MAX_THREADS];
+static thread_local log_ring* thread_ring;
+static std::atomic<uint64_t> ringless_dropped; // records from threads that found every ring taken
+static std::atomic<bool> active;
+static pthread_key_t ring_key;
+static pthread_t flusher;
+
+static void* flusher_fn(void* arg);
+static void flush_rings();
+static log_ring* claim_ring();
+
+static void release_ring(void* ptr) {
+  log_ring* ring = static_cast<log_ring*>(ptr);
+  std::atomic_store(&ring->state, RING_RELEASED);
+}
 
 int setup_logging(const char* fpath) {
+  /**
+   * Opens the log file and starts the thread that writes to it
+   *
+   * The flusher blocks every signal, so the process's handlers keep
+   * running on the threads they were meant for
+   */
   fd = open(fpath, O_WRONLY | O_CREAT | O_APPEND, 0664);
   if (fd < 0) {
     return -errno;
   }
+
+  int ret = pthread_key_create(&ring_key, release_ring);
+  if (ret) {
+    close(fd);
+    fd = -1;
+    return -ret;
+  }
+
+  // the thread setting up logging always gets a ring, however many others come and go
+  std::atomic_store(&active, true);
+  claim_ring();
+
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+  ret = pthread_create(&flusher, nullptr, flusher_fn, nullptr);
+  pthread_sigmask(SIG_SETMASK, &prev, nullptr);
+
+  if (ret) {
+    std::atomic_store(&active, false);
+    pthread_key_delete(ring_key);
+    close(fd);
+    fd = -1;
+    return -ret;
+  }
+
   return 0;
 }
 
 void cleanup_logging() {
-  if (fd >= 0) {
-    close(fd);
+  /**
+   * Stops the flusher once it has written everything logged so far
+   */
+  if (fd < 0) {
+    return;
   }
+
+  std::atomic_store(&active, false);
+  pthread_join(flusher, nullptr);
+  flush_rings();
+  pthread_key_delete(ring_key);
+
+  close(fd);
+  fd = -1;
+}
+
+static log_ring* claim_ring() {
+  /**
+   * Takes a free ring for the calling thread on its first log
+   *
+   * Only atomics and a thread specific store, so a thread can first
+   * log from a signal handler. glibc keeps the first 32 keys' values
+   * inline in the thread, so pthread_setspecific never allocates here.
+   * The key's destructor hands the ring back when the thread exits.
+   */
+  for (uint32_t i = 0; i < LOG_MAX_THREADS; i++) {
+    log_ring* ring = &rings[i];
+
+    // an exited thread's ring is as good as free once drained
+    uint32_t expected = std::atomic_load(&ring->state);
+    if (expected == RING_OWNED) {
+      continue;
+    }
+    if (expected == RING_RELEASED && std::atomic_load(&ring->tail) != std::atomic_load(&ring->reserve)) {
+      continue;
+    }
+    if (!std::atomic_compare_exchange_strong(&ring->state, &expected, RING_OWNED)) {
+      continue;
+    }
+
+    thread_ring = ring;
+    pthread_setspecific(ring_key, thread_ring);
+    return thread_ring;
+  }
+
+  return nullptr;
+}
+
+void log_msg(log_level lvl, const char* file, int line, const char* log_str) {
+  /**
+   * Records a log entry for the flusher thread to format and write
+   *
+   * Costs a clock read and a copy of the message into the calling
+   * thread's ring, with no locks and no syscalls, so it is safe to
+   * call from signal handlers and hot paths. When the ring is full,
+   * because the thread logs faster than the flusher drains, the entry
+   * is dropped and counted rather than waited on. Messages are cut at
+   * LOG_MSG_LEN - 1 characters.
+   */
+  if (!std::atomic_load_explicit(&active, std::memory_order_relaxed)) {
+    return;
+  }
+
+  log_ring* ring = thread_ring ? thread_ring : claim_ring();
+  if (!ring) {
+    std::atomic_fetch_add_explicit(&ringless_dropped, 1, std::memory_order_relaxed);
+    return;
+  }
+
+  uint64_t tail = std::atomic_load_explicit(&ring->tail, std::memory_order_acquire);
+  uint64_t idx = std::atomic_load_explicit(&ring->reserve, std::memory_order_relaxed);
+  do {
+    if (idx - tail >= LOG_RING_RECORDS) {
+      std::atomic_fetch_add_explicit(&ring->dropped, 1, std::memory_order_relaxed);
+      return;
+    }
+  } while (!std::atomic_compare_exchange_weak_explicit(
+    &ring->reserve,
+    &idx,
+    idx + 1,
+    std::memory_order_relaxed,
+    std::memory_order_relaxed
+  ));
+
+  log_record* rec = &ring->records[idx & (LOG_RING_RECORDS - 1)];
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  rec->file = file;
+  rec->line = line;
+  rec->lvl = lvl;
+
+  size_t len = 0;
+  for (; len < LOG_MSG_LEN - 1 && log_str[len]; len++) {
+    rec->msg[len] = log_str[len];
+  }
+  rec->msg[len] = '\0';
+
+  std::atomic_store_explicit(&rec->seq, idx + 1, std::memory_order_release);
 }
 
 static void i_to_str(int value, char* buffer, size_t* offset) {
@@ -35,11 +229,6 @@ static void i_to_str(int value, char* buffer, size_t* offset) {
    * 3. Builds digits in reverse order in a temporary buffer
    * 4. Copies digits to final position in correct order
    *
-   * The algorithm avoids:
-   * - Dynamic memory allocation
-   * - Function calls that might allocate
-   * - Global state modifications
-   *
    * Note: Caller must ensure buffer has sufficient space for maximum
    * possible number of digits plus sign (11 chars for 32-bit int)
    */
@@ -65,43 +254,43 @@ static void i_to_str(int value, char* buffer, size_t* offset) {
   }
 }
 
-#define LEAP_YEAR(year) ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)
-#define SECONDS_PER_LEAP_YEAR 31622400
-#define SECONDS_PER_YEAR 31536000
+static void padded(int value, int width, char* buffer, size_t* offset) {
+  for (int limit = 10; width > 1; width--, limit *= 10) {
+    if (value < limit) {
+      buffer[(*offset)++] = '0';
+    }
+  }
+  i_to_str(value, buffer, offset);
+}
+
 #define SECONDS_PER_DAY 86400
 #define SECONDS_PER_HOUR 3600
 #define SECONDS_PER_MINUTE 60
 #define NANOS_PER_MILLISECOND 1000000
 #define NANOS_PER_MICROSECOND 1000
 
-static const int SECONDS_PER_MONTH[] = {
-  2505600,  // February leap
-  2678400,  // January
-  2419200,  // February
-  2678400,  // March
-  2592000,  // April
-  2678400,  // May
-  2592000,  // June
-  2678400,  // July
-  2678400,  // August
-  2592000,  // September
-  2678400,  // October
-  2592000,  // November
-  2678400   // December
-};
+static void civil_from_days(int64_t days, int* year, int* month, int* day) {
+  /**
+   * Converts days since 1970-01-01 to a proleptic Gregorian date in
+   * constant time, by counting from 0000-03-01 in 400 year eras, which
+   * puts the leap day at the end of each year
+   */
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  int64_t day_of_era = days - era * 146097;
+  int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int64_t march_month = (5 * day_of_year + 2) / 153;
 
-static void timestamp(char* buffer, size_t* offset) {
+  *day = day_of_year - (153 * march_month + 2) / 5 + 1;
+  *month = march_month < 10 ? march_month + 3 : march_month - 9;
+  *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+static void timestamp(uint64_t ns, char* buffer, size_t* offset) {
   /**
-   * Generates an ISO 8601 timestamp without using unsafe time functions.
-   *
-   * 1. Gets raw seconds and nanoseconds
-   * 2. Accounts for leap years since epoch
-   * 3. Breaks down into calendar components:
-   *    - Years since 1970
-   *    - Months (handling February in leap years)
-   *    - Days
-   *    - Hours, minutes, seconds
-   *    - Milliseconds and microseconds
+   * Formats a realtime timestamp as ISO 8601 without the libc time
+   * functions, which take locks and may read the timezone database
    *
    * Format: "YYYY-MM-DD HH:MM:SS.mmmuuuZ"
    * Example: "2024-03-27 14:30:15.123456Z"
@@ -109,36 +298,11 @@ static void timestamp(char* buffer, size_t* offset) {
    * Note: The Z suffix indicates UTC timezone, which is what
    * CLOCK_REALTIME provides on Linux systems
    */
-  struct timespec ts;
-  clock_gettime(CLOCK_REALTIME, &ts);
-  time_t seconds = ts.tv_sec;
-  int nanos = ts.tv_nsec;
-
-  int year = 1970;
-  while (true) {
-    int seconds_in_year = LEAP_YEAR(year) ?
-                        SECONDS_PER_LEAP_YEAR :
-                        SECONDS_PER_YEAR;
-    if (seconds < seconds_in_year) {
-      break;
-    }
-    seconds -= seconds_in_year;
-    year++;
-  }
-
-  int month = 1;
-  while (true) {
-    int seconds_in_month = LEAP_YEAR(year) && month == 2 ?
-                         SECONDS_PER_MONTH[0] :
-                         SECONDS_PER_MONTH[month];
-    if (seconds < seconds_in_month) {
-      break;
-    }
-    seconds -= seconds_in_month;
-    month++;
-  }
+  int64_t seconds = ns / 1000000000ULL;
+  int nanos = ns % 1000000000ULL;
 
-  int day = seconds / SECONDS_PER_DAY + 1;
+  int year, month, day;
+  civil_from_days(seconds / SECONDS_PER_DAY, &year, &month, &day);
   seconds %= SECONDS_PER_DAY;
   int hour = seconds / SECONDS_PER_HOUR;
   seconds %= SECONDS_PER_HOUR;
@@ -150,53 +314,18 @@ static void timestamp(char* buffer, size_t* offset) {
 
   i_to_str(year, buffer, offset);
   buffer[(*offset)++] = '-';
-
-  if (month < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(month, buffer, offset);
+  padded(month, 2, buffer, offset);
   buffer[(*offset)++] = '-';
-
-  if (day < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(day, buffer, offset);
+  padded(day, 2, buffer, offset);
   buffer[(*offset)++] = ' ';
-
-  if (hour < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(hour, buffer, offset);
+  padded(hour, 2, buffer, offset);
   buffer[(*offset)++] = ':';
-
-  if (minute < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(minute, buffer, offset);
+  padded(minute, 2, buffer, offset);
   buffer[(*offset)++] = ':';
-
-  if (seconds < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(seconds, buffer, offset);
+  padded(seconds, 2, buffer, offset);
   buffer[(*offset)++] = '.';
-
-  if (millis < 100) {
-    buffer[(*offset)++] = '0';
-  }
-  if (millis < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(millis, buffer, offset);
-
-  if (micros < 100) {
-    buffer[(*offset)++] = '0';
-  }
-  if (micros < 10) {
-    buffer[(*offset)++] = '0';
-  }
-  i_to_str(micros, buffer, offset);
-
+  padded(millis, 3, buffer, offset);
+  padded(micros, 3, buffer, offset);
   buffer[(*offset)++] = 'Z';
 }
 
@@ -208,47 +337,48 @@ static const char* log_levels[] = {
   "[UNKNOWN]"
 };
 
-void log_msg(log_level lvl, const char* file, int line, const char* log_str) {
+static void format_line(
+  uint64_t ns,
+  uint32_t lvl,
+  const char* file,
+  int line,
+  const char* msg,
+  char* buffer,
+  size_t* offset
+) {
   /**
-   * Atomic writes a log entry, safe for multiple threads to share
-   *
    * The log format is:
    * "TIMESTAMP [LEVEL] file:line: message\n"
    * Example:
    * "2024-03-27 14:30:15.123456Z [INFO] main.cpp:42: Process started\n"
    */
-  if (fd < 0) {
-    return;
-  }
-
-  char buffer[256];
-  size_t offset = 0;
-
-  timestamp(buffer, &offset);
-  buffer[offset++] = ' ';
-  const char* level_str = log_levels[lvl];
+  timestamp(ns, buffer, offset);
+  buffer[(*offset)++] = ' ';
+  const char* level_str = log_levels[lvl <= ERROR ? lvl : ERROR + 1];
   for (; *level_str; level_str++) {
-    buffer[offset++] = *level_str;
+    buffer[(*offset)++] = *level_str;
   }
-  buffer[offset++] = ' ';
-  for (const char* c = file; *c; c++) {
-    buffer[offset++] = *c;
+  buffer[(*offset)++] = ' ';
+  for (int i = 0; i < LOG_FILE_LEN && file[i]; i++) {
+    buffer[(*offset)++] = file[i];
   }
-  buffer[offset++] = ':';
-  i_to_str(line, buffer, &offset);
-  buffer[offset++] = ':';
-  buffer[offset++] = ' ';
-  for (const char* c = log_str; *c; c++) {
-    buffer[offset++] = *c;
+  buffer[(*offset)++] = ':';
+  i_to_str(line, buffer, offset);
+  buffer[(*offset)++] = ':';
+  buffer[(*offset)++] = ' ';
+  for (const char* c = msg; *c; c++) {
+    buffer[(*offset)++] = *c;
   }
-  buffer[offset++] = '\n';
+  buffer[(*offset)++] = '\n';
+}
 
+static void write_all(const char* buffer, size_t len) {
   size_t total_bytes_written = 0;
-  while (total_bytes_written < offset) {
+  while (total_bytes_written < len) {
     ssize_t result = write(
       fd,
       buffer + total_bytes_written,
-      offset - total_bytes_written
+      len - total_bytes_written
     );
 
     if (result < 0) {
@@ -261,3 +391,117 @@ void log_msg(log_level lvl, const char* file, int line, const char* log_str) {
     total_bytes_written += result;
   }
 }
+
+static log_record* ready_record(log_ring* ring) {
+  uint64_t tail = std::atomic_load_explicit(&ring->tail, std::memory_order_relaxed);
+  log_record* rec = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+  if (std::atomic_load_explicit(&rec->seq, std::memory_order_acquire) != tail + 1) {
+    return nullptr;
+  }
+  return rec;
+}
+
+static void flush_rings() {
+  /**
+   * Formats every complete record in timestamp order across threads,
+   * writing them in as few syscalls as the buffer allows, then frees
+   * the drained rings of exited threads
+   *
+   * Drops, from a thread filling its ring between flushes or finding
+   * every ring taken, are reported as their own line once noticed
+   */
+  static char out[LOG_OUT_BUF_SIZE];
+  static uint64_t reported_drops;
+  size_t offset = 0;
+
+  while (true) {
+    log_ring* next = nullptr;
+    log_record* next_rec = nullptr;
+    for (uint32_t i = 0; i < LOG_MAX_THREADS; i++) {
+      if (std::atomic_load_explicit(&rings[i].state, std::memory_order_relaxed) == RING_FREE) {
+        continue;
+      }
+
+      log_record* rec = ready_record(&rings[i]);
+      if (rec && (!next_rec || rec->timestamp < next_rec->timestamp)) {
+        next = &rings[i];
+        next_rec = rec;
+      }
+    }
+    if (!next) {
+      break;
+    }
+
+    if (offset > LOG_OUT_BUF_SIZE - LOG_LINE_MAX) {
+      write_all(out, offset);
+      offset = 0;
+    }
+
+    format_line(
+      next_rec->timestamp,
+      next_rec->lvl,
+      next_rec->file,
+      next_rec->line,
+      next_rec->msg,
+      out,
+      &offset
+    );
+
+    uint64_t tail = std::atomic_load_explicit(&next->tail, std::memory_order_relaxed);
+    std::atomic_store_explicit(&next->tail, tail + 1, std::memory_order_release);
+  }
+
+  uint64_t drops = std::atomic_load(&ringless_dropped);
+  for (uint32_t i = 0; i < LOG_MAX_THREADS; i++) {
+    log_ring* ring = &rings[i];
+    drops += std::atomic_load(&ring->dropped);
+
+    uint32_t released = RING_RELEASED;
+    if (std::atomic_load(&ring->tail) == std::atomic_load(&ring->reserve)) {
+      std::atomic_compare_exchange_strong(&ring->state, &released, RING_FREE);
+    }
+  }
+
+  if (drops != reported_drops) {
+    char msg[LOG_MSG_LEN];
+    size_t len = 0;
+    const char* prefix = "Log records dropped for lack of ring space: ";
+    for (; *prefix; prefix++) {
+      msg[len++] = *prefix;
+    }
+    i_to_str(static_cast<int>(drops - reported_drops), msg, &len);
+    msg[len] = '\0';
+
+    if (offset > LOG_OUT_BUF_SIZE - LOG_LINE_MAX) {
+      write_all(out, offset);
+      offset = 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    format_line(
+      ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+      WARNING,
+      __FILE__,
+      __LINE__,
+      msg,
+      out,
+      &offset
+    );
+    reported_drops = drops;
+  }
+
+  if (offset) {
+    write_all(out, offset);
+  }
+}
+
+static void* flusher_fn(void*) {
+  timespec interval = {0, LOG_FLUSH_INTERVAL};
+  while (std::atomic_load(&active)) {
+    flush_rings();
+    nanosleep(&interval, nullptr);
+  }
+
+  return nullptr;
+}
@@ -0,0 +1,71 @@
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "notify.hpp"
+
+static uint32_t* futex_word(notifier* n) {
+  return reinterpret_cast<uint32_t*>(&n->seq);
+}
+
+void notify(notifier* n) {
+  /**
+   * Wakes every thread sleeping on the notifier
+   *
+   * The seq bump is ordered before the waiters check, and a sleeper
+   * registers as a waiter before the kernel rechecks seq, so either we
+   * see the waiter or the waiter sees the new seq and never sleeps
+   */
+  n->seq.fetch_add(1);
+  if (n->waiters.load() == 0)
+    return;
+
+  syscall(
+    SYS_futex,
+    futex_word(n),
+    FUTEX_WAKE,
+    INT_MAX,
+    nullptr,
+    nullptr,
+    0
+  );
+}
+
+int32_t notify_wait(
+  notifier* n,
+  uint32_t seq,
+  uint64_t timeout_ns
+) {
+  /**
+   * Sleeps until the notifier moves past seq or the timeout passes
+   *
+   * Returns:
+   *   0 when woken or seq already moved, -ETIMEDOUT, or -EINTR
+   */
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ns / 1000000000ULL;
+  timeout.tv_nsec = timeout_ns % 1000000000ULL;
+
+  n->waiters.fetch_add(1);
+  long ret = syscall(
+    SYS_futex,
+    futex_word(n),
+    FUTEX_WAIT,
+    seq,
+    &timeout,
+    nullptr,
+    0
+  );
+  int32_t err = errno;
+  n->waiters.fetch_sub(1);
+
+  if (ret == 0 || err == EAGAIN)
+    return 0;
+
+  return -err;
+}
@@ -1,41 +1,142 @@
+#include <algorithm>
 #include <csignal>
 #include <cstring>
 #include <cstdint>
 #include <cstdio>
 #include <cerrno>
+#include <ctime>
 #include <fcntl.h>
-#include <memory>
-#include <spsc_queue.hpp>
+#include <climits>
+#include <mntent.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 #include <unistd.h>
 
 #include "stream_ctl.h"
 #include "logging.h"
+#include "notify.hpp"
+#include "trace.hpp"
+
+static int32_t subscribe(stream_ctx& ctx);
+static void unsubscribe(stream_ctx& ctx);
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int32_t open_segment(const char* shm_name) {
+  /**
+   * Opens the server's segment, which lives on a hugetlbfs mount
+   * under the shm name when the server was configured for hugepages,
+   * and is a regular POSIX shm object otherwise
+   *
+   * Returns:
+   * - int32_t: the fd, or -1 with errno set
+   */
+  FILE* mounts = setmntent("/proc/mounts", "r");
+  if (mounts != nullptr) {
+    char path[PATH_MAX];
+    struct mntent* mnt;
+    while ((mnt = getmntent(mounts)) != nullptr) {
+      if (strcmp(mnt->mnt_type, "hugetlbfs") != 0)
+        continue;
+
+      snprintf(path, sizeof(path), "%s%s", mnt->mnt_dir, shm_name);
+      int32_t fd = open(path, O_RDWR);
+      if (fd >= 0) {
+        endmntent(mounts);
+        return fd;
+      }
+    }
+    endmntent(mounts);
+  }
+
+  return shm_open(
+    shm_name,
+    O_RDWR,
+    0666
+  );
+}
+
+static bool retry_wait(uint64_t deadline, useconds_t& retry_cd) {
+  /**
+   * Sleeps before the next attempt at attaching, backing off up to
+   * ATTACH_RETRY_MAX_US
+   *
+   * Returns:
+   * - bool: false without sleeping once the deadline has passed
+   */
+  if (now_ns() >= deadline)
+    return false;
+
+  usleep(retry_cd);
+  retry_cd = std::min<useconds_t>(retry_cd * 2, ATTACH_RETRY_MAX_US);
+  return true;
+}
 
 static inline uint64_t alignup(uint64_t offset, uint64_t alignment) {
   return (offset + (alignment - 1)) & ~(alignment - 1);
 }
 
+static void reset_ctx(stream_ctx& ctx) {
+  ctx.server_pid = 0;
+  ctx.shm_fd = -1;
+  ctx.shm_size = 0;
+  ctx.mmap_buf = nullptr;
+  ctx.header = nullptr;
+  ctx.ts_frame_bufs = nullptr;
+  ctx.frameset_slots = nullptr;
+  ctx.frameset_refs = nullptr;
+  ctx.bus = nullptr;
+  ctx.filled_frameset_notify = nullptr;
+  ctx.server_notify = nullptr;
+  ctx.stats = nullptr;
+  ctx.mode = sub_mode::reliable;
+  ctx.sub_idx = -1;
+  ctx.cursor = 0;
+}
+
 int32_t start_streams(
-  struct stream_ctx& ctx,
+  stream_ctx& ctx,
   uint32_t frame_width,
   uint32_t frame_height,
   uint32_t cam_count,
-  char* target_id = nullptr
+  char* target_id,
+  const char* shm_name,
+  sub_mode mode,
+  const char* conf_path
 ) {
+  /**
+   * Launches the stream server on the named shared memory segment
+   * and attaches to it once the server has initialized it
+   *
+   * Parameters:
+   * - char* target_id: camera id to stream alone, or nullptr for all
+   * - const char* shm_name: lets several sessions run side by side
+   * - sub_mode mode: how we subscribe to published framesets
+   * - const char* conf_path: camera config for the server, or nullptr
+   *   for the server's default
+   *
+   * The server traces alongside us when trace_init enabled tracing
+   *
+   * Returns:
+   * - int32_t: 0 on success, a negative errno otherwise
+   */
   char logstr[128];
 
-  ctx.server_pid = 0;
-  ctx.shm_fd = -1;
-  ctx.shm_size = 0;
-  ctx.mmap_buf = nullptr;
-  ctx.filled_frameset_q = nullptr;
-  ctx.empty_frameset_q = nullptr;
+  reset_ctx(ctx);
+
+  char server_trace[PATH_MAX];
+  if (trace_path() != nullptr)
+    snprintf(server_trace, sizeof(server_trace), "%s.server", trace_path());
 
-  ctx.server_pid = fork();
-  if (ctx.server_pid == -1) {
+  pid_t server_pid = fork();
+  if (server_pid == -1) {
     snprintf(
       logstr,
       sizeof(logstr),
@@ -43,46 +144,88 @@ int32_t start_streams(
       strerror(errno)
     );
     log_write(ERROR, logstr);
-    cleanup_streams(ctx);
     return -errno;
   }
 
-  if (ctx.server_pid == 0) {
-    execl(SERVER_EXE, SERVER_EXE, target_id, nullptr);
+  if (server_pid == 0) {
+    const char* argv[9];
+    int argc = 0;
+    argv[argc++] = SERVER_EXE;
+    argv[argc++] = "-s";
+    argv[argc++] = shm_name;
+    if (conf_path != nullptr) {
+      argv[argc++] = "-c";
+      argv[argc++] = conf_path;
+    }
+    if (trace_path() != nullptr) {
+      argv[argc++] = "-t";
+      argv[argc++] = server_trace;
+    }
+    argv[argc++] = target_id;
+    argv[argc] = nullptr;
+
+    execv(SERVER_EXE, const_cast<char* const*>(argv));
     _exit(errno);
   }
 
+  int32_t ret = attach_streams(
+    ctx,
+    frame_width,
+    frame_height,
+    cam_count,
+    shm_name,
+    mode
+  );
+  ctx.server_pid = server_pid;
+  return ret;
+}
+
+int32_t attach_streams(
+  stream_ctx& ctx,
+  uint32_t frame_width,
+  uint32_t frame_height,
+  uint32_t cam_count,
+  const char* shm_name,
+  sub_mode mode
+) {
   /**
-   * The frameset producer server will create, resize, initialize, and cleanup
-   * the shared memory. We just need to map out the layout so we can find our
-   * filled frameset consumer queue, and empty frameset producer queues, and
-   * get the size so we can unmap it at cleanup time
+   * Attaches to a segment created by an already running server
+   *
+   * The server writes a header at offset 0 describing the segment and
+   * sets its ready flag once everything is initialized, so we map just
+   * the header, wait for the flag, validate it against what we expect
+   * to consume, then map the whole segment at whatever address the
+   * kernel picks. Every region is found through the header's offsets.
+   *
+   * Any number of consumers up to MAX_SUBSCRIBERS can attach to the
+   * same server, each with its own subscription.
+   *
+   * A server that was just launched may still be running its decoder
+   * self-test or prefaulting hugepages, so we keep retrying for up to
+   * ATTACH_TIMEOUT_MS in all.
+   *
+   * Returns:
+   * - int32_t: 0 on success, a negative errno otherwise
    */
+  char logstr[128];
 
-  uint32_t max_attempts = 10;
+  reset_ctx(ctx);
+
+  uint64_t deadline = now_ns() + ATTACH_TIMEOUT_MS * 1000000ULL;
   useconds_t retry_cd = 1000; // 1ms
-  for (uint32_t attempt = 0; attempt < max_attempts; attempt++) {
-    ctx.shm_fd = shm_open(
-      SHM_NAME,
-      O_RDWR,
-      0666
-    );
-    if (ctx.shm_fd != -1)
+  while (true) {
+    ctx.shm_fd = open_segment(shm_name);
+    if (ctx.shm_fd != -1 || errno != ENOENT)
       break;
-
-    if (errno == ENOENT) {
-      usleep(retry_cd);
-      retry_cd *= 2;
-    } else {
+    if (!retry_wait(deadline, retry_cd))
       break;
-    }
   }
 
   if (ctx.shm_fd == -1) {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Error creating shared memory: %s",
+      "Error opening shared memory: %s",
       strerror(errno)
     );
     log_write(ERROR, logstr);
@@ -91,8 +234,7 @@ int32_t start_streams(
   }
 
   struct stat sb;
-  retry_cd = 1000; // 1ms
-  for (uint32_t attempt = 0; attempt < max_attempts; attempt++) {
+  while (true) {
     int32_t ret = fstat(ctx.shm_fd, &sb);
     if (ret == -1) {
       snprintf(
@@ -106,64 +248,87 @@ int32_t start_streams(
       return -errno;
     }
 
-    if (sb.st_size > 0)
+    if (static_cast<uint64_t>(sb.st_size) >= sizeof(shm_header))
+      break;
+    if (!retry_wait(deadline, retry_cd))
       break;
-
-    usleep(retry_cd);
-    retry_cd *= 2;
   }
 
-  if (sb.st_size == 0) {
+  if (static_cast<uint64_t>(sb.st_size) < sizeof(shm_header)) {
     log_write(ERROR, "Timeout waiting for shared memory initialization");
     cleanup_streams(ctx);
     return -ETIMEDOUT;
   }
 
-  // frame buffers
-  uint64_t frame_size = frame_width * frame_height * 3 / 2;
-  uint64_t frame_count = cam_count * FRAME_BUFS_PER_THREAD;
-  ctx.shm_size = frame_size * frame_count;
-
-  // timestamped structs with frame buffer ptrs
-  ctx.shm_size = alignup(ctx.shm_size, alignof(struct ts_frame_buf));
-  ctx.shm_size += sizeof(ts_frame_buf) * frame_count;
-
-  // filled frameset producer queue
-  ctx.shm_size = alignup(ctx.shm_size, alignof(struct producer_q));
-  ctx.shm_size += sizeof(struct producer_q);
-
-  // filled frameset consumer queue, we want a ref to this one
-  ctx.shm_size = alignup(ctx.shm_size, alignof(struct consumer_q));
-  uint64_t filled_frameset_consumer_q_offset = ctx.shm_size;
-  ctx.shm_size += sizeof(struct consumer_q);
+  // hugetlbfs reports its page size as the block size, and only maps whole pages
+  struct statfs sfs;
+  if (fstatfs(ctx.shm_fd, &sfs) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error checking shared memory page size: %s",
+      strerror(errno)
+    );
+    log_write(ERROR, logstr);
+    cleanup_streams(ctx);
+    return -errno;
+  }
+  uint64_t header_map_size = alignup(sizeof(shm_header), sfs.f_bsize);
 
-  // empty frameset producer queue, we want a ref to this one too
-  ctx.shm_size = alignup(ctx.shm_size, alignof(struct producer_q));
-  uint64_t empty_frameset_producer_q_offset = ctx.shm_size;
-  ctx.shm_size += sizeof(struct producer_q);
+  void* header_map = mmap(
+    nullptr,
+    header_map_size,
+    PROT_READ,
+    MAP_SHARED,
+    ctx.shm_fd,
+    0
+  );
+  if (header_map == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping shared memory header: %s",
+      strerror(errno)
+    );
+    log_write(ERROR, logstr);
+    cleanup_streams(ctx);
+    return -errno;
+  }
 
-  // empty frameset consumer queue
-  ctx.shm_size = alignup(ctx.shm_size, alignof(struct consumer_q));
-  ctx.shm_size += sizeof(struct consumer_q);
+  shm_header* header = static_cast<shm_header*>(header_map);
+  while (!header->ready.load(std::memory_order_acquire)) {
+    if (!retry_wait(deadline, retry_cd))
+      break;
+  }
 
-  // filled frameset queue buffer
-  ctx.shm_size = alignup(ctx.shm_size, alignof(void**));
-  ctx.shm_size += (sizeof(void*) * FRAME_BUFS_PER_THREAD);
+  const char* invalid = nullptr;
+  if (!header->ready.load(std::memory_order_acquire))
+    invalid = "Timeout waiting for shared memory initialization";
+  else if (header->magic != SHM_MAGIC)
+    invalid = "Shared memory segment was not created by the stream server";
+  else if (header->version != SHM_VERSION || header->header_size != sizeof(shm_header))
+    invalid = "Shared memory layout version does not match this build";
+  else if (header->frame_width != frame_width || header->frame_height != frame_height)
+    invalid = "Shared memory frame geometry does not match the config";
+  else if (header->cam_count < cam_count)
+    invalid = "Shared memory has fewer camera positions than the config has cameras";
 
-  // empty frameset queue buffer
-  ctx.shm_size = alignup(ctx.shm_size, alignof(void**));
-  ctx.shm_size += (sizeof(void*) * FRAME_BUFS_PER_THREAD);
+  uint64_t shm_size = header->shm_size;
+  uint64_t page_size = header->page_size;
+  munmap(header_map, header_map_size);
 
-  // frameset slots
-  ctx.shm_size = alignup(ctx.shm_size, alignof(struct ts_frame_buf*));
-  ctx.shm_size += sizeof(struct ts_frame_buf*) * (FRAMESET_SLOTS_PER_THREAD * cam_count);
+  if (invalid) {
+    log_write(ERROR, invalid);
+    cleanup_streams(ctx);
+    return -EINVAL;
+  }
 
-  if (static_cast<uint64_t>(sb.st_size) != ctx.shm_size) {
+  if (static_cast<uint64_t>(sb.st_size) != shm_size) {
     snprintf(
       logstr,
       sizeof(logstr),
       "Shared memory size mismatch: expected %lu, got %lu",
-      ctx.shm_size,
+      shm_size,
       sb.st_size
     );
     log_write(ERROR, logstr);
@@ -172,14 +337,15 @@ int32_t start_streams(
   }
 
   ctx.mmap_buf = mmap(
-    SHM_ADDR,
-    ctx.shm_size,
+    nullptr,
+    shm_size,
     PROT_READ | PROT_WRITE,
-    MAP_SHARED,
+    page_size > 4096 ? MAP_SHARED | MAP_POPULATE : MAP_SHARED,
     ctx.shm_fd,
     0
   );
   if (ctx.mmap_buf == MAP_FAILED) {
+    ctx.mmap_buf = nullptr;
     snprintf(
       logstr,
       sizeof(logstr),
@@ -190,15 +356,270 @@ int32_t start_streams(
     cleanup_streams(ctx);
     return -errno;
   }
+  ctx.shm_size = shm_size;
+
+  uint8_t* base_ptr = static_cast<uint8_t*>(ctx.mmap_buf);
+  ctx.header = reinterpret_cast<shm_header*>(base_ptr);
+  ctx.ts_frame_bufs = reinterpret_cast<ts_frame_buf*>(base_ptr + ctx.header->ts_frame_bufs_offset);
+  ctx.frameset_slots = reinterpret_cast<struct frameset*>(base_ptr + ctx.header->frameset_slots_offset);
+  ctx.frameset_refs = reinterpret_cast<frameset_ref*>(base_ptr + ctx.header->frameset_refs_offset);
+  ctx.bus = reinterpret_cast<frameset_bus*>(base_ptr + ctx.header->frameset_bus_offset);
+  ctx.filled_frameset_notify = reinterpret_cast<notifier*>(base_ptr + ctx.header->filled_frameset_notify_offset);
+  ctx.server_notify = reinterpret_cast<notifier*>(base_ptr + ctx.header->server_notify_offset);
+  ctx.stats = reinterpret_cast<server_stats*>(base_ptr + ctx.header->stats_offset);
+  ctx.mode = mode;
 
-  uint8_t* base_ptr = reinterpret_cast<uint8_t*>(ctx.mmap_buf);
-  ctx.filled_frameset_q = reinterpret_cast<consumer_q*>((base_ptr + filled_frameset_consumer_q_offset));
-  ctx.empty_frameset_q = reinterpret_cast<producer_q*>((base_ptr + empty_frameset_producer_q_offset));
+  int32_t ret = subscribe(ctx);
+  if (ret) {
+    log_write(ERROR, "Every frameset subscription is already taken");
+    cleanup_streams(ctx);
+    return ret;
+  }
 
   return 0;
 }
 
-void cleanup_streams(struct stream_ctx& ctx) {
+static int32_t subscribe(stream_ctx& ctx) {
+  /**
+   * Claims a free subscriber slot, whose index is also the bit we
+   * mark our references to frameset slots with
+   *
+   * Reliable subscribers start at the next publish. One racing with
+   * our join may miss our bit, and is skipped when we get to it.
+   */
+  frameset_bus* bus = ctx.bus;
+
+  for (uint32_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    uint32_t expected = SUB_FREE;
+    if (!bus->subs[i].state.compare_exchange_strong(expected, SUB_CLAIMED))
+      continue;
+
+    bus->subs[i].pid.store(getpid());
+    ctx.sub_idx = i;
+    ctx.cursor = bus->head.load(std::memory_order_acquire);
+
+    if (ctx.mode == sub_mode::reliable) {
+      bus->reliable_mask.fetch_or(1U << i);
+      bus->subs[i].state.store(SUB_RELIABLE);
+    } else {
+      bus->subs[i].state.store(SUB_LATEST);
+    }
+
+    return 0;
+  }
+
+  return -EBUSY;
+}
+
+static void unsubscribe(stream_ctx& ctx) {
+  /**
+   * Drops every reference we hold and frees our subscriber slot
+   *
+   * The bit leaves the reliable mask before the sweep, so the server
+   * either stops handing it out or we clear it from the slot afterward
+   */
+  if (ctx.sub_idx < 0)
+    return;
+
+  uint32_t bit = 1U << ctx.sub_idx;
+  frameset_bus* bus = ctx.bus;
+
+  bus->reliable_mask.fetch_and(~bit);
+  for (uint32_t i = 0; i < ctx.header->frameset_slots; i++)
+    ctx.frameset_refs[i].refs.fetch_and(~bit);
+
+  bus->subs[ctx.sub_idx].pid.store(0);
+  bus->subs[ctx.sub_idx].state.store(SUB_FREE);
+  ctx.sub_idx = -1;
+
+  notify(ctx.server_notify);
+}
+
+static struct frameset* next_reliable(stream_ctx& ctx) {
+  /**
+   * Takes the next publish in order, which the server already
+   * referenced on our behalf when it published it
+   */
+  frameset_bus* bus = ctx.bus;
+  uint32_t bit = 1U << ctx.sub_idx;
+  uint64_t head = bus->head.load(std::memory_order_acquire);
+
+  while (ctx.cursor < head) {
+    uint64_t seq = ctx.cursor++;
+    uint32_t slot = bus->entries[seq & bus->mask].load(std::memory_order_relaxed);
+    if (slot >= ctx.header->frameset_slots)
+      continue;
+
+    frameset_ref* ref = &ctx.frameset_refs[slot];
+    if ((ref->refs.load() & bit) && ref->seq.load() == seq)
+      return &ctx.frameset_slots[slot];
+  }
+
+  return nullptr;
+}
+
+static struct frameset* next_latest(stream_ctx& ctx) {
+  /**
+   * Takes a reference on the newest publish, if it is newer than the
+   * last one we took
+   *
+   * The server keeps the newest publish referenced, and nothing can
+   * reference a slot after its refs reach 0, so we only take one that
+   * is still live, then check it was not reused before we got to it
+   */
+  frameset_bus* bus = ctx.bus;
+  uint32_t bit = 1U << ctx.sub_idx;
+
+  while (true) {
+    uint64_t head = bus->head.load(std::memory_order_acquire);
+    if (head == ctx.cursor)
+      return nullptr;
+
+    uint64_t seq = head - 1;
+    uint32_t slot = bus->entries[seq & bus->mask].load(std::memory_order_relaxed);
+    if (slot >= ctx.header->frameset_slots)
+      continue;
+
+    frameset_ref* ref = &ctx.frameset_refs[slot];
+    uint32_t refs = ref->refs.load();
+    bool acquired = false;
+    while (refs != 0) {
+      if (ref->refs.compare_exchange_weak(refs, refs | bit)) {
+        acquired = true;
+        break;
+      }
+    }
+    if (!acquired)
+      continue;
+
+    if (ref->seq.load() != seq) {
+      release_frameset(ctx, &ctx.frameset_slots[slot]);
+      continue;
+    }
+
+    ctx.cursor = head;
+    return &ctx.frameset_slots[slot];
+  }
+}
+
+struct frameset* wait_frameset(stream_ctx& ctx, uint32_t timeout_ms) {
+  /**
+   * Blocks until the server publishes a frameset we have not seen
+   *
+   * Reliable subscribers get every frameset published since they
+   * attached, in order. Latest subscribers get the newest one and
+   * skip anything published while they were busy.
+   *
+   * Returns nullptr on timeout or when a signal interrupts the wait,
+   * so callers should check their stop flag and call again
+   */
+  if (ctx.sub_idx < 0)
+    return nullptr;
+
+  uint64_t deadline = now_ns() + timeout_ms * 1000000ULL;
+
+  while (true) {
+    uint32_t seq = ctx.filled_frameset_notify->seq.load();
+
+    struct frameset* frameset = ctx.mode == sub_mode::reliable ?
+                                next_reliable(ctx) :
+                                next_latest(ctx);
+    if (frameset != nullptr)
+      return frameset;
+
+    uint64_t now = now_ns();
+    if (now >= deadline)
+      return nullptr;
+
+    int32_t ret = notify_wait(ctx.filled_frameset_notify, seq, deadline - now);
+    if (ret == -EINTR)
+      return nullptr;
+  }
+}
+
+void release_frameset(stream_ctx& ctx, struct frameset* frameset) {
+  /**
+   * Drops our reference so the server can reuse the frameset's
+   * frames once every other subscriber has dropped theirs too
+   */
+  uint32_t bit = 1U << ctx.sub_idx;
+  frameset_ref* ref = &ctx.frameset_refs[frameset - ctx.frameset_slots];
+
+  // only the last reference out has anything for the server to do
+  uint32_t prev = ref->refs.fetch_and(~bit);
+  if ((prev & ~bit) == 0)
+    notify(ctx.server_notify);
+}
+
+uint8_t* frameset_frame(stream_ctx& ctx, struct frameset* frameset, uint32_t cam) {
+  /**
+   * Returns the frame a camera contributed to the frameset, laid out
+   * as header->pixel_format says, only valid while the camera's bit
+   * is set in cam_mask
+   */
+  ts_frame_buf* buf = &ctx.ts_frame_bufs[frameset->frame_idx[cam]];
+  return static_cast<uint8_t*>(ctx.mmap_buf) + buf->frame_offset;
+}
+
+int32_t frameset_position(stream_ctx& ctx, struct frameset* frameset, uint8_t cam_id) {
+  /**
+   * Finds the position holding the frame of the camera with config id
+   * cam_id, to pass to frameset_frame
+   *
+   * A reloaded config moves cameras to other positions, so they're
+   * looked up in the server's cam_ids among the ones streaming for the
+   * frameset, rather than taken from the order of the config.
+   *
+   * Returns:
+   * - int32_t: the position, or -1 when the camera has no frame in it
+   */
+  for (uint32_t pos = 0; pos < MAX_CAMS; pos++) {
+    uint64_t bit = 1ULL << pos;
+    if ((frameset->active_mask & bit) &&
+        (frameset->cam_mask & bit) &&
+        ctx.header->cam_ids[pos] == cam_id)
+      return pos;
+  }
+
+  return -1;
+}
+
+int32_t pin_consumer(stream_ctx& ctx) {
+  /**
+   * Pins the calling thread, and the threads it spawns after, to the
+   * cpu the server set aside for its consumer, which shares an L3 with
+   * the server's threads
+   *
+   * Only call it once the streams are started, since a server started
+   * by start_streams places its threads among the cpus it inherits.
+   *
+   * Returns:
+   * - int32_t: 0 on success, or a negative errno
+   */
+  char logstr[128];
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(ctx.header->consumer_cpu, &cpuset);
+  if (sched_setaffinity(0, sizeof(cpuset), &cpuset) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error pinning to cpu %u: %s",
+      ctx.header->consumer_cpu,
+      strerror(errno)
+    );
+    log_write(WARNING, logstr);
+    return -errno;
+  }
+
+  return 0;
+}
+
+void cleanup_streams(stream_ctx& ctx) {
+  if (ctx.bus != nullptr)
+    unsubscribe(ctx);
+
   if (ctx.mmap_buf != nullptr)
     munmap(ctx.mmap_buf, ctx.shm_size);
 
@@ -207,4 +628,6 @@ void cleanup_streams(struct stream_ctx& ctx) {
 
   if (ctx.server_pid > 0)
     kill(ctx.server_pid, SIGTERM);
+
+  reset_ctx(ctx);
 }
@@ -0,0 +1,180 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "logging.h"
+#include "trace.hpp"
+
+struct trace_event {
+  uint64_t start; // monotonic ns, the same clock as the server's trace
+  uint64_t end;
+  uint64_t frame_ts; // capture timestamp of the frameset
+  trace_stage stage;
+};
+
+static const char* stage_names[] = {
+  "dequeue",
+  "preprocess",
+  "inference"
+};
+
+static thread_local bool tracing_thread = false;
+static bool error_dumped = false; // only the first error is worth a flight recording
+static std::vector<trace_event> events;
+static uint64_t head = 0; // events ever recorded, the newest is at head - 1
+static const char* path = nullptr;
+static const char* name = nullptr;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int32_t trace_init(const char* process_name, uint32_t fps) {
+  /**
+   * Starts tracing the calling thread when MOCAP_TRACE names a file,
+   * keeping its last TRACE_SECONDS of events for trace_stop to write
+   * as Chrome trace event JSON, and for trace_error to write to the
+   * same path with .error appended
+   *
+   * The server started by start_streams traces to the same path with
+   * .server appended, dumping its own flight recording to
+   * .server.error if it hits an error. Both use the monotonic clock,
+   * so the files can be merged onto one timeline, for example with
+   * jq -s '{traceEvents: map(.traceEvents) | add}'
+   *
+   * Returns:
+   * - int32_t: 0 on success, or -ENOMEM
+   */
+  path = getenv(TRACE_ENV);
+  if (path == nullptr || *path == '\0') {
+    path = nullptr;
+    return 0;
+  }
+
+  uint64_t capacity = static_cast<uint64_t>(TRACE_SECONDS) * fps * TRACE_EVENTS_PER_FRAMESET;
+  try {
+    events.resize(capacity ? capacity : 1);
+  } catch (const std::bad_alloc&) {
+    log_write(ERROR, "Failed to allocate the trace ring");
+    path = nullptr;
+    return -ENOMEM;
+  }
+
+  name = process_name;
+  tracing_thread = true;
+  return 0;
+}
+
+const char* trace_path() {
+  return path;
+}
+
+uint64_t trace_begin() {
+  return tracing_thread ? now_ns() : 0;
+}
+
+void trace_end(trace_stage stage, uint64_t frame_ts, uint64_t start) {
+  if (!tracing_thread)
+    return;
+
+  trace_event& ev = events[head % events.size()];
+  ev.start = start;
+  ev.end = now_ns();
+  ev.frame_ts = frame_ts;
+  ev.stage = stage;
+  head++;
+}
+
+static void trace_dump(const char* out_path, const char* reason) {
+  char logstr[128];
+
+  FILE* f = fopen(out_path, "w");
+  if (f == nullptr) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening trace file %s: %s",
+      out_path,
+      strerror(errno)
+    );
+    log_write(ERROR, logstr);
+    return;
+  }
+
+  pid_t pid = getpid();
+  pid_t tid = gettid();
+  fprintf(
+    f,
+    "{\"otherData\":{\"reason\":\"%s\"},\"displayTimeUnit\":\"ms\",\"traceEvents\":["
+    "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}"
+    ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"main\"}}",
+    reason,
+    pid,
+    name,
+    pid,
+    tid
+  );
+
+  uint64_t capacity = events.size();
+  for (uint64_t idx = head > capacity ? head - capacity : 0; idx < head; idx++) {
+    const trace_event& ev = events[idx % capacity];
+    fprintf(
+      f,
+      ",\n{\"name\":\"%s\",\"cat\":\"consumer\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+      "\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"args\":{\"frame\":%lu}}",
+      stage_names[static_cast<uint32_t>(ev.stage)],
+      pid,
+      tid,
+      ev.start / 1000,
+      ev.start % 1000,
+      (ev.end - ev.start) / 1000,
+      (ev.end - ev.start) % 1000,
+      ev.frame_ts
+    );
+  }
+
+  fputs("\n]}\n", f);
+  fclose(f);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Wrote %lu trace events to %s",
+    head < capacity ? head : capacity,
+    out_path
+  );
+  log_write(INFO, logstr);
+}
+
+void trace_error(const char* reason) {
+  /**
+   * Dumps the flight recording once, on the first error, while the
+   * consumer keeps running
+   *
+   * The ring is only the tracing thread's, so errors on other threads
+   * aren't dumped.
+   */
+  if (!tracing_thread || error_dumped)
+    return;
+
+  error_dumped = true;
+  std::string error_path = std::string(path) + ".error";
+  trace_dump(error_path.c_str(), reason);
+}
+
+void trace_stop() {
+  if (!tracing_thread)
+    return;
+
+  trace_dump(path, "stop");
+  tracing_thread = false;
+}
@@ -0,0 +1,716 @@
+#include <algorithm>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "logging.h"
+#include "stream_ctl.h"
+
+/*
+ * Measures the frameset pipeline end to end on one host
+ *
+ * For every point of the sweep it writes a config of local cameras,
+ * starts camera_sim on it, starts the server on a shared memory
+ * segment of its own through stream_ctl and consumes every frameset as
+ * a reliable subscriber. After a warmup it records, per frameset, the
+ * time from the scheduled capture timestamp to our dequeue, which cameras
+ * are missing from it and whether whole framesets went missing, and
+ * samples CPU time per pipeline stage from the server's thread names.
+ *
+ * Each point prints one JSON object on a line of its own on stdout:
+ *
+ *   frameset_bench -n 4,8,16 -r 1280x720,1920x1080 -f 30,60 -d 20 >> bench.jsonl
+ *
+ * With -u every point runs once per receive backend, recv and then
+ * io_uring, so the two can be compared by their receive syscalls per
+ * packet and CPU per camera, from the server's stats region and the
+ * camera, ingest and decode stages:
+ *
+ *   frameset_bench -u -n 4,16 -d 20
+ *
+ * Latencies are CLOCK_REALTIME based like the capture timestamps, so
+ * they include the camera's own pacing jitter, which camera_sim keeps to
+ * a few tens of microseconds.
+ */
+
+constexpr const char* LOG_PATH = "/var/log/mocap-toolkit/frameset_bench.log";
+constexpr const char* SIM_EXE = "/usr/local/bin/camera_sim";
+constexpr const char* BENCH_SHM_NAME = "/mocap-bench_shm";
+constexpr const char* BENCH_CONF_PATH = "/tmp/mocap-bench-cams.yaml";
+
+// the following constants need to match camera_sim -g identically:
+constexpr uint32_t GEN_BASE_TCP_PORT = 12345;
+constexpr uint32_t GEN_BASE_UDP_PORT = 22345;
+
+constexpr uint32_t DEFAULT_DURATION_SEC = 10;
+constexpr uint32_t DEFAULT_WARMUP_SEC = 3; // covers the server's start delay and decoder warmup
+constexpr uint32_t SIM_READY_TIMEOUT_MS = 30000; // the test pattern is encoded at startup
+constexpr uint32_t MAX_BENCH_CAMS = 100; // camera names have two digits
+
+enum bench_stage {
+  STAGE_CAMERA, // thread per camera mode, socket and decoder together
+  STAGE_INGEST, // reactor threads
+  STAGE_DECODE, // decode workers, and the decoder threads they spawn
+  STAGE_ASSEMBLY, // main thread, frameset assembly and publishing
+  STAGE_SIM,
+  STAGE_CONSUMER,
+  STAGE_COUNT
+};
+
+static const char* stage_names[STAGE_COUNT] = {
+  "camera",
+  "ingest",
+  "decode",
+  "assembly",
+  "sim",
+  "consumer"
+};
+
+struct bench_point {
+  uint32_t cams;
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+};
+
+struct cpu_sample {
+  uint64_t ticks[STAGE_COUNT];
+  uint64_t wall_ns;
+  uint64_t recv_syscalls; // of every camera, from the server's stats region
+  uint64_t packets;
+};
+
+struct bench_result {
+  uint64_t framesets;
+  uint64_t complete;
+  uint64_t partial;
+  uint64_t missing; // framesets that never arrived, from gaps in the timestamps
+  uint64_t drops[MAX_CAMS]; // framesets each camera is missing from
+  std::vector<uint64_t> latencies;
+  double seconds;
+  double cpu_pct[STAGE_COUNT];
+  double cpu_pct_per_cam; // camera, ingest and decode stages over the cameras
+  double syscalls_per_packet;
+};
+
+volatile sig_atomic_t stop_flag = 0;
+
+void stop_handler(int signum) {
+  (void)signum;
+  stop_flag = 1;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool parse_list(const char* arg, std::vector<uint32_t>& out) {
+  out.clear();
+  std::string list(arg);
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+
+    uint32_t value = strtoul(list.substr(start, end - start).c_str(), nullptr, 10);
+    if (value == 0)
+      return false;
+    out.push_back(value);
+    start = end + 1;
+  }
+  return !out.empty();
+}
+
+static bool parse_resolutions(
+  const char* arg,
+  std::vector<std::pair<uint32_t, uint32_t>>& out
+) {
+  out.clear();
+  std::string list(arg);
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::string res = list.substr(start, end - start);
+    if (sscanf(res.c_str(), "%ux%u", &width, &height) != 2 || width == 0 || height == 0)
+      return false;
+    out.emplace_back(width, height);
+    start = end + 1;
+  }
+  return !out.empty();
+}
+
+static int32_t write_conf(
+  const bench_point& point,
+  const std::vector<std::string>& params
+) {
+  /**
+   * Writes a config for point.cams cameras on localhost with the port
+   * pairs camera_sim -g uses, plus any extra stream_params as given
+   */
+  FILE* f = fopen(BENCH_CONF_PATH, "w");
+  if (f == nullptr)
+    return -errno;
+
+  fprintf(f, "stream_params:\n");
+  fprintf(f, "  frame_width: %u\n", point.width);
+  fprintf(f, "  frame_height: %u\n", point.height);
+  fprintf(f, "  fps: %u\n", point.fps);
+  for (const std::string& param : params) {
+    size_t eq = param.find('=');
+    fprintf(
+      f,
+      "  %s: %s\n",
+      param.substr(0, eq).c_str(),
+      param.substr(eq + 1).c_str()
+    );
+  }
+
+  fprintf(f, "cameras:\n");
+  for (uint32_t i = 0; i < point.cams; i++) {
+    fprintf(f, "  - name: rpicam%02u\n", i);
+    fprintf(f, "    id: %u\n", i + 1);
+    fprintf(f, "    eth_ip: 127.0.0.1\n");
+    fprintf(f, "    wifi_ip: 127.0.0.1\n");
+    fprintf(f, "    tcp_port: %u\n", GEN_BASE_TCP_PORT + i);
+    fprintf(f, "    udp_port: %u\n", GEN_BASE_UDP_PORT + i);
+  }
+
+  if (fclose(f) != 0)
+    return -errno;
+  return 0;
+}
+
+static pid_t start_sim(const char* sim_exe, const char* clip_path) {
+  /**
+   * Starts camera_sim on the bench config and waits for it to report
+   * every camera bound, so the server's start timestamp can't be missed
+   *
+   * Returns:
+   * - pid_t: the sim's pid, or a negative errno
+   */
+  char logstr[128];
+
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+    return -errno;
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    int32_t ret = -errno;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return ret;
+  }
+
+  if (pid == 0) {
+    dup2(pipefd[1], STDOUT_FILENO);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (clip_path != nullptr)
+      execl(sim_exe, sim_exe, "-c", BENCH_CONF_PATH, "-f", clip_path, nullptr);
+    else
+      execl(sim_exe, sim_exe, "-c", BENCH_CONF_PATH, nullptr);
+    _exit(errno);
+  }
+
+  close(pipefd[1]);
+
+  char buf[64];
+  size_t len = 0;
+  bool ready = false;
+  uint64_t deadline = clock_ns(CLOCK_MONOTONIC) + SIM_READY_TIMEOUT_MS * 1000000ULL;
+  while (!ready && !stop_flag) {
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    if (now >= deadline)
+      break;
+
+    struct pollfd pfd = { pipefd[0], POLLIN, 0 };
+    int ret = poll(&pfd, 1, (deadline - now) / 1000000 + 1);
+    if (ret <= 0)
+      continue;
+
+    ssize_t n = read(pipefd[0], buf + len, sizeof(buf) - 1 - len);
+    if (n <= 0)
+      break; // the sim exited
+    len += n;
+    buf[len] = '\0';
+    ready = strstr(buf, "ready") != nullptr;
+    if (len == sizeof(buf) - 1)
+      len = 0;
+  }
+  close(pipefd[0]);
+
+  if (!ready) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera sim %s did not become ready",
+      sim_exe
+    );
+    log_write(ERROR, logstr);
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -ETIMEDOUT;
+  }
+
+  return pid;
+}
+
+static enum bench_stage thread_stage(const char* comm) {
+  if (strncmp(comm, "cam-", 4) == 0)
+    return STAGE_CAMERA;
+  if (strncmp(comm, "reactor-", 8) == 0)
+    return STAGE_INGEST;
+  if (strncmp(comm, "decode-", 7) == 0)
+    return STAGE_DECODE;
+  return STAGE_ASSEMBLY;
+}
+
+static bool read_stat(const char* path, char* comm, size_t comm_len, uint64_t* ticks) {
+  /**
+   * Reads the name and user plus system time of a process or thread
+   * from its /proc stat file
+   */
+  FILE* f = fopen(path, "r");
+  if (f == nullptr)
+    return false;
+
+  char line[1024];
+  bool ok = fgets(line, sizeof(line), f) != nullptr;
+  fclose(f);
+  if (!ok)
+    return false;
+
+  // the name is parenthesized and may itself hold spaces or parentheses
+  char* open = strchr(line, '(');
+  char* close = strrchr(line, ')');
+  if (open == nullptr || close == nullptr || close < open)
+    return false;
+
+  size_t name_len = std::min(static_cast<size_t>(close - open - 1), comm_len - 1);
+  memcpy(comm, open + 1, name_len);
+  comm[name_len] = '\0';
+
+  // utime and stime are the 12th and 13th fields after the name
+  char* field = close + 1;
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  for (int i = 0; i < 11 && field != nullptr; i++)
+    field = strchr(field + 1, ' ');
+  if (field == nullptr || sscanf(field, " %lu %lu", &utime, &stime) != 2)
+    return false;
+
+  *ticks = utime + stime;
+  return true;
+}
+
+static void sample_cpu(
+  const stream_ctx& ctx,
+  uint32_t cams,
+  pid_t sim_pid,
+  cpu_sample& sample
+) {
+  /**
+   * Sums the CPU time of the server's threads by the stage their names
+   * put them in, along with the sim's and our own, and the receive
+   * syscalls and packets of its cameras
+   */
+  char path[PATH_MAX];
+  char comm[64];
+  uint64_t ticks;
+  pid_t server_pid = ctx.server_pid;
+
+  memset(&sample, 0, sizeof(sample));
+  sample.wall_ns = clock_ns(CLOCK_MONOTONIC);
+
+  for (uint32_t i = 0; i < cams; i++) {
+    sample.recv_syscalls += ctx.stats->cams[i].recv_syscalls.load(std::memory_order_relaxed);
+    sample.packets += ctx.stats->cams[i].packets.load(std::memory_order_relaxed);
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/task", server_pid);
+  DIR* tasks = opendir(path);
+  if (tasks != nullptr) {
+    struct dirent* task;
+    while ((task = readdir(tasks)) != nullptr) {
+      if (task->d_name[0] == '.')
+        continue;
+
+      snprintf(path, sizeof(path), "/proc/%d/task/%s/stat", server_pid, task->d_name);
+      if (read_stat(path, comm, sizeof(comm), &ticks))
+        sample.ticks[thread_stage(comm)] += ticks;
+    }
+    closedir(tasks);
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", sim_pid);
+  if (read_stat(path, comm, sizeof(comm), &ticks))
+    sample.ticks[STAGE_SIM] = ticks;
+
+  if (read_stat("/proc/self/stat", comm, sizeof(comm), &ticks))
+    sample.ticks[STAGE_CONSUMER] = ticks;
+}
+
+static void consume(
+  stream_ctx& ctx,
+  const bench_point& point,
+  uint32_t warmup_sec,
+  uint32_t duration_sec,
+  pid_t sim_pid,
+  bench_result& result
+) {
+  /**
+   * Dequeues every frameset for the warmup plus the duration, only
+   * measuring those after the warmup. Each is released right away, so
+   * the latency is the pipeline's and not ours
+   */
+  const uint64_t full_mask = full_cam_mask(point.cams);
+  const uint64_t interval = 1000000000ULL / point.fps;
+  const long clk_tck = sysconf(_SC_CLK_TCK);
+
+  uint64_t start = clock_ns(CLOCK_MONOTONIC);
+  uint64_t measure_start = start + warmup_sec * 1000000000ULL;
+  uint64_t end = measure_start + duration_sec * 1000000000ULL;
+  bool measuring = false;
+  uint64_t last_timestamp = 0;
+  cpu_sample before;
+  cpu_sample after;
+
+  result.latencies.reserve(static_cast<size_t>(duration_sec) * point.fps);
+
+  while (!stop_flag) {
+    struct frameset* frameset = wait_frameset(ctx, FRAMESET_WAIT_MS);
+    uint64_t dequeued = clock_ns(CLOCK_REALTIME);
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    if (!measuring && now >= measure_start) {
+      measuring = true;
+      sample_cpu(ctx, point.cams, sim_pid, before);
+    }
+
+    if (now >= end) {
+      if (frameset != nullptr)
+        release_frameset(ctx, frameset);
+      break;
+    }
+
+    if (frameset == nullptr)
+      continue;
+
+    uint64_t timestamp = frameset->timestamp;
+    uint64_t cam_mask = frameset->cam_mask;
+    release_frameset(ctx, frameset);
+
+    if (!measuring) {
+      last_timestamp = timestamp;
+      continue;
+    }
+
+    result.framesets++;
+    result.latencies.push_back(dequeued > timestamp ? dequeued - timestamp : 0);
+
+    if (cam_mask == full_mask) {
+      result.complete++;
+    } else {
+      result.partial++;
+      for (uint32_t i = 0; i < point.cams; i++) {
+        if (!(cam_mask & (1ULL << i)))
+          result.drops[i]++;
+      }
+    }
+
+    if (last_timestamp != 0 && timestamp > last_timestamp + interval + interval / 2)
+      result.missing += (timestamp - last_timestamp + interval / 2) / interval - 1;
+    last_timestamp = timestamp;
+  }
+
+  if (!measuring)
+    return;
+
+  sample_cpu(ctx, point.cams, sim_pid, after);
+  result.seconds = (after.wall_ns - before.wall_ns) / 1e9;
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    double secs = static_cast<double>(after.ticks[i] - before.ticks[i]) / clk_tck;
+    result.cpu_pct[i] = result.seconds > 0 ? secs / result.seconds * 100 : 0;
+  }
+
+  // only one of the camera and ingest stages runs, depending on the server's mode
+  double cam_pct = result.cpu_pct[STAGE_CAMERA] + result.cpu_pct[STAGE_INGEST] + result.cpu_pct[STAGE_DECODE];
+  result.cpu_pct_per_cam = cam_pct / point.cams;
+
+  uint64_t packets = after.packets - before.packets;
+  result.syscalls_per_packet = packets ?
+    static_cast<double>(after.recv_syscalls - before.recv_syscalls) / packets :
+    0;
+}
+
+static double percentile_us(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+
+  size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+  return sorted[idx] / 1e3;
+}
+
+static void print_result(
+  const bench_point& point,
+  const std::vector<std::string>& params,
+  bench_result& result,
+  int32_t error
+) {
+  /**
+   * Prints the point as a single line JSON object, with an error
+   * field instead of measurements if it could not be run
+   */
+  printf(
+    "{\"cams\":%u,\"width\":%u,\"height\":%u,\"fps\":%u,\"params\":{",
+    point.cams,
+    point.width,
+    point.height,
+    point.fps
+  );
+  for (size_t i = 0; i < params.size(); i++) {
+    size_t eq = params[i].find('=');
+    printf(
+      "%s\"%s\":\"%s\"",
+      i ? "," : "",
+      params[i].substr(0, eq).c_str(),
+      params[i].substr(eq + 1).c_str()
+    );
+  }
+  printf("}");
+
+  if (error) {
+    printf(",\"error\":\"%s\"}\n", strerror(-error));
+    fflush(stdout);
+    return;
+  }
+
+  std::sort(result.latencies.begin(), result.latencies.end());
+  uint64_t max = result.latencies.empty() ? 0 : result.latencies.back();
+
+  printf(
+    ",\"seconds\":%.3f,\"framesets\":%lu,\"framesets_per_sec\":%.2f"
+    ",\"complete\":%lu,\"partial\":%lu,\"missing\":%lu"
+    ",\"syscalls_per_packet\":%.2f,\"cpu_pct_per_cam\":%.2f",
+    result.seconds,
+    result.framesets,
+    result.seconds > 0 ? result.framesets / result.seconds : 0,
+    result.complete,
+    result.partial,
+    result.missing,
+    result.syscalls_per_packet,
+    result.cpu_pct_per_cam
+  );
+  printf(
+    ",\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+    percentile_us(result.latencies, 0.50),
+    percentile_us(result.latencies, 0.99),
+    percentile_us(result.latencies, 0.999),
+    max / 1e3
+  );
+
+  printf(",\"drops\":[");
+  for (uint32_t i = 0; i < point.cams; i++)
+    printf("%s%lu", i ? "," : "", result.drops[i]);
+  printf("],\"cpu_pct\":{");
+  for (int i = 0; i < STAGE_COUNT; i++)
+    printf("%s\"%s\":%.1f", i ? "," : "", stage_names[i], result.cpu_pct[i]);
+  printf("}}\n");
+  fflush(stdout);
+}
+
+static int32_t run_point(
+  const bench_point& point,
+  const std::vector<std::string>& params,
+  const char* sim_exe,
+  const char* clip_path,
+  uint32_t warmup_sec,
+  uint32_t duration_sec,
+  bench_result& result
+) {
+  char logstr[128];
+
+  int32_t ret = write_conf(point, params);
+  if (ret)
+    return ret;
+
+  pid_t sim_pid = start_sim(sim_exe, clip_path);
+  if (sim_pid < 0)
+    return sim_pid;
+
+  struct stream_ctx stream_ctx;
+  ret = start_streams(
+    stream_ctx,
+    point.width,
+    point.height,
+    point.cams,
+    nullptr,
+    BENCH_SHM_NAME,
+    sub_mode::reliable,
+    BENCH_CONF_PATH
+  );
+
+  // cleanup_streams only signals the server, the next point needs its ports
+  pid_t server_pid = stream_ctx.server_pid;
+  if (ret == 0)
+    consume(stream_ctx, point, warmup_sec, duration_sec, sim_pid, result);
+  cleanup_streams(stream_ctx);
+
+  if (server_pid > 0)
+    waitpid(server_pid, nullptr, 0);
+  kill(sim_pid, SIGTERM);
+  waitpid(sim_pid, nullptr, 0);
+
+  if (ret == 0 && result.framesets == 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "No framesets from %u cameras at %ux%u %u fps",
+      point.cams,
+      point.width,
+      point.height,
+      point.fps
+    );
+    log_write(WARNING, logstr);
+    ret = -ENODATA;
+  }
+
+  return ret;
+}
+
+int main(int argc, char* argv[]) {
+  int32_t ret = 0;
+
+  std::vector<uint32_t> cam_counts = {4};
+  std::vector<std::pair<uint32_t, uint32_t>> resolutions = {{1280, 720}};
+  std::vector<uint32_t> fps_list = {30};
+  std::vector<std::string> params;
+  uint32_t duration_sec = DEFAULT_DURATION_SEC;
+  uint32_t warmup_sec = DEFAULT_WARMUP_SEC;
+  const char* sim_exe = SIM_EXE;
+  const char* clip_path = nullptr;
+  bool compare_rx = false;
+
+  bool valid = true;
+  int opt;
+  while (valid && (opt = getopt(argc, argv, "n:r:f:d:w:p:s:c:u")) != -1) {
+    switch (opt) {
+      case 'n':
+        valid = parse_list(optarg, cam_counts);
+        break;
+      case 'r':
+        valid = parse_resolutions(optarg, resolutions);
+        break;
+      case 'f':
+        valid = parse_list(optarg, fps_list);
+        break;
+      case 'd':
+        duration_sec = strtoul(optarg, nullptr, 10);
+        valid = duration_sec > 0;
+        break;
+      case 'w':
+        warmup_sec = strtoul(optarg, nullptr, 10);
+        break;
+      case 'p':
+        params.emplace_back(optarg);
+        valid = params.back().find('=') != std::string::npos;
+        break;
+      case 's':
+        sim_exe = optarg;
+        break;
+      case 'c':
+        clip_path = optarg;
+        break;
+      case 'u':
+        compare_rx = true;
+        break;
+      default:
+        valid = false;
+    }
+  }
+
+  for (uint32_t cams : cam_counts)
+    valid = valid && cams <= std::min(MAX_CAMS, MAX_BENCH_CAMS);
+
+  if (!valid) {
+    fprintf(
+      stderr,
+      "Usage: frameset_bench [-n cams,...] [-r WxH,...] [-f fps,...] [-d seconds] [-w warmup]\n"
+      "                      [-p stream_param=value]... [-s camera_sim] [-c clip] [-u]\n"
+    );
+    return -EINVAL;
+  }
+
+  ret = setup_logging(LOG_PATH);
+  if (ret) {
+    fprintf(stderr, "Error opening log file: %s\n", strerror(errno));
+    return -errno;
+  }
+
+  struct sigaction sa;
+  sa.sa_handler = stop_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  // with -u each point runs with the recv backend, then with io_uring
+  std::vector<std::vector<std::string>> param_sets = { params };
+  if (compare_rx) {
+    param_sets = { params, params };
+    param_sets[0].emplace_back("uring_rx=0");
+    param_sets[1].emplace_back("uring_rx=1");
+  }
+
+  for (uint32_t cams : cam_counts) {
+    for (auto& [width, height] : resolutions) {
+      for (uint32_t fps : fps_list) {
+        for (const std::vector<std::string>& point_params : param_sets) {
+          if (stop_flag)
+            break;
+
+          bench_point point = { cams, width, height, fps };
+          bench_result result = {};
+          int32_t point_ret = run_point(
+            point,
+            point_params,
+            sim_exe,
+            clip_path,
+            warmup_sec,
+            duration_sec,
+            result
+          );
+          if (point_ret)
+            ret = point_ret;
+
+          if (!stop_flag)
+            print_result(point, point_params, result, point_ret);
+        }
+      }
+    }
+  }
+
+  unlink(BENCH_CONF_PATH);
+  cleanup_logging();
+  return ret;
+}
@@ -4,7 +4,6 @@
 #include <errno.h>
 #include <opencv2/opencv.hpp>
 #include <sched.h>
-#include <spsc_queue.hpp>
 #include <string>
 #include <iostream>
 #include <unistd.h>
@@ -22,8 +21,6 @@ constexpr uint32_t BOARD_WIDTH = 9;
 constexpr uint32_t BOARD_HEIGHT = 6;
 constexpr float SQUARE_SIZE = 25.0; // mm
 
-constexpr uint32_t CORES_PER_CCD = 8;
-
 volatile sig_atomic_t stop_flag = 0;
 
 void stop_handler(int signum) {
@@ -75,16 +72,6 @@ int main(int argc, char* argv[]) {
     return ret;
   }
 
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  CPU_SET(cam_count % CORES_PER_CCD, &cpuset);
-  pid_t pid = getpid();
-  sched_setaffinity(
-    pid,
-    sizeof(cpu_set_t),
-    &cpuset
-  );
-
   int target_cam_id = -1;
   if (argc == 2) {
     target_cam_id = std::stoi(argv[1]);
@@ -139,6 +126,12 @@ int main(int argc, char* argv[]) {
     cleanup_logging();
     return ret;
   }
+  pin_consumer(stream_ctx);
+
+  // zero copy decoding leaves frames in I420 rather than NV12
+  const bool i420 = stream_ctx.header->pixel_format == FRAME_FORMAT_I420;
+  const int yuv2bgr = i420 ? cv::COLOR_YUV2BGR_I420 : cv::COLOR_YUV2BGR_NV12;
+  const int yuv2gray = i420 ? cv::COLOR_YUV2GRAY_I420 : cv::COLOR_YUV2GRAY_NV12;
 
   /*
    * In either a success or a failure case, we want to wait
@@ -158,31 +151,34 @@ int main(int argc, char* argv[]) {
 
   bool calibration_complete = false;
   while (!stop_flag && !calibration_complete) {
-    struct ts_frame_buf** frameset = static_cast<ts_frame_buf**>(
-      spsc_dequeue(stream_ctx.filled_frameset_q)
-    );
-    if (frameset == nullptr) {
-      usleep(100); // 0.1ms
+    struct frameset* frameset = wait_frameset(stream_ctx, FRAMESET_WAIT_MS);
+    if (frameset == nullptr)
+      continue;
+
+    // framesets the camera missed have no frame of it to calibrate on
+    int32_t position = frameset_position(stream_ctx, frameset, cam_confs[0].id);
+    if (position < 0) {
+      release_frameset(stream_ctx, frameset);
       continue;
     }
 
-    cv::Mat nv12_frame(
+    cv::Mat yuv_frame(
       stream_conf.frame_height * 3/2,
       stream_conf.frame_width,
       CV_8UC1,
-      frameset[0]->frame_buf
+      frameset_frame(stream_ctx, frameset, position)
     );
 
     cv::Mat unprocessed_bgr;
     cv::cvtColor(
-      nv12_frame,
+      yuv_frame,
       unprocessed_bgr,
-      cv::COLOR_YUV2BGR_NV12
+      yuv2bgr
     );
     cv::Mat bgr_frame = wide_to_3_4_ar(unprocessed_bgr);
 
     if (cooldown > 0) {
-      spsc_enqueue(stream_ctx.empty_frameset_q, frameset);
+      release_frameset(stream_ctx, frameset);
 
       cv::imshow("stream", bgr_frame);
       cv::waitKey(1);
@@ -197,13 +193,13 @@ int main(int argc, char* argv[]) {
 
     cv::Mat unprocessed_gray;
     cv::cvtColor(
-      nv12_frame,
+      yuv_frame,
       unprocessed_gray,
-      cv::COLOR_YUV2GRAY_NV12
+      yuv2gray
     );
     cv::Mat gray_frame = wide_to_3_4_ar(unprocessed_gray);
 
-    spsc_enqueue(stream_ctx.empty_frameset_q, frameset);
+    release_frameset(stream_ctx, frameset);
 
     bool found_corners = calibrator.try_frame(gray_frame);
     if (!found_corners) {
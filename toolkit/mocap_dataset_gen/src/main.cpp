@@ -3,7 +3,6 @@
 #include <cstring>
 #include <errno.h>
 #include <opencv2/opencv.hpp>
-#include <spsc_queue.hpp>
 #include <string>
 #include <iostream>
 #include <vector>
@@ -16,14 +15,13 @@
 #include "stereo_calibration.hpp"
 #include "pose_predictor.hpp"
 #include "stream_ctl.h"
+#include "trace.hpp"
 
 constexpr const char* LOG_PATH = "/var/log/mocap-toolkit/dataset_gen.log";
 constexpr const char* CAM_CONF_PATH = "/etc/mocap-toolkit/cams.yaml";
 constexpr const char* CALIBRATION_PARAMS_PATH = "/etc/mocap-toolkit/";
 constexpr const char* MODEL_PATH = "/var/lib/mocap-toolkit/sapiens_1b_coco_wholebody_best_coco_wholebody_AP_727_torchscript.pt2";
 
-constexpr uint32_t CORES_PER_CCD = 8;
-
 volatile sig_atomic_t stop_flag = 0;
 
 void stop_handler(int signum) {
@@ -75,15 +73,11 @@ int main() {
     return ret;
   }
 
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  CPU_SET(cam_count % CORES_PER_CCD, &cpuset);
-  pid_t pid = getpid();
-  sched_setaffinity(
-    pid,
-    sizeof(cpu_set_t),
-    &cpuset
-  );
+  ret = trace_init("mocap_dataset_gen", stream_conf.fps);
+  if (ret) {
+    cleanup_logging();
+    return ret;
+  }
 
   struct calibration_params calib_params[cam_count];
   for (int i = 0; i < cam_count; i++) {
@@ -129,36 +123,66 @@ int main() {
     cleanup_logging();
     return ret;
   }
+  pin_consumer(stream_ctx);
 
+  // zero copy decoding leaves frames in I420 rather than NV12
+  const bool i420 = stream_ctx.header->pixel_format == FRAME_FORMAT_I420;
+  const int yuv2bgr = i420 ? cv::COLOR_YUV2BGR_I420 : cv::COLOR_YUV2BGR_NV12;
+
+  int32_t positions[cam_count];
+  bool streaming = false;
+  uint32_t waited_ms = 0;
   while (!stop_flag) {
-    struct ts_frame_buf** frameset = static_cast<ts_frame_buf**>(
-      spsc_dequeue(stream_ctx.filled_frameset_q)
-    );
+    uint64_t trace_start = trace_begin();
+    struct frameset* frameset = wait_frameset(stream_ctx, FRAMESET_WAIT_MS);
     if (frameset == nullptr) {
-      usleep(100); // 0.1ms
+      // once framesets flow, a long gap in them is the pipeline stalling
+      waited_ms += FRAMESET_WAIT_MS;
+      if (streaming && !stop_flag && waited_ms >= TRACE_STALL_MS)
+        trace_error("framesets stalled");
+      continue;
+    }
+    streaming = true;
+    waited_ms = 0;
+    uint64_t frame_ts = frameset->timestamp;
+    trace_end(trace_stage::dequeue, frame_ts, trace_start);
+
+    // triangulation needs every view, wherever a reloaded config put each camera
+    bool complete = true;
+    for (int i = 0; i < cam_count && complete; i++) {
+      positions[i] = frameset_position(stream_ctx, frameset, cam_confs[i].id);
+      complete = positions[i] >= 0;
+    }
+    if (!complete) {
+      release_frameset(stream_ctx, frameset);
       continue;
     }
 
+    trace_start = trace_begin();
     for (int i = 0; i < cam_count; i++) {
-      cv::Mat nv12_frame(
+      cv::Mat yuv_frame(
         stream_conf.frame_height * 3/2,
         stream_conf.frame_width,
         CV_8UC1,
-        frameset[i]->frame_buf
+        frameset_frame(stream_ctx, frameset, positions[i])
       );
 
       cv::Mat unprocessed_bgr;
       cv::cvtColor(
-        nv12_frame,
+        yuv_frame,
         unprocessed_bgr,
-        cv::COLOR_YUV2BGR_NV12
+        yuv2bgr
       );
       cv::Mat processed_bgr = wide_to_3_4_ar(unprocessed_bgr);
       bgr_frames[i] = processed_bgr;
     }
 
-    spsc_enqueue(stream_ctx.empty_frameset_q, frameset);
+    release_frameset(stream_ctx, frameset);
+    trace_end(trace_stage::preprocess, frame_ts, trace_start);
+
+    trace_start = trace_begin();
     predictor.predict(bgr_frames, keypoints, confidence_scores);
+    trace_end(trace_stage::inference, frame_ts, trace_start);
 
     for (int i = 0; i < cam_count; i++) {
       for (int j = 0; j < NUM_KEYPOINTS; j++) {
@@ -176,6 +200,7 @@ int main() {
   }
 
   cleanup_streams(stream_ctx);
+  trace_stop();
   cleanup_logging();
   return 0;
 }
@@ -3,7 +3,6 @@
 #include <cstring>
 #include <errno.h>
 #include <opencv2/opencv.hpp>
-#include <spsc_queue.hpp>
 #include <string>
 #include <iostream>
 #include <vector>
@@ -25,8 +24,6 @@ constexpr uint32_t BOARD_WIDTH = 9;
 constexpr uint32_t BOARD_HEIGHT = 6;
 constexpr float SQUARE_SIZE = 25.0; // mm
 
-constexpr uint32_t CORES_PER_CCD = 8;
-
 volatile sig_atomic_t stop_flag = 0;
 
 void stop_handler(int signum);
@@ -77,16 +74,6 @@ int main() {
 
   VidPlayer vid_player{stream_conf.fps};
 
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  CPU_SET(cam_count % CORES_PER_CCD, &cpuset);
-  pid_t pid = getpid();
-  sched_setaffinity(
-    pid,
-    sizeof(cpu_set_t),
-    &cpuset
-  );
-
   struct calibration_params calib_params[cam_count];
   for (int i = 0; i < cam_count; i++) {
     std::string filename =
@@ -135,6 +122,12 @@ int main() {
     cleanup_logging();
     return ret;
   }
+  pin_consumer(stream_ctx);
+
+  // zero copy decoding leaves frames in I420 rather than NV12
+  const bool i420 = stream_ctx.header->pixel_format == FRAME_FORMAT_I420;
+  const int yuv2bgr = i420 ? cv::COLOR_YUV2BGR_I420 : cv::COLOR_YUV2BGR_NV12;
+  const int yuv2gray = i420 ? cv::COLOR_YUV2GRAY_I420 : cv::COLOR_YUV2GRAY_NV12;
 
   const uint32_t cooldown_limit = stream_conf.fps / 3;
   uint32_t cooldown = 0;
@@ -143,41 +136,49 @@ int main() {
   bool done_calibrating = false;
   cv::Mat gray_frames[cam_count];
   cv::Mat bgr_frames[cam_count];
+  int32_t positions[cam_count];
   while (!stop_flag && !done_calibrating) {
-    struct ts_frame_buf** frameset = static_cast<ts_frame_buf**>(
-      spsc_dequeue(stream_ctx.filled_frameset_q)
-    );
-    if (frameset == nullptr) {
-      usleep(100); // 0.1ms
+    struct frameset* frameset = wait_frameset(stream_ctx, FRAMESET_WAIT_MS);
+    if (frameset == nullptr)
+      continue;
+
+    // stereo pairs need every view, wherever a reloaded config put each camera
+    bool complete = true;
+    for (int i = 0; i < cam_count && complete; i++) {
+      positions[i] = frameset_position(stream_ctx, frameset, cam_confs[i].id);
+      complete = positions[i] >= 0;
+    }
+    if (!complete) {
+      release_frameset(stream_ctx, frameset);
       continue;
     }
 
     for (int i = 0; i < cam_count; i++) {
-      cv::Mat nv12_frame(
+      cv::Mat yuv_frame(
         stream_conf.frame_height * 3/2,
         stream_conf.frame_width,
         CV_8UC1,
-        frameset[i]->frame_buf
+        frameset_frame(stream_ctx, frameset, positions[i])
       );
 
       cv::Mat unprocessed_gray;
       cv::cvtColor(
-        nv12_frame,
+        yuv_frame,
         unprocessed_gray,
-        cv::COLOR_YUV2GRAY_NV12
+        yuv2gray
       );
       gray_frames[i] = wide_to_3_4_ar(unprocessed_gray);
 
       cv::Mat unprocessed_bgr;
       cv::cvtColor(
-        nv12_frame,
+        yuv_frame,
         unprocessed_bgr,
-        cv::COLOR_YUV2BGR_NV12
+        yuv2bgr
       );
       bgr_frames[i] = wide_to_3_4_ar(unprocessed_bgr);
     }
 
-    spsc_enqueue(stream_ctx.empty_frameset_q, frameset);
+    release_frameset(stream_ctx, frameset);
 
     vid_player.offer_frame(bgr_frames[0]);
 